@@ -241,7 +241,6 @@ audio_init (struct audio *audio,
   audio->volume_change_callback_data = data;
   audio->ready_callback = audio_ready_callback;
   audio->control.data = g_malloc (sizeof (struct sample_info));
-  audio->control.callback = NULL;
   audio->sel_len = 0;
 
   audio_init_int (audio);
@@ -23,6 +23,12 @@
 #include "local.h"
 #include "sample.h"
 
+#define BE_STATS_ADD(backend, member, value) { \
+  g_mutex_lock (&(backend)->stats_mutex); \
+  (backend)->stats.member += (value); \
+  g_mutex_unlock (&(backend)->stats_mutex); \
+}
+
 // When sending a batch of SysEx messages we want the trasfer status to be controlled outside this function.
 // This is what the update parameter is for.
 
@@ -77,32 +83,27 @@ backend_get_fs_operations_by_name (struct backend *backend, const gchar *name)
   return e ? e->data : NULL;
 }
 
-void
-backend_midi_handshake (struct backend *backend)
+gint
+backend_midi_identity (struct backend *backend, gint timeout)
 {
+  gint err;
   GByteArray *tx_msg;
   GByteArray *rx_msg;
   gint offset;
 
-  backend->name[0] = 0;
-  backend->version[0] = 0;
-  backend->description[0] = 0;
-  backend->fs_ops = NULL;
-  backend->upgrade_os = NULL;
-  backend->get_storage_stats = NULL;
   memset (&backend->midi_info, 0, sizeof (struct backend_midi_info));
 
   tx_msg = g_byte_array_sized_new (sizeof (BE_MIDI_IDENTITY_REQUEST));
   g_byte_array_append (tx_msg, (guchar *) BE_MIDI_IDENTITY_REQUEST,
 		       sizeof (BE_MIDI_IDENTITY_REQUEST));
-  rx_msg = backend_tx_and_rx_sysex (backend, tx_msg,
-				    BE_SYSEX_TIMEOUT_GUESS_MS);
+  rx_msg = backend_tx_and_rx_sysex (backend, tx_msg, timeout);
   if (!rx_msg)
     {
       debug_print (1, "No MIDI identity reply\n");
-      return;
+      return -ETIMEDOUT;
     }
 
+  err = -EIO;
   if (rx_msg->data[4] == 2)
     {
       if (rx_msg->len == 15 || rx_msg->len == 17)
@@ -133,6 +134,7 @@ backend_midi_handshake (struct backend *backend)
 		    backend->midi_info.version[3]);
 	  debug_print (1, "Detected device: %s %s\n", backend->name,
 		       backend->version);
+	  err = 0;
 	}
       else
 	{
@@ -146,20 +148,80 @@ backend_midi_handshake (struct backend *backend)
 
   free_msg (rx_msg);
 
-  usleep (BE_REST_TIME_US);
+  return err;
+}
+
+void
+backend_midi_handshake (struct backend *backend)
+{
+  backend->name[0] = 0;
+  backend->version[0] = 0;
+  backend->description[0] = 0;
+  backend->fs_ops = NULL;
+  backend->upgrade_os = NULL;
+  backend->get_storage_stats = NULL;
+
+  if (backend_midi_identity (backend, BE_SYSEX_TIMEOUT_GUESS_MS) ==
+      -ETIMEDOUT)
+    {
+      return;
+    }
+
+  backend_rest (backend, BE_REST_TIME_US);
+}
+
+static void
+backend_stats_tx (struct backend *backend, struct sysex_transfer *transfer)
+{
+  if (!transfer->err)
+    {
+      g_mutex_lock (&backend->stats_mutex);
+      backend->stats.tx_msgs++;
+      backend->stats.tx_bytes += transfer->raw->len;
+      g_mutex_unlock (&backend->stats_mutex);
+    }
+}
+
+static void
+backend_stats_rtt (struct backend *backend, gint64 rtt)
+{
+  gint bucket = 0;
+
+  while (bucket < BE_STATS_RTT_BUCKETS - 1 && rtt >= (1000 << bucket))
+    {
+      bucket++;
+    }
+
+  g_mutex_lock (&backend->stats_mutex);
+  backend->stats.rtt[bucket]++;
+  backend->stats.rtt_count++;
+  backend->stats.rtt_total_us += rtt;
+  if (rtt > backend->stats.rtt_max_us)
+    {
+      backend->stats.rtt_max_us = rtt;
+    }
+  if (rtt > backend->rtt_mark_max_us)
+    {
+      backend->rtt_mark_max_us = rtt;
+    }
+  g_mutex_unlock (&backend->stats_mutex);
 }
 
 gint
 backend_tx_sysex_no_status (struct backend *backend,
 			    struct sysex_transfer *transfer)
 {
-  return backend_tx_sysex_internal (backend, transfer, FALSE);
+  backend_tx_sysex_internal (backend, transfer, FALSE);
+  backend_stats_tx (backend, transfer);
+  return transfer->err;
 }
 
 gint
 backend_tx_sysex (struct backend *backend, struct sysex_transfer *transfer)
 {
-  return backend_tx_sysex_internal (backend, transfer, TRUE);
+  backend_tx_sysex_internal (backend, transfer, TRUE);
+  backend_stats_tx (backend, transfer);
+  return transfer->err;
 }
 
 //Synchronized
@@ -183,10 +245,13 @@ backend_tx_and_rx_sysex_transfer (struct backend *backend,
 				  struct sysex_transfer *transfer,
 				  gboolean free)
 {
+  gint64 start;
+
   transfer->batch = FALSE;
 
   g_mutex_lock (&backend->mutex);
 
+  start = g_get_monotonic_time ();
   backend_tx_sysex (backend, transfer);
   if (free)
     {
@@ -196,6 +261,14 @@ backend_tx_and_rx_sysex_transfer (struct backend *backend,
   if (!transfer->err)
     {
       backend_rx_sysex (backend, transfer);
+      if (!transfer->err)
+	{
+	  backend_stats_rtt (backend, g_get_monotonic_time () - start);
+	}
+      else if (transfer->err == -ETIMEDOUT)
+	{
+	  BE_STATS_ADD (backend, timeouts, 1);
+	}
     }
 
   g_mutex_unlock (&backend->mutex);
@@ -300,13 +373,25 @@ backend_send_rpn (struct backend *backend, guint8 channel,
   return err;
 }
 
+//A replay replaces the MIDI port so only the buffer is needed.
+
+static gint
+backend_init_replay (struct backend *backend)
+{
+  backend->buffer = g_malloc (sizeof (guint8) * BE_INT_BUF_LEN);
+  backend->rx_len = 0;
+  return 0;
+}
+
 gint
 backend_init (struct backend *backend, const gchar *id)
 {
   debug_print (1, "Initializing backend (%s) to '%s'...\n",
 	       backend_name (), id);
   backend->type = BE_TYPE_MIDI;
-  gint err = backend_init_int (backend, id);
+  backend_stats_reset (backend);
+  gint err = backend->replay ? backend_init_replay (backend) :
+    backend_init_int (backend, id);
   if (!err)
     {
       g_mutex_lock (&backend->mutex);
@@ -319,13 +404,41 @@ backend_init (struct backend *backend, const gchar *id)
     {
       error_print ("Error while stopping device\n");
     }
-  usleep (BE_REST_TIME_US);
+  backend_rest (backend, BE_REST_TIME_US);
 
   backend_midi_handshake (backend);
 
   return err;
 }
 
+//Unlike backend_init, this does not wait for pending messages nor stops the device.
+
+gint
+backend_probe (struct backend *backend, const gchar *id, gint timeout)
+{
+  gint err;
+
+  debug_print (1, "Probing '%s'...\n", id);
+  backend->type = BE_TYPE_MIDI;
+  backend_stats_reset (backend);
+  err = backend_init_int (backend, id);
+  if (err)
+    {
+      return err;
+    }
+
+  backend->rx_len = 0;
+  backend_rx_drain_int (backend);
+
+  err = backend_midi_identity (backend, timeout);
+  if (err)
+    {
+      backend_destroy (backend);
+    }
+
+  return err;
+}
+
 void
 backend_destroy (struct backend *backend)
 {
@@ -338,7 +451,15 @@ backend_destroy (struct backend *backend)
 
   if (backend->type == BE_TYPE_MIDI)
     {
-      backend_destroy_int (backend);
+      if (backend->replay)
+	{
+	  g_free (backend->buffer);
+	  backend->buffer = NULL;
+	}
+      else
+	{
+	  backend_destroy_int (backend);
+	}
     }
 
   backend->upgrade_os = NULL;
@@ -354,7 +475,7 @@ backend_check (struct backend *backend)
   switch (backend->type)
     {
     case BE_TYPE_MIDI:
-      return backend_check_int (backend);
+      return backend->replay || backend_check_int (backend);
     case BE_TYPE_SYSTEM:
       return TRUE;
     default:
@@ -366,11 +487,10 @@ static ssize_t
 backend_rx_raw_loop (struct backend *backend, struct sysex_transfer *transfer)
 {
   ssize_t rx_len, rx_len_msg;
-  gchar *text;
   guint8 tmp[BE_TMP_BUFF_LEN];
   guint8 *tmp_msg, *data = backend->buffer + backend->rx_len;
 
-  if (!backend->inputp)
+  if (!backend->replay && !backend->inputp)
     {
       error_print ("Input port is NULL\n");
       return -ENOTCONN;
@@ -393,11 +513,9 @@ backend_rx_raw_loop (struct backend *backend, struct sysex_transfer *transfer)
 	  && transfer->time >= transfer->timeout)
 	{
 	  debug_print (1, "Timeout (%d)\n", transfer->timeout);
-	  gchar *text = debug_get_hex_data (debug_level, backend->buffer,
-					    backend->rx_len);
-	  debug_print (4, "Internal buffer data (%zd): %s\n", backend->rx_len,
-		       text);
-	  g_free (text);
+	  debug_print_hex (4, backend->buffer, backend->rx_len,
+			   "Internal buffer data (%zd): %s\n",
+			   backend->rx_len);
 	  return -ETIMEDOUT;
 	}
 
@@ -420,13 +538,8 @@ backend_rx_raw_loop (struct backend *backend, struct sysex_transfer *transfer)
       tmp_msg = tmp;
       if (!backend->rx_len && *tmp_msg != 0xf0)
 	{
-	  if (debug_level >= 4)
-	    {
-	      gchar *text = debug_get_hex_data (debug_level, tmp, rx_len);
-	      debug_print (4, "Skipping non SysEx data (%zd): %s\n", rx_len,
-			   text);
-	      g_free (text);
-	    }
+	  debug_print_hex (4, tmp, rx_len,
+			   "Skipping non SysEx data (%zd): %s\n", rx_len);
 
 	  tmp_msg++;
 	  rx_len_msg = 1;
@@ -438,6 +551,7 @@ backend_rx_raw_loop (struct backend *backend, struct sysex_transfer *transfer)
 		}
 	    }
 	  rx_len -= rx_len_msg;
+	  BE_STATS_ADD (backend, skipped, rx_len_msg);
 	}
 
       if (rx_len == 0)
@@ -448,6 +562,7 @@ backend_rx_raw_loop (struct backend *backend, struct sysex_transfer *transfer)
 
       if (rx_len > 0)
 	{
+	  BE_STATS_ADD (backend, rx_bytes, rx_len);
 	  memcpy (backend->buffer + backend->rx_len, tmp_msg, rx_len);
 	  backend->rx_len += rx_len;
 	  break;
@@ -459,30 +574,33 @@ backend_rx_raw_loop (struct backend *backend, struct sysex_transfer *transfer)
 	}
     }
 
-  if (debug_level >= 3)
-    {
-      text = debug_get_hex_data (debug_level, data, rx_len);
-      debug_print (3, "Queued data (%zu): %s\n", rx_len, text);
-      g_free (text);
-    }
+  debug_print_hex (3, data, rx_len, "Queued data (%zu): %s\n", rx_len);
 
   return rx_len;
 }
 
-//Access to this function must be synchronized.
+//If there is a callback, the transfer is run in batch mode and every message is passed to it instead of being accumulated.
 
-gint
-backend_rx_sysex (struct backend *backend, struct sysex_transfer *transfer)
+static gint
+backend_rx_sysex_int (struct backend *backend,
+		      struct sysex_transfer *transfer, t_sysex_rx_cb cb,
+		      gpointer data)
 {
   gint next_check, len, i;
   guint8 *b;
   ssize_t rx_len;
+  guint msgs = 0;
+  gint64 start = g_get_monotonic_time ();
 
   transfer->err = 0;
   transfer->time = 0;
   transfer->active = TRUE;
   transfer->status = WAITING;
   transfer->raw = g_byte_array_sized_new (BE_INT_BUF_LEN);
+  if (cb)
+    {
+      transfer->batch = TRUE;
+    }
 
   next_check = 0;
   while (1)
@@ -540,13 +658,15 @@ backend_rx_sysex (struct backend *backend, struct sysex_transfer *transfer)
 	  //Filter out everything until an 0xf0 is found.
 	  b = backend->buffer;
 	  for (i = 0; i < len && *b != 0xf0; i++, b++);
-	  if (i > 0 && debug_level >= 4)
+	  if (i > 0)
 	    {
-	      gchar *text = debug_get_hex_data (debug_level, backend->buffer,
-						i);
-	      debug_print (4, "Skipping non SysEx data in buffer (%d): %s\n",
-			   i, text);
-	      g_free (text);
+	      debug_print_hex (4, backend->buffer, i,
+			       "Skipping non SysEx data in buffer (%d): %s\n",
+			       i);
+	    }
+	  if (i > 0)
+	    {
+	      BE_STATS_ADD (backend, skipped, i);
 	    }
 	  debug_print (3, "Copying %d bytes...\n", len - i);
 	  g_byte_array_append (transfer->raw, b, len - i);
@@ -566,14 +686,21 @@ backend_rx_sysex (struct backend *backend, struct sysex_transfer *transfer)
 	      continue;
 	    }
 
-	  if (debug_level >= 4)
+	  BE_STATS_ADD (backend, rx_msgs, 1);
+
+	  debug_print_hex (4, transfer->raw->data, transfer->raw->len,
+			   "Queued data (%d): %s\n", transfer->raw->len);
+
+	  if (cb)
 	    {
-	      gchar *text =
-		debug_get_hex_data (debug_level, transfer->raw->data,
-				    transfer->raw->len);
-	      debug_print (4, "Queued data (%d): %s\n",
-			   transfer->raw->len, text);
-	      g_free (text);
+	      msgs++;
+	      transfer->err = cb (transfer->raw,
+				  g_get_monotonic_time () - start, data);
+	      g_byte_array_set_size (transfer->raw, 0);
+	      if (transfer->err)
+		{
+		  goto end;
+		}
 	    }
 	}
       else
@@ -588,25 +715,19 @@ backend_rx_sysex (struct backend *backend, struct sysex_transfer *transfer)
     }
 
 end:
-  if (!transfer->raw->len)
+  if (!transfer->raw->len && !msgs)
     {
       transfer->err = -ETIMEDOUT;
     }
-  if (transfer->err)
+  if (transfer->err || cb)
     {
       free_msg (transfer->raw);
       transfer->raw = NULL;
     }
   else
     {
-      if (debug_level >= 2)
-	{
-	  gchar *text = debug_get_hex_data (debug_level, transfer->raw->data,
-					    transfer->raw->len);
-	  debug_print (2, "Raw message received (%d): %s\n",
-		       transfer->raw->len, text);
-	  g_free (text);
-	}
+      debug_print_hex (2, transfer->raw->data, transfer->raw->len,
+		       "Raw message received (%d): %s\n", transfer->raw->len);
 
     }
   transfer->active = FALSE;
@@ -616,6 +737,24 @@ end:
 
 //Access to this function must be synchronized.
 
+gint
+backend_rx_sysex (struct backend *backend, struct sysex_transfer *transfer)
+{
+  return backend_rx_sysex_int (backend, transfer, NULL, NULL);
+}
+
+//Access to this function must be synchronized.
+
+gint
+backend_rx_sysex_stream (struct backend *backend,
+			 struct sysex_transfer *transfer, t_sysex_rx_cb cb,
+			 gpointer data)
+{
+  return backend_rx_sysex_int (backend, transfer, cb, data);
+}
+
+//Access to this function must be synchronized.
+
 void
 backend_rx_drain (struct backend *backend)
 {
@@ -625,7 +764,10 @@ backend_rx_drain (struct backend *backend)
 
   debug_print (2, "Draining buffers...\n");
   backend->rx_len = 0;
-  backend_rx_drain_int (backend);
+  if (!backend->replay)
+    {
+      backend_rx_drain_int (backend);
+    }
   while (!backend_rx_sysex (backend, &transfer))
     {
       free_msg (transfer.raw);
@@ -671,6 +813,184 @@ backend_fill_fs_ops (struct backend *backend, ...)
   va_end (argptr);
 }
 
+void
+backend_rest (struct backend *backend, guint us)
+{
+  usleep (backend->replay ? us * backend->replay->scale : us);
+  BE_STATS_ADD (backend, rest_us, us);
+}
+
+void
+backend_lock_op (struct backend *backend)
+{
+  g_atomic_int_inc (&backend->op_waiting);
+  g_rec_mutex_lock (&backend->op_mutex);
+  g_atomic_int_dec_and_test (&backend->op_waiting);
+}
+
+void
+backend_lock_op_background (struct backend *backend)
+{
+  while (TRUE)
+    {
+      g_rec_mutex_lock (&backend->op_mutex);
+      if (!g_atomic_int_get (&backend->op_waiting))
+	{
+	  return;
+	}
+      g_rec_mutex_unlock (&backend->op_mutex);
+      usleep (BE_OP_YIELD_TIME_US);
+    }
+}
+
+void
+backend_unlock_op (struct backend *backend)
+{
+  g_rec_mutex_unlock (&backend->op_mutex);
+}
+
+void
+backend_stats_retry (struct backend *backend)
+{
+  BE_STATS_ADD (backend, retries, 1);
+}
+
+void
+backend_stats_reset (struct backend *backend)
+{
+  g_mutex_lock (&backend->stats_mutex);
+  memset (&backend->stats, 0, sizeof (struct backend_stats));
+  backend->rtt_mark_max_us = 0;
+  g_mutex_unlock (&backend->stats_mutex);
+}
+
+void
+backend_stats_get (struct backend *backend, struct backend_stats *stats)
+{
+  g_mutex_lock (&backend->stats_mutex);
+  memcpy (stats, &backend->stats, sizeof (struct backend_stats));
+  g_mutex_unlock (&backend->stats_mutex);
+}
+
+void
+backend_stats_mark (struct backend *backend, struct backend_stats *stats)
+{
+  g_mutex_lock (&backend->stats_mutex);
+  memcpy (stats, &backend->stats, sizeof (struct backend_stats));
+  backend->rtt_mark_max_us = 0;
+  g_mutex_unlock (&backend->stats_mutex);
+}
+
+static void
+backend_stats_sub (struct backend_stats *stats,
+		   const struct backend_stats *prev)
+{
+  stats->tx_msgs -= prev->tx_msgs;
+  stats->tx_bytes -= prev->tx_bytes;
+  stats->rx_msgs -= prev->rx_msgs;
+  stats->rx_bytes -= prev->rx_bytes;
+  stats->timeouts -= prev->timeouts;
+  stats->retries -= prev->retries;
+  stats->skipped -= prev->skipped;
+  stats->rest_us -= prev->rest_us;
+  stats->rtt_count -= prev->rtt_count;
+  stats->rtt_total_us -= prev->rtt_total_us;
+  for (gint i = 0; i < BE_STATS_RTT_BUCKETS; i++)
+    {
+      stats->rtt[i] -= prev->rtt[i];
+    }
+}
+
+void
+backend_stats_get_since (struct backend *backend,
+			 struct backend_stats *stats,
+			 const struct backend_stats *mark)
+{
+  g_mutex_lock (&backend->stats_mutex);
+  memcpy (stats, &backend->stats, sizeof (struct backend_stats));
+  stats->rtt_max_us = backend->rtt_mark_max_us;
+  g_mutex_unlock (&backend->stats_mutex);
+
+  backend_stats_sub (stats, mark);
+}
+
+static void
+backend_stats_add_member (JsonBuilder *builder, const gchar *name,
+			  guint64 value)
+{
+  json_builder_set_member_name (builder, name);
+  json_builder_add_int_value (builder, value);
+}
+
+void
+backend_stats_build_json (JsonBuilder *builder,
+			  const struct backend_stats *stats)
+{
+  backend_stats_add_member (builder, "tx_msgs", stats->tx_msgs);
+  backend_stats_add_member (builder, "tx_bytes", stats->tx_bytes);
+  backend_stats_add_member (builder, "rx_msgs", stats->rx_msgs);
+  backend_stats_add_member (builder, "rx_bytes", stats->rx_bytes);
+  backend_stats_add_member (builder, "timeouts", stats->timeouts);
+  backend_stats_add_member (builder, "retries", stats->retries);
+  backend_stats_add_member (builder, "skipped", stats->skipped);
+  backend_stats_add_member (builder, "rest_us", stats->rest_us);
+  backend_stats_add_member (builder, "rtt_count", stats->rtt_count);
+  backend_stats_add_member (builder, "rtt_total_us", stats->rtt_total_us);
+  backend_stats_add_member (builder, "rtt_max_us", stats->rtt_max_us);
+
+  json_builder_set_member_name (builder, "rtt_histogram_ms");
+  json_builder_begin_object (builder);
+  for (gint i = 0; i < BE_STATS_RTT_BUCKETS; i++)
+    {
+      gchar *bucket = i < BE_STATS_RTT_BUCKETS - 1 ?
+	g_strdup_printf ("<%d", 1 << i) :
+	g_strdup_printf (">=%d", 1 << (i - 1));
+      backend_stats_add_member (builder, bucket, stats->rtt[i]);
+      g_free (bucket);
+    }
+  json_builder_end_object (builder);
+}
+
+gchar *
+backend_stats_to_string (const struct backend_stats *stats)
+{
+  gchar *rtt;
+  GString *str = g_string_new (NULL);
+
+  g_string_append_printf (str,
+			  "TX: %" PRIu64 " msgs, %" PRIu64 " B; RX: %" PRIu64
+			  " msgs, %" PRIu64 " B", stats->tx_msgs,
+			  stats->tx_bytes, stats->rx_msgs, stats->rx_bytes);
+  g_string_append_printf (str,
+			  "\nTimeouts: %" PRIu64 "; retries: %" PRIu64
+			  "; skipped: %" PRIu64 " B; rest: %" PRIu64 " ms",
+			  stats->timeouts, stats->retries, stats->skipped,
+			  stats->rest_us / 1000);
+
+  if (stats->rtt_count)
+    {
+      g_string_append_printf (str,
+			      "\nRTT: %" PRIu64 " requests, %.1f ms avg, %.1f ms max;",
+			      stats->rtt_count,
+			      stats->rtt_total_us / 1000.0 / stats->rtt_count,
+			      stats->rtt_max_us / 1000.0);
+      for (gint i = 0; i < BE_STATS_RTT_BUCKETS; i++)
+	{
+	  if (!stats->rtt[i])
+	    {
+	      continue;
+	    }
+	  rtt = i < BE_STATS_RTT_BUCKETS - 1 ?
+	    g_strdup_printf ("<%d", 1 << i) :
+	    g_strdup_printf (">=%d", 1 << (i - 1));
+	  g_string_append_printf (str, " %s ms: %" PRIu64, rtt, stats->rtt[i]);
+	  g_free (rtt);
+	}
+    }
+
+  return g_string_free (str, FALSE);
+}
+
 gchar **
 backend_get_audio_exts (struct backend *backend,
 			const struct fs_operations *ops)
@@ -19,6 +19,7 @@
  */
 
 #include "utils.h"
+#include "trace.h"
 
 #if defined(ELEKTROID_RTMIDI)
 #include <fcntl.h>
@@ -48,6 +49,7 @@
 
 #define BE_DUMP_TIMEOUT 5000	//With and E-Mu ESI-2000 it takes this more than 3 seconds to receive to receive some packets after the process has started.
 #define BE_REST_TIME_US 50000
+#define BE_OP_YIELD_TIME_US 10000
 #define BE_SYSEX_TIMEOUT_MS 5000
 #define BE_SYSEX_TIMEOUT_GUESS_MS 1000	//When the request is not implemented, 5 s is too much.
 
@@ -58,6 +60,26 @@
 
 #define BE_SYSTEM_ID "SYSTEM_ID"
 
+#define BE_STATS_RTT_BUCKETS 12	//Bucket i counts the RTTs under 2^i ms. The last one counts the rest.
+
+//Counters of the MIDI traffic. Every backend keeps the ones since it was initialized and every task the ones of its transfer.
+
+struct backend_stats
+{
+  guint64 tx_msgs;
+  guint64 tx_bytes;
+  guint64 rx_msgs;
+  guint64 rx_bytes;
+  guint64 timeouts;
+  guint64 retries;
+  guint64 skipped;		//Non SysEx bytes received
+  guint64 rest_us;		//Time slept waiting for the device
+  guint64 rtt_count;
+  guint64 rtt_total_us;
+  guint64 rtt_max_us;
+  guint64 rtt[BE_STATS_RTT_BUCKETS];
+};
+
 struct backend_storage_stats
 {
   gchar name[LABEL_MAX];
@@ -105,7 +127,15 @@ struct backend
   gchar name[LABEL_MAX];
   gchar version[LABEL_MAX];
   gchar description[LABEL_MAX];
+  gchar port_name[LABEL_MAX];	//Tells apart the units of the same model.
   GMutex mutex;
+  GRecMutex op_mutex;		//See backend_lock_op.
+  gint op_waiting;
+  GMutex stats_mutex;
+  struct backend_stats stats;
+  guint64 rtt_mark_max_us;	//Max RTT since the last backend_stats_mark.
+  struct trace *trace;		//If set, every frame sent and received is recorded.
+  struct trace_replay *replay;	//If set, it replaces the MIDI port. It must be set before initializing the backend and it is owned by the caller.
   //This must be filled by the concrete connector.
   const gchar *conn_name;
   GSList *fs_ops;
@@ -124,6 +154,10 @@ struct backend_device
 
 gint backend_init (struct backend *, const gchar *);
 
+//Opens the port and sends the MIDI identity request. On success, the backend must be destroyed by the caller.
+
+gint backend_probe (struct backend *, const gchar *, gint);
+
 void backend_destroy (struct backend *);
 
 ssize_t backend_rx_raw (struct backend *, guint8 *, guint);
@@ -136,6 +170,16 @@ gint backend_tx_sysex (struct backend *, struct sysex_transfer *);
 
 gint backend_rx_sysex (struct backend *, struct sysex_transfer *);
 
+//Called for every message received with the time in µs since the reception started. Returning an error stops the reception.
+
+typedef gint (*t_sysex_rx_cb) (GByteArray *, gint64, gpointer);
+
+//Receives in batch mode but, instead of accumulating the messages, passes every one to the callback as soon as it is complete.
+//It waits for the first message until canceled and ends after the transfer timeout without receiving. The raw member is left NULL.
+
+gint backend_rx_sysex_stream (struct backend *, struct sysex_transfer *,
+			      t_sysex_rx_cb, gpointer);
+
 gint backend_tx (struct backend *, GByteArray *);
 
 gint backend_tx_and_rx_sysex_transfer (struct backend *,
@@ -164,6 +208,10 @@ void backend_destroy_data (struct backend *);
 
 void backend_midi_handshake (struct backend *backend);
 
+//Sends the MIDI identity request and fills the MIDI info, the name and the version. It does not rest after the reply.
+
+gint backend_midi_identity (struct backend *backend, gint timeout);
+
 gint backend_program_change (struct backend *, guint8, guint8);
 
 gint backend_send_controller (struct backend *backend, guint8 channel,
@@ -191,6 +239,41 @@ const gchar *backend_name ();
 
 void backend_fill_fs_ops (struct backend *backend, ...);
 
+//Sleeps and accounts the time in the stats. It is intended for the rests between messages.
+
+void backend_rest (struct backend *, guint);
+
+//Operations made of several requests hold this lock so that the background users of the backend, like the preset index verification, do not interleave their requests with them.
+
+void backend_lock_op (struct backend *);
+
+//Background users only take the lock when no operation is waiting for it so that they never delay an operation more than one of their own.
+
+void backend_lock_op_background (struct backend *);
+
+void backend_unlock_op (struct backend *);
+
+void backend_stats_retry (struct backend *);
+
+void backend_stats_reset (struct backend *);
+
+void backend_stats_get (struct backend *, struct backend_stats *);
+
+//Gets the stats and starts a new interval for the max RTT.
+
+void backend_stats_mark (struct backend *, struct backend_stats *);
+
+//Gets the stats since the given mark. The max RTT is the one since the last mark.
+
+void backend_stats_get_since (struct backend *, struct backend_stats *,
+			      const struct backend_stats *);
+
+//Adds the stats members to the current object of the builder.
+
+void backend_stats_build_json (JsonBuilder *, const struct backend_stats *);
+
+gchar *backend_stats_to_string (const struct backend_stats *);
+
 gchar **backend_get_audio_exts (struct backend *,
 				const struct fs_operations *);
 
@@ -139,6 +139,11 @@ backend_tx_raw (struct backend *backend, guint8 *data, guint len)
 {
   ssize_t tx_len;
 
+  if (backend->replay)
+    {
+      return trace_replay_tx (backend->replay, data, len);
+    }
+
   if (!backend->outputp)
     {
       error_print ("Output port is NULL\n");
@@ -153,6 +158,10 @@ backend_tx_raw (struct backend *backend, guint8 *data, guint len)
       error_print ("Error while writing to device: %s\n",
 		   snd_strerror (tx_len));
     }
+  else if (backend->trace)
+    {
+      trace_record (backend->trace, TRACE_DIR_TX, data, tx_len);
+    }
   return tx_len;
 }
 
@@ -197,13 +206,10 @@ backend_tx_sysex_internal (struct backend *backend,
       transfer->err = -ECANCELED;
     }
 
-  if (!transfer->err && debug_level >= 2)
+  if (!transfer->err)
     {
-      gchar *text = debug_get_hex_data (debug_level, transfer->raw->data,
-					transfer->raw->len);
-      debug_print (2, "Raw message sent (%d): %s\n", transfer->raw->len,
-		   text);
-      g_free (text);
+      debug_print_hex (2, transfer->raw->data, transfer->raw->len,
+		       "Raw message sent (%d): %s\n", transfer->raw->len);
     }
 
   if (update)
@@ -227,6 +233,11 @@ backend_rx_raw (struct backend *backend, guint8 *buffer, guint len)
   ssize_t rx_len;
   unsigned short revents;
 
+  if (backend->replay)
+    {
+      return trace_replay_rx (backend->replay, buffer, len);
+    }
+
   debug_print (6, "Polling...\n");
   err = poll (backend->pfds, backend->npfds, BE_POLL_TIMEOUT_MS);
   if (err == 0)
@@ -275,6 +286,10 @@ backend_rx_raw (struct backend *backend, guint8 *buffer, guint len)
       error_print ("Error while reading from device: %s\n",
 		   snd_strerror (rx_len));
     }
+  else if (backend->trace)
+    {
+      trace_record (backend->trace, TRACE_DIR_RX, buffer, rx_len);
+    }
 
   return rx_len;
 }
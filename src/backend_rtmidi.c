@@ -146,17 +146,28 @@ backend_tx_sysex_internal (struct backend *backend,
       transfer->status = SENDING;
     }
 
-  rtmidi_out_send_message (backend->outputp, transfer->raw->data,
-			   transfer->raw->len);
-  transfer->err = backend->outputp->ok ? 0 : -EIO;
+  if (backend->replay)
+    {
+      trace_replay_tx (backend->replay, transfer->raw->data,
+		       transfer->raw->len);
+      transfer->err = 0;
+    }
+  else
+    {
+      rtmidi_out_send_message (backend->outputp, transfer->raw->data,
+			       transfer->raw->len);
+      transfer->err = backend->outputp->ok ? 0 : -EIO;
+      if (!transfer->err && backend->trace)
+	{
+	  trace_record (backend->trace, TRACE_DIR_TX, transfer->raw->data,
+			transfer->raw->len);
+	}
+    }
 
-  if (!transfer->err && debug_level >= 2)
+  if (!transfer->err)
     {
-      gchar *text = debug_get_hex_data (debug_level, transfer->raw->data,
-					transfer->raw->len);
-      debug_print (2, "Raw message sent (%d): %s\n", transfer->raw->len,
-		   text);
-      g_free (text);
+      debug_print_hex (2, transfer->raw->data, transfer->raw->len,
+		       "Raw message sent (%d): %s\n", transfer->raw->len);
     }
 
   if (update)
@@ -195,6 +206,12 @@ ssize_t
 backend_rx_raw (struct backend *backend, guint8 *buffer, guint len)
 {
   size_t size = len;
+
+  if (backend->replay)
+    {
+      return trace_replay_rx (backend->replay, buffer, len);
+    }
+
   rtmidi_in_get_message (backend->inputp, buffer, &size);
   if (!backend->inputp->ok)
     {
@@ -205,6 +222,10 @@ backend_rx_raw (struct backend *backend, guint8 *buffer, guint len)
     {
       usleep (BE_POLL_TIMEOUT_MS * 1000);
     }
+  else if (backend->trace)
+    {
+      trace_record (backend->trace, TRACE_DIR_RX, buffer, size);
+    }
 
   return size;
 }
@@ -154,6 +154,19 @@ browser_refresh (GtkWidget *object, gpointer data)
   browser_load_dir (browser);
 }
 
+//Unlike refreshing, this reads the dir again from the device even if the filesystem keeps an index of it.
+
+void
+browser_rescan (GtkWidget *object, gpointer data)
+{
+  struct browser *browser = data;
+  if (browser->fs_ops && browser->fs_ops->rescan)
+    {
+      browser->fs_ops->rescan (browser->backend, browser->dir);
+    }
+  browser_load_dir (browser);
+}
+
 void
 browser_go_up (GtkWidget *object, gpointer data)
 {
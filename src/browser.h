@@ -118,6 +118,8 @@ void browser_selection_changed (GtkTreeSelection *, gpointer);
 
 void browser_refresh (GtkWidget *, gpointer);
 
+void browser_rescan (GtkWidget *, gpointer);
+
 void browser_go_up (GtkWidget *, gpointer);
 
 void browser_item_activated (GtkTreeView *, GtkTreePath *,
@@ -18,6 +18,8 @@
  *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <sys/stat.h>
+#include <json-glib/json-glib.h>
 #include "backend.h"
 #include "connector.h"
 #include "connectors/system.h"
@@ -37,60 +39,80 @@ struct connector
   const gchar *name;
   //If the backend device name matches this regex, the handshake will be run before than the connectors that didn't match.
   const gchar *regex;
+  //If the MIDI identity reply contains this manufacturer ID, the handshake will be run before than the connectors that didn't match.
+  const guint8 *company;
 };
 
+#define CONNECTOR_CACHE_FILE "/connectors.json"
+
+static const guint8 COMPANY_NONE[BE_COMPANY_LEN] = { 0 };
+static const guint8 COMPANY_ELEKTRON[BE_COMPANY_LEN] = { 0x00, 0x20, 0x3c };
+static const guint8 COMPANY_ARTURIA[BE_COMPANY_LEN] = { 0x00, 0x20, 0x6b };
+static const guint8 COMPANY_MOOG[BE_COMPANY_LEN] = { 0x04, 0x00, 0x00 };
+static const guint8 COMPANY_NOVATION[BE_COMPANY_LEN] = { 0x00, 0x20, 0x29 };
+static const guint8 COMPANY_EVENTIDE[BE_COMPANY_LEN] = { 0x1c, 0x00, 0x00 };
+
 static const struct connector CONNECTOR_ELEKTRON = {
   .handshake = elektron_handshake,
   .name = "elektron",
-  .regex = ".*Elektron.*"
+  .regex = ".*Elektron.*",
+  .company = COMPANY_ELEKTRON
 };
 
 static const struct connector CONNECTOR_MICROBRUTE = {
   .handshake = microbrute_handshake,
   .name = MICROBRUTE_NAME,
-  .regex = ".*MicroBrute.*"
+  .regex = ".*MicroBrute.*",
+  .company = COMPANY_ARTURIA
 };
 
 static const struct connector CONNECTOR_MICROFREAK = {
   .handshake = microfreak_handshake,
   .name = "microfreak",
-  .regex = ".*MicroFreak.*"
+  .regex = ".*MicroFreak.*",
+  .company = COMPANY_ARTURIA
 };
 
 static const struct connector CONNECTOR_CZ = {
   .handshake = cz_handshake,
   .name = "cz",
-  .regex = NULL
+  .regex = NULL,
+  .company = NULL
 };
 
 static const struct connector CONNECTOR_SDS = {
   .handshake = sds_handshake,
   .name = "sds",
-  .regex = NULL
+  .regex = NULL,
+  .company = NULL
 };
 
 static const struct connector CONNECTOR_EFACTOR = {
   .handshake = efactor_handshake,
   .name = "efactor",
-  .regex = ".*Factor Pedal.*"
+  .regex = ".*Factor Pedal.*",
+  .company = COMPANY_EVENTIDE
 };
 
 static const struct connector CONNECTOR_PHATTY = {
   .handshake = phatty_handshake,
   .name = "phatty",
-  .regex = ".*Phatty.*"
+  .regex = ".*Phatty.*",
+  .company = COMPANY_MOOG
 };
 
 static const struct connector CONNECTOR_SUMMIT = {
   .handshake = summit_handshake,
   .name = "summit",
   .regex = ".*(Peak|Summit).*",
+  .company = COMPANY_NOVATION
 };
 
 static const struct connector CONNECTOR_DEFAULT = {
   .handshake = default_handshake,
   .name = "default",
-  .regex = NULL
+  .regex = NULL,
+  .company = NULL
 };
 
 static const struct connector *CONNECTORS[] = {
@@ -99,6 +121,310 @@ static const struct connector *CONNECTORS[] = {
   &CONNECTOR_EFACTOR, &CONNECTOR_DEFAULT, NULL
 };
 
+static GRegex *connector_regexes[G_N_ELEMENTS (CONNECTORS)];
+static gsize connector_regexes_init = 0;
+static GMutex connector_cache_mutex;
+
+static void
+connector_init_regexes ()
+{
+  const struct connector **connector;
+  GRegex **regex;
+
+  if (g_once_init_enter (&connector_regexes_init))
+    {
+      connector = CONNECTORS;
+      regex = connector_regexes;
+      while (*connector)
+	{
+	  if ((*connector)->regex)
+	    {
+	      *regex = g_regex_new ((*connector)->regex,
+				    G_REGEX_CASELESS | G_REGEX_OPTIMIZE, 0,
+				    NULL);
+	    }
+	  connector++;
+	  regex++;
+	}
+      g_once_init_leave (&connector_regexes_init, 1);
+    }
+}
+
+//The cache key is made of the MIDI identity and the port name as devices not replying to the identity request can only be told apart by the latter.
+
+static gchar *
+connector_get_cache_key (struct backend *backend,
+			 struct backend_device *device)
+{
+  struct backend_midi_info *info = &backend->midi_info;
+
+  return g_strdup_printf ("%02x%02x%02x%02x%02x%02x%02x %s",
+			  (guint8) info->company[0],
+			  (guint8) info->company[1],
+			  (guint8) info->company[2],
+			  (guint8) info->family[0],
+			  (guint8) info->family[1],
+			  (guint8) info->model[0], (guint8) info->model[1],
+			  device->name);
+}
+
+static GHashTable *
+connector_load_cache ()
+{
+  gint members;
+  gchar **keys;
+  GError *error;
+  JsonReader *reader;
+  JsonParser *parser;
+  GHashTable *cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+					     g_free);
+  gchar *path = get_user_dir (CONF_DIR CONNECTOR_CACHE_FILE);
+
+  parser = json_parser_new ();
+  error = NULL;
+  json_parser_load_from_file (parser, path, &error);
+  if (error)
+    {
+      debug_print (1, "Error while loading connector cache from '%s': %s\n",
+		   path, error->message);
+      g_error_free (error);
+      g_object_unref (parser);
+      g_free (path);
+      return cache;
+    }
+
+  reader = json_reader_new (json_parser_get_root (parser));
+
+  keys = json_reader_list_members (reader);
+  members = keys ? g_strv_length (keys) : 0;
+  for (gint i = 0; i < members; i++)
+    {
+      if (json_reader_read_member (reader, keys[i]))
+	{
+	  const gchar *name = json_reader_get_string_value (reader);
+	  if (name)
+	    {
+	      g_hash_table_insert (cache, g_strdup (keys[i]), g_strdup (name));
+	    }
+	}
+      json_reader_end_member (reader);
+    }
+
+  g_strfreev (keys);
+  g_object_unref (reader);
+  g_object_unref (parser);
+  g_free (path);
+
+  return cache;
+}
+
+static void
+connector_save_cache (GHashTable *cache)
+{
+  gchar *path, *json;
+  JsonBuilder *builder;
+  JsonGenerator *gen;
+  JsonNode *root;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  path = get_user_dir (CONF_DIR);
+  if (g_mkdir_with_parents (path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH |
+			    S_IXOTH))
+    {
+      error_print ("Error wile creating directory `%s'\n", path);
+      g_free (path);
+      return;
+    }
+  g_free (path);
+
+  builder = json_builder_new ();
+
+  json_builder_begin_object (builder);
+  g_hash_table_iter_init (&iter, cache);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      json_builder_set_member_name (builder, key);
+      json_builder_add_string_value (builder, value);
+    }
+  json_builder_end_object (builder);
+
+  gen = json_generator_new ();
+  root = json_builder_get_root (builder);
+  json_generator_set_root (gen, root);
+  json = json_generator_to_data (gen, NULL);
+
+  path = get_user_dir (CONF_DIR CONNECTOR_CACHE_FILE);
+  debug_print (1, "Saving connector cache to '%s'...\n", path);
+  save_file_char (path, (guint8 *) json, strlen (json));
+
+  g_free (path);
+  g_free (json);
+  json_node_free (root);
+  g_object_unref (gen);
+  g_object_unref (builder);
+}
+
+//If name is NULL, the entry is removed.
+
+static void
+connector_update_cache (const gchar *key, const gchar *name)
+{
+  GHashTable *cache;
+  const gchar *cached;
+  gboolean changed;
+
+  g_mutex_lock (&connector_cache_mutex);
+
+  cache = connector_load_cache ();
+  cached = g_hash_table_lookup (cache, key);
+  if (name)
+    {
+      changed = !cached || strcmp (cached, name);
+      if (changed)
+	{
+	  g_hash_table_replace (cache, g_strdup (key), g_strdup (name));
+	}
+    }
+  else
+    {
+      changed = g_hash_table_remove (cache, key);
+    }
+
+  if (changed)
+    {
+      connector_save_cache (cache);
+    }
+
+  g_hash_table_destroy (cache);
+
+  g_mutex_unlock (&connector_cache_mutex);
+}
+
+static gchar *
+connector_get_cached_name (const gchar *key)
+{
+  GHashTable *cache;
+  gchar *name;
+
+  g_mutex_lock (&connector_cache_mutex);
+  cache = connector_load_cache ();
+  name = g_strdup (g_hash_table_lookup (cache, key));
+  g_hash_table_destroy (cache);
+  g_mutex_unlock (&connector_cache_mutex);
+
+  return name;
+}
+
+static gboolean
+connector_matches_company (const struct connector *connector,
+			   struct backend *backend)
+{
+  return connector->company &&
+    memcmp (backend->midi_info.company, COMPANY_NONE, BE_COMPANY_LEN) &&
+    !memcmp (backend->midi_info.company, connector->company, BE_COMPANY_LEN);
+}
+
+//Connectors are tested in this order: the one that last succeeded with the same device, the ones matching the manufacturer ID, the ones matching the device name and the remaining ones.
+//Within every group, the order of CONNECTORS is kept.
+
+enum connector_priority
+{
+  CONNECTOR_PRIORITY_NONE,
+  CONNECTOR_PRIORITY_REGEX,
+  CONNECTOR_PRIORITY_COMPANY,
+  CONNECTOR_PRIORITY_CACHE,
+  CONNECTOR_PRIORITY_MAX
+};
+
+static GSList *
+connector_get_sorted_list (struct backend *backend,
+			   struct backend_device *device,
+			   const gchar *cached_name)
+{
+  gint i;
+  GSList *list = NULL;
+  const struct connector **connector;
+  enum connector_priority priorities[G_N_ELEMENTS (CONNECTORS)];
+
+  connector_init_regexes ();
+
+  connector = CONNECTORS;
+  i = 0;
+  while (*connector)
+    {
+      if (cached_name && !strcmp (cached_name, (*connector)->name))
+	{
+	  debug_print (1, "Connector %s is cached for the device\n",
+		       (*connector)->name);
+	  priorities[i] = CONNECTOR_PRIORITY_CACHE;
+	}
+      else if (connector_matches_company (*connector, backend))
+	{
+	  debug_print (1, "Connector %s matches the device manufacturer\n",
+		       (*connector)->name);
+	  priorities[i] = CONNECTOR_PRIORITY_COMPANY;
+	}
+      else if (connector_regexes[i] &&
+	       g_regex_match (connector_regexes[i], device->name, 0, NULL))
+	{
+	  debug_print (1, "Connector %s matches the device\n",
+		       (*connector)->name);
+	  priorities[i] = CONNECTOR_PRIORITY_REGEX;
+	}
+      else
+	{
+	  priorities[i] = CONNECTOR_PRIORITY_NONE;
+	}
+      connector++;
+      i++;
+    }
+
+  for (enum connector_priority p = CONNECTOR_PRIORITY_NONE;
+       p < CONNECTOR_PRIORITY_MAX; p++)
+    {
+      for (gint j = i - 1; j >= 0; j--)
+	{
+	  if (priorities[j] == p)
+	    {
+	      list = g_slist_prepend (list, (void *) CONNECTORS[j]);
+	    }
+	}
+    }
+
+  return list;
+}
+
+const gchar *
+connector_get_known_name (struct backend *backend,
+			  struct backend_device *device)
+{
+  GSList *list;
+  gchar *key, *cached_name;
+  const gchar *name = NULL;
+  const struct connector *c;
+
+  key = connector_get_cache_key (backend, device);
+  cached_name = connector_get_cached_name (key);
+  list = connector_get_sorted_list (backend, device, cached_name);
+
+  c = list->data;
+  if (cached_name && !strcmp (cached_name, c->name))
+    {
+      name = c->name;
+    }
+  else if (connector_matches_company (c, backend))
+    {
+      name = c->name;
+    }
+
+  g_slist_free (list);
+  g_free (cached_name);
+  g_free (key);
+
+  return name;
+}
+
 // A handshake function might return these values:
 // 0, the device matches the connector.
 // -ENODEV, the device does not match the connector but we can continue with the next connector.
@@ -111,9 +437,9 @@ connector_init_backend (struct backend *backend,
 			struct sysex_transfer *sysex_transfer)
 {
   gint err;
-  GSList *list = NULL, *iterator;
+  GSList *list, *iterator;
   gboolean active = TRUE;
-  const struct connector **connector;
+  gchar *key, *cached_name;
 
   if (device->type == BE_TYPE_SYSTEM &&
       !system_init_backend (backend, device->id))
@@ -127,31 +453,12 @@ connector_init_backend (struct backend *backend,
       return err;
     }
 
-  connector = CONNECTORS;
-  while (*connector)
-    {
-      if ((*connector)->regex)
-	{
-	  GRegex *regex = g_regex_new ((*connector)->regex, G_REGEX_CASELESS,
-				       0, NULL);
-	  if (g_regex_match (regex, device->name, 0, NULL))
-	    {
-	      debug_print (1, "Connector %s matches the device\n",
-			   (*connector)->name);
-	      list = g_slist_prepend (list, (void *) *connector);
-	    }
-	  else
-	    {
-	      list = g_slist_append (list, (void *) *connector);
-	    }
-	  g_regex_unref (regex);
-	}
-      else
-	{
-	  list = g_slist_append (list, (void *) *connector);
-	}
-      connector++;
-    }
+  snprintf (backend->port_name, LABEL_MAX, "%s", device->name);
+
+  //The key must be computed before running any handshake as these might change the MIDI identity.
+  key = connector_get_cache_key (backend, device);
+  cached_name = conn_name ? NULL : connector_get_cached_name (key);
+  list = connector_get_sorted_list (backend, device, cached_name);
 
   err = -ENODEV;
   for (iterator = list; iterator; iterator = iterator->next)
@@ -189,6 +496,14 @@ connector_init_backend (struct backend *backend,
 	{
 	  debug_print (1, "Testing %s connector...\n", c->name);
 	  err = c->handshake (backend);
+
+	  if (err == -ENODEV && cached_name && !strcmp (cached_name, c->name))
+	    {
+	      debug_print (1, "Cached connector %s does not match anymore\n",
+			   c->name);
+	      connector_update_cache (key, NULL);
+	    }
+
 	  if (err && err != -ENODEV)
 	    {
 	      goto end;
@@ -206,6 +521,14 @@ connector_init_backend (struct backend *backend,
   error_print ("No device recognized\n");
 
 end:
+  //A forced connector says nothing about the device so the cache is left as is.
+  if (!err && !conn_name
+      && (!cached_name || strcmp (cached_name, backend->conn_name)))
+    {
+      connector_update_cache (key, backend->conn_name);
+    }
+  g_free (cached_name);
+  g_free (key);
   g_slist_free (list);
   if (err)
     {
@@ -28,4 +28,9 @@ gint connector_init_backend (struct backend *backend,
 			     const gchar * name,
 			     struct sysex_transfer *sysex_transfer);
 
+//Returns the connector that would be tested first for a device after the MIDI identity request without running any handshake or NULL if it is not known.
+
+const gchar *connector_get_known_name (struct backend *backend,
+				       struct backend_device *device);
+
 #endif
@@ -350,3 +350,24 @@ common_sample_load (const gchar *path, GByteArray *sample,
     }
   return res;
 }
+
+gint
+common_sample_open_source (const gchar *path, struct sample_source **source,
+			   struct job_control *control, guint32 rate,
+			   guint32 channels, guint32 format)
+{
+  struct sample_info sample_info_dst;
+  sample_info_dst.rate = rate;
+  sample_info_dst.channels = channels;
+  sample_info_dst.format = format;
+  gint res = sample_source_open (path, &sample_info_dst, source);
+  if (!res)
+    {
+      if (!control->data)
+	{
+	  control->data = g_malloc (sizeof (struct sample_info));
+	}
+      memcpy (control->data, &sample_info_dst, sizeof (struct sample_info));
+    }
+  return res;
+}
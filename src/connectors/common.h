@@ -86,3 +86,8 @@ gchar *common_get_sanitized_name (const gchar * name, const gchar * alphabet,
 gint common_sample_load (const gchar * path, GByteArray * sample,
 			 struct job_control *control, guint32 rate,
 			 guint32 channels, guint32 format);
+
+gint common_sample_open_source (const gchar * path,
+				struct sample_source **source,
+				struct job_control *control, guint32 rate,
+				guint32 channels, guint32 format);
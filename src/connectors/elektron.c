@@ -28,6 +28,7 @@
 #include "../config.h"
 
 #define DEVICES_FILE "/elektron/devices.json"
+#define SAMPLE_HASHES_FILE "/elektron_sample_hashes.json"
 
 #define DEV_TAG_ID "id"
 #define DEV_TAG_NAME "name"
@@ -37,6 +38,8 @@
 
 static const gchar *FS_TYPE_NAMES[] = { "+Drive", "RAM" };
 
+static GMutex sample_hashes_mutex;
+
 #define DATA_TRANSF_BLOCK_BYTES 0x2000
 #define OS_TRANSF_BLOCK_BYTES 0x800
 #define MAX_ZIP_SIZE (128 * 1024 * 1024)
@@ -97,10 +100,19 @@ typedef GByteArray *(*elektron_msg_path_len_func) (const gchar *, guint);
 
 typedef GByteArray *(*elektron_msg_read_blk_func) (guint, guint, guint);
 
+//Builds the message to write a block. The total amount of bytes is needed by the headers.
+
 typedef GByteArray *(*elektron_msg_write_blk_func) (guint, GByteArray *,
-						    guint *, guint, void *);
+						    guint, guint, void *);
+
+//Replaces the content of the block with the next bytes of the resource as stored in the device.
+
+typedef gint (*elektron_read_blk_func) (GByteArray *, guint, gpointer);
+
+//Receives every block of the resource as stored in the device.
 
-typedef void (*elektron_copy_array) (GByteArray *, GByteArray *);
+typedef gint (*elektron_write_blk_func) (GByteArray *, struct job_control *,
+					 gpointer);
 
 typedef gint (*elektron_path_func) (struct backend *, const gchar *);
 
@@ -554,86 +566,69 @@ elektron_new_msg_list (const gchar *path, int32_t start_index,
   return msg;
 }
 
+static void
+elektron_set_sample_header (struct elektron_sample_header *header,
+			    guint32 bytes, struct sample_info *sample_info)
+{
+  header->type = 0;
+  header->sample_len_bytes = g_htonl (bytes);
+  header->rate = g_htonl (ELEKTRON_SAMPLE_RATE);
+  header->loop_start = g_htonl (sample_info->loop_start);
+  header->loop_end = g_htonl (sample_info->loop_end);
+  header->loop_type = g_htonl (ELEKTRON_LOOP_TYPE);
+  memset (&header->padding, 0,
+	  sizeof (guint32) * ELEKTRON_SAMPLE_INFO_PAD_I32_LEN);
+}
+
 static GByteArray *
-elektron_new_msg_write_sample_blk (guint id, GByteArray *sample,
-				   guint *total, guint seq, void *data)
+elektron_new_msg_write_common_blk (const guint8 *data, guint len, guint id,
+				   guint seq, const guint8 *header,
+				   guint header_len, GByteArray *blk)
 {
   guint32 aux32;
-  guint16 aux16, *aux16p;
-  int i, consumed, bytes_blk;
-  struct sample_info *sample_info = data;
-  struct elektron_sample_header elektron_sample_header;
-  GByteArray *msg = elektron_new_msg (FS_SAMPLE_WRITE_FILE_REQUEST,
-				      sizeof (FS_SAMPLE_WRITE_FILE_REQUEST));
-
+  GByteArray *msg = elektron_new_msg (data, len);
 
   aux32 = g_htonl (id);
   memcpy (&msg->data[5], &aux32, sizeof (guint32));
+  aux32 = g_htonl (header_len + blk->len);
+  memcpy (&msg->data[9], &aux32, sizeof (guint32));
   aux32 = g_htonl (DATA_TRANSF_BLOCK_BYTES * seq);
   memcpy (&msg->data[13], &aux32, sizeof (guint32));
 
-  bytes_blk = DATA_TRANSF_BLOCK_BYTES;
-  consumed = 0;
-
-  if (seq == 0)
-    {
-      elektron_sample_header.type = 0;
-      elektron_sample_header.sample_len_bytes = g_htonl (sample->len);
-      elektron_sample_header.rate = g_htonl (ELEKTRON_SAMPLE_RATE);
-      elektron_sample_header.loop_start = g_htonl (sample_info->loop_start);
-      elektron_sample_header.loop_end = g_htonl (sample_info->loop_end);
-      elektron_sample_header.loop_type = g_htonl (ELEKTRON_LOOP_TYPE);
-      memset (&elektron_sample_header.padding, 0,
-	      sizeof (guint32) * ELEKTRON_SAMPLE_INFO_PAD_I32_LEN);
+  g_byte_array_append (msg, header, header_len);
+  g_byte_array_append (msg, blk->data, blk->len);
 
-      g_byte_array_append (msg, (guchar *) & elektron_sample_header,
-			   sizeof (struct elektron_sample_header));
+  return msg;
+}
 
-      consumed = sizeof (struct elektron_sample_header);
-      bytes_blk -= consumed;
-    }
+static GByteArray *
+elektron_new_msg_write_sample_blk (guint id, GByteArray *blk, guint seq,
+				   guint bytes, void *data)
+{
+  guint header_len = 0;
+  struct elektron_sample_header header;
 
-  i = 0;
-  aux16p = (guint16 *) & sample->data[*total];
-  while (i < bytes_blk && *total < sample->len)
+  if (seq == 0)
     {
-      aux16 = g_htons (*aux16p);
-      g_byte_array_append (msg, (guint8 *) & aux16, sizeof (guint16));
-      aux16p++;
-      (*total) += sizeof (guint16);
-      consumed += sizeof (guint16);
-      i += sizeof (guint16);
+      elektron_set_sample_header (&header, bytes, data);
+      header_len = sizeof (struct elektron_sample_header);
     }
 
-  aux32 = g_htonl (consumed);
-  memcpy (&msg->data[9], &aux32, sizeof (guint32));
-
-  return msg;
+  return elektron_new_msg_write_common_blk (FS_SAMPLE_WRITE_FILE_REQUEST,
+					    sizeof
+					    (FS_SAMPLE_WRITE_FILE_REQUEST),
+					    id, seq, (guint8 *) & header,
+					    header_len, blk);
 }
 
 static GByteArray *
-elektron_new_msg_write_raw_blk (guint id, GByteArray *raw, guint *total,
-				guint seq, void *data)
+elektron_new_msg_write_raw_blk (guint id, GByteArray *blk, guint seq,
+				guint bytes, void *data)
 {
-  gint len;
-  guint32 aux32;
-  GByteArray *msg = elektron_new_msg (FS_RAW_WRITE_FILE_REQUEST,
-				      sizeof (FS_RAW_WRITE_FILE_REQUEST));
-
-  aux32 = g_htonl (id);
-  memcpy (&msg->data[5], &aux32, sizeof (guint32));
-  aux32 = g_htonl (DATA_TRANSF_BLOCK_BYTES * seq);
-  memcpy (&msg->data[13], &aux32, sizeof (guint32));
-
-  len = raw->len - *total;
-  len = len > DATA_TRANSF_BLOCK_BYTES ? DATA_TRANSF_BLOCK_BYTES : len;
-  g_byte_array_append (msg, &raw->data[*total], len);
-  (*total) += len;
-
-  aux32 = g_htonl (len);
-  memcpy (&msg->data[9], &aux32, sizeof (guint32));
-
-  return msg;
+  return elektron_new_msg_write_common_blk (FS_RAW_WRITE_FILE_REQUEST,
+					    sizeof
+					    (FS_RAW_WRITE_FILE_REQUEST),
+					    id, seq, NULL, 0, blk);
 }
 
 static GByteArray *
@@ -735,7 +730,6 @@ elektron_tx (struct backend *backend, const GByteArray *msg)
 {
   gint res;
   guint16 aux;
-  gchar *text;
   struct sysex_transfer transfer;
   struct elektron_data *data = backend->data;
 
@@ -747,9 +741,8 @@ elektron_tx (struct backend *backend, const GByteArray *msg)
   res = backend_tx_sysex (backend, &transfer);
   if (!res)
     {
-      text = debug_get_hex_msg (msg);
-      debug_print (1, "Message sent (%d): %s\n", msg->len, text);
-      g_free (text);
+      debug_print_hex (1, msg->data, msg->len, "Message sent (%d): %s\n",
+		       msg->len);
     }
 
   free_msg (transfer.raw);
@@ -759,7 +752,6 @@ elektron_tx (struct backend *backend, const GByteArray *msg)
 static GByteArray *
 elektron_rx (struct backend *backend, gint timeout)
 {
-  gchar *text;
   GByteArray *msg;
   struct sysex_transfer transfer;
 
@@ -779,22 +771,16 @@ elektron_rx (struct backend *backend, gint timeout)
 	  break;
 	}
 
-      if (debug_level > 1)
-	{
-	  text = debug_get_hex_msg (transfer.raw);
-	  debug_print (2, "Message skipped (%d): %s\n", transfer.raw->len,
-		       text);
-	  g_free (text);
-	}
+      debug_print_hex (2, transfer.raw->data, transfer.raw->len,
+		       "Message skipped (%d): %s\n", transfer.raw->len);
       free_msg (transfer.raw);
     }
 
   msg = elektron_raw_to_msg (transfer.raw);
   if (msg)
     {
-      text = debug_get_hex_msg (msg);
-      debug_print (1, "Message received (%d): %s\n", msg->len, text);
-      g_free (text);
+      debug_print_hex (1, msg->data, msg->len,
+		       "Message received (%d): %s\n", msg->len);
     }
 
   free_msg (transfer.raw);
@@ -907,7 +893,7 @@ elektron_read_common_dir (struct backend *backend,
   GByteArray *tx_msg, *rx_msg = NULL;
   gboolean is_file = file_exists (backend, dir);
 
-  usleep (BE_REST_TIME_US);
+  backend_rest (backend, BE_REST_TIME_US);
 
   if (is_file)
     {
@@ -1285,16 +1271,57 @@ elektron_delete_raw_item (struct backend *backend, const gchar *path)
 				      elektron_delete_raw);
 }
 
+struct elektron_array_reader
+{
+  GByteArray *input;
+  guint pos;
+};
+
+static gint
+elektron_read_array_blk (GByteArray *blk, guint len, gpointer data)
+{
+  struct elektron_array_reader *reader = data;
+  g_byte_array_set_size (blk, 0);
+  g_byte_array_append (blk, &reader->input->data[reader->pos], len);
+  reader->pos += len;
+  return 0;
+}
+
+//Samples are stored in the device as big endian.
+
+static void
+elektron_swap_sample_blk (GByteArray *blk)
+{
+  guint16 *aux16p = (guint16 *) blk->data;
+  for (gint i = 0; i < blk->len; i += sizeof (guint16), aux16p++)
+    {
+      *aux16p = g_htons (*aux16p);
+    }
+}
+
+static gint
+elektron_read_sample_array_blk (GByteArray *blk, guint len, gpointer data)
+{
+  elektron_read_array_blk (blk, len, data);
+  elektron_swap_sample_blk (blk);
+  return 0;
+}
+
+//The header, if any, is sent within the first block.
+
 static gint
 elektron_upload_smplrw (struct backend *backend, const gchar *path,
-			GByteArray *input, struct job_control *control,
+			guint bytes, guint header_len,
+			struct job_control *control,
+			elektron_read_blk_func read_blk, gpointer read_data,
 			elektron_msg_path_len_func new_msg_open_write,
 			elektron_msg_write_blk_func new_msg_write_blk,
 			elektron_msg_id_len_func new_msg_close_write)
 {
   GByteArray *tx_msg;
   GByteArray *rx_msg;
-  guint transferred;
+  GByteArray *blk;
+  guint transferred, len;
   guint32 id;
   int i;
   gboolean active;
@@ -1303,7 +1330,7 @@ elektron_upload_smplrw (struct backend *backend, const gchar *path,
   //If the file already exists the device makes no difference between creating a new file and creating an already existent file.
   //Also, the new file would be discarded if an upload is not completed.
 
-  tx_msg = new_msg_open_write (path, input->len);
+  tx_msg = new_msg_open_write (path, bytes);
   if (!tx_msg)
     {
       return -EINVAL;
@@ -1328,18 +1355,29 @@ elektron_upload_smplrw (struct backend *backend, const gchar *path,
 
   transferred = 0;
   i = 0;
+  blk = g_byte_array_sized_new (DATA_TRANSF_BLOCK_BYTES);
 
   g_mutex_lock (&control->mutex);
   active = control->active;
   g_mutex_unlock (&control->mutex);
 
-  while (transferred < input->len && active)
+  while (transferred < bytes && active)
     {
-      tx_msg = new_msg_write_blk (id, input, &transferred, i, control->data);
+      len = DATA_TRANSF_BLOCK_BYTES - (i ? 0 : header_len);
+      len = MIN (len, bytes - transferred);
+      res = read_blk (blk, len, read_data);
+      if (res)
+	{
+	  break;
+	}
+
+      tx_msg = new_msg_write_blk (id, blk, i, bytes, control->data);
+      transferred += blk->len;
       rx_msg = elektron_tx_and_rx (backend, tx_msg);
       if (!rx_msg)
 	{
-	  return -EIO;
+	  res = -EIO;
+	  break;
 	}
       //Response: x, x, x, x, 0xc2, [0 (error), 1 (success)]...
       if (!elektron_get_msg_status (rx_msg))
@@ -1349,17 +1387,19 @@ elektron_upload_smplrw (struct backend *backend, const gchar *path,
       free_msg (rx_msg);
       i++;
 
-      set_job_control_progress (control, transferred / (double) input->len);
+      set_job_control_progress (control, transferred / (double) bytes);
       g_mutex_lock (&control->mutex);
       active = control->active;
       g_mutex_unlock (&control->mutex);
 
-      usleep (BE_REST_TIME_US);
+      backend_rest (backend, BE_REST_TIME_US);
     }
 
+  g_byte_array_free (blk, TRUE);
+
   debug_print (2, "%d bytes sent\n", transferred);
 
-  if (active)
+  if (active && !res)
     {
       tx_msg = new_msg_close_write (id, transferred);
       rx_msg = elektron_tx_and_rx (backend, tx_msg);
@@ -1382,26 +1422,358 @@ gint
 elektron_upload_sample_part (struct backend *backend, const gchar *path,
 			     GByteArray *sample, struct job_control *control)
 {
-  return elektron_upload_smplrw (backend, path, sample, control,
-				 elektron_new_msg_open_sample_write,
+  struct elektron_array_reader reader;
+  reader.input = sample;
+  reader.pos = 0;
+  return elektron_upload_smplrw (backend, path, sample->len,
+				 sizeof (struct elektron_sample_header),
+				 control, elektron_read_sample_array_blk,
+				 &reader, elektron_new_msg_open_sample_write,
 				 elektron_new_msg_write_sample_blk,
 				 elektron_new_msg_close_sample_write);
 }
 
+//The hash function used by the devices is not documented so the hash and the size the device reports after an upload are stored by the SHA-256 of the local content.
+//Hence, only the content uploaded once through Elektroid can be recognized.
+
+static JsonNode *
+elektron_load_sample_hashes ()
+{
+  JsonNode *root;
+  JsonParser *parser;
+  GError *error = NULL;
+  gchar *path = get_user_dir (CONF_DIR SAMPLE_HASHES_FILE);
+
+  parser = json_parser_new ();
+  if (json_parser_load_from_file (parser, path, &error))
+    {
+      root = json_parser_get_root (parser);
+      root = JSON_NODE_HOLDS_OBJECT (root) ? json_node_copy (root) : NULL;
+    }
+  else
+    {
+      debug_print (1, "Error while loading sample hashes from '%s': %s\n",
+		   path, error->message);
+      g_error_free (error);
+      root = NULL;
+    }
+
+  g_object_unref (parser);
+  g_free (path);
+
+  return root;
+}
+
+static gint
+elektron_get_cached_sample_hash (const gchar *checksum, guint32 *hash,
+				 guint32 *size)
+{
+  JsonNode *root, *node;
+  JsonObject *entry;
+  gint err = -ENOENT;
+
+  g_mutex_lock (&sample_hashes_mutex);
+  root = elektron_load_sample_hashes ();
+  g_mutex_unlock (&sample_hashes_mutex);
+
+  if (!root)
+    {
+      return err;
+    }
+
+  node = json_object_get_member (json_node_get_object (root), checksum);
+  if (node && JSON_NODE_HOLDS_OBJECT (node))
+    {
+      entry = json_node_get_object (node);
+      if (json_object_has_member (entry, "hash") &&
+	  json_object_has_member (entry, "size"))
+	{
+	  *hash = json_object_get_int_member (entry, "hash");
+	  *size = json_object_get_int_member (entry, "size");
+	  err = 0;
+	}
+    }
+
+  json_node_free (root);
+
+  return err;
+}
+
+static void
+elektron_set_cached_sample_hash (const gchar *checksum, guint32 hash,
+				 guint32 size)
+{
+  gchar *path, *json;
+  JsonNode *root;
+  JsonObject *entry;
+  JsonGenerator *gen;
+
+  entry = json_object_new ();
+  json_object_set_int_member (entry, "hash", hash);
+  json_object_set_int_member (entry, "size", size);
+
+  g_mutex_lock (&sample_hashes_mutex);
+
+  root = elektron_load_sample_hashes ();
+  if (!root)
+    {
+      root = json_node_new (JSON_NODE_OBJECT);
+      json_node_take_object (root, json_object_new ());
+    }
+  json_object_set_object_member (json_node_get_object (root), checksum,
+				 entry);
+
+  gen = json_generator_new ();
+  json_generator_set_root (gen, root);
+  json = json_generator_to_data (gen, NULL);
+
+  path = get_user_dir (CONF_DIR);
+  if (g_mkdir_with_parents (path, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH |
+			    S_IXOTH))
+    {
+      error_print ("Error wile creating directory `%s'\n", path);
+    }
+  else
+    {
+      g_free (path);
+      path = get_user_dir (CONF_DIR SAMPLE_HASHES_FILE);
+      debug_print (1, "Saving sample hashes to '%s'...\n", path);
+      save_file_char (path, (guint8 *) json, strlen (json));
+    }
+
+  g_mutex_unlock (&sample_hashes_mutex);
+
+  g_free (path);
+  g_free (json);
+  json_node_free (root);
+  g_object_unref (gen);
+}
+
+static gint
+elektron_get_sample_entry (struct backend *backend, const gchar *path,
+			   guint32 *hash, guint32 *size)
+{
+  gint err;
+  gchar *dir, *name;
+  struct item_iterator iter;
+  struct elektron_iterator_data *data;
+
+  dir = g_path_get_dirname (path);
+  err = elektron_read_samples_dir (backend, &iter, dir, NULL);
+  g_free (dir);
+  if (err)
+    {
+      return err;
+    }
+
+  err = -ENOENT;
+  name = g_path_get_basename (path);
+  while (!next_item_iterator (&iter))
+    {
+      if (iter.item.type == ELEKTROID_FILE && !strcmp (iter.item.name, name))
+	{
+	  data = iter.data;
+	  *hash = data->hash;
+	  *size = iter.item.size;
+	  err = 0;
+	  break;
+	}
+    }
+  g_free (name);
+  free_item_iterator (&iter);
+
+  return err;
+}
+
+//The content might be in the device under a different path but only the destination path counts as the protocol has no copy operation.
+
+static gboolean
+elektron_sample_is_in_device (struct backend *backend, const gchar *path,
+			      const gchar *checksum)
+{
+  gchar *found;
+  gboolean same;
+  guint32 hash, size, entry_hash, entry_size;
+
+  if (elektron_get_cached_sample_hash (checksum, &hash, &size))
+    {
+      return FALSE;
+    }
+
+  found = elektron_get_sample_path_from_hash_size (backend, hash, size);
+  if (!found)
+    {
+      return FALSE;
+    }
+
+  debug_print (1, "Sample 0x%08x (%d B) found in %s\n", hash, size, found);
+  same = !strcmp (found, path);
+  g_free (found);
+  if (same)
+    {
+      return TRUE;
+    }
+
+  return !elektron_get_sample_entry (backend, path, &entry_hash, &entry_size)
+    && entry_hash == hash && entry_size == size;
+}
+
+static gboolean
+elektron_skip_sample_upload (struct backend *backend, const gchar *path,
+			     const gchar *checksum,
+			     struct job_control *control)
+{
+  if (!elektron_sample_is_in_device (backend, path, checksum))
+    {
+      return FALSE;
+    }
+
+  debug_print (1, "Skipping upload of %s...\n", path);
+  control->deduplicated = TRUE;
+  set_job_control_progress (control, 1.0);
+  return TRUE;
+}
+
+static void
+elektron_cache_sample_hash (struct backend *backend, const gchar *path,
+			    const gchar *checksum,
+			    struct job_control *control)
+{
+  gboolean active;
+  guint32 hash, size;
+
+  g_mutex_lock (&control->mutex);
+  active = control->active;
+  g_mutex_unlock (&control->mutex);
+
+  if (active && !elektron_get_sample_entry (backend, path, &hash, &size))
+    {
+      debug_print (1, "Sample %s stored with hash 0x%08x (%d B)\n", path,
+		   hash, size);
+      elektron_set_cached_sample_hash (checksum, hash, size);
+    }
+}
+
+//The file is not available here so the converted frames and the loop points are used.
+
+static gchar *
+elektron_get_sample_checksum (GByteArray *sample,
+			      struct sample_info *sample_info)
+{
+  gchar *str;
+  GChecksum *checksum = g_checksum_new (G_CHECKSUM_SHA256);
+
+  g_checksum_update (checksum, sample->data, sample->len);
+  g_checksum_update (checksum, (guint8 *) & sample_info->loop_start,
+		     sizeof (guint32));
+  g_checksum_update (checksum, (guint8 *) & sample_info->loop_end,
+		     sizeof (guint32));
+  str = g_strdup (g_checksum_get_string (checksum));
+  g_checksum_free (checksum);
+
+  return str;
+}
+
 static gint
 elektron_upload_sample (struct backend *backend, const gchar *path,
 			GByteArray *input, struct job_control *control)
 {
+  gint err;
+  gchar *checksum;
+
   control->parts = 1;
   control->part = 0;
-  return elektron_upload_sample_part (backend, path, input, control);
+
+  if (!control->data)
+    {
+      return elektron_upload_sample_part (backend, path, input, control);
+    }
+
+  checksum = elektron_get_sample_checksum (input, control->data);
+
+  if (elektron_skip_sample_upload (backend, path, checksum, control))
+    {
+      g_free (checksum);
+      return 0;
+    }
+
+  err = elektron_upload_sample_part (backend, path, input, control);
+  if (!err)
+    {
+      elektron_cache_sample_hash (backend, path, checksum, control);
+    }
+
+  g_free (checksum);
+  return err;
+}
+
+static gint
+elektron_read_sample_source_blk (GByteArray *blk, guint len, gpointer data)
+{
+  gint err;
+  struct sample_source *source = data;
+
+  err = sample_source_read (source, blk, len / sizeof (guint16));
+  if (err)
+    {
+      return err;
+    }
+
+  elektron_swap_sample_blk (blk);
+
+  return 0;
+}
+
+//The sample is converted while it is being sent so it is never entirely in memory.
+
+static gint
+elektron_upload_sample_source (struct backend *backend, const gchar *path,
+			       struct sample_source *source,
+			       struct job_control *control)
+{
+  gint err;
+  guint32 bytes;
+  gchar *checksum;
+  const struct sample_info *sample_info =
+    sample_source_get_sample_info (source);
+
+  control->parts = 1;
+  control->part = 0;
+
+  checksum = sample_source_get_checksum (source);
+
+  if (elektron_skip_sample_upload (backend, path, checksum, control))
+    {
+      g_free (checksum);
+      return 0;
+    }
+
+  bytes = sample_info->frames * SAMPLE_INFO_FRAME_SIZE (sample_info);
+
+  err = elektron_upload_smplrw (backend, path, bytes,
+				sizeof (struct elektron_sample_header),
+				control, elektron_read_sample_source_blk,
+				source, elektron_new_msg_open_sample_write,
+				elektron_new_msg_write_sample_blk,
+				elektron_new_msg_close_sample_write);
+  if (!err)
+    {
+      elektron_cache_sample_hash (backend, path, checksum, control);
+    }
+
+  g_free (checksum);
+  return err;
 }
 
 static gint
 elektron_upload_raw (struct backend *backend, const gchar *path,
-		     GByteArray *sample, struct job_control *control)
+		     GByteArray *raw, struct job_control *control)
 {
-  return elektron_upload_smplrw (backend, path, sample, control,
+  struct elektron_array_reader reader;
+  reader.input = raw;
+  reader.pos = 0;
+  return elektron_upload_smplrw (backend, path, raw->len, 0, control,
+				 elektron_read_array_blk, &reader,
 				 elektron_new_msg_open_raw_write,
 				 elektron_new_msg_write_raw_blk,
 				 elektron_new_msg_close_raw_write);
@@ -1423,41 +1795,40 @@ elektron_new_msg_open_raw_read (const gchar *path)
 				(FS_RAW_OPEN_FILE_READER_REQUEST), path);
 }
 
-static void
-elektron_copy_sample_data (GByteArray *input, GByteArray *output)
+static gint
+elektron_write_sample_array_blk (GByteArray *blk,
+				 struct job_control *control, gpointer data)
 {
-  gint i;
-  gint16 v;
-  gint16 *frame = (gint16 *) input->data;
-
-  for (i = 0; i < input->len; i += sizeof (gint16))
-    {
-      v = g_ntohs (*frame);
-      g_byte_array_append (output, (guint8 *) & v, sizeof (gint16));
-      frame++;
-    }
+  GByteArray *output = data;
+  elektron_swap_sample_blk (blk);
+  g_byte_array_append (output, blk->data, blk->len);
+  return 0;
 }
 
-static void
-elektron_copy_raw_data (GByteArray *input, GByteArray *output)
+static gint
+elektron_write_raw_array_blk (GByteArray *blk, struct job_control *control,
+			      gpointer data)
 {
-  g_byte_array_append (output, input->data, input->len);
+  GByteArray *output = data;
+  g_byte_array_append (output, blk->data, blk->len);
+  return 0;
 }
 
 static gint
 elektron_download_smplrw (struct backend *backend, const gchar *path,
-			  GByteArray *output, struct job_control *control,
+			  struct job_control *control,
 			  elektron_msg_path_func new_msg_open_read,
 			  guint read_offset,
 			  elektron_msg_read_blk_func new_msg_read_blk,
 			  elektron_msg_id_func new_msg_close_read,
-			  elektron_copy_array copy_array)
+			  elektron_write_blk_func write_blk,
+			  gpointer write_data)
 {
   struct sample_info *sample_info;
   struct elektron_sample_header *elektron_sample_header;
   GByteArray *tx_msg;
   GByteArray *rx_msg;
-  GByteArray *array;
+  GByteArray *blk;
   guint32 id;
   guint frames;
   guint next_block_start;
@@ -1493,7 +1864,7 @@ elektron_download_smplrw (struct backend *backend, const gchar *path,
   active = control->active;
   g_mutex_unlock (&control->mutex);
 
-  array = g_byte_array_new ();
+  blk = g_byte_array_sized_new (DATA_TRANSF_BLOCK_BYTES);
   res = 0;
   next_block_start = 0;
   offset = read_offset;
@@ -1511,14 +1882,10 @@ elektron_download_smplrw (struct backend *backend, const gchar *path,
 	  res = -EIO;
 	  goto cleanup;
 	}
-      g_byte_array_append (array, &rx_msg->data[FS_SAMPLES_PAD_RES + offset],
-			   req_size - offset);
 
-      next_block_start += req_size;
       //Only in the first iteration. It has no effect for the raw filesystem (M:C) as offset is 0.
       if (offset)
 	{
-	  offset = 0;
 	  elektron_sample_header =
 	    (struct elektron_sample_header *)
 	    &rx_msg->data[FS_SAMPLES_PAD_RES];
@@ -1537,23 +1904,31 @@ elektron_download_smplrw (struct backend *backend, const gchar *path,
 		       sample_info->loop_start, sample_info->loop_end);
 	}
 
+      g_byte_array_set_size (blk, 0);
+      g_byte_array_append (blk, &rx_msg->data[FS_SAMPLES_PAD_RES + offset],
+			   req_size - offset);
+      offset = 0;
       free_msg (rx_msg);
 
+      next_block_start += req_size;
+
+      res = write_blk (blk, control, write_data);
+      if (res)
+	{
+	  break;
+	}
+
       set_job_control_progress (control, next_block_start / (double) frames);
       g_mutex_lock (&control->mutex);
       active = control->active;
       g_mutex_unlock (&control->mutex);
 
-      usleep (BE_REST_TIME_US);
+      backend_rest (backend, BE_REST_TIME_US);
     }
 
   debug_print (2, "%d bytes received\n", next_block_start);
 
-  if (active)
-    {
-      copy_array (array, output);
-    }
-  else
+  if (!active && !res)
     {
       res = -1;
     }
@@ -1569,7 +1944,7 @@ elektron_download_smplrw (struct backend *backend, const gchar *path,
   free_msg (rx_msg);
 
 cleanup:
-  free_msg (array);
+  g_byte_array_free (blk, TRUE);
   return res;
 }
 
@@ -1578,12 +1953,12 @@ elektron_download_sample_part (struct backend *backend, const gchar *path,
 			       GByteArray *output,
 			       struct job_control *control)
 {
-  return elektron_download_smplrw (backend, path, output, control,
+  return elektron_download_smplrw (backend, path, control,
 				   elektron_new_msg_open_sample_read,
 				   sizeof (struct elektron_sample_header),
 				   elektron_new_msg_read_sample_blk,
 				   elektron_new_msg_close_sample_read,
-				   elektron_copy_sample_data);
+				   elektron_write_sample_array_blk, output);
 }
 
 static gint
@@ -1595,17 +1970,79 @@ elektron_download_sample (struct backend *backend, const gchar *path,
   return elektron_download_sample_part (backend, path, output, control);
 }
 
+struct elektron_sink_writer
+{
+  const gchar *path;
+  struct sample_sink *sink;
+};
+
+//The file can only be opened once the header has been received.
+
+static gint
+elektron_write_sample_sink_blk (GByteArray *blk, struct job_control *control,
+				gpointer data)
+{
+  gint err;
+  struct elektron_sink_writer *writer = data;
+  struct sample_info *sample_info = control->data;
+
+  if (!writer->sink)
+    {
+      //The frames member contains the size in bytes reported by the device.
+      err = sample_sink_open (writer->path, sample_info,
+			      SF_FORMAT_WAV | SF_FORMAT_PCM_16,
+			      sample_info->frames, &writer->sink);
+      if (err)
+	{
+	  return err;
+	}
+    }
+
+  elektron_swap_sample_blk (blk);
+  return sample_sink_write (writer->sink, blk);
+}
+
+//The sample is written to the file while it is being received so it is never entirely in memory.
+
+static gint
+elektron_download_sample_sink (struct backend *backend, const gchar *path,
+			       const gchar *dst, struct job_control *control)
+{
+  gint err, close_err;
+  struct elektron_sink_writer writer;
+
+  control->parts = 1;
+  control->part = 0;
+
+  writer.path = dst;
+  writer.sink = NULL;
+  err = elektron_download_smplrw (backend, path, control,
+				  elektron_new_msg_open_sample_read,
+				  sizeof (struct elektron_sample_header),
+				  elektron_new_msg_read_sample_blk,
+				  elektron_new_msg_close_sample_read,
+				  elektron_write_sample_sink_blk, &writer);
+
+  if (writer.sink)
+    {
+      close_err = sample_sink_close (writer.sink, !err);
+      err = err ? err : close_err;
+    }
+
+  return err;
+}
+
 static gint
 elektron_download_raw (struct backend *backend, const gchar *path,
 		       GByteArray *output, struct job_control *control)
 {
   gint ret;
   gchar *path_with_ext = elektron_add_ext_to_mc_snd (path);
-  ret = elektron_download_smplrw (backend, path_with_ext, output, control,
+  ret = elektron_download_smplrw (backend, path_with_ext, control,
 				  elektron_new_msg_open_raw_read,
 				  0, elektron_new_msg_read_raw_blk,
 				  elektron_new_msg_close_raw_read,
-				  elektron_copy_raw_data);
+				  elektron_write_raw_array_blk, output);
   g_free (path_with_ext);
   return ret;
 }
@@ -1716,7 +2153,7 @@ elektron_upgrade_os (struct backend *backend, struct sysex_transfer *transfer)
 
       free_msg (rx_msg);
 
-      usleep (BE_REST_TIME_US);
+      backend_rest (backend, BE_REST_TIME_US);
 
       g_mutex_lock (&transfer->mutex);
       active = transfer->active;
@@ -2365,7 +2802,7 @@ elektron_download_data_prefix (struct backend *backend, const gchar *path,
       return -EIO;
     }
 
-  usleep (BE_REST_TIME_US);
+  backend_rest (backend, BE_REST_TIME_US);
 
   jidbe = g_htonl (jid);
 
@@ -2446,7 +2883,7 @@ elektron_download_data_prefix (struct backend *backend, const gchar *path,
 	  g_mutex_unlock (&control->mutex);
 	}
 
-      usleep (BE_REST_TIME_US);
+      backend_rest (backend, BE_REST_TIME_US);
     }
 
   return elektron_close_datum (backend, jid, O_RDONLY, 0);
@@ -2710,7 +3147,7 @@ elektron_upload_data_prefix (struct backend *backend, const gchar *path,
       goto end;
     }
 
-  usleep (BE_REST_TIME_US);
+  backend_rest (backend, BE_REST_TIME_US);
 
   jidbe = g_htonl (jid);
 
@@ -2761,7 +3198,7 @@ elektron_upload_data_prefix (struct backend *backend, const gchar *path,
 	  goto end;
 	}
 
-      usleep (BE_REST_TIME_US);
+      backend_rest (backend, BE_REST_TIME_US);
 
       if (!elektron_get_msg_status (rx_msg))
 	{
@@ -2902,6 +3339,17 @@ elektron_sample_load (const gchar *path, GByteArray *sample,
 			     ELEKTRON_SAMPLE_CHANNELS, SF_FORMAT_PCM_16);
 }
 
+static gint
+elektron_sample_open_source (const gchar *path,
+			     struct sample_source **source,
+			     struct job_control *control)
+{
+  return common_sample_open_source (path, source, control,
+				    ELEKTRON_SAMPLE_RATE,
+				    ELEKTRON_SAMPLE_CHANNELS,
+				    SF_FORMAT_PCM_16);
+}
+
 gchar *
 elektron_get_sample_path_from_hash_size (struct backend *backend,
 					 guint32 hash, guint32 size)
@@ -2936,6 +3384,37 @@ elektron_get_sample_path_from_hash_size (struct backend *backend,
   return path;
 }
 
+//Only the files uploaded through the source are recognized as the checksum of the file itself is used.
+
+static gint
+elektron_sample_matches (struct backend *backend, const gchar *path,
+			 struct item_iterator *iter)
+{
+  gint err;
+  gsize len;
+  gchar *contents, *checksum;
+  guint32 hash, size;
+  struct elektron_iterator_data *data = iter->data;
+
+  if (!g_file_get_contents (path, &contents, &len, NULL))
+    {
+      return -EIO;
+    }
+
+  checksum = g_compute_checksum_for_data (G_CHECKSUM_SHA256,
+					  (guint8 *) contents, len);
+  g_free (contents);
+
+  err = elektron_get_cached_sample_hash (checksum, &hash, &size);
+  g_free (checksum);
+  if (err)
+    {
+      return err;
+    }
+
+  return hash == data->hash && size == iter->item.size;
+}
+
 gint
 elektron_sample_save (const gchar *path, GByteArray *sample,
 		      struct job_control *control)
@@ -2962,11 +3441,15 @@ static const struct fs_operations FS_SAMPLES_OPERATIONS = {
   .move = elektron_move_samples_item,
   .download = elektron_download_sample,
   .upload = elektron_upload_sample,
+  .download_sink = elektron_download_sample_sink,
   .load = elektron_sample_load,
+  .open_source = elektron_sample_open_source,
+  .upload_source = elektron_upload_sample_source,
   .save = elektron_sample_save,
   .get_exts = backend_get_audio_exts,
   .get_upload_path = elektron_get_upload_path_smplrw,
-  .get_download_path = elektron_get_download_path_sample
+  .get_download_path = elektron_get_download_path_sample,
+  .matches = elektron_sample_matches
 };
 
 static const struct fs_operations FS_RAW_ANY_OPERATIONS = {
@@ -3340,7 +3823,7 @@ elektron_handshake (struct backend *backend)
       return -ENODEV;
     }
 
-  usleep (BE_REST_TIME_US);
+  backend_rest (backend, BE_REST_TIME_US);
 
   tx_msg = elektron_new_msg (SOFTWARE_VERSION_REQUEST,
 			     sizeof (SOFTWARE_VERSION_REQUEST));
@@ -3355,9 +3838,9 @@ elektron_handshake (struct backend *backend)
   snprintf (backend->version, LABEL_MAX, "%s", (gchar *) & rx_msg->data[10]);
   free_msg (rx_msg);
 
-  usleep (BE_REST_TIME_US);
+  backend_rest (backend, BE_REST_TIME_US);
 
-  if (debug_level > 1)
+  if (debug_enabled (2))
     {
       tx_msg = elektron_new_msg (DEVICEUID_REQUEST,
 				 sizeof (DEVICEUID_REQUEST));
@@ -3368,7 +3851,7 @@ elektron_handshake (struct backend *backend)
 	  free_msg (rx_msg);
 	}
 
-      usleep (BE_REST_TIME_US);
+      backend_rest (backend, BE_REST_TIME_US);
     }
 
   snprintf (backend->description, LABEL_MAX, "%s", overbridge_name);
@@ -19,8 +19,10 @@
  */
 
 #include <zip.h>
+#include <zlib.h>
 #include "microfreak.h"
 #include "common.h"
+#include "preset_index.h"
 
 #define MICROFREAK_PRESET_NAME_LEN 14
 #define MICROFREAK_MAX_PRESETS 512
@@ -35,6 +37,8 @@
 #define MICROFREAK_SAMPLE_MSG_SIZE (MICROFREAK_SAMPLE_BLK_SIZE * 8 / 7)
 #define MICROFREAK_SAMPLE_BATCH_SIZE 4096	// 147 packets (146 * 14 + 4)
 #define MICROFREAK_SAMPLE_BATCH_PACKETS 147
+#define MICROFREAK_SAMPLE_WINDOW_MIN 1
+#define MICROFREAK_SAMPLE_WINDOW_MAX 16
 
 #define MICROFREAK_GET_MSG_PAYLOAD_LEN(msg) (msg->data[7])
 #define MICROFREAK_GET_MSG_OP(msg) (msg->data[8])
@@ -65,6 +69,16 @@ enum microfreak_fs
   FS_MICROFREAK_SAMPLE
 };
 
+//The sample window is the amount of data packets sent without waiting for their acknowledgements.
+//It starts at the minimum and is doubled after every batch the device acknowledges in time, so it is learned from the device and kept across uploads.
+
+struct microfreak_data
+{
+  guint8 seq;
+  guint window;
+  struct preset_index preset_index;
+};
+
 struct microfreak_iter_data
 {
   guint next;
@@ -168,11 +182,11 @@ static GByteArray *
 microfreak_get_msg (struct backend *backend, guint8 op, void *data,
 		    guint8 len)
 {
-  guint8 *seq = backend->data;
+  struct microfreak_data *microfreak_data = backend->data;
   GByteArray *tx_msg = g_byte_array_sized_new (256);
   g_byte_array_append (tx_msg, MICROFREAK_REQUEST_HEADER,
 		       sizeof (MICROFREAK_REQUEST_HEADER));
-  g_byte_array_append (tx_msg, seq, 1);
+  g_byte_array_append (tx_msg, &microfreak_data->seq, 1);
   if (!data)
     {
       len = 0;
@@ -184,10 +198,10 @@ microfreak_get_msg (struct backend *backend, guint8 op, void *data,
       g_byte_array_append (tx_msg, (guint8 *) data, len);
     }
   g_byte_array_append (tx_msg, (guint8 *) "\xf7", 1);
-  (*seq)++;
-  if (*seq == 0x80)
+  microfreak_data->seq++;
+  if (microfreak_data->seq == 0x80)
     {
-      *seq = 0;
+      microfreak_data->seq = 0;
     }
   return tx_msg;
 }
@@ -253,21 +267,17 @@ microfreak_get_category_name (GByteArray *rx_msg)
 }
 
 static gint
-microfreak_next_preset_dentry (struct item_iterator *iter)
+microfreak_read_preset_slot (struct backend *backend, const gchar *dir,
+			     guint id, struct preset_index_entry *entry)
 {
   gint err;
+  guint8 *payload;
   const gchar *category;
   gchar preset_name[MICROFREAK_PRESET_NAME_LEN + 1];
   GByteArray *tx_msg, *rx_msg;
-  struct microfreak_iter_data *data = iter->data;
-
-  if (data->next > MICROFREAK_MAX_PRESETS)
-    {
-      return -ENOENT;
-    }
 
-  tx_msg = microfreak_get_preset_dump_msg (data->backend, data->next - 1, 0);
-  rx_msg = backend_tx_and_rx_sysex (data->backend, tx_msg, -1);
+  tx_msg = microfreak_get_preset_dump_msg (backend, id - 1, 0);
+  rx_msg = backend_tx_and_rx_sysex (backend, tx_msg, -1);
   if (!rx_msg)
     {
       return -EIO;
@@ -280,21 +290,58 @@ microfreak_next_preset_dentry (struct item_iterator *iter)
     }
 
   microfreak_get_preset_name (preset_name, rx_msg);
-  snprintf (iter->item.name, LABEL_MAX, "%s", preset_name);
+  snprintf (entry->name, LABEL_MAX, "%s", preset_name);
+  category = microfreak_get_category_name (rx_msg);
+  snprintf (entry->info, LABEL_MAX, "%s", category);
+  //The sequence number is not part of the payload.
+  payload = MICROFREAK_GET_MSG_PAYLOAD (rx_msg);
+  entry->hash = crc32 (0, payload, MICROFREAK_GET_MSG_PAYLOAD_LEN (rx_msg));
+
+end:
+  free_msg (rx_msg);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
+  return err;
+}
+
+static gint
+microfreak_next_preset_dentry (struct item_iterator *iter)
+{
+  gint err;
+  struct preset_index_entry entry;
+  struct microfreak_iter_data *data = iter->data;
+  struct microfreak_data *microfreak_data = data->backend->data;
+
+  if (data->next > MICROFREAK_MAX_PRESETS)
+    {
+      return -ENOENT;
+    }
+
+  err = preset_index_read (&microfreak_data->preset_index, "/", data->next,
+			   &entry);
+  if (err)
+    {
+      return err;
+    }
 
+  snprintf (iter->item.name, LABEL_MAX, "%s", entry.name);
   iter->item.id = data->next;
   iter->item.type = ELEKTROID_FILE;
   iter->item.size = -1;
-  category = microfreak_get_category_name (rx_msg);
-  snprintf (iter->item.object_info, LABEL_MAX, "%s", category);
+  snprintf (iter->item.object_info, LABEL_MAX, "%s", entry.info);
   (data->next)++;
 
-end:
-  free_msg (rx_msg);
-  usleep (MICROFREAK_REST_TIME_US);
   return 0;
 }
 
+static void
+microfreak_free_preset_iter_data (void *data)
+{
+  struct microfreak_iter_data *iter_data = data;
+  struct microfreak_data *microfreak_data = iter_data->backend->data;
+  preset_index_end_read (&microfreak_data->preset_index);
+  g_free (iter_data);
+}
+
 static gint
 microfreak_preset_read_dir (struct backend *backend,
 			    struct item_iterator *iter, const gchar *path,
@@ -312,7 +359,22 @@ microfreak_preset_read_dir (struct backend *backend,
   data->backend = backend;
   iter->data = data;
   iter->next = microfreak_next_preset_dentry;
-  iter->free = g_free;
+  iter->free = microfreak_free_preset_iter_data;
+
+  return 0;
+}
+
+static gint
+microfreak_preset_rescan (struct backend *backend, const gchar *path)
+{
+  struct microfreak_data *microfreak_data = backend->data;
+
+  if (strcmp (path, "/"))
+    {
+      return -ENOTDIR;
+    }
+
+  preset_index_invalidate_dir (&microfreak_data->preset_index, path);
 
   return 0;
 }
@@ -499,7 +561,7 @@ microfreak_preset_download (struct backend *backend, const gchar *path,
   free_msg (rx_msg);
   mfp.parts = init ? 0 : MICROFREAK_PRESET_PARTS;
 
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   if (init)
     {
@@ -525,7 +587,7 @@ microfreak_preset_download (struct backend *backend, const gchar *path,
   //Nothing to do with this response
   free_msg (rx_msg);
 
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   for (gint i = 0; i < mfp.parts; i++)
     {
@@ -546,7 +608,7 @@ microfreak_preset_download (struct backend *backend, const gchar *path,
       memcpy (mfp.part[i], MICROFREAK_GET_MSG_PAYLOAD (rx_msg), len);
       free_msg (rx_msg);
 
-      usleep (MICROFREAK_REST_TIME_US);
+      backend_rest (backend, MICROFREAK_REST_TIME_US);
     }
 
 end:
@@ -554,7 +616,7 @@ end:
     {
       microfreak_serialize_preset (output, &mfp);
     }
-  usleep (MICROFREAK_REST_TIME_US);	//Additional rest
+  backend_rest (backend, MICROFREAK_REST_TIME_US);	//Additional rest
   return err;
 }
 
@@ -566,6 +628,7 @@ microfreak_preset_upload (struct backend *backend, const gchar *path,
   GByteArray *tx_msg, *rx_msg;
   guint id;
   guint8 payload[3];
+  struct microfreak_data *microfreak_data = backend->data;
   gint err = common_slot_get_id_name_from_path (path, &id, NULL);
   if (err)
     {
@@ -578,6 +641,8 @@ microfreak_preset_upload (struct backend *backend, const gchar *path,
       return -EINVAL;
     }
 
+  preset_index_invalidate (&microfreak_data->preset_index, "/", id + 1);
+
   err = microfreak_deserialize_preset (&mfp, input);
   if (err)
     {
@@ -600,7 +665,7 @@ microfreak_preset_upload (struct backend *backend, const gchar *path,
       return err;
     }
 
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   control->part++;
   payload[0] = COMMON_GET_MIDI_BANK (id);
@@ -614,7 +679,7 @@ microfreak_preset_upload (struct backend *backend, const gchar *path,
     }
   free_msg (rx_msg);
 
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   control->part++;
   tx_msg = microfreak_get_msg (backend, 0x15, NULL, 0);
@@ -625,7 +690,7 @@ microfreak_preset_upload (struct backend *backend, const gchar *path,
     }
   free_msg (rx_msg);
 
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   for (gint i = 0; i < mfp.parts; i++)
     {
@@ -639,10 +704,10 @@ microfreak_preset_upload (struct backend *backend, const gchar *path,
 	{
 	  return err;
 	}
-      usleep (MICROFREAK_REST_TIME_US);
+      backend_rest (backend, MICROFREAK_REST_TIME_US);
     }
 
-  usleep (MICROFREAK_REST_TIME_US);	//Additional rest
+  backend_rest (backend, MICROFREAK_REST_TIME_US);	//Additional rest
   return 0;
 }
 
@@ -668,6 +733,7 @@ microfreak_preset_rename (struct backend *backend, const gchar *src,
   gchar *name, *sanitized;
   guint8 *header_payload, len, payload[3];
   GByteArray *tx_msg, *rx_msg;
+  struct microfreak_data *microfreak_data = backend->data;
 
   debug_print (1, "Renaming preset...\n");
   err = common_slot_get_id_name_from_path (src, &id, NULL);
@@ -682,6 +748,8 @@ microfreak_preset_rename (struct backend *backend, const gchar *src,
       return -EINVAL;
     }
 
+  preset_index_invalidate (&microfreak_data->preset_index, "/", id + 1);
+
   tx_msg = microfreak_get_preset_dump_msg (backend, id, 0);
   rx_msg = backend_tx_and_rx_sysex (backend, tx_msg, -1);
   if (!rx_msg)
@@ -695,7 +763,7 @@ microfreak_preset_rename (struct backend *backend, const gchar *src,
       return -EIO;
     }
 
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   header_payload = MICROFREAK_GET_MSG_PAYLOAD (rx_msg);
   name = MICROFREAK_GET_NAME_FROM_HEADER (header_payload);
@@ -716,7 +784,7 @@ microfreak_preset_rename (struct backend *backend, const gchar *src,
     }
   free_msg (rx_msg);
 
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   payload[0] = COMMON_GET_MIDI_BANK (id);
   payload[1] = COMMON_GET_MIDI_PRESET (id);
@@ -729,7 +797,7 @@ microfreak_preset_rename (struct backend *backend, const gchar *src,
     }
   free_msg (rx_msg);
 
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   common_midi_program_change_int (backend, NULL, id);
 
@@ -749,6 +817,7 @@ static const struct fs_operations FS_MICROFREAK_PRESET_OPERATIONS = {
   .print_item = common_print_item,
   .get_slot = microfreak_get_object_id_as_slot,
   .rename = microfreak_preset_rename,
+  .rescan = microfreak_preset_rescan,
   .download = microfreak_preset_download,
   .upload = microfreak_preset_upload,
   .load = load_file,
@@ -880,6 +949,7 @@ static const struct fs_operations FS_MICROFREAK_ZPRESET_OPERATIONS = {
   .print_item = common_print_item,
   .get_slot = microfreak_get_object_id_as_slot,
   .rename = microfreak_preset_rename,
+  .rescan = microfreak_preset_rescan,
   .download = microfreak_preset_download,
   .upload = microfreak_preset_upload,
   .load = microfreak_load_zpreset,
@@ -950,7 +1020,7 @@ microfreak_next_sample_dentry (struct item_iterator *iter)
 
 end:
   free_msg (rx_msg);
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (data->backend, MICROFREAK_REST_TIME_US);
   return err;
 }
 
@@ -996,7 +1066,7 @@ microfreak_reset_sample (struct backend *backend, guint id,
       goto end;
     }
 
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   tx_msg = microfreak_get_msg (backend, 0x15, NULL, 0);
   rx_msg = backend_tx_and_rx_sysex (backend, tx_msg, -1);
@@ -1011,7 +1081,7 @@ microfreak_reset_sample (struct backend *backend, guint id,
       goto end;
     }
 
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   tx_msg = microfreak_get_msg_from_sample_header (backend, 0x17, header);
   rx_msg = backend_tx_and_rx_sysex (backend, tx_msg, -1);
@@ -1023,7 +1093,7 @@ microfreak_reset_sample (struct backend *backend, guint id,
   free_msg (rx_msg);
 
 end:
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
   return err;
 }
 
@@ -1051,12 +1121,45 @@ microfreak_clear_sample (struct backend *backend, const gchar *path)
   return microfreak_reset_sample (backend, id, &header);
 }
 
+static gint
+microfreak_rx_sample_ack (struct backend *backend,
+			  struct job_control *control)
+{
+  gint err;
+  struct sysex_transfer transfer;
+
+  transfer.timeout = BE_SYSEX_TIMEOUT_MS;
+  transfer.batch = FALSE;
+
+  g_mutex_lock (&backend->mutex);
+  backend_rx_sysex (backend, &transfer);
+  g_mutex_unlock (&backend->mutex);
+
+  if (transfer.err)
+    {
+      return transfer.err;
+    }
+
+  err = MICROFREAK_CHECK_OP_LEN (transfer.raw, 0x18, 0);
+  free_msg (transfer.raw);
+  if (err)
+    {
+      return err;
+    }
+
+  set_job_control_progress (control, 1.0);
+  control->part++;
+  return 0;
+}
+
 static gint
 microfreak_upload_sample (struct backend *backend, const gchar *path,
 			  GByteArray *input, struct job_control *control)
 {
   gint err;
-  guint id, batches;
+  gboolean active = TRUE;
+  guint id, batches, in_flight, batch_total, batch_part;
+  struct microfreak_data *microfreak_data = backend->data;
   gchar *name, *sanitized;
   struct microfreak_sample_header header;
   GByteArray *tx_msg, *rx_msg;
@@ -1097,7 +1200,7 @@ microfreak_upload_sample (struct backend *backend, const gchar *path,
     }
 
   control->part++;
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   tx_msg = microfreak_get_msg (backend, 0x15, NULL, 0);
   err = common_data_tx_and_rx_part (backend, tx_msg, &rx_msg, control);
@@ -1113,7 +1216,7 @@ microfreak_upload_sample (struct backend *backend, const gchar *path,
     }
 
   control->part++;
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   memset (&header, 0, sizeof (header));
   header.size = input->len;
@@ -1138,7 +1241,7 @@ microfreak_upload_sample (struct backend *backend, const gchar *path,
     }
 
   control->part++;
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   tx_msg = g_byte_array_new ();	//This is an empty message
   err = common_data_tx_and_rx_part (backend, tx_msg, &rx_msg, control);
@@ -1154,7 +1257,7 @@ microfreak_upload_sample (struct backend *backend, const gchar *path,
     }
 
   control->part++;
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   err = microfreak_reset_sample (backend, id, &header);
   if (err)
@@ -1164,12 +1267,16 @@ microfreak_upload_sample (struct backend *backend, const gchar *path,
 
   control->part++;
   set_job_control_progress (control, 1.0);
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
 
   guint32 total = 0;
-  gint16 *src = (gint16 *) input->data;
+  gint16 *src = (gint16 *) input->data, *batch_src;
   for (gint b = 0; b < batches; b++)
     {
+      batch_src = src;
+      batch_total = total;
+      batch_part = control->part;
+
       //Starting packets
 
       tx_msg = microfreak_get_sample_op_msg (backend, 0x58, id, 1);
@@ -1186,7 +1293,7 @@ microfreak_upload_sample (struct backend *backend, const gchar *path,
 	}
 
       control->part++;
-      usleep (MICROFREAK_REST_TIME_US);
+      backend_rest (backend, MICROFREAK_REST_TIME_US);
 
       tx_msg = microfreak_get_msg (backend, 0x15, NULL, 0);
       err = common_data_tx_and_rx_part (backend, tx_msg, &rx_msg, control);
@@ -1202,10 +1309,11 @@ microfreak_upload_sample (struct backend *backend, const gchar *path,
 	}
 
       control->part++;
-      usleep (MICROFREAK_REST_TIME_US);
+      backend_rest (backend, MICROFREAK_REST_TIME_US);
 
-      //Data packets
+      //Data packets are streamed and their acknowledgements are only waited for when the window is full.
 
+      in_flight = 0;
       for (gint p = 1; p <= MICROFREAK_SAMPLE_BATCH_PACKETS; p++)
 	{
 	  guint8 op, *msg;
@@ -1242,28 +1350,83 @@ microfreak_upload_sample (struct backend *backend, const gchar *path,
 	  tx_msg = microfreak_get_msg (backend, op, msg,
 				       MICROFREAK_SAMPLE_MSG_SIZE);
 	  g_free (msg);
-	  err = common_data_tx_and_rx_part (backend, tx_msg, &rx_msg,
-					    control);
+	  err = backend_tx (backend, tx_msg);
 	  if (err)
 	    {
 	      goto end;
 	    }
-	  err = MICROFREAK_CHECK_OP_LEN (rx_msg, 0x18, 0);
-	  free_msg (rx_msg);
-	  if (err)
+	  in_flight++;
+
+	  if (in_flight == microfreak_data->window)
+	    {
+	      err = microfreak_rx_sample_ack (backend, control);
+	      if (err)
+		{
+		  break;
+		}
+	      in_flight--;
+	    }
+
+	  g_mutex_lock (&control->mutex);
+	  active = control->active;
+	  g_mutex_unlock (&control->mutex);
+	  if (!active)
+	    {
+	      break;
+	    }
+	}
+
+      for (; in_flight && !err; in_flight--)
+	{
+	  err = microfreak_rx_sample_ack (backend, control);
+	}
+
+      //A window too large for the device loses acknowledgements so the batch is sent again with a smaller one.
+
+      if (err)
+	{
+	  if (!active || microfreak_data->window == MICROFREAK_SAMPLE_WINDOW_MIN)
 	    {
 	      goto end;
 	    }
 
-	  control->part++;
-	  usleep (MICROFREAK_REST_TIME_US);
+	  backend_rx_drain (backend);
+	  microfreak_data->window >>= 1;
+	  debug_print (1, "Sample window decreased to %u. Resending batch...\n",
+		       microfreak_data->window);
+
+	  src = batch_src;
+	  total = batch_total;
+	  control->part = batch_part;
+	  err = 0;
+	  b--;
+	  continue;
+	}
+
+      if (!active)
+	{
+	  err = -ECANCELED;
+	  goto end;
+	}
+
+      if (microfreak_data->window < MICROFREAK_SAMPLE_WINDOW_MAX)
+	{
+	  microfreak_data->window <<= 1;
+	  debug_print (2, "Sample window increased to %u\n",
+		       microfreak_data->window);
 	}
     }
 
 end:
+  if (err && err != -ECANCELED)
+    {
+      //Acknowledgements still in flight must not be taken as responses to later requests.
+      backend_rx_drain (backend);
+      microfreak_data->window = MICROFREAK_SAMPLE_WINDOW_MIN;
+    }
   g_free (name);
   g_free (sanitized);
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
   return err;
 }
 
@@ -1309,7 +1472,7 @@ microfreak_get_storage_stats (struct backend *backend, guint8 type,
 
 err:
   free_msg (rx_msg);
-  usleep (MICROFREAK_REST_TIME_US);
+  backend_rest (backend, MICROFREAK_REST_TIME_US);
   return err;
 }
 
@@ -1360,16 +1523,25 @@ microfreak_handshake_int (struct backend *backend)
   return 0;
 }
 
+static void
+microfreak_destroy_data (struct backend *backend)
+{
+  struct microfreak_data *microfreak_data = backend->data;
+  preset_index_destroy (&microfreak_data->preset_index);
+  backend_destroy_data (backend);
+}
+
 gint
 microfreak_handshake (struct backend *backend)
 {
   gint err;
-  guint8 *seq;
+  struct microfreak_data *microfreak_data;
   GByteArray *tx_msg, *rx_msg;
 
-  seq = g_malloc (sizeof (guint8));
-  *seq = 0;
-  backend->data = seq;
+  microfreak_data = g_malloc (sizeof (struct microfreak_data));
+  microfreak_data->seq = 0;
+  microfreak_data->window = MICROFREAK_SAMPLE_WINDOW_MIN;
+  backend->data = microfreak_data;
 
   err = microfreak_handshake_int (backend);
   if (err)
@@ -1384,7 +1556,7 @@ microfreak_handshake (struct backend *backend)
 	  return -ENODEV;
 	}
       free_msg (rx_msg);
-      usleep (MICROFREAK_REST_TIME_US);
+      backend_rest (backend, MICROFREAK_REST_TIME_US);
       backend_midi_handshake (backend);
       err = microfreak_handshake_int (backend);
       if (err)
@@ -1398,7 +1570,9 @@ microfreak_handshake (struct backend *backend)
   backend_fill_fs_ops (backend, &FS_MICROFREAK_PRESET_OPERATIONS,
 		       &FS_MICROFREAK_ZPRESET_OPERATIONS,
 		       &FS_MICROFREAK_SAMPLE_OPERATIONS, NULL);
-  backend->destroy_data = backend_destroy_data;
+  preset_index_init (&microfreak_data->preset_index, backend, "preset",
+		     microfreak_read_preset_slot);
+  backend->destroy_data = microfreak_destroy_data;
   backend->get_storage_stats = microfreak_get_storage_stats;
 
   snprintf (backend->name, LABEL_MAX, "Arturia MicroFreak");
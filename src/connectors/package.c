@@ -20,6 +20,8 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <errno.h>
+#include <glib/gstdio.h>
 #include <json-glib/json-glib.h>
 #include "package.h"
 #include "utils.h"
@@ -44,9 +46,52 @@
 #define MAN_TAG_HASH "hash"
 #define MAN_TAG_SIZE "size"
 
-#define MAX_PACKAGE_LEN (64 * 1024 * 1024)
-#define MAX_MANIFEST_LEN (128 * 1024)
 #define MANIFEST_FILENAME "manifest.json"
+#define PACKAGE_TMP_FILENAME "package.zip"
+#define PACKAGE_SAMPLE_JOBS 2	//One sample is downloaded while the previous one is converted.
+#define PACKAGE_DECODE_AHEAD 2	//Samples decoded while the current one is uploaded.
+
+struct package_sample_ref
+{
+  guint32 hash;
+  guint32 size;
+  gchar *path;
+};
+
+//A job without sample stops the consumer.
+
+struct package_sample_job
+{
+  GByteArray *sample;
+  struct sample_info *sample_info;
+  gchar *path;
+  guint32 hash;
+  guint32 size;
+};
+
+struct package_consumer
+{
+  struct package *pkg;
+  GAsyncQueue *ready;
+  GAsyncQueue *free;
+};
+
+struct package_upload_job
+{
+  gchar *path;
+  GByteArray *wave;
+  GByteArray *raw;
+  struct job_control control;	//The sample info is stored here after decoding.
+  gint err;
+  gboolean done;
+};
+
+struct package_decoder
+{
+  GThreadPool *pool;
+  GMutex mutex;
+  GCond cond;
+};
 
 static gint
 package_add_resource (struct package *pkg,
@@ -88,49 +133,122 @@ package_add_resource (struct package *pkg,
   return 0;
 }
 
+static gchar *
+package_get_tmp_path (struct package *pkg)
+{
+  gchar name[LABEL_MAX];
+  snprintf (name, LABEL_MAX, "%d", g_list_length (pkg->resources));
+  return path_chain (PATH_SYSTEM, pkg->tmp_dir, name);
+}
+
+//The file is only read when the zip is closed so only its metadata stays in memory.
+
+static gint
+package_add_file_resource (struct package *pkg,
+			   struct package_resource *pkg_resource,
+			   const gchar *path)
+{
+  zip_source_t *source;
+  zip_int64_t index;
+
+  debug_print (1, "Adding file %s to zip from %s...\n", pkg_resource->path,
+	       path);
+  source = zip_source_file (pkg->zip, path, 0, ZIP_LENGTH_TO_END);
+  if (!source)
+    {
+      error_print ("Error while creating file source: %s\n",
+		   zip_error_strerror (zip_get_error (pkg->zip)));
+      return -1;
+    }
+
+  index = zip_file_add (pkg->zip, pkg_resource->path, source,
+			ZIP_FL_OVERWRITE | ZIP_FL_ENC_UTF_8);
+  if (index < 0)
+    {
+      error_print ("Error while adding file: %s\n",
+		   zip_error_strerror (zip_get_error (pkg->zip)));
+      zip_source_free (source);
+      return -1;
+    }
+
+  pkg->resources = g_list_append (pkg->resources, pkg_resource);
+
+  return 0;
+}
+
+static void
+package_remove_tmp_dir (struct package *pkg)
+{
+  GDir *dir;
+  const gchar *name;
+  gchar *path;
+
+  if (!pkg->tmp_dir)
+    {
+      return;
+    }
+
+  if ((dir = g_dir_open (pkg->tmp_dir, 0, NULL)))
+    {
+      while ((name = g_dir_read_name (dir)) != NULL)
+	{
+	  path = path_chain (PATH_SYSTEM, pkg->tmp_dir, name);
+	  g_unlink (path);
+	  g_free (path);
+	}
+      g_dir_close (dir);
+    }
+
+  g_rmdir (pkg->tmp_dir);
+  g_free (pkg->tmp_dir);
+  pkg->tmp_dir = NULL;
+}
+
+
+//Entries are written to a temporary dir as they are received so there is no size limit and only one of them is in memory at a time.
 
 gint
 package_begin (struct package *pkg, gchar *name, const gchar *fw_version,
 	       const struct device_desc *device_desc, enum package_type type)
 {
+  gint zerr;
+  gchar *path;
+  GError *error = NULL;
   zip_error_t zerror;
+
   pkg->resources = NULL;
-  pkg->buff = g_malloc (MAX_PACKAGE_LEN);
+  pkg->zip_source = NULL;
   pkg->name = name;
   pkg->fw_version = strdup (fw_version);
   pkg->device_desc = device_desc;
   pkg->type = type;
 
-  debug_print (1, "Creating zip buffer...\n");
-
-  zip_error_init (&zerror);
-  pkg->zip_source =
-    zip_source_buffer_create (pkg->buff, MAX_PACKAGE_LEN, 0, &zerror);
-  if (!pkg->zip_source)
+  pkg->tmp_dir = g_dir_make_tmp (PACKAGE_NAME "-XXXXXX", &error);
+  if (!pkg->tmp_dir)
     {
-      error_print ("Error while creating zip source: %s\n",
-		   zip_error_strerror (&zerror));
-      zip_error_fini (&zerror);
-      g_free (pkg->buff);
+      error_print ("Error while creating temporary dir: %s\n",
+		   error->message);
+      g_clear_error (&error);
       return -1;
     }
 
-  pkg->zip = zip_open_from_source (pkg->zip_source, ZIP_TRUNCATE, &zerror);
+  path = path_chain (PATH_SYSTEM, pkg->tmp_dir, PACKAGE_TMP_FILENAME);
+  debug_print (1, "Creating zip file %s...\n", path);
+  pkg->zip = zip_open (path, ZIP_CREATE | ZIP_TRUNCATE, &zerr);
+  g_free (path);
   if (!pkg->zip)
     {
-      error_print ("Error while creating in memory zip: %s\n",
+      zip_error_init_with_code (&zerror, zerr);
+      error_print ("Error while creating zip: %s\n",
 		   zip_error_strerror (&zerror));
       zip_error_fini (&zerror);
-      zip_source_free (pkg->zip_source);
-      g_free (pkg->buff);
+      package_remove_tmp_dir (pkg);
       return -1;
     }
 
-  zip_source_keep (pkg->zip_source);
-
   pkg->manifest = g_malloc (sizeof (struct package_resource));
   pkg->manifest->type = PKG_RES_TYPE_MANIFEST;
-  pkg->manifest->data = g_byte_array_sized_new (MAX_MANIFEST_LEN);	//We need this because we can not resize later.
+  pkg->manifest->data = g_byte_array_new ();
   pkg->manifest->path = strdup (MANIFEST_FILENAME);
   package_add_resource (pkg, pkg->manifest, TRUE);
 
@@ -241,9 +359,9 @@ package_add_manifest (struct package *pkg)
   json_generator_set_root (gen, root);
   json = json_generator_to_data (gen, NULL);
 
+  //The data is only read when the zip is closed and the previous source is released now.
   len = strlen (json);
-  memcpy (pkg->manifest->data->data, json, len);
-  pkg->manifest->data->len = len;
+  g_byte_array_append (pkg->manifest->data, (guint8 *) json, len);
   package_add_resource (pkg, pkg->manifest, FALSE);
 
   g_free (json);
@@ -259,7 +377,7 @@ gint
 package_end (struct package *pkg, GByteArray *out)
 {
   int ret = 0;
-  zip_stat_t zstat;
+  gchar *path;
 
   ret = package_add_manifest (pkg);
   if (ret)
@@ -268,21 +386,25 @@ package_end (struct package *pkg, GByteArray *out)
       return ret;
     }
 
-  debug_print (1, "Writing zip to buffer...\n");
+  debug_print (1, "Writing zip file...\n");
   if (zip_close (pkg->zip))
     {
-      error_print ("Error while creating in memory zip: %s\n",
+      error_print ("Error while creating zip: %s\n",
 		   zip_error_strerror (zip_get_error (pkg->zip)));
       return -1;
     }
+  pkg->zip = NULL;
 
-  zip_source_stat (pkg->zip_source, &zstat);
-  debug_print (1, "%" PRIu64 " B written to package\n", zstat.comp_size);
+  path = path_chain (PATH_SYSTEM, pkg->tmp_dir, PACKAGE_TMP_FILENAME);
+  ret = load_file (path, out, NULL);
+  g_free (path);
+  if (ret)
+    {
+      error_print ("Error while reading zip: %s\n", g_strerror (-ret));
+      return -1;
+    }
 
-  zip_source_open (pkg->zip_source);
-  g_byte_array_set_size (out, zstat.comp_size);
-  zip_source_read (pkg->zip_source, out->data, zstat.comp_size);
-  zip_source_close (pkg->zip_source);
+  debug_print (1, "%d B written to package\n", out->len);
 
   return 0;
 }
@@ -291,15 +413,26 @@ void
 package_free_package_resource (gpointer data)
 {
   struct package_resource *pkg_resource = data;
-  g_byte_array_free (pkg_resource->data, TRUE);
+  if (pkg_resource->data)
+    {
+      g_byte_array_free (pkg_resource->data, TRUE);
+    }
+  g_free (pkg_resource->path);
   g_free (pkg_resource);
 }
 
 void
 package_destroy (struct package *pkg)
 {
+  if (pkg->tmp_dir)
+    {
+      if (pkg->zip)
+	{
+	  zip_discard (pkg->zip);
+	}
+      package_remove_tmp_dir (pkg);
+    }
   zip_source_free (pkg->zip_source);
-  g_free (pkg->buff);
   g_free (pkg->name);
   g_free (pkg->fw_version);
   g_list_free_full (pkg->resources, package_free_package_resource);
@@ -359,7 +492,7 @@ package_open (struct package *pkg, GByteArray *data,
 
   pkg->resources = NULL;
   pkg->resources = g_list_append (pkg->resources, pkg->manifest);
-  pkg->buff = NULL;
+  pkg->tmp_dir = NULL;
   pkg->name = NULL;
   pkg->fw_version = NULL;
   pkg->device_desc = device_desc;
@@ -374,6 +507,136 @@ package_close (struct package *pkg)
   package_destroy (pkg);
 }
 
+static GArray *
+package_read_sample_refs (JsonReader *reader, gint elements)
+{
+  gboolean valid;
+  struct package_sample_ref ref;
+  GArray *refs = g_array_new (FALSE, FALSE,
+			      sizeof (struct package_sample_ref));
+
+  for (gint i = 0; i < elements; i++)
+    {
+      if (!json_reader_read_element (reader, i))
+	{
+	  error_print ("Cannot read element %d. Continuing...\n", i);
+	  json_reader_end_element (reader);
+	  continue;
+	}
+
+      valid = json_reader_read_member (reader, MAN_TAG_HASH);
+      if (valid)
+	{
+	  ref.hash = json_reader_get_int_value (reader);
+	}
+      else
+	{
+	  error_print ("Cannot read member '%s'. Continuing...\n",
+		       MAN_TAG_HASH);
+	}
+      json_reader_end_member (reader);
+
+      if (valid)
+	{
+	  valid = json_reader_read_member (reader, MAN_TAG_SIZE);
+	  if (valid)
+	    {
+	      ref.size = json_reader_get_int_value (reader);
+	    }
+	  else
+	    {
+	      error_print ("Cannot read member '%s'. Continuing...\n",
+			   MAN_TAG_SIZE);
+	    }
+	  json_reader_end_member (reader);
+	}
+
+      json_reader_end_element (reader);
+
+      if (valid)
+	{
+	  ref.path = NULL;
+	  g_array_append_val (refs, ref);
+	}
+    }
+
+  return refs;
+}
+
+//Runs on its own thread while the next sample is downloaded.
+
+static void
+package_add_sample (struct package *pkg, struct package_sample_job *job)
+{
+  gint err;
+  gchar *tmp_path;
+  GString *package_resource_path;
+  struct job_control control;
+  struct package_resource *pkg_resource;
+
+  if (!job->sample_info)
+    {
+      error_print ("No sample info for %s. Continuing...\n", job->path);
+      return;
+    }
+
+  memset (&control, 0, sizeof (struct job_control));
+  control.data = job->sample_info;
+
+  tmp_path = package_get_tmp_path (pkg);
+  err = sample_save_to_file (tmp_path, job->sample, &control,
+			     SF_FORMAT_WAV | SF_FORMAT_PCM_16);
+  if (err)
+    {
+      error_print
+	("Error while converting sample to wave file. Continuing...\n");
+      g_free (tmp_path);
+      return;
+    }
+
+  pkg_resource = g_malloc (sizeof (struct package_resource));
+  pkg_resource->type = PKG_RES_TYPE_SAMPLE;
+  pkg_resource->data = NULL;
+  pkg_resource->hash = job->hash;
+  pkg_resource->size = job->size;
+  package_resource_path = g_string_new (NULL);
+  g_string_append_printf (package_resource_path, "%s%s.wav",
+			  PKG_TAG_SAMPLES, job->path);
+  pkg_resource->path = g_string_free (package_resource_path, FALSE);
+  if (package_add_file_resource (pkg, pkg_resource, tmp_path))
+    {
+      package_free_package_resource (pkg_resource);
+      error_print ("Error while packaging sample\n");
+    }
+  g_free (tmp_path);
+}
+
+static gpointer
+package_sample_consumer (gpointer data)
+{
+  struct package_sample_job *job;
+  struct package_consumer *consumer = data;
+
+  while (1)
+    {
+      job = g_async_queue_pop (consumer->ready);
+      if (!job->sample)
+	{
+	  break;
+	}
+
+      package_add_sample (consumer->pkg, job);
+
+      g_free (job->path);
+      job->path = NULL;
+      g_free (job->sample_info);
+      job->sample_info = NULL;
+      g_async_queue_push (consumer->free, job);
+    }
+
+  return NULL;
+}
+
 gint
 package_receive_pkg_resources (struct package *pkg,
 			       const gchar *payload_path,
@@ -385,12 +648,15 @@ package_receive_pkg_resources (struct package *pkg,
   gint ret, i, elements;
   JsonParser *parser;
   JsonReader *reader;
-  gint64 hash, size;
-  GError *error;
-  gchar *sample_path, *metadata_path;
+  GError *error = NULL;
+  gchar *metadata_path, *tmp_path;
   struct package_resource *pkg_resource;
-  GByteArray *wave, *payload, *metadata, *sample;
-  GString *package_resource_path;
+  GByteArray *payload, *metadata;
+  GArray *refs;
+  GThread *consumer_thread;
+  struct package_sample_ref *ref;
+  struct package_sample_job *job, end_job;
+  struct package_consumer consumer;
 
   metadata_path = path_chain (PATH_INTERNAL, payload_path, ".metadata");
   debug_print (1, "Getting metadata from %s...\n", metadata_path);
@@ -450,86 +716,83 @@ package_receive_pkg_resources (struct package *pkg,
       goto cleanup_reader;
     }
 
-  sample = g_byte_array_new ();
-  control->parts = 2 + elements;
-  set_job_control_progress (control, 0.0);
-  for (i = 0; i < elements; i++, control->part++)
+  refs = package_read_sample_refs (reader, elements);
+
+  //Every lookup is done before the first download so the link is only used for the transfers afterwards.
+  for (i = 0; i < refs->len; i++)
     {
-      if (!json_reader_read_element (reader, i))
-	{
-	  error_print ("Cannot read element %d. Continuing...\n", i);
-	  continue;
-	}
-      if (!json_reader_read_member (reader, MAN_TAG_HASH))
-	{
-	  error_print ("Cannot read member '%s'. Continuing...\n",
-		       MAN_TAG_HASH);
-	  continue;
-	}
-      hash = json_reader_get_int_value (reader);
-      json_reader_end_element (reader);
+      ref = &g_array_index (refs, struct package_sample_ref, i);
+      ref->path = elektron_get_sample_path_from_hash_size (backend,
+							  ref->hash,
+							  ref->size);
+      debug_print (1, "Hash: %u; size: %u; path: %s\n", ref->hash,
+		   ref->size, ref->path ? ref->path : "not found");
+    }
 
-      if (!json_reader_read_member (reader, MAN_TAG_SIZE))
-	{
-	  error_print ("Cannot read member '%s'. Continuing...\n",
-		       MAN_TAG_SIZE);
-	  continue;
-	}
-      size = json_reader_get_int_value (reader);
-      json_reader_end_element (reader);
+  control->parts = 2 + elements;
+  set_job_control_progress (control, 0.0);
 
-      json_reader_end_element (reader);
+  consumer.pkg = pkg;
+  consumer.ready = g_async_queue_new ();
+  consumer.free = g_async_queue_new ();
+  for (i = 0; i < PACKAGE_SAMPLE_JOBS; i++)
+    {
+      job = g_malloc0 (sizeof (struct package_sample_job));
+      job->sample = g_byte_array_new ();
+      g_async_queue_push (consumer.free, job);
+    }
+  consumer_thread = g_thread_new ("package consumer",
+				  package_sample_consumer, &consumer);
 
-      sample_path = elektron_get_sample_path_from_hash_size (backend, hash,
-							     size);
-      if (!sample_path)
+  for (i = 0; i < refs->len; i++, control->part++)
+    {
+      ref = &g_array_index (refs, struct package_sample_ref, i);
+      if (!ref->path)
 	{
 	  debug_print (1, "Sample not found. Skipping...\n");
 	  continue;
 	}
 
-      debug_print (1, "Hash: %" PRIu64 "; size: %" PRIu64 "; path: %s\n",
-		   hash, size, sample_path);
-      debug_print (1, "Getting sample %s...\n", sample_path);
-      g_byte_array_set_size (sample, 0);
-      if (download_sample (backend, sample_path, sample, control))
+      debug_print (1, "Getting sample %s...\n", ref->path);
+      job = g_async_queue_pop (consumer.free);
+      g_byte_array_set_size (job->sample, 0);
+      if (download_sample (backend, ref->path, job->sample, control))
 	{
-	  g_free (sample_path);
 	  error_print ("Error while downloading sample. Continuing...\n");
+	  g_free (control->data);
+	  control->data = NULL;
+	  g_async_queue_push (consumer.free, job);
 	  continue;
 	}
 
-      wave = g_byte_array_new ();
-      ret = sample_get_audio_file_data_from_array (sample, wave, control,
-						   SF_FORMAT_WAV |
-						   SF_FORMAT_PCM_16);
-      if (ret)
-	{
-	  error_print
-	    ("Error while converting sample to wave file. Continuing...\n");
-	  g_byte_array_free (wave, TRUE);
-	  g_free (sample_path);
-	  continue;
-	}
+      job->sample_info = control->data;
+      control->data = NULL;
+      job->path = ref->path;
+      ref->path = NULL;
+      job->hash = ref->hash;
+      job->size = ref->size;
+      g_async_queue_push (consumer.ready, job);
+    }
 
-      pkg_resource = g_malloc (sizeof (struct package_resource));
-      pkg_resource->type = PKG_RES_TYPE_SAMPLE;
-      pkg_resource->data = wave;
-      pkg_resource->hash = hash;
-      pkg_resource->size = size;
-      package_resource_path = g_string_new (NULL);
-      g_string_append_printf (package_resource_path, "%s%s.wav",
-			      PKG_TAG_SAMPLES, sample_path);
-      pkg_resource->path = g_string_free (package_resource_path, FALSE);
-      if (package_add_resource (pkg, pkg_resource, TRUE))
-	{
-	  package_free_package_resource (pkg_resource);
-	  error_print ("Error while packaging sample\n");
-	  continue;
-	}
+  end_job.sample = NULL;
+  g_async_queue_push (consumer.ready, &end_job);
+  g_thread_join (consumer_thread);
+
+  for (i = 0; i < PACKAGE_SAMPLE_JOBS; i++)
+    {
+      job = g_async_queue_pop (consumer.free);
+      g_byte_array_free (job->sample, TRUE);
+      g_free (job);
     }
+  g_async_queue_unref (consumer.ready);
+  g_async_queue_unref (consumer.free);
+
+  for (i = 0; i < refs->len; i++)
+    {
+      g_free (g_array_index (refs, struct package_sample_ref, i).path);
+    }
+  g_array_free (refs, TRUE);
 
-  g_byte_array_free (sample, TRUE);
 cleanup_reader:
   g_object_unref (reader);
   g_object_unref (parser);
@@ -545,27 +808,206 @@ get_payload:
     }
   else
     {
-      pkg_resource = g_malloc (sizeof (struct package_resource));
-      pkg_resource->type = PKG_RES_TYPE_PAYLOAD;
-      pkg_resource->data = payload;
-      pkg_resource->path = strdup (pkg->name);
-      if (package_add_resource (pkg, pkg_resource, TRUE))
+      tmp_path = package_get_tmp_path (pkg);
+      ret = save_file (tmp_path, payload, NULL);
+      if (ret)
 	{
-	  package_free_package_resource (pkg_resource);
+	  error_print ("Error while saving payload\n");
 	  ret = -1;
 	}
+      else
+	{
+	  pkg_resource = g_malloc (sizeof (struct package_resource));
+	  pkg_resource->type = PKG_RES_TYPE_PAYLOAD;
+	  pkg_resource->data = NULL;
+	  pkg_resource->path = strdup (pkg->name);
+	  if (package_add_file_resource (pkg, pkg_resource, tmp_path))
+	    {
+	      package_free_package_resource (pkg_resource);
+	      ret = -1;
+	    }
+	}
+      g_free (tmp_path);
     }
+  g_byte_array_free (payload, TRUE);
   return ret;
 }
 
+static gboolean
+package_read_uint_member (JsonReader *reader, const gchar *member,
+			  guint32 *value)
+{
+  JsonNode *node;
+  gboolean valid = json_reader_read_member (reader, member);
+
+  if (valid)
+    {
+      node = json_reader_get_value (reader);
+      if (!node)
+	{
+	  valid = FALSE;
+	}
+      else if (json_node_get_value_type (node) == G_TYPE_STRING)
+	{
+	  //The hashes are stored as strings.
+	  *value = g_ascii_strtoull (json_node_get_string (node), NULL, 10);
+	}
+      else
+	{
+	  *value = json_node_get_int (node);
+	}
+    }
+  json_reader_end_member (reader);
+
+  return valid;
+}
+
+static void
+package_clear_upload_job (struct package_upload_job *job)
+{
+  if (job->wave)
+    {
+      g_byte_array_free (job->wave, TRUE);
+      job->wave = NULL;
+    }
+  if (job->raw)
+    {
+      g_byte_array_free (job->raw, TRUE);
+      job->raw = NULL;
+    }
+  g_free (job->control.data);
+  job->control.data = NULL;
+}
+
+static void
+package_free_upload_job (gpointer data)
+{
+  struct package_upload_job *job = data;
+  package_clear_upload_job (job);
+  g_mutex_clear (&job->control.mutex);
+  g_free (job->path);
+  g_free (job);
+}
+
+//Samples already in the device, which are found by hash and size, are not decoded nor uploaded.
+
+static GPtrArray *
+package_get_upload_jobs (JsonReader *reader, gint elements,
+			 struct backend *backend)
+{
+  gchar *dev_path;
+  gboolean known;
+  guint32 hash, size;
+  const gchar *sample_path;
+  struct package_upload_job *job;
+  GPtrArray *jobs = g_ptr_array_new_with_free_func (package_free_upload_job);
+
+  for (gint i = 0; i < elements; i++)
+    {
+      json_reader_read_element (reader, i);
+      json_reader_read_member (reader, PKG_TAG_FILE_NAME);
+      sample_path = json_reader_get_string_value (reader);
+      json_reader_end_member (reader);
+      known = package_read_uint_member (reader, PKG_TAG_FILE_SIZE, &size)
+	&& package_read_uint_member (reader, PKG_TAG_HASH, &hash);
+      json_reader_end_element (reader);
+
+      if (!sample_path)
+	{
+	  error_print ("No '%s' found in sample %d\n", PKG_TAG_FILE_NAME, i);
+	  continue;
+	}
+
+      if (known)
+	{
+	  dev_path = elektron_get_sample_path_from_hash_size (backend, hash,
+							      size);
+	  if (dev_path)
+	    {
+	      debug_print (1, "Sample %s already in %s. Skipping...\n",
+			   sample_path, dev_path);
+	      g_free (dev_path);
+	      continue;
+	    }
+	}
+
+      job = g_malloc0 (sizeof (struct package_upload_job));
+      job->path = strdup (sample_path);
+      g_mutex_init (&job->control.mutex);
+      job->control.active = TRUE;
+      job->control.parts = 1;
+      g_ptr_array_add (jobs, job);
+    }
+
+  return jobs;
+}
+
+static void
+package_decode_runner (gpointer data, gpointer user_data)
+{
+  struct package_upload_job *job = data;
+  struct package_decoder *decoder = user_data;
+  struct sample_info sample_info_dst;
+
+  sample_info_dst.rate = ELEKTRON_SAMPLE_RATE;
+  sample_info_dst.channels = ELEKTRON_SAMPLE_CHANNELS;
+
+  job->raw = g_byte_array_new ();
+  job->err = sample_load_from_array (job->wave, job->raw, &job->control,
+				     &sample_info_dst);
+  g_byte_array_free (job->wave, TRUE);
+  job->wave = NULL;
+
+  g_mutex_lock (&decoder->mutex);
+  job->done = TRUE;
+  g_cond_broadcast (&decoder->cond);
+  g_mutex_unlock (&decoder->mutex);
+}
+
+//The zip is only accessed from the calling thread.
+
+static void
+package_decode (struct package *pkg, struct package_decoder *decoder,
+		struct package_upload_job *job)
+{
+  zip_stat_t zstat;
+  zip_file_t *zip_file;
+
+  if (zip_stat (pkg->zip, job->path, ZIP_FL_ENC_STRICT, &zstat))
+    {
+      error_print ("Error while loading '%s': %s\n", job->path,
+		   zip_strerror (pkg->zip));
+      job->err = -1;
+      job->done = TRUE;
+      return;
+    }
+
+  zip_file = zip_fopen (pkg->zip, job->path, 0);
+  if (!zip_file)
+    {
+      error_print ("Error while opening '%s': %s\n", job->path,
+		   zip_strerror (pkg->zip));
+      job->err = -1;
+      job->done = TRUE;
+      return;
+    }
+
+  job->wave = g_byte_array_sized_new (zstat.size);
+  zip_fread (zip_file, job->wave->data, zstat.size);
+  job->wave->len = zstat.size;
+  zip_fclose (zip_file);
+
+  g_thread_pool_push (decoder->pool, job, NULL);
+}
+
 gint
 package_send_pkg_resources (struct package *pkg, const gchar *payload_path,
 			    struct job_control *control,
 			    struct backend *backend,
 			    fs_remote_file_op upload_data)
 {
-  gint elements, i, ret = 0;
-  const gchar *file_type, *sample_path;
+  gint elements, i, next, ret = 0;
+  const gchar *file_type;
   gchar *dev_sample_path;
   gint64 product_type;
   JsonParser *parser;
@@ -574,7 +1016,9 @@ package_send_pkg_resources (struct package *pkg, const gchar *payload_path,
   zip_stat_t zstat;
   zip_error_t zerror;
   zip_file_t *zip_file;
-  GByteArray *wave, *raw;
+  GPtrArray *jobs;
+  struct package_upload_job *job;
+  struct package_decoder decoder;
   struct package_resource *pkg_resource;
 
   zip_error_init (&zerror);
@@ -720,74 +1164,70 @@ package_send_pkg_resources (struct package *pkg, const gchar *payload_path,
       goto cleanup_reader;
     }
 
-  wave = g_byte_array_sized_new (zstat.size);
-  raw = g_byte_array_sized_new (MAX_PACKAGE_LEN);
   elements = json_reader_count_elements (reader);
-  control->parts = elements + 1;
+  jobs = package_get_upload_jobs (reader, elements, backend);
+
+  control->parts = jobs->len + 1;
   control->part = 1;
-  for (i = 0; i < elements; i++, control->part++)
+  if (!jobs->len)
     {
-      struct sample_info sample_info_dst;
-      sample_info_dst.rate = ELEKTRON_SAMPLE_RATE;
-      sample_info_dst.channels = ELEKTRON_SAMPLE_CHANNELS;
+      control->part = 0;
+      control->parts = 1;
+      set_job_control_progress (control, 1.0);
+    }
 
-      json_reader_read_element (reader, i);
-      json_reader_read_member (reader, PKG_TAG_FILE_NAME);
-      sample_path = json_reader_get_string_value (reader);
-      json_reader_end_element (reader);
-      json_reader_end_element (reader);
+  g_mutex_init (&decoder.mutex);
+  g_cond_init (&decoder.cond);
+  decoder.pool = g_thread_pool_new (package_decode_runner, &decoder,
+				    PACKAGE_DECODE_AHEAD + 1, FALSE, NULL);
 
-      if (zip_stat (pkg->zip, sample_path, ZIP_FL_ENC_STRICT, &zstat))
+  next = 0;
+  for (i = 0; i < jobs->len; i++, control->part++)
+    {
+      //Decoding runs ahead of the uploads but only a few samples are kept in memory.
+      while (next < jobs->len && next <= i + PACKAGE_DECODE_AHEAD)
 	{
-	  error_print ("Error while loading '%s': %s\n",
-		       MANIFEST_FILENAME, zip_error_strerror (&zerror));
-	  zip_error_fini (&zerror);
-	  ret = -1;
-	  continue;
+	  package_decode (pkg, &decoder, g_ptr_array_index (jobs, next));
+	  next++;
 	}
 
-      g_byte_array_set_size (wave, zstat.size);
-      zip_file = zip_fopen (pkg->zip, sample_path, 0);
-      zip_fread (zip_file, wave->data, zstat.size);
-      wave->len = zstat.size;
-      zip_fclose (zip_file);
+      job = g_ptr_array_index (jobs, i);
+      g_mutex_lock (&decoder.mutex);
+      while (!job->done)
+	{
+	  g_cond_wait (&decoder.cond, &decoder.mutex);
+	}
+      g_mutex_unlock (&decoder.mutex);
 
-      raw->len = 0;
-      if (sample_load_from_array (wave, raw, control, &sample_info_dst))
+      if (job->err)
 	{
-	  error_print ("Error while loading '%s': %s\n",
-		       sample_path, zip_error_strerror (&zerror));
+	  error_print ("Error while loading '%s'\n", job->path);
+	  ret = -1;
 	  continue;
 	}
 
-      pkg_resource = g_malloc (sizeof (struct package_resource));
-      pkg_resource->type = PKG_RES_TYPE_SAMPLE;
-      pkg_resource->data = g_byte_array_sized_new (raw->len);
-      pkg_resource->data->len = raw->len;
-      memcpy (pkg_resource->data->data, raw->data, raw->len);
-      pkg_resource->path = strdup (sample_path);
-
-      pkg->resources = g_list_append (pkg->resources, pkg_resource);
-
       //We remove the "Samples" at the beggining of the full zip path...
-      dev_sample_path = strdup (&sample_path[7]);
+      dev_sample_path = strdup (&job->path[7]);
       //... And the extension.
       remove_ext (dev_sample_path);
-      ret = elektron_upload_sample_part (backend, dev_sample_path,
-					 pkg_resource->data, control);
-      g_free (dev_sample_path);
-      g_free (control->data);
+      control->data = job->control.data;
+      ret = elektron_upload_sample_part (backend, dev_sample_path, job->raw,
+					 control);
       control->data = NULL;
+      g_free (dev_sample_path);
+      package_clear_upload_job (job);
       if (ret)
 	{
 	  error_print ("Error while uploading sample to '%s'\n",
-		       &sample_path[7]);
+		       &job->path[7]);
 	  continue;
 	}
     }
 
-  g_byte_array_free (wave, TRUE);
-  g_byte_array_free (raw, TRUE);
+  g_thread_pool_free (decoder.pool, FALSE, TRUE);
+  g_mutex_clear (&decoder.mutex);
+  g_cond_clear (&decoder.cond);
+  g_ptr_array_free (jobs, TRUE);
 
 cleanup_reader:
   g_object_unref (reader);
@@ -67,7 +67,7 @@ struct package
   enum package_type type;
   gchar *fw_version;
   const struct device_desc *device_desc;
-  gchar *buff;
+  gchar *tmp_dir;		//Only used while building a package. It contains the zip and its entries.
   zip_source_t *zip_source;
   zip_t *zip;
   GList *resources;
@@ -405,7 +405,6 @@ phatty_rename (struct backend *backend, const gchar *src, const gchar *dst)
   transfer.raw = g_byte_array_new ();
   //The control initialization is needed.
   control.active = TRUE;
-  control.callback = NULL;
   g_mutex_init (&control.mutex);
   err = phatty_download (backend, src, transfer.raw, &control);
   if (err)
@@ -0,0 +1,463 @@
+/*
+ *   preset_index.c
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/stat.h>
+#include <json-glib/json-glib.h>
+#include "preset_index.h"
+#include "common.h"
+
+#define PRESET_INDEX_DIR CONF_DIR "/index"
+#define PORT_NAME_ALPHABET "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-"
+
+#define MEMBER_NAME "name"
+#define MEMBER_INFO "info"
+#define MEMBER_HASH "hash"
+
+static gchar *
+preset_index_get_key (const gchar *dir, guint id)
+{
+  return g_strdup_printf ("%s:%u", dir, id);
+}
+
+static void
+preset_index_load (struct preset_index *index)
+{
+  gint members;
+  gchar **keys;
+  GError *error;
+  JsonReader *reader;
+  JsonParser *parser = json_parser_new ();
+
+  error = NULL;
+  json_parser_load_from_file (parser, index->path, &error);
+  if (error)
+    {
+      debug_print (1, "Error while loading preset index from '%s': %s\n",
+		   index->path, error->message);
+      g_error_free (error);
+      g_object_unref (parser);
+      return;
+    }
+
+  debug_print (1, "Loading preset index from '%s'...\n", index->path);
+
+  reader = json_reader_new (json_parser_get_root (parser));
+
+  keys = json_reader_list_members (reader);
+  members = keys ? g_strv_length (keys) : 0;
+  for (gint i = 0; i < members; i++)
+    {
+      struct preset_index_entry *entry;
+
+      if (!json_reader_read_member (reader, keys[i]))
+	{
+	  json_reader_end_member (reader);
+	  continue;
+	}
+
+      entry = g_malloc0 (sizeof (struct preset_index_entry));
+
+      if (json_reader_read_member (reader, MEMBER_NAME))
+	{
+	  snprintf (entry->name, LABEL_MAX, "%s",
+		    json_reader_get_string_value (reader));
+	}
+      json_reader_end_member (reader);
+
+      if (json_reader_read_member (reader, MEMBER_INFO))
+	{
+	  snprintf (entry->info, LABEL_MAX, "%s",
+		    json_reader_get_string_value (reader));
+	}
+      json_reader_end_member (reader);
+
+      if (json_reader_read_member (reader, MEMBER_HASH))
+	{
+	  entry->hash = json_reader_get_int_value (reader);
+	}
+      json_reader_end_member (reader);
+
+      g_hash_table_insert (index->entries, g_strdup (keys[i]), entry);
+
+      json_reader_end_member (reader);
+    }
+
+  g_strfreev (keys);
+  g_object_unref (reader);
+  g_object_unref (parser);
+}
+
+//The caller must hold the mutex.
+
+static gchar *
+preset_index_get_json (struct preset_index *index)
+{
+  JsonBuilder *builder;
+  JsonGenerator *gen;
+  JsonNode *root;
+  gchar *json;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  builder = json_builder_new ();
+
+  json_builder_begin_object (builder);
+
+  g_hash_table_iter_init (&iter, index->entries);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      struct preset_index_entry *entry = value;
+
+      json_builder_set_member_name (builder, key);
+      json_builder_begin_object (builder);
+
+      json_builder_set_member_name (builder, MEMBER_NAME);
+      json_builder_add_string_value (builder, entry->name);
+
+      json_builder_set_member_name (builder, MEMBER_INFO);
+      json_builder_add_string_value (builder, entry->info);
+
+      json_builder_set_member_name (builder, MEMBER_HASH);
+      json_builder_add_int_value (builder, entry->hash);
+
+      json_builder_end_object (builder);
+    }
+
+  json_builder_end_object (builder);
+
+  gen = json_generator_new ();
+  root = json_builder_get_root (builder);
+  json_generator_set_root (gen, root);
+  json = json_generator_to_data (gen, NULL);
+
+  json_node_free (root);
+  g_object_unref (gen);
+  g_object_unref (builder);
+
+  return json;
+}
+
+//The entries are copied under the mutex and written without it. The saves are serialized so that an older copy never overwrites a newer one.
+
+static gint
+preset_index_save (struct preset_index *index)
+{
+  gint err;
+  gchar *dir, *json;
+
+  g_mutex_lock (&index->save_mutex);
+
+  g_mutex_lock (&index->mutex);
+  if (!index->dirty)
+    {
+      g_mutex_unlock (&index->mutex);
+      g_mutex_unlock (&index->save_mutex);
+      return 0;
+    }
+  json = preset_index_get_json (index);
+  index->dirty = FALSE;
+  g_mutex_unlock (&index->mutex);
+
+  dir = get_user_dir (PRESET_INDEX_DIR);
+  if (g_mkdir_with_parents (dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH |
+			    S_IXOTH))
+    {
+      error_print ("Error wile creating directory `%s'\n", dir);
+      err = -EIO;
+    }
+  else
+    {
+      debug_print (1, "Saving preset index to '%s'...\n", index->path);
+      err = save_file_char (index->path, (guint8 *) json, strlen (json));
+    }
+  g_free (dir);
+  g_free (json);
+
+  if (err)
+    {
+      g_mutex_lock (&index->mutex);
+      index->dirty = TRUE;
+      g_mutex_unlock (&index->mutex);
+    }
+
+  g_mutex_unlock (&index->save_mutex);
+
+  return err;
+}
+
+void
+preset_index_init (struct preset_index *index, struct backend *backend,
+		   const gchar *fs_name, preset_index_read_slot read_slot)
+{
+  gchar *id, *filename, *dir, *port;
+  struct backend_midi_info *info = &backend->midi_info;
+
+  //The port name tells apart the units of the same model as in the connector cache.
+  port = common_get_sanitized_name (backend->port_name, PORT_NAME_ALPHABET,
+				    '_');
+  id = g_strdup_printf ("%02x%02x%02x%02x%02x%02x%02x%s%s",
+			(guint8) info->company[0], (guint8) info->company[1],
+			(guint8) info->company[2], (guint8) info->family[0],
+			(guint8) info->family[1], (guint8) info->model[0],
+			(guint8) info->model[1], *port ? "-" : "", port);
+  g_free (port);
+  filename = g_strdup_printf ("%s-%s.json", id, fs_name);
+  dir = get_user_dir (PRESET_INDEX_DIR);
+  index->path = path_chain (PATH_SYSTEM, dir, filename);
+  g_free (dir);
+  g_free (filename);
+  g_free (id);
+
+  index->backend = backend;
+  index->read_slot = read_slot;
+  g_mutex_init (&index->mutex);
+  g_mutex_init (&index->save_mutex);
+  index->entries = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+					  g_free);
+  index->dirty = FALSE;
+  index->thread = NULL;
+  index->verifying = FALSE;
+
+  preset_index_load (index);
+}
+
+static void
+preset_index_stop_verification (struct preset_index *index)
+{
+  g_mutex_lock (&index->mutex);
+  index->verifying = FALSE;
+  g_mutex_unlock (&index->mutex);
+
+  if (index->thread)
+    {
+      g_thread_join (index->thread);
+      index->thread = NULL;
+    }
+}
+
+void
+preset_index_destroy (struct preset_index *index)
+{
+  preset_index_stop_verification (index);
+
+  preset_index_save (index);
+
+  g_hash_table_destroy (index->entries);
+  g_mutex_clear (&index->mutex);
+  g_mutex_clear (&index->save_mutex);
+  g_free (index->path);
+}
+
+gint
+preset_index_read (struct preset_index *index, const gchar *dir, guint id,
+		   struct preset_index_entry *entry)
+{
+  gint err;
+  struct preset_index_entry *indexed;
+  gchar *key = preset_index_get_key (dir, id);
+
+  g_mutex_lock (&index->mutex);
+  indexed = g_hash_table_lookup (index->entries, key);
+  if (indexed)
+    {
+      memcpy (entry, indexed, sizeof (struct preset_index_entry));
+    }
+  g_mutex_unlock (&index->mutex);
+
+  if (indexed)
+    {
+      g_free (key);
+      return 0;
+    }
+
+  debug_print (2, "Slot %s not indexed. Reading it...\n", key);
+
+  memset (entry, 0, sizeof (struct preset_index_entry));
+  backend_lock_op (index->backend);
+  err = index->read_slot (index->backend, dir, id, entry);
+  backend_unlock_op (index->backend);
+  if (err)
+    {
+      g_free (key);
+      return err;
+    }
+  entry->verified = TRUE;
+
+  indexed = g_malloc (sizeof (struct preset_index_entry));
+  memcpy (indexed, entry, sizeof (struct preset_index_entry));
+
+  g_mutex_lock (&index->mutex);
+  g_hash_table_replace (index->entries, key, indexed);
+  index->dirty = TRUE;
+  g_mutex_unlock (&index->mutex);
+
+  return 0;
+}
+
+static gpointer
+preset_index_verify_runner (gpointer data)
+{
+  gint err;
+  gchar *key, *colon;
+  guint id;
+  GList *keys, *l;
+  gboolean verifying;
+  GHashTableIter iter;
+  gpointer k, v;
+  struct preset_index_entry entry, *indexed;
+  struct preset_index *index = data;
+
+  g_mutex_lock (&index->mutex);
+  keys = NULL;
+  g_hash_table_iter_init (&iter, index->entries);
+  while (g_hash_table_iter_next (&iter, &k, &v))
+    {
+      indexed = v;
+      if (!indexed->verified)
+	{
+	  keys = g_list_prepend (keys, g_strdup (k));
+	}
+    }
+  g_mutex_unlock (&index->mutex);
+
+  debug_print (1, "Verifying %d preset index entries...\n",
+	       g_list_length (keys));
+
+  for (l = keys; l; l = l->next)
+    {
+      g_mutex_lock (&index->mutex);
+      verifying = index->verifying;
+      g_mutex_unlock (&index->mutex);
+      if (!verifying)
+	{
+	  break;
+	}
+
+      key = l->data;
+      colon = strrchr (key, ':');
+      *colon = 0;
+      id = atoi (colon + 1);
+
+      //The verification pauses while other operations use the device.
+      memset (&entry, 0, sizeof (struct preset_index_entry));
+      backend_lock_op_background (index->backend);
+      err = index->read_slot (index->backend, key, id, &entry);
+      backend_unlock_op (index->backend);
+      *colon = ':';
+      if (err)
+	{
+	  continue;
+	}
+
+      //Entries removed while reading the slot must not be added back as the content might be outdated.
+      g_mutex_lock (&index->mutex);
+      indexed = g_hash_table_lookup (index->entries, key);
+      if (indexed)
+	{
+	  if (indexed->hash != entry.hash || strcmp (indexed->name, entry.name)
+	      || strcmp (indexed->info, entry.info))
+	    {
+	      debug_print (1, "Slot %s changed in the device\n", key);
+	      memcpy (indexed, &entry, sizeof (struct preset_index_entry));
+	      index->dirty = TRUE;
+	    }
+	  indexed->verified = TRUE;
+	}
+      g_mutex_unlock (&index->mutex);
+    }
+
+  g_list_free_full (keys, g_free);
+
+  preset_index_save (index);
+
+  g_mutex_lock (&index->mutex);
+  index->verifying = FALSE;
+  g_mutex_unlock (&index->mutex);
+
+  return NULL;
+}
+
+void
+preset_index_end_read (struct preset_index *index)
+{
+  gboolean verifying;
+
+  preset_index_save (index);
+
+  g_mutex_lock (&index->mutex);
+  verifying = index->verifying;
+  g_mutex_unlock (&index->mutex);
+
+  if (verifying)
+    {
+      return;
+    }
+
+  if (index->thread)
+    {
+      g_thread_join (index->thread);
+    }
+
+  g_mutex_lock (&index->mutex);
+  index->verifying = TRUE;
+  g_mutex_unlock (&index->mutex);
+
+  index->thread = g_thread_new ("preset_index_verify_runner",
+				preset_index_verify_runner, index);
+}
+
+void
+preset_index_invalidate (struct preset_index *index, const gchar *dir,
+			 guint id)
+{
+  gchar *key = preset_index_get_key (dir, id);
+
+  g_mutex_lock (&index->mutex);
+  if (g_hash_table_remove (index->entries, key))
+    {
+      index->dirty = TRUE;
+    }
+  g_mutex_unlock (&index->mutex);
+
+  g_free (key);
+}
+
+static gboolean
+preset_index_key_in_dir (gpointer key, gpointer value, gpointer data)
+{
+  const gchar *dir = data;
+  const gchar *colon = strrchr (key, ':');
+  return strlen (dir) == colon - (gchar *) key &&
+    !strncmp (key, dir, colon - (gchar *) key);
+}
+
+void
+preset_index_invalidate_dir (struct preset_index *index, const gchar *dir)
+{
+  debug_print (1, "Invalidating preset index dir %s...\n", dir);
+
+  g_mutex_lock (&index->mutex);
+  if (g_hash_table_foreach_remove (index->entries, preset_index_key_in_dir,
+				   (gpointer) dir))
+    {
+      index->dirty = TRUE;
+    }
+  g_mutex_unlock (&index->mutex);
+}
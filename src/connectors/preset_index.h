@@ -0,0 +1,75 @@
+/*
+ *   preset_index.h
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PRESET_INDEX_H
+#define PRESET_INDEX_H
+
+#include "backend.h"
+
+//A preset index stores the name, the info and a hash of the content of every preset slot of a filesystem of a device.
+//It is persisted under the configuration dir for every model and MIDI port so that listing a slot based filesystem does not require a request per slot.
+//Entries loaded from disk are verified in the background after a listing and are removed when Elektroid changes a slot.
+//The verification only uses the backend when no other operation holds or waits for it (see backend_lock_op).
+
+struct preset_index_entry
+{
+  gchar name[LABEL_MAX];
+  gchar info[LABEL_MAX];
+  guint32 hash;
+  gboolean verified;		//Read from the device in this session.
+};
+
+//This reads a slot from the device. It must leave verified untouched.
+
+typedef gint (*preset_index_read_slot) (struct backend *, const gchar *,
+					guint, struct preset_index_entry *);
+
+struct preset_index
+{
+  gchar *path;
+  struct backend *backend;
+  preset_index_read_slot read_slot;
+  GMutex mutex;
+  GMutex save_mutex;
+  GHashTable *entries;
+  gboolean dirty;
+  GThread *thread;
+  gboolean verifying;
+};
+
+void preset_index_init (struct preset_index *, struct backend *,
+			const gchar *, preset_index_read_slot);
+
+void preset_index_destroy (struct preset_index *);
+
+//Returns the indexed entry or reads it from the device if not present.
+
+gint preset_index_read (struct preset_index *, const gchar *, guint,
+			struct preset_index_entry *);
+
+//Saves the index and starts the background verification of the entries not read in this session.
+
+void preset_index_end_read (struct preset_index *);
+
+void preset_index_invalidate (struct preset_index *, const gchar *, guint);
+
+void preset_index_invalidate_dir (struct preset_index *, const gchar *);
+
+#endif
@@ -39,16 +39,47 @@
 #define SDS_NO_SPEC_TIMEOUT_TRY 1500	//Timeout for SDS extensions that might not be implemented.
 #define SDS_REST_TIME_DEFAULT 50000	//Rest time to not overwhelm the devices when sending consecutive packets. Lower values cause an an E-Mu ESI-2000 to send corrupted packets.s
 #define SDS_INCOMPLETE_PACKET_TIMEOUT 2000
-#define SDS_NO_SPEC_OPEN_LOOP_REST_TIME 200000
+#define SDS_NO_SPEC_OPEN_LOOP_REST_TIME 200000	//Maximum time between open loop packets.
+#define SDS_LINK_BYTES_PER_S 3125	//31250 bauds MIDI DIN link with 10 bits per byte.
+#define SDS_LINK_BYTES_PER_S_ENV "ELEKTROID_SDS_LINK_BYTES_PER_S"
+#define SDS_LINK_MARGIN_PERCENT 25	//Extra time over the packet time in the link for the receiver to process the packet.
+#define SDS_PACING_PACKETS 16	//Consecutive packets acknowledged at the first try needed to lower the packet rest time.
+#define SDS_PACING_MIN_REST_TIME 1000	//Below this, the packet rest time is 0.
+#define SDS_ENCODER_RING_LEN 16
 #define SDS_SAMPLE_CHANNELS 1
 #define SDS_SAMPLE_NAME_MAX_LEN 127
 
 struct sds_data
 {
   gint rest_time;
+  gint packet_rest_time;	//Rest time between handshaked data packets.
+  gboolean fast_pacing;		//The packet rest time can still be lowered.
+  gint open_loop_time;		//Time between the start of consecutive open loop data packets.
   gboolean name_extension;
 };
 
+//Data packets are encoded by a thread into a ring of messages ahead of the transmission.
+//If there is a source, the frames of every packet are read from it just before encoding the packet.
+//If reading fails, an empty message is queued instead and the encoder stops with the error set.
+
+struct sds_encoder
+{
+  GThread *thread;
+  GAsyncQueue *free;
+  GAsyncQueue *ready;
+  gint abort;
+  gint err;
+  struct sample_source *source;
+  GByteArray *blk;
+  gint16 *frame;
+  guint word;
+  guint words;
+  guint words_per_packet;
+  guint packets;
+  guint bits;
+  guint bytes_per_word;
+};
+
 struct sds_iterator_data
 {
   guint32 next;
@@ -363,9 +394,12 @@ sds_download_get_header (struct backend *backend, guint id)
   return NULL;
 }
 
+//Either output or dst is used. If dst is given, the samples are written to that file while they are received.
+
 static gint
 sds_download_try (struct backend *backend, const gchar *path,
-		  GByteArray *output, struct job_control *control)
+		  GByteArray *output, const gchar *dst,
+		  struct job_control *control)
 {
   guint id, words, word_size, read_bytes, bytes_per_word, total_words, err,
     retries, packets, packet, exp_packet, rx_packets, bits;
@@ -376,9 +410,16 @@ sds_download_try (struct backend *backend, const gchar *path,
   gboolean active, first;
   gboolean last_packet_ack;
   struct sample_info *sample_info;
+  struct sample_sink *sink;
+  GByteArray *blk;
   struct sysex_transfer transfer;
   struct sds_data *sds_data = backend->data;
 
+  sink = NULL;
+  blk = NULL;
+  rx_packets = 0;
+  packets = 0;
+
   name = g_path_get_basename (path);
   id = atoi (name);
   g_free (name);
@@ -409,6 +450,7 @@ sds_download_try (struct backend *backend, const gchar *path,
 	  break;
 	}
       retries++;
+      backend_stats_retry (backend);
       if (retries == SDS_MAX_RETRIES)
 	{
 	  err = -EIO;
@@ -439,8 +481,22 @@ sds_download_try (struct backend *backend, const gchar *path,
   set_job_control_progress (control, 0.0);
   control->data = sample_info;
 
+  if (dst)
+    {
+      err = sample_sink_open (dst, sample_info,
+			      SF_FORMAT_WAV | SF_FORMAT_PCM_16,
+			      words * sizeof (gint16), &sink);
+      if (err)
+	{
+	  goto end;
+	}
+    }
+
   debug_print (1, "Receiving dump data...\n");
 
+  blk = g_byte_array_sized_new (SDS_DATA_PACKET_PAYLOAD_LEN *
+				sizeof (gint16));
+
   tx_msg = g_byte_array_new ();
   total_words = 0;
   retries = 0;
@@ -502,9 +558,9 @@ sds_download_try (struct backend *backend, const gchar *path,
 	      rx_packets++;
 
 	      //We cancel the upload.
-	      usleep (sds_data->rest_time);
+	      backend_rest (backend, sds_data->rest_time);
 	      sds_tx_handshake (backend, SDS_CANCEL, packet % 0x80);
-	      usleep (sds_data->rest_time);
+	      backend_rest (backend, sds_data->rest_time);
 
 	      err = 0;
 	      goto end;
@@ -546,16 +602,31 @@ sds_download_try (struct backend *backend, const gchar *path,
 
       read_bytes = 0;
       dataptr = &rx_msg->data[5];
+      g_byte_array_set_size (blk, 0);
       while (read_bytes < SDS_DATA_PACKET_PAYLOAD_LEN && total_words < words)
 	{
 	  sample = sds_get_gint16_value_left_just (dataptr, bytes_per_word,
 						   bits);
-	  g_byte_array_append (output, (guint8 *) & sample, sizeof (sample));
+	  g_byte_array_append (blk, (guint8 *) & sample, sizeof (sample));
 	  dataptr += bytes_per_word;
 	  read_bytes += bytes_per_word;
 	  total_words++;
 	}
 
+      if (sink)
+	{
+	  err = sample_sink_write (sink, blk);
+	  if (err)
+	    {
+	      free_msg (rx_msg);
+	      break;
+	    }
+	}
+      else
+	{
+	  g_byte_array_append (output, blk->data, blk->len);
+	}
+
       set_job_control_progress (control, rx_packets / (double) packets);
 
       g_mutex_lock (&control->mutex);
@@ -573,8 +644,9 @@ sds_download_try (struct backend *backend, const gchar *path,
 	  free_msg (rx_msg);
 	}
       last_packet_ack = FALSE;
-      usleep (sds_data->rest_time);
+      backend_rest (backend, sds_data->rest_time);
       retries++;
+      backend_stats_retry (backend);
       continue;
     }
 
@@ -592,7 +664,19 @@ end:
       sds_tx_handshake (backend, SDS_CANCEL, packet % 0x80);
     }
 
-  usleep (sds_data->rest_time);
+  backend_rest (backend, sds_data->rest_time);
+
+  if (sink)
+    {
+      gint close_err = sample_sink_close (sink, active && !err
+					  && rx_packets == packets);
+      err = err ? err : close_err;
+    }
+
+  if (blk)
+    {
+      g_byte_array_free (blk, TRUE);
+    }
 
   return err;
 }
@@ -604,7 +688,7 @@ sds_download (struct backend *backend, const gchar *path,
   gint err;
   for (gint i = 0; i < SDS_MAX_RETRIES; i++)
     {
-      err = sds_download_try (backend, path, output, control);
+      err = sds_download_try (backend, path, output, NULL, control);
       if (err == -EBADMSG)
 	{
 	  //We retry the whole download to fix a downloading error with an E-Mu ESI-2000 as it occasionally doesn't send the last packet.
@@ -619,6 +703,26 @@ sds_download (struct backend *backend, const gchar *path,
   return err;
 }
 
+static gint
+sds_download_sink (struct backend *backend, const gchar *path,
+		   const gchar *dst, struct job_control *control)
+{
+  gint err;
+  for (gint i = 0; i < SDS_MAX_RETRIES; i++)
+    {
+      err = sds_download_try (backend, path, NULL, dst, control);
+      if (err == -EBADMSG)
+	{
+	  debug_print (2, "Bug detected. Retrying download...\n");
+	}
+      else
+	{
+	  break;
+	}
+    }
+  return err;
+}
+
 static gint
 sds_tx_and_wait_ack (struct backend *backend, GByteArray *tx_msg,
 		     guint packet, gint timeout, gint timeout2)
@@ -628,11 +732,16 @@ sds_tx_and_wait_ack (struct backend *backend, GByteArray *tx_msg,
   guint rx_packet;
   GByteArray *rx_msg;
   gboolean waiting = FALSE;
-  rx_msg = backend_tx_and_rx_sysex (backend, tx_msg, timeout);
-  if (!rx_msg)
+  struct sysex_transfer transfer;
+
+  //The message is not freed as the data packets are reused.
+  transfer.raw = tx_msg;
+  transfer.timeout = timeout;
+  if (backend_tx_and_rx_sysex_transfer (backend, &transfer, FALSE))
     {
       return -ETIMEDOUT;	//Nothing was received
     }
+  rx_msg = transfer.raw;
 
   t = timeout2;
   while (1)
@@ -684,12 +793,13 @@ sds_tx_and_wait_ack (struct backend *backend, GByteArray *tx_msg,
   return err;
 }
 
-static inline GByteArray *
-sds_get_data_packet_msg (gint packet, guint words, guint *word,
-			 gint16 **frame, guint bits, guint bytes_per_word)
+static inline void
+sds_set_data_packet_msg (GByteArray *tx_msg, gint packet, guint words,
+			 guint *word, gint16 **frame, guint bits,
+			 guint bytes_per_word)
 {
   guint8 *data;
-  GByteArray *tx_msg = g_byte_array_sized_new (SDS_DATA_PACKET_LEN);
+  g_byte_array_set_size (tx_msg, 0);
   g_byte_array_append (tx_msg, SDS_DATA_PACKET_HEADER,
 		       sizeof (SDS_DATA_PACKET_HEADER));
   g_byte_array_set_size (tx_msg, SDS_DATA_PACKET_LEN);
@@ -710,7 +820,105 @@ sds_get_data_packet_msg (gint packet, guint words, guint *word,
 	}
     }
   tx_msg->data[SDS_DATA_PACKET_CKSUM_POS] = sds_checksum (tx_msg->data);
-  return tx_msg;
+}
+
+static gpointer
+sds_encoder_runner (gpointer data)
+{
+  gint err;
+  GByteArray *tx_msg;
+  struct sds_encoder *encoder = data;
+
+  for (guint packet = 0; packet < encoder->packets; packet++)
+    {
+      tx_msg = g_async_queue_pop (encoder->free);
+      if (g_atomic_int_get (&encoder->abort))
+	{
+	  g_async_queue_push (encoder->free, tx_msg);
+	  break;
+	}
+      if (encoder->source)
+	{
+	  err = sample_source_read (encoder->source, encoder->blk,
+				    encoder->words_per_packet);
+	  if (err)
+	    {
+	      g_atomic_int_set (&encoder->err, err);
+	      g_byte_array_set_size (tx_msg, 0);
+	      g_async_queue_push (encoder->ready, tx_msg);
+	      break;
+	    }
+	  encoder->frame = (gint16 *) encoder->blk->data;
+	}
+      sds_set_data_packet_msg (tx_msg, packet % 0x80, encoder->words,
+			       &encoder->word, &encoder->frame, encoder->bits,
+			       encoder->bytes_per_word);
+      g_async_queue_push (encoder->ready, tx_msg);
+    }
+
+  return NULL;
+}
+
+static void
+sds_encoder_start (struct sds_encoder *encoder, GByteArray *input,
+		   struct sample_source *source, guint words,
+		   guint words_per_packet, guint packets, guint bits,
+		   guint bytes_per_word)
+{
+  encoder->free = g_async_queue_new_full ((GDestroyNotify) free_msg);
+  encoder->ready = g_async_queue_new_full ((GDestroyNotify) free_msg);
+  for (gint i = 0; i < SDS_ENCODER_RING_LEN; i++)
+    {
+      g_async_queue_push (encoder->free,
+			  g_byte_array_sized_new (SDS_DATA_PACKET_LEN));
+    }
+  encoder->abort = FALSE;
+  encoder->err = 0;
+  encoder->source = source;
+  encoder->blk = source ? g_byte_array_sized_new (words_per_packet *
+						  sizeof (gint16)) : NULL;
+  encoder->frame = input ? (gint16 *) input->data : NULL;
+  encoder->word = 0;
+  encoder->words = words;
+  encoder->words_per_packet = words_per_packet;
+  encoder->packets = packets;
+  encoder->bits = bits;
+  encoder->bytes_per_word = bytes_per_word;
+  encoder->thread = g_thread_new ("sds_encoder_runner", sds_encoder_runner,
+				  encoder);
+}
+
+//The encoder might be waiting for a free message so every ready message is given back before joining.
+
+static void
+sds_encoder_stop (struct sds_encoder *encoder)
+{
+  GByteArray *tx_msg;
+
+  g_atomic_int_set (&encoder->abort, TRUE);
+  while ((tx_msg = g_async_queue_try_pop (encoder->ready)))
+    {
+      g_async_queue_push (encoder->free, tx_msg);
+    }
+  g_thread_join (encoder->thread);
+
+  g_async_queue_unref (encoder->ready);
+  g_async_queue_unref (encoder->free);
+  if (encoder->blk)
+    {
+      g_byte_array_free (encoder->blk, TRUE);
+    }
+}
+
+static gint
+sds_tx (struct backend *backend, GByteArray *tx_msg)
+{
+  struct sysex_transfer transfer;
+  transfer.raw = tx_msg;
+  g_mutex_lock (&backend->mutex);
+  backend_tx_sysex (backend, &transfer);
+  g_mutex_unlock (&backend->mutex);
+  return transfer.err;
 }
 
 static inline GByteArray *
@@ -760,17 +968,67 @@ sds_rename (struct backend *backend, const gchar *src, const gchar *dst)
   return err;
 }
 
+//Devices implementing any SDS extension start with the default packet rest time, which is halved every time they acknowledge SDS_PACING_PACKETS consecutive packets at the first try.
+//A packet that needs a retry restores the default value for the rest of the session.
+
+static void
+sds_pacing_ack (struct sds_data *sds_data, guint *acked)
+{
+  if (!sds_data->fast_pacing || !sds_data->packet_rest_time)
+    {
+      return;
+    }
+
+  (*acked)++;
+  if (*acked < SDS_PACING_PACKETS)
+    {
+      return;
+    }
+
+  *acked = 0;
+  sds_data->packet_rest_time /= 2;
+  if (sds_data->packet_rest_time < SDS_PACING_MIN_REST_TIME)
+    {
+      sds_data->packet_rest_time = 0;
+    }
+  debug_print (1, "Packet rest time lowered to %d us\n",
+	       sds_data->packet_rest_time);
+}
+
+static void
+sds_pacing_retry (struct sds_data *sds_data, guint *acked)
+{
+  *acked = 0;
+
+  if (!sds_data->fast_pacing)
+    {
+      return;
+    }
+
+  sds_data->fast_pacing = FALSE;
+  if (sds_data->packet_rest_time != SDS_REST_TIME_DEFAULT)
+    {
+      debug_print (1, "Restoring packet rest time to %d us\n",
+		   SDS_REST_TIME_DEFAULT);
+      sds_data->packet_rest_time = SDS_REST_TIME_DEFAULT;
+    }
+}
+
+//Either the input or the source must be provided.
+
 static gint
 sds_upload (struct backend *backend, const gchar *path, GByteArray *input,
-	    struct job_control *control, guint bits)
+	    struct sample_source *source, struct job_control *control,
+	    guint bits)
 {
   gchar *name;
   GByteArray *tx_msg;
-  gint16 *frame, *f;
   gboolean active, open_loop = FALSE;
-  guint word, words, words_per_packet, id, packet = 0, packets, retries =
-    0, w, bytes_per_word;
+  guint words, words_per_packet, id, packet = 0, packets, retries =
+    0, bytes_per_word, acked = 0;
   gint err = 0, word_size;
+  gint64 next_time = 0, now;
+  struct sds_encoder encoder;
   struct sds_data *sds_data = backend->data;
   struct sample_info *sample_info = control->data;
 
@@ -793,7 +1051,7 @@ sds_upload (struct backend *backend, const gchar *path, GByteArray *input,
 
   debug_print (1, "Sending dump header...\n");
 
-  words = input->len >> 1;	//bytes to words (frames)
+  words = input ? input->len >> 1 : sample_info->frames;	//bytes to words (frames)
   word_size = (gint) ceil (bits / 8.0);
   bytes_per_word = (gint) ceil (bits / 7.0);
   words_per_packet = SDS_DATA_PACKET_PAYLOAD_LEN / bytes_per_word;
@@ -803,6 +1061,7 @@ sds_upload (struct backend *backend, const gchar *path, GByteArray *input,
   //The first timeout should be SDS_SPEC_TIMEOUT_HANDSHAKE (2 s) but it is not enough sometimes.
   err = sds_tx_and_wait_ack (backend, tx_msg, 0, SDS_NO_SPEC_TIMEOUT,
 			     SDS_NO_SPEC_TIMEOUT);
+  free_msg (tx_msg);
   if (err == -ENOMSG)
     {
       debug_print (2, "No packet received after a WAIT. Continuing...\n");
@@ -810,7 +1069,8 @@ sds_upload (struct backend *backend, const gchar *path, GByteArray *input,
   else if (err == -ETIMEDOUT)
     {
       //In case of no response, we can assume an open loop.
-      debug_print (1, "Assuming open loop...\n");
+      debug_print (1, "Assuming open loop (%d us per packet)...\n",
+		   sds_data->open_loop_time);
       open_loop = TRUE;
     }
   else if (err)
@@ -820,15 +1080,16 @@ sds_upload (struct backend *backend, const gchar *path, GByteArray *input,
 
   debug_print (1, "Sending dump data...\n");
 
-  word = 0;
   sds_debug_print_sample_data (bits, bytes_per_word,
 			       word_size, sample_info->rate, words, packets);
-  frame = (gint16 *) input->data;
+  sds_encoder_start (&encoder, input, source, words, words_per_packet,
+		     packets, bits, bytes_per_word);
+  tx_msg = NULL;
   while (packet < packets && active)
     {
       if (retries)
 	{
-	  usleep (sds_data->rest_time);
+	  backend_rest (backend, sds_data->rest_time);
 	}
 
       if (retries == SDS_MAX_RETRIES)
@@ -837,14 +1098,27 @@ sds_upload (struct backend *backend, const gchar *path, GByteArray *input,
 	  break;
 	}
 
-      f = frame;
-      w = word;
-      tx_msg = sds_get_data_packet_msg (packet % 0x80, words, &w, &f, bits,
-					bytes_per_word);
+      //When retrying, the same message is sent again.
+      if (!tx_msg)
+	{
+	  tx_msg = g_async_queue_pop (encoder.ready);
+	  if (!tx_msg->len)
+	    {
+	      error_print ("Error while reading the sample\n");
+	      goto end;
+	    }
+	}
+
       if (open_loop)
 	{
-	  err = backend_tx (backend, tx_msg);
-	  usleep (SDS_NO_SPEC_OPEN_LOOP_REST_TIME);
+	  //Packets are spaced from the start of the previous one so the time spent here does not add up.
+	  now = g_get_monotonic_time ();
+	  if (now < next_time)
+	    {
+	      backend_rest (backend, next_time - now);
+	    }
+	  next_time = g_get_monotonic_time () + sds_data->open_loop_time;
+	  err = sds_tx (backend, tx_msg);
 	}
       else
 	{
@@ -857,7 +1131,12 @@ sds_upload (struct backend *backend, const gchar *path, GByteArray *input,
       if (err == -EBADMSG)
 	{
 	  debug_print (2, "NAK received. Retrying...\n");
+	  if (!open_loop)
+	    {
+	      sds_pacing_retry (sds_data, &acked);
+	    }
 	  retries++;
+	  backend_stats_retry (backend);
 	  continue;
 	}
       else if (err == -ENOMSG)
@@ -870,13 +1149,23 @@ sds_upload (struct backend *backend, const gchar *path, GByteArray *input,
       else if (err == -EINVAL)
 	{
 	  debug_print (2, "Unexpected packet number. Retrying...\n");
+	  if (!open_loop)
+	    {
+	      sds_pacing_retry (sds_data, &acked);
+	    }
 	  retries++;
+	  backend_stats_retry (backend);
 	  continue;
 	}
       else if (err == -ETIMEDOUT)
 	{
 	  debug_print (2, "No response. Retrying...\n");
+	  if (!open_loop)
+	    {
+	      sds_pacing_retry (sds_data, &acked);
+	    }
 	  retries++;
+	  backend_stats_retry (backend);
 	  continue;
 	}
       else if (err == -ECANCELED)
@@ -895,13 +1184,20 @@ sds_upload (struct backend *backend, const gchar *path, GByteArray *input,
       active = control->active;
       g_mutex_unlock (&control->mutex);
 
-      word = w;
-      frame = f;
+      g_async_queue_push (encoder.free, tx_msg);
+      tx_msg = NULL;
       packet++;
       retries = 0;
       err = 0;
 
-      usleep (sds_data->rest_time);
+      if (!open_loop)
+	{
+	  if (sds_data->packet_rest_time)
+	    {
+	      backend_rest (backend, sds_data->packet_rest_time);
+	    }
+	  sds_pacing_ack (sds_data, &acked);
+	}
     }
 
   if (active && sds_data->name_extension)
@@ -910,6 +1206,12 @@ sds_upload (struct backend *backend, const gchar *path, GByteArray *input,
     }
 
 end:
+  if (tx_msg)
+    {
+      g_async_queue_push (encoder.free, tx_msg);
+    }
+  sds_encoder_stop (&encoder);
+
   if (active && packet == packets)
     {
       set_job_control_progress (control, 1.0);
@@ -918,7 +1220,7 @@ end:
     {
       debug_print (2, "Cancelling SDS upload...\n");
       sds_tx_handshake (backend, SDS_CANCEL, packet % 0x80);
-      err = -ECANCELED;
+      err = encoder.err ? encoder.err : -ECANCELED;
     }
 
 cleanup:
@@ -930,28 +1232,60 @@ static gint
 sds_upload_8b (struct backend *backend, const gchar *path,
 	       GByteArray *input, struct job_control *control)
 {
-  return sds_upload (backend, path, input, control, 8);
+  return sds_upload (backend, path, input, NULL, control, 8);
 }
 
 static gint
 sds_upload_12b (struct backend *backend, const gchar *path,
 		GByteArray *input, struct job_control *control)
 {
-  return sds_upload (backend, path, input, control, 12);
+  return sds_upload (backend, path, input, NULL, control, 12);
 }
 
 static gint
 sds_upload_14b (struct backend *backend, const gchar *path,
 		GByteArray *input, struct job_control *control)
 {
-  return sds_upload (backend, path, input, control, 14);
+  return sds_upload (backend, path, input, NULL, control, 14);
 }
 
 static gint
 sds_upload_16b (struct backend *backend, const gchar *path,
 		GByteArray *input, struct job_control *control)
 {
-  return sds_upload (backend, path, input, control, 16);
+  return sds_upload (backend, path, input, NULL, control, 16);
+}
+
+static gint
+sds_upload_source_8b (struct backend *backend, const gchar *path,
+		      struct sample_source *source,
+		      struct job_control *control)
+{
+  return sds_upload (backend, path, NULL, source, control, 8);
+}
+
+static gint
+sds_upload_source_12b (struct backend *backend, const gchar *path,
+		       struct sample_source *source,
+		       struct job_control *control)
+{
+  return sds_upload (backend, path, NULL, source, control, 12);
+}
+
+static gint
+sds_upload_source_14b (struct backend *backend, const gchar *path,
+		       struct sample_source *source,
+		       struct job_control *control)
+{
+  return sds_upload (backend, path, NULL, source, control, 14);
+}
+
+static gint
+sds_upload_source_16b (struct backend *backend, const gchar *path,
+		       struct sample_source *source,
+		       struct job_control *control)
+{
+  return sds_upload (backend, path, NULL, source, control, 16);
 }
 
 static gint
@@ -1049,6 +1383,51 @@ sds_sample_load_8 (const gchar *path, GByteArray *sample,
   return sds_sample_load_common (path, sample, control, 8000);
 }
 
+static gint
+sds_sample_open_source_common (const gchar *path,
+			       struct sample_source **source,
+			       struct job_control *control, gint32 rate)
+{
+  return common_sample_open_source (path, source, control, rate,
+				    SDS_SAMPLE_CHANNELS, SF_FORMAT_PCM_16);
+}
+
+static gint
+sds_sample_open_source (const gchar *path, struct sample_source **source,
+			struct job_control *control)
+{
+  return sds_sample_open_source_common (path, source, control, 0);	// Any sample rate is valid.
+}
+
+static gint
+sds_sample_open_source_441 (const gchar *path,
+			    struct sample_source **source,
+			    struct job_control *control)
+{
+  return sds_sample_open_source_common (path, source, control, 44100);
+}
+
+static gint
+sds_sample_open_source_32 (const gchar *path, struct sample_source **source,
+			   struct job_control *control)
+{
+  return sds_sample_open_source_common (path, source, control, 32000);
+}
+
+static gint
+sds_sample_open_source_16 (const gchar *path, struct sample_source **source,
+			   struct job_control *control)
+{
+  return sds_sample_open_source_common (path, source, control, 16000);
+}
+
+static gint
+sds_sample_open_source_8 (const gchar *path, struct sample_source **source,
+			  struct job_control *control)
+{
+  return sds_sample_open_source_common (path, source, control, 8000);
+}
+
 static gint
 sds_sample_save (const gchar *path, GByteArray *sample,
 		 struct job_control *control)
@@ -1083,7 +1462,10 @@ static const struct fs_operations FS_SAMPLES_SDS_8B_OPERATIONS = {
   .rename = sds_rename,
   .download = sds_download,
   .upload = sds_upload_8b,
+  .download_sink = sds_download_sink,
   .load = sds_sample_load,
+  .open_source = sds_sample_open_source,
+  .upload_source = sds_upload_source_8b,
   .save = sds_sample_save,
   .get_exts = backend_get_audio_exts,
   .get_upload_path = common_slot_get_upload_path,
@@ -1104,7 +1486,10 @@ static const struct fs_operations FS_SAMPLES_SDS_12B_OPERATIONS = {
   .rename = sds_rename,
   .download = sds_download,
   .upload = sds_upload_12b,
+  .download_sink = sds_download_sink,
   .load = sds_sample_load,
+  .open_source = sds_sample_open_source,
+  .upload_source = sds_upload_source_12b,
   .save = sds_sample_save,
   .get_exts = backend_get_audio_exts,
   .get_upload_path = common_slot_get_upload_path,
@@ -1125,7 +1510,10 @@ static const struct fs_operations FS_SAMPLES_SDS_14B_OPERATIONS = {
   .rename = sds_rename,
   .download = sds_download,
   .upload = sds_upload_14b,
+  .download_sink = sds_download_sink,
   .load = sds_sample_load,
+  .open_source = sds_sample_open_source,
+  .upload_source = sds_upload_source_14b,
   .save = sds_sample_save,
   .get_exts = backend_get_audio_exts,
   .get_upload_path = common_slot_get_upload_path,
@@ -1146,7 +1534,10 @@ static const struct fs_operations FS_SAMPLES_SDS_16B_OPERATIONS = {
   .rename = sds_rename,
   .download = sds_download,
   .upload = sds_upload_16b,
+  .download_sink = sds_download_sink,
   .load = sds_sample_load,
+  .open_source = sds_sample_open_source,
+  .upload_source = sds_upload_source_16b,
   .save = sds_sample_save,
   .get_exts = backend_get_audio_exts,
   .get_upload_path = common_slot_get_upload_path,
@@ -1167,7 +1558,10 @@ static const struct fs_operations FS_SAMPLES_SDS_16B_441_OPERATIONS = {
   .rename = sds_rename,
   .download = sds_download,
   .upload = sds_upload_16b,
+  .download_sink = sds_download_sink,
   .load = sds_sample_load_441,
+  .open_source = sds_sample_open_source_441,
+  .upload_source = sds_upload_source_16b,
   .save = sds_sample_save,
   .get_exts = backend_get_audio_exts,
   .get_upload_path = common_slot_get_upload_path,
@@ -1188,7 +1582,10 @@ static const struct fs_operations FS_SAMPLES_SDS_16B_32_OPERATIONS = {
   .rename = sds_rename,
   .download = sds_download,
   .upload = sds_upload_16b,
+  .download_sink = sds_download_sink,
   .load = sds_sample_load_32,
+  .open_source = sds_sample_open_source_32,
+  .upload_source = sds_upload_source_16b,
   .save = sds_sample_save,
   .get_exts = backend_get_audio_exts,
   .get_upload_path = common_slot_get_upload_path,
@@ -1209,7 +1606,10 @@ static const struct fs_operations FS_SAMPLES_SDS_16B_16_OPERATIONS = {
   .rename = sds_rename,
   .download = sds_download,
   .upload = sds_upload_16b,
+  .download_sink = sds_download_sink,
   .load = sds_sample_load_16,
+  .open_source = sds_sample_open_source_16,
+  .upload_source = sds_upload_source_16b,
   .save = sds_sample_save,
   .get_exts = backend_get_audio_exts,
   .get_upload_path = common_slot_get_upload_path,
@@ -1230,7 +1630,10 @@ static const struct fs_operations FS_SAMPLES_SDS_16B_8_OPERATIONS = {
   .rename = sds_rename,
   .download = sds_download,
   .upload = sds_upload_16b,
+  .download_sink = sds_download_sink,
   .load = sds_sample_load_8,
+  .open_source = sds_sample_open_source_8,
+  .upload_source = sds_upload_source_16b,
   .save = sds_sample_save,
   .get_exts = backend_get_audio_exts,
   .get_upload_path = common_slot_get_upload_path,
@@ -1309,30 +1712,65 @@ sds_handshake_esi_2000 (struct backend *backend)
   gint err = sds_tx_and_wait_ack (backend, tx_msg, 0,
 				  SDS_SPEC_TIMEOUT_HANDSHAKE,
 				  SDS_NO_SPEC_TIMEOUT_TRY);
+  free_msg (tx_msg);
   if (err && err != -EBADMSG && err != -ECANCELED)
     {
       return -ENODEV;
     }
 
   //We cancel the upload.
-  usleep (SDS_REST_TIME_DEFAULT);
+  backend_rest (backend, SDS_REST_TIME_DEFAULT);
   sds_tx_handshake (backend, SDS_CANCEL, 0);
-  usleep (SDS_REST_TIME_DEFAULT);
+  backend_rest (backend, SDS_REST_TIME_DEFAULT);
 
   return 0;
 }
 
+//This is the time a data packet takes in the link plus a margin.
+//Only the devices implementing any of the SDS extensions use the MIDI DIN rate by default as the rest might be slower than the link; the others keep the maximum time.
+//The rate can be set for any device with the environment variable.
+
+static gint
+sds_get_open_loop_time (gboolean fast_pacing)
+{
+  gint64 t, bytes_per_s = 0;
+  const gchar *env = g_getenv (SDS_LINK_BYTES_PER_S_ENV);
+
+  if (env)
+    {
+      bytes_per_s = g_ascii_strtoll (env, NULL, 10);
+      if (bytes_per_s <= 0)
+	{
+	  error_print ("Invalid link rate '%s'. Ignoring...\n", env);
+	  bytes_per_s = 0;
+	}
+    }
+
+  if (!bytes_per_s)
+    {
+      if (!fast_pacing)
+	{
+	  return SDS_NO_SPEC_OPEN_LOOP_REST_TIME;
+	}
+      bytes_per_s = SDS_LINK_BYTES_PER_S;
+    }
+
+  t = SDS_DATA_PACKET_LEN * G_USEC_PER_SEC / bytes_per_s;
+  t += t * SDS_LINK_MARGIN_PERCENT / 100;
+  return MIN (t, SDS_NO_SPEC_OPEN_LOOP_REST_TIME);
+}
+
 gint
 sds_handshake (struct backend *backend)
 {
   gint err;
-  gboolean name_extension;
+  gboolean name_extension, fast_pacing;
   struct sds_data *sds_data;
 
   //We cancel anything that might be running.
-  usleep (SDS_REST_TIME_DEFAULT);
+  backend_rest (backend, SDS_REST_TIME_DEFAULT);
   sds_tx_handshake (backend, SDS_CANCEL, 0);
-  usleep (SDS_REST_TIME_DEFAULT);
+  backend_rest (backend, SDS_REST_TIME_DEFAULT);
 
   err = sds_handshake_elektron (backend);
   if (err)
@@ -1340,6 +1778,9 @@ sds_handshake (struct backend *backend)
       return err;
     }
 
+  //Devices implementing any of the SDS extensions are candidates to lower the rest between handshaked packets.
+  fast_pacing = TRUE;
+
   err = sds_handshake_name (backend);
   if (err)
     {
@@ -1362,14 +1803,19 @@ sds_handshake (struct backend *backend)
     {
       return err;
     }
+  fast_pacing = FALSE;
 
 end:
   debug_print (1, "Name extension: %s\n", name_extension ? "yes" : "no");
+  debug_print (1, "Fast pacing: %s\n", fast_pacing ? "yes" : "no");
 
   //The remaining code is meant to set up different devices. These are the default values.
 
   sds_data = g_malloc (sizeof (struct sds_data));
   sds_data->rest_time = SDS_REST_TIME_DEFAULT;
+  sds_data->packet_rest_time = SDS_REST_TIME_DEFAULT;
+  sds_data->fast_pacing = fast_pacing;
+  sds_data->open_loop_time = sds_get_open_loop_time (fast_pacing);
   sds_data->name_extension = name_extension;
 
   backend_fill_fs_ops (backend, &FS_PROGRAM_DEFAULT_OPERATIONS,
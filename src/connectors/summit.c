@@ -18,9 +18,11 @@
  *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <zlib.h>
 #include "summit.h"
 #include "common.h"
 #include "scala.h"
+#include "preset_index.h"
 
 #define SUMMIT_PATCHES_PER_BANK 128
 #define SUMMIT_PATCH_NAME_LEN 16
@@ -38,9 +40,12 @@
 #define SUMMIT_WAVETABLE_LEN (SUMMIT_WAVETABLE_HEADER_LEN + SUMMIT_WAVETABLE_WAVES * SUMMIT_WAVETABLE_WAVE_LEN)
 #define SUMMIT_WAVETABLE_ID_POS 14
 #define SUMMIT_REQ_OP_POS 8
+#define SUMMIT_TUNING_ID_POS 5
+#define SUMMIT_BULK_WINDOW 4
 
 #define SUMMIT_GET_NAME_FROM_MSG(msg, type) (&msg->data[type == FS_SUMMIT_SINGLE_PATCH ? 0x10 : 0x19b])
 #define SUMMIT_GET_BANK_ID_FROM_DIR(dir) ((guint8) dir[1] - 0x40)	// Bank A is the bank 1.
+#define SUMMIT_IS_BANK_DIR(dir) (strlen (dir) == 2 && SUMMIT_GET_BANK_ID_FROM_DIR (dir) >= 1 && SUMMIT_GET_BANK_ID_FROM_DIR (dir) <= 4)
 
 #define SUMMIT_ALPHABET " ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789!\"#$%&'()*+,-./:;<=>?@[\\]^_`{|}"
 #define SUMMIT_DEFAULT_CHAR '?'
@@ -63,10 +68,16 @@ enum summit_fs
   FS_SUMMIT_BULK_TUNING
 };
 
+struct summit_data
+{
+  struct preset_index single_index;
+  struct preset_index multi_index;
+};
+
 struct summit_bank_iterator_data
 {
   guint8 next;
-  guint8 bank;
+  gchar dir[LABEL_MAX];
   enum summit_fs fs;
   struct backend *backend;
 };
@@ -77,6 +88,179 @@ struct summit_wavetable_iterator_data
   struct backend *backend;
 };
 
+//Bulk dumps send the requests back to back keeping up to SUMMIT_BULK_WINDOW of them in flight.
+//Responses are matched to the requests by the key found in the messages and by their length so they are stored in request order.
+
+struct summit_bulk_request
+{
+  GByteArray *msg;
+  guint key;
+  guint len;
+  GByteArray *response;
+};
+
+typedef guint (*summit_bulk_get_key) (GByteArray *);
+
+static void
+summit_bulk_add_request (GArray *requests, GByteArray *msg, guint key,
+			 guint len)
+{
+  struct summit_bulk_request request;
+  request.msg = msg;
+  request.key = key;
+  request.len = len;
+  request.response = NULL;
+  g_array_append_val (requests, request);
+}
+
+static void
+summit_bulk_free_requests (GArray *requests)
+{
+  for (guint i = 0; i < requests->len; i++)
+    {
+      struct summit_bulk_request *request =
+	&g_array_index (requests, struct summit_bulk_request, i);
+      free_msg (request->msg);
+      if (request->response)
+	{
+	  free_msg (request->response);
+	}
+    }
+  g_array_free (requests, TRUE);
+}
+
+//Requests sharing a key are matched in the order they were sent.
+
+static struct summit_bulk_request *
+summit_bulk_match (GArray *requests, guint sent, GByteArray *response,
+		   summit_bulk_get_key get_key)
+{
+  guint key = get_key (response);
+  for (guint i = 0; i < sent; i++)
+    {
+      struct summit_bulk_request *request =
+	&g_array_index (requests, struct summit_bulk_request, i);
+      if (!request->response && request->key == key &&
+	  request->len == response->len)
+	{
+	  return request;
+	}
+    }
+  return NULL;
+}
+
+static gint
+summit_bulk_dump (struct backend *backend, GArray *requests,
+		  summit_bulk_get_key get_key, struct job_control *control)
+{
+  gint err = 0;
+  guint sent = 0, received = 0;
+  gboolean active;
+  struct sysex_transfer transfer;
+  struct summit_bulk_request *request;
+
+  control->parts = 1;
+  control->part = 0;
+  set_job_control_progress (control, 0.0);
+
+  debug_print (1, "Dumping %d messages...\n", requests->len);
+
+  g_mutex_lock (&backend->mutex);
+
+  while (received < requests->len)
+    {
+      while (sent < requests->len && sent - received < SUMMIT_BULK_WINDOW)
+	{
+	  request = &g_array_index (requests, struct summit_bulk_request,
+				    sent);
+	  transfer.raw = request->msg;
+	  backend_tx_sysex (backend, &transfer);
+	  if (transfer.err)
+	    {
+	      err = transfer.err;
+	      goto end;
+	    }
+	  sent++;
+	}
+
+      transfer.timeout = BE_SYSEX_TIMEOUT_MS;
+      transfer.batch = FALSE;
+      backend_rx_sysex (backend, &transfer);
+      if (transfer.err)
+	{
+	  err = transfer.err;
+	  goto end;
+	}
+
+      request = summit_bulk_match (requests, sent, transfer.raw, get_key);
+      if (!request)
+	{
+	  debug_print (1, "Unexpected message of %d bytes. Skipping...\n",
+		       transfer.raw->len);
+	  free_msg (transfer.raw);
+	  continue;
+	}
+
+      request->response = transfer.raw;
+      received++;
+      set_job_control_progress (control,
+				received / (gdouble) requests->len);
+
+      g_mutex_lock (&control->mutex);
+      active = control->active;
+      g_mutex_unlock (&control->mutex);
+      if (!active)
+	{
+	  err = -ECANCELED;
+	  goto end;
+	}
+    }
+
+end:
+  if (err)
+    {
+      backend_rx_drain (backend);
+    }
+  g_mutex_unlock (&backend->mutex);
+  usleep (SUMMIT_REST_TIME_US);
+  return err;
+}
+
+static void
+summit_bulk_append_responses (GArray *requests, GByteArray *output)
+{
+  for (guint i = 0; i < requests->len; i++)
+    {
+      struct summit_bulk_request *request =
+	&g_array_index (requests, struct summit_bulk_request, i);
+      g_byte_array_append (output, request->response->data,
+			   request->response->len);
+    }
+}
+
+static gchar *
+summit_get_bulk_download_path (struct backend *backend,
+			       const struct fs_operations *ops,
+			       const gchar *dst_dir, const gchar *src_path)
+{
+  gchar *filename, *path;
+
+  if (strcmp (src_path, "/"))
+    {
+      filename = g_strdup_printf ("%s %s bank %c.%s", backend->name,
+				  ops->name, src_path[1], ops->ext);
+    }
+  else
+    {
+      filename = g_strdup_printf ("%s %s all.%s", backend->name, ops->name,
+				  ops->ext);
+    }
+  path = path_chain (PATH_SYSTEM, dst_dir, filename);
+  g_free (filename);
+
+  return path;
+}
+
 static gint
 summit_set_patch_bank_and_id (GByteArray *msg, guint8 bank, guint8 id)
 {
@@ -127,6 +311,11 @@ summit_get_patch_download_path (struct backend *backend,
   gchar *path;
   gchar name[SUMMIT_PATCH_NAME_LEN + 1];
 
+  if (!strcmp (src_path, "/") || SUMMIT_IS_BANK_DIR (src_path))
+    {
+      return summit_get_bulk_download_path (backend, ops, dst_dir, src_path);
+    }
+
   if (!patch)
     {
       return NULL;
@@ -187,47 +376,111 @@ summit_get_category_name (GByteArray *rx_msg)
     }
 }
 
+static struct preset_index *
+summit_get_preset_index (struct backend *backend, enum summit_fs fs)
+{
+  struct summit_data *data = backend->data;
+  return fs == FS_SUMMIT_SINGLE_PATCH ? &data->single_index :
+    &data->multi_index;
+}
+
+static void
+summit_invalidate_patch (struct backend *backend, enum summit_fs fs,
+			 guint8 bank, guint8 id)
+{
+  gchar dir[LABEL_MAX];
+  snprintf (dir, LABEL_MAX, "/%c", 0x40 + bank);
+  preset_index_invalidate (summit_get_preset_index (backend, fs), dir, id);
+}
+
 static gint
-summit_patch_next_dentry (struct item_iterator *iter)
+summit_read_patch_slot (struct backend *backend, const gchar *dir,
+			guint id, struct preset_index_entry *entry,
+			enum summit_fs fs)
 {
   GByteArray *tx_msg, *rx_msg;
-  struct summit_bank_iterator_data *data = iter->data;
-
-  if (data->next >= SUMMIT_PATCHES_PER_BANK)
-    {
-      return -ENOENT;
-    }
+  guint8 bank = SUMMIT_GET_BANK_ID_FROM_DIR (dir);
 
-  tx_msg = summit_get_patch_dump_msg (data->bank, data->next, data->fs);
-  rx_msg = backend_tx_and_rx_sysex (data->backend, tx_msg, -1);
+  tx_msg = summit_get_patch_dump_msg (bank, id, fs);
+  rx_msg = backend_tx_and_rx_sysex (backend, tx_msg, -1);
   if (!rx_msg)
     {
       return -EIO;
     }
 
-  memcpy (iter->item.name, SUMMIT_GET_NAME_FROM_MSG (rx_msg, data->fs),
+  memcpy (entry->name, SUMMIT_GET_NAME_FROM_MSG (rx_msg, fs),
 	  SUMMIT_PATCH_NAME_LEN);
-  iter->item.name[SUMMIT_PATCH_NAME_LEN] = 0;
-  gchar *c = &iter->item.name[SUMMIT_PATCH_NAME_LEN - 1];
+  entry->name[SUMMIT_PATCH_NAME_LEN] = 0;
+  gchar *c = &entry->name[SUMMIT_PATCH_NAME_LEN - 1];
   summit_truncate_name_at_last_useful_char (c);
-  if (data->fs == FS_SUMMIT_SINGLE_PATCH)
+  if (fs == FS_SUMMIT_SINGLE_PATCH)
     {
       const gchar *category = summit_get_category_name (rx_msg);
-      snprintf (iter->item.object_info, LABEL_MAX, "%s", category);
+      snprintf (entry->info, LABEL_MAX, "%s", category);
     }
+  entry->hash = crc32 (0, rx_msg->data, rx_msg->len);
   free_msg (rx_msg);
 
+  usleep (SUMMIT_REST_TIME_US);
+
+  return 0;
+}
+
+static gint
+summit_read_single_slot (struct backend *backend, const gchar *dir,
+			 guint id, struct preset_index_entry *entry)
+{
+  return summit_read_patch_slot (backend, dir, id, entry,
+				 FS_SUMMIT_SINGLE_PATCH);
+}
+
+static gint
+summit_read_multi_slot (struct backend *backend, const gchar *dir,
+			guint id, struct preset_index_entry *entry)
+{
+  return summit_read_patch_slot (backend, dir, id, entry,
+				 FS_SUMMIT_MULTI_PATCH);
+}
+
+static gint
+summit_patch_next_dentry (struct item_iterator *iter)
+{
+  gint err;
+  struct preset_index_entry entry;
+  struct summit_bank_iterator_data *data = iter->data;
+
+  if (data->next >= SUMMIT_PATCHES_PER_BANK)
+    {
+      return -ENOENT;
+    }
+
+  err = preset_index_read (summit_get_preset_index (data->backend, data->fs),
+			   data->dir, data->next, &entry);
+  if (err)
+    {
+      return err;
+    }
+
+  snprintf (iter->item.name, LABEL_MAX, "%s", entry.name);
+  snprintf (iter->item.object_info, LABEL_MAX, "%s", entry.info);
   iter->item.id = data->next;
   iter->item.type = ELEKTROID_FILE;
   iter->item.size =
     data->fs == FS_SUMMIT_SINGLE_PATCH ? SUMMIT_SINGLE_LEN : SUMMIT_MULTI_LEN;
   data->next++;
 
-  usleep (SUMMIT_REST_TIME_US);
-
   return 0;
 }
 
+static void
+summit_free_bank_iterator_data (void *data)
+{
+  struct summit_bank_iterator_data *iter_data = data;
+  preset_index_end_read (summit_get_preset_index (iter_data->backend,
+						  iter_data->fs));
+  g_free (iter_data);
+}
+
 static gint
 summit_patch_next_dentry_root (struct item_iterator *iter)
 {
@@ -269,17 +522,57 @@ summit_patch_read_dir (struct backend *backend, struct item_iterator *iter,
 	g_malloc (sizeof (struct summit_bank_iterator_data));
       data->next = 0;
       data->fs = fs;
-      data->bank = bank;
+      snprintf (data->dir, LABEL_MAX, "%s", path);
       data->backend = backend;
       iter->data = data;
       iter->next = summit_patch_next_dentry;
-      iter->free = g_free;
+      iter->free = summit_free_bank_iterator_data;
+      return 0;
+    }
+
+  return -ENOTDIR;
+}
+
+static gint
+summit_patch_rescan (struct backend *backend, const gchar *path,
+		     enum summit_fs fs)
+{
+  guint bank;
+  gchar dir[LABEL_MAX];
+  struct preset_index *index = summit_get_preset_index (backend, fs);
+
+  if (!strcmp (path, "/"))
+    {
+      for (bank = 1; bank <= 4; bank++)
+	{
+	  snprintf (dir, LABEL_MAX, "/%c", 0x40 + bank);
+	  preset_index_invalidate_dir (index, dir);
+	}
+      return 0;
+    }
+
+  bank = SUMMIT_GET_BANK_ID_FROM_DIR (path);
+  if (strlen (path) == 2 && bank >= 1 && bank <= 4)
+    {
+      preset_index_invalidate_dir (index, path);
       return 0;
     }
 
   return -ENOTDIR;
 }
 
+static gint
+summit_single_rescan (struct backend *backend, const gchar *path)
+{
+  return summit_patch_rescan (backend, path, FS_SUMMIT_SINGLE_PATCH);
+}
+
+static gint
+summit_multi_rescan (struct backend *backend, const gchar *path)
+{
+  return summit_patch_rescan (backend, path, FS_SUMMIT_MULTI_PATCH);
+}
+
 static gint
 summit_single_read_dir (struct backend *backend, struct item_iterator *iter,
 			const gchar *path, gchar **extensions)
@@ -313,6 +606,63 @@ summit_get_bank_and_id_from_path (const gchar *path, guint8 *bank, guint8 *id)
   return 0;
 }
 
+static guint
+summit_get_patch_key (GByteArray *msg)
+{
+  if (msg->len <= SUMMIT_MSG_PATCH_POS)
+    {
+      return G_MAXUINT;
+    }
+  return (msg->data[SUMMIT_MSG_BANK_POS] << 7) |
+    msg->data[SUMMIT_MSG_PATCH_POS];
+}
+
+//The root dir downloads every bank.
+
+static gint
+summit_patch_bank_download (struct backend *backend, const gchar *path,
+			    GByteArray *output, struct job_control *control,
+			    enum summit_fs fs)
+{
+  gint err;
+  guint8 first, last;
+  GArray *requests;
+  guint len = fs == FS_SUMMIT_SINGLE_PATCH ? SUMMIT_SINGLE_LEN :
+    SUMMIT_MULTI_LEN;
+
+  if (strcmp (path, "/"))
+    {
+      first = SUMMIT_GET_BANK_ID_FROM_DIR (path);
+      last = first;
+    }
+  else
+    {
+      first = 1;
+      last = 4;
+    }
+
+  requests = g_array_new (FALSE, FALSE, sizeof (struct summit_bulk_request));
+  for (guint8 bank = first; bank <= last; bank++)
+    {
+      for (guint8 id = 0; id < SUMMIT_PATCHES_PER_BANK; id++)
+	{
+	  summit_bulk_add_request (requests,
+				   summit_get_patch_dump_msg (bank, id, fs),
+				   (bank << 7) | id, len);
+	}
+    }
+
+  err = summit_bulk_dump (backend, requests, summit_get_patch_key, control);
+  if (!err)
+    {
+      summit_bulk_append_responses (requests, output);
+    }
+
+  summit_bulk_free_requests (requests);
+
+  return err;
+}
+
 static gint
 summit_patch_download (struct backend *backend, const gchar *path,
 		       GByteArray *output, struct job_control *control,
@@ -322,6 +672,12 @@ summit_patch_download (struct backend *backend, const gchar *path,
   gint len, err;
   GByteArray *tx_msg, *rx_msg;
 
+  if (!strcmp (path, "/") || SUMMIT_IS_BANK_DIR (path))
+    {
+      return summit_patch_bank_download (backend, path, output, control,
+					 fs);
+    }
+
   err = summit_get_bank_and_id_from_path (path, &bank, &id);
   if (err)
     {
@@ -368,7 +724,8 @@ summit_multi_download (struct backend *backend, const gchar *path,
 
 static gint
 summit_patch_upload (struct backend *backend, const gchar *path,
-		     GByteArray *input, struct job_control *control)
+		     GByteArray *input, struct job_control *control,
+		     enum summit_fs fs)
 {
   guint8 id, bank;
   gint err;
@@ -380,6 +737,8 @@ summit_patch_upload (struct backend *backend, const gchar *path,
       goto end;
     }
 
+  summit_invalidate_patch (backend, fs, bank, id);
+
   msg = g_byte_array_sized_new (input->len);
   g_byte_array_append (msg, input->data, input->len);
 
@@ -407,7 +766,8 @@ summit_single_upload (struct backend *backend, const gchar *path,
       return -EINVAL;
     }
 
-  return summit_patch_upload (backend, path, input, control);
+  return summit_patch_upload (backend, path, input, control,
+			      FS_SUMMIT_SINGLE_PATCH);
 }
 
 static gint
@@ -419,7 +779,8 @@ summit_multi_upload (struct backend *backend, const gchar *path,
       return -EINVAL;
     }
 
-  return summit_patch_upload (backend, path, input, control);
+  return summit_patch_upload (backend, path, input, control,
+			      FS_SUMMIT_MULTI_PATCH);
 }
 
 static gint
@@ -428,14 +789,21 @@ summit_patch_rename (struct backend *backend, const gchar *src,
 {
   GByteArray *preset, *rx_msg;
   gint err, len;
-  guint8 *name;
+  guint8 *name, bank, id;
   gchar *sanitized;
   struct job_control control;
   debug_print (1, "Renaming from %s to %s...\n", src, dst);
 
+  err = summit_get_bank_and_id_from_path (src, &bank, &id);
+  if (err)
+    {
+      return err;
+    }
+
+  summit_invalidate_patch (backend, fs, bank, id);
+
   //The control initialization is needed.
   control.active = TRUE;
-  control.callback = NULL;
   g_mutex_init (&control.mutex);
 
   preset = g_byte_array_sized_new (1024);
@@ -559,6 +927,7 @@ static const struct fs_operations FS_SUMMIT_SINGLE_OPERATIONS = {
   .readdir = summit_single_read_dir,
   .print_item = common_print_item,
   .rename = summit_single_rename,
+  .rescan = summit_single_rescan,
   .download = summit_single_download,
   .upload = summit_single_upload,
   .get_slot = summit_get_patch_id_as_slot,
@@ -583,6 +952,7 @@ static const struct fs_operations FS_SUMMIT_MULTI_OPERATIONS = {
   .readdir = summit_multi_read_dir,
   .print_item = common_print_item,
   .rename = summit_multi_rename,
+  .rescan = summit_multi_rescan,
   .download = summit_multi_download,
   .upload = summit_multi_upload,
   .get_slot = summit_get_patch_id_as_slot,
@@ -655,6 +1025,48 @@ static const struct fs_operations FS_SUMMIT_SCALE_OPERATIONS = {
   .get_upload_path = common_slot_get_upload_path
 };
 
+static GByteArray *
+summit_get_tuning_dump_msg (guint8 id)
+{
+  GByteArray *tx_msg = g_byte_array_sized_new (16);
+  g_byte_array_append (tx_msg, SUMMIT_BULK_TUNING_REQ,
+		       sizeof (SUMMIT_BULK_TUNING_REQ));
+  tx_msg->data[SUMMIT_TUNING_ID_POS] = id;
+  return tx_msg;
+}
+
+static guint
+summit_get_tuning_key (GByteArray *msg)
+{
+  return msg->len > SUMMIT_TUNING_ID_POS ? msg->data[SUMMIT_TUNING_ID_POS] :
+    G_MAXUINT;
+}
+
+static gint
+summit_tuning_bank_download (struct backend *backend, GByteArray *output,
+			     struct job_control *control)
+{
+  gint err;
+  GArray *requests;
+
+  requests = g_array_new (FALSE, FALSE, sizeof (struct summit_bulk_request));
+  for (guint8 id = 0; id < SUMMIT_MAX_TUNINGS; id++)
+    {
+      summit_bulk_add_request (requests, summit_get_tuning_dump_msg (id), id,
+			       SCALA_TUNING_BANK_SIZE);
+    }
+
+  err = summit_bulk_dump (backend, requests, summit_get_tuning_key, control);
+  if (!err)
+    {
+      summit_bulk_append_responses (requests, output);
+    }
+
+  summit_bulk_free_requests (requests);
+
+  return err;
+}
+
 static gint
 summit_tuning_download (struct backend *backend, const gchar *path,
 			GByteArray *output, struct job_control *control)
@@ -663,6 +1075,11 @@ summit_tuning_download (struct backend *backend, const gchar *path,
   gint err = 0;
   GByteArray *tx_msg, *rx_msg;
 
+  if (!strcmp (path, "/"))
+    {
+      return summit_tuning_bank_download (backend, output, control);
+    }
+
   if (common_slot_get_id_name_from_path (path, &id, NULL))
     {
       return -EINVAL;
@@ -672,10 +1089,7 @@ summit_tuning_download (struct backend *backend, const gchar *path,
       return -EINVAL;
     }
 
-  tx_msg = g_byte_array_sized_new (16);
-  g_byte_array_append (tx_msg, SUMMIT_BULK_TUNING_REQ,
-		       sizeof (SUMMIT_BULK_TUNING_REQ));
-  tx_msg->data[5] = id;
+  tx_msg = summit_get_tuning_dump_msg (id);
   err = common_data_tx_and_rx (backend, tx_msg, &rx_msg, control);
   if (err)
     {
@@ -695,6 +1109,19 @@ end:
   return err;
 }
 
+static gchar *
+summit_get_tuning_download_path (struct backend *backend,
+				 const struct fs_operations *ops,
+				 const gchar *dst_dir, const gchar *src_path,
+				 GByteArray *sysex)
+{
+  if (!strcmp (src_path, "/"))
+    {
+      return summit_get_bulk_download_path (backend, ops, dst_dir, src_path);
+    }
+  return common_get_download_path (backend, ops, dst_dir, src_path, sysex);
+}
+
 static const struct fs_operations FS_SUMMIT_BULK_TUNING_OPERATIONS = {
   .id = FS_SUMMIT_BULK_TUNING,
   .options = FS_OPTION_SINGLE_OP | FS_OPTION_ID_AS_FILENAME |
@@ -709,7 +1136,7 @@ static const struct fs_operations FS_SUMMIT_BULK_TUNING_OPERATIONS = {
   .upload = summit_tuning_upload,
   .load = load_file,
   .save = save_file,
-  .get_download_path = common_get_download_path,
+  .get_download_path = summit_get_tuning_download_path,
   .get_upload_path = common_slot_get_upload_path
 };
 
@@ -796,73 +1223,77 @@ summit_wavetable_read_dir (struct backend *backend,
   return -ENOTDIR;
 }
 
+static guint
+summit_get_wavetable_key (GByteArray *msg)
+{
+  return msg->len > SUMMIT_WAVETABLE_ID_POS ?
+    msg->data[SUMMIT_WAVETABLE_ID_POS] : G_MAXUINT;
+}
+
+//The header is requested with the id plus 64 and the response contains that id.
+//The wave responses only contain the wavetable id and the position of the wave index in them is not known, so the five waves share the key and are matched in the order they were requested.
+//This relies on the device answering the requests in order, which MIDI preserves, as summit_bulk_match takes the first request waiting for a response with that key.
+
+static void
+summit_wavetable_add_requests (GArray *requests, guint8 id)
+{
+  summit_bulk_add_request (requests,
+			   summit_get_wavetable_header_dump_msg (id + 64),
+			   id + 64, SUMMIT_WAVETABLE_HEADER_LEN);
+  for (guint8 i = 0; i < SUMMIT_WAVETABLE_WAVES; i++)
+    {
+      summit_bulk_add_request (requests,
+			       summit_get_wavetable_wave_dump_msg (id, i), id,
+			       SUMMIT_WAVETABLE_WAVE_LEN);
+    }
+}
+
+//The root dir downloads every wavetable.
+
 static gint
 summit_wavetable_download (struct backend *backend, const gchar *path,
 			   GByteArray *output, struct job_control *control)
 {
   guint32 id;
-  gint err = 0;
-  GByteArray *tx_msg, *rx_msg;
-
-  if (common_slot_get_id_name_from_path (path, &id, NULL))
-    {
-      return -EINVAL;
-    }
-  if (id >= SUMMIT_MAX_WAVETABLES)
-    {
-      return -EINVAL;
-    }
+  gint err;
+  GArray *requests;
+  struct summit_bulk_request *header;
 
-  control->parts = 6;
-  control->part = 0;
+  requests = g_array_new (FALSE, FALSE, sizeof (struct summit_bulk_request));
 
-  //Header
-  tx_msg = summit_get_wavetable_header_dump_msg (id + 64);
-  err = common_data_tx_and_rx_part (backend, tx_msg, &rx_msg, control);
-  if (err)
+  if (!strcmp (path, "/"))
     {
-      return err;
+      for (id = 0; id < SUMMIT_MAX_WAVETABLES; id++)
+	{
+	  summit_wavetable_add_requests (requests, id);
+	}
     }
-  if (rx_msg->len != SUMMIT_WAVETABLE_HEADER_LEN)
+  else
     {
-      err = -EINVAL;
-      goto err;
+      if (common_slot_get_id_name_from_path (path, &id, NULL) ||
+	  id >= SUMMIT_MAX_WAVETABLES)
+	{
+	  g_array_free (requests, TRUE);
+	  return -EINVAL;
+	}
+      summit_wavetable_add_requests (requests, id);
     }
 
-  rx_msg->data[SUMMIT_WAVETABLE_ID_POS] = id;
-  g_byte_array_append (output, rx_msg->data, rx_msg->len);
-  free_msg (rx_msg);
-
-  control->part++;
-  usleep (SUMMIT_REST_TIME_US);
-
-  //Waves
-  for (gint8 i = 0; i < SUMMIT_WAVETABLE_WAVES; i++)
+  err = summit_bulk_dump (backend, requests, summit_get_wavetable_key,
+			  control);
+  if (!err)
     {
-      tx_msg = summit_get_wavetable_wave_dump_msg (id, i);
-      err = common_data_tx_and_rx_part (backend, tx_msg, &rx_msg, control);
-      if (err)
-	{
-	  goto err;
-	}
-      if (rx_msg->len != SUMMIT_WAVETABLE_WAVE_LEN)
+      for (guint i = 0; i < requests->len;
+	   i += 1 + SUMMIT_WAVETABLE_WAVES)
 	{
-	  err = -EINVAL;
-	  goto err;
+	  header = &g_array_index (requests, struct summit_bulk_request, i);
+	  header->response->data[SUMMIT_WAVETABLE_ID_POS] = header->key - 64;
 	}
-
-      g_byte_array_append (output, rx_msg->data, rx_msg->len);
-      free_msg (rx_msg);
-
-      control->part++;
-      usleep (SUMMIT_REST_TIME_US);
+      summit_bulk_append_responses (requests, output);
     }
 
-  return 0;
+  summit_bulk_free_requests (requests);
 
-err:
-  free_msg (rx_msg);
-  usleep (SUMMIT_REST_TIME_US);
   return err;
 }
 
@@ -876,11 +1307,21 @@ summit_get_wavetable_download_path (struct backend *backend,
   gchar *path;
   gchar name[SUMMIT_PATCH_NAME_LEN + 1];
 
+  if (!strcmp (src_path, "/"))
+    {
+      return summit_get_bulk_download_path (backend, ops, dst_dir, src_path);
+    }
+
   if (common_slot_get_id_name_from_path (src_path, &id, NULL))
     {
       return NULL;
     }
 
+  if (!patch)
+    {
+      return NULL;
+    }
+
   memcpy (name, &patch->data[15], SUMMIT_WAVETABLE_NAME_LEN);
   name[SUMMIT_WAVETABLE_NAME_LEN] = 0;
   summit_truncate_name_at_last_useful_char (&name
@@ -979,15 +1420,34 @@ static const struct fs_operations FS_SUMMIT_WAVETABLE_OPERATIONS = {
   .get_upload_path = common_slot_get_upload_path
 };
 
+static void
+summit_destroy_data (struct backend *backend)
+{
+  struct summit_data *data = backend->data;
+  preset_index_destroy (&data->single_index);
+  preset_index_destroy (&data->multi_index);
+  backend_destroy_data (backend);
+}
+
 gint
 summit_handshake (struct backend *backend)
 {
+  struct summit_data *data;
+
   if (memcmp (backend->midi_info.company, NOVATION_ID, sizeof (NOVATION_ID))
       || memcmp (backend->midi_info.family, SUMMIT_ID, sizeof (SUMMIT_ID)))
     {
       return -ENODEV;
     }
 
+  data = g_malloc (sizeof (struct summit_data));
+  preset_index_init (&data->single_index, backend, "single",
+		     summit_read_single_slot);
+  preset_index_init (&data->multi_index, backend, "multi",
+		     summit_read_multi_slot);
+  backend->data = data;
+  backend->destroy_data = summit_destroy_data;
+
   backend_fill_fs_ops (backend, &FS_SUMMIT_SINGLE_OPERATIONS,
 		       &FS_SUMMIT_MULTI_OPERATIONS,
 		       &FS_SUMMIT_WAVETABLE_OPERATIONS,
@@ -0,0 +1,142 @@
+/*
+ *   discovery.c
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "discovery.h"
+#include "connector.h"
+
+struct discovery_probe_data
+{
+  struct discovery_result *result;
+  gint64 deadline;		//Monotonic time in µs shared by every probe.
+};
+
+static gpointer
+discovery_probe_runner (gpointer data)
+{
+  gint timeout;
+  struct backend *backend;
+  struct discovery_probe_data *probe_data = data;
+  struct discovery_result *result = probe_data->result;
+
+  backend = g_malloc0 (sizeof (struct backend));
+  g_mutex_init (&backend->mutex);
+
+  //The time spent opening the port is deducted from the timeout. A 0 timeout would mean no timeout at all.
+  timeout = (probe_data->deadline - g_get_monotonic_time ()) / 1000;
+  result->err = backend_probe (backend, result->device.id,
+			       timeout > 0 ? timeout : 1);
+  if (!result->err)
+    {
+      memcpy (&result->midi_info, &backend->midi_info,
+	      sizeof (struct backend_midi_info));
+      snprintf (result->identity, LABEL_MAX, "%s", backend->name);
+      snprintf (result->version, LABEL_MAX, "%s", backend->version);
+    }
+  if (!result->err || result->err == -ETIMEDOUT)
+    {
+      //Devices not replying to the identity request might be known by their port name.
+      result->conn_name = connector_get_known_name (backend,
+						    &result->device);
+    }
+  if (!result->err)
+    {
+      backend_destroy (backend);
+    }
+
+  g_mutex_clear (&backend->mutex);
+  g_free (backend);
+
+  return NULL;
+}
+
+GArray *
+discovery_probe (GArray *devices, gint timeout)
+{
+  gint64 deadline;
+  GThread **threads;
+  struct discovery_probe_data *probe_data;
+  GArray *results = g_array_sized_new (FALSE, TRUE,
+				       sizeof (struct discovery_result),
+				       devices->len);
+
+  g_array_set_size (results, devices->len);
+  threads = g_malloc0 (sizeof (GThread *) * devices->len);
+  probe_data = g_malloc (sizeof (struct discovery_probe_data) * devices->len);
+
+  debug_print (1, "Probing %d devices...\n", devices->len);
+
+  deadline = g_get_monotonic_time () + timeout * 1000;
+  for (gint i = 0; i < devices->len; i++)
+    {
+      struct discovery_result *result = &g_array_index (results,
+							struct
+							discovery_result,
+							i);
+      result->device = g_array_index (devices, struct backend_device, i);
+      result->err = -ENODEV;
+
+      if (result->device.type != BE_TYPE_MIDI)
+	{
+	  continue;
+	}
+
+      probe_data[i].result = result;
+      probe_data[i].deadline = deadline;
+      threads[i] = g_thread_new ("discovery_probe_runner",
+				 discovery_probe_runner, &probe_data[i]);
+    }
+
+  for (gint i = 0; i < devices->len; i++)
+    {
+      if (threads[i])
+	{
+	  g_thread_join (threads[i]);
+	}
+    }
+
+  g_free (threads);
+  g_free (probe_data);
+
+  return results;
+}
+
+gchar *
+discovery_get_result_label (struct discovery_result *result)
+{
+  if (result->conn_name && !result->err)
+    {
+      return g_strdup_printf ("%s (%s, %s)", result->device.name,
+			      result->conn_name, result->identity);
+    }
+  else if (result->conn_name)
+    {
+      return g_strdup_printf ("%s (%s)", result->device.name,
+			      result->conn_name);
+    }
+  else if (!result->err)
+    {
+      return g_strdup_printf ("%s (%s)", result->device.name,
+			      result->identity);
+    }
+  else
+    {
+      return g_strdup (result->device.name);
+    }
+}
@@ -0,0 +1,51 @@
+/*
+ *   discovery.h
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DISCOVERY_H
+#define DISCOVERY_H
+
+#include "backend.h"
+
+#define DISCOVERY_TIMEOUT_MS BE_SYSEX_TIMEOUT_GUESS_MS
+
+//Discovery opens every MIDI port at the same time and sends the MIDI identity request to all of them.
+//The replies are collected within a single timeout so the time needed does not depend on the amount of ports.
+//No handshake is run so the connector is the one Elektroid would test first, if any.
+
+struct discovery_result
+{
+  struct backend_device device;
+  gint err;			//0 if the device replied to the identity request.
+  struct backend_midi_info midi_info;
+  gchar identity[LABEL_MAX];
+  gchar version[LABEL_MAX];
+  const gchar *conn_name;
+};
+
+//Returns an array of struct discovery_result with the same order than the devices array.
+//Non MIDI devices are not probed.
+
+GArray *discovery_probe (GArray * devices, gint timeout);
+
+//The returned string must be freed.
+
+gchar *discovery_get_result_label (struct discovery_result *);
+
+#endif
@@ -23,24 +23,73 @@
 #include <unistd.h>
 #if defined(__linux__)
 #include <signal.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #endif
 #include <stdint.h>
 #include <inttypes.h>
 #include <stddef.h>
+#include <getopt.h>
+#include <glib/gstdio.h>
 #include "backend.h"
 #include "connector.h"
+#include "discovery.h"
 #include "utils.h"
+#include "scheduler.h"
+#include "sync.h"
+#include "session.h"
+#include "sysex_file.h"
+#include "local.h"
 
 #define COMMAND_NOT_IN_SYSTEM_FS "Command not available in system backend\n"
 
+#define CLI_SERVE_DIR PACKAGE
+#define CLI_SERVE_SOCKET PACKAGE "-cli.sock"
+#define CLI_SERVE_MAX_REQUEST_LEN (1024 * 1024)
+#define CLI_SERVE_POLL_MS 500
+#define CLI_SERVE_TIMEOUT_MS 10000	//Time for the server to start running a request.
+#define CLI_SERVE_STARTED 1
+#define CLI_SERVE_CANCEL 1
+
 #define GET_FS_OPS_OFFSET(member) offsetof(struct fs_operations, member)
 #define GET_FS_OPS_FUNC(type,fs,offset) (*(((type *) (((gchar *) fs) + offset))))
 #define CHECK_FS_OPS_FUNC(f) if (!(f)) {return -ENOSYS;}
 
 static struct backend backend;
-static struct job_control control;
+static struct scheduler scheduler;
+static struct session *session;
+static GMutex session_mutex;	//Held while the session is cancelled or destroyed.
+static enum scheduler_policy policy = SCHEDULER_POLICY_FIFO;
+static gboolean dry_run, sync_delete, sync_by_size, recursive, timestamps;
+static gint sysex_gap;
+static const gchar *from_file;
+static const gchar *trace_path, *replay_path;
+static gdouble replay_scale;
+
+enum cli_stats_format
+{
+  CLI_STATS_NONE,
+  CLI_STATS_TEXT,
+  CLI_STATS_JSON
+};
+
+static enum cli_stats_format stats_format;
+
+struct cli_task_stats
+{
+  gchar *src;
+  gchar *dst;
+  enum task_status status;
+  struct backend_stats stats;
+};
+
+static GPtrArray *task_stats;
 static struct sysex_transfer sysex_transfer;
 static gchar *connector, *fs, *op;
+static gboolean serving;
+static gchar connected_id[LABEL_MAX];
 const struct fs_operations *fs_ops;
 
 static const gchar *
@@ -64,15 +113,27 @@ static gint
 cli_ld ()
 {
   gint i;
-  struct backend_device device;
+  struct discovery_result *result;
   GArray *devices = backend_get_devices ();
+  GArray *results = discovery_probe (devices, DISCOVERY_TIMEOUT_MS);
 
-  for (i = 0; i < devices->len; i++)
+  for (i = 0; i < results->len; i++)
     {
-      device = g_array_index (devices, struct backend_device, i);
-      printf ("%d: id: %s; name: %s\n", i, device.id, device.name);
+      result = &g_array_index (results, struct discovery_result, i);
+      printf ("%d: id: %s; name: %s", i, result->device.id,
+	      result->device.name);
+      if (!result->err)
+	{
+	  printf ("; identity: %s %s", result->identity, result->version);
+	}
+      if (result->conn_name)
+	{
+	  printf ("; connector: %s", result->conn_name);
+	}
+      printf ("\n");
     }
 
+  g_array_free (results, TRUE);
   g_array_free (devices, TRUE);
 
   return EXIT_SUCCESS;
@@ -83,17 +144,46 @@ cli_connect (const gchar *device_path)
 {
   gint err, id = (gint) atoi (device_path);
   struct backend_device device;
-  GArray *devices = backend_get_devices ();
+  GArray *devices;
 
-  if (!devices->len || id >= devices->len)
+  //The device in the path is ignored as the replay replaces the MIDI port.
+  if (backend.replay)
     {
-      error_print ("Invalid device %d\n", id);
-      return -ENODEV;
+      device.type = BE_TYPE_MIDI;
+      snprintf (device.id, LABEL_MAX, "%s", "replay");
+      snprintf (device.name, LABEL_MAX, "%s", "replay");
+    }
+  else
+    {
+      devices = backend_get_devices ();
+      if (!devices->len || id >= devices->len)
+	{
+	  error_print ("Invalid device %d\n", id);
+	  g_array_free (devices, TRUE);
+	  return -ENODEV;
+	}
+
+      device = g_array_index (devices, struct backend_device, id);
+      g_array_free (devices, TRUE);
     }
 
-  device = g_array_index (devices, struct backend_device, id);
-  err = connector_init_backend (&backend, &device, connector, NULL);
-  g_array_free (devices, TRUE);
+  //When serving, the connection is kept between commands and only replaced if another device or connector is needed.
+  if (serving && backend_check (&backend)
+      && !strcmp (connected_id, device.id)
+      && (!connector || !strcmp (connector, backend.conn_name)))
+    {
+      debug_print (1, "Reusing connection to '%s'...\n", device.id);
+      err = 0;
+    }
+  else
+    {
+      if (backend_check (&backend))
+	{
+	  backend_destroy (&backend);
+	}
+      err = connector_init_backend (&backend, &device, connector, NULL);
+      snprintf (connected_id, LABEL_MAX, "%s", err ? "" : device.id);
+    }
 
   if (!err && fs)
     {
@@ -476,300 +566,1717 @@ cli_upgrade_os (int argc, gchar *argv[], int *optind)
   return err;
 }
 
-static int
-cli_download (int argc, gchar *argv[], int *optind)
+struct cli_report
 {
-  const gchar *src_path;
-  gchar *device_src_path, *download_path;
+  guint tasks;
+  guint completed;
+  guint deduplicated;
+  guint failed;
+  guint canceled;
   gint err;
-  GByteArray *array;
+  gboolean progress;
+  gint64 bytes;			//Bytes of the completed tasks
+  gint64 start;
+};
 
-  if (*optind == argc)
+static guint
+cli_report_get_finished (struct cli_report *report)
+{
+  return report->completed + report->deduplicated + report->failed +
+    report->canceled;
+}
+
+static void
+cli_task_progress (struct scheduler *scheduler, const struct task *task)
+{
+  struct cli_report *report = scheduler->data;
+
+  report->progress = TRUE;
+  if (report->tasks > 1)
     {
-      error_print ("Remote path missing\n");
-      return EXIT_FAILURE;
+      fprintf (stderr, "\r[%u/%u] ", cli_report_get_finished (report) + 1,
+	       report->tasks);
     }
   else
     {
-      device_src_path = argv[*optind];
-      (*optind)++;
+      fprintf (stderr, "\r");
     }
-
-  err = cli_connect (device_src_path);
-  if (err)
+  fprintf (stderr, "%s: %3.0f%%", task->src, 100.0 * task->progress);
+  if (task->eta >= 0)
     {
-      return err;
+      fprintf (stderr, " (ETA %" PRId64 ":%02" PRId64 ")", task->eta / 60,
+	       task->eta % 60);
     }
+  fflush (stderr);
+}
 
-  src_path = cli_get_path (device_src_path);
+//The size of the downloads is only known once saved.
 
-  control.active = TRUE;
-  array = g_byte_array_new ();
-  CHECK_FS_OPS_FUNC (fs_ops->download);
-  err = fs_ops->download (&backend, src_path, array, &control);
-  if (err)
+static gint64
+cli_get_task_bytes (const struct task *task)
+{
+  GStatBuf info;
+
+  if (task->size > 0)
     {
-      goto end;
+      return task->size;
     }
 
-  download_path = fs_ops->get_download_path (&backend, fs_ops, ".", src_path,
-					     array);
-  if (!download_path)
+  if (task->type == TASK_TYPE_DOWNLOAD && task->path
+      && !g_stat (task->path, &info))
     {
-      err = -EINVAL;
-      goto end;
+      return info.st_size;
     }
 
-  err = fs_ops->save (download_path, array, &control);
-  g_free (download_path);
-  g_free (control.data);
-
-end:
-  g_byte_array_free (array, TRUE);
-  return err;
+  return 0;
 }
 
-static int
-cli_upload (int argc, gchar *argv[], int *optind)
+static void
+cli_report_task (struct cli_report *report, const struct task *task)
 {
-  const gchar *dst_path;
-  gchar *src_path, *device_dst_path, *upload_path;
-  gint err;
-  GByteArray *array;
+  debug_print (1, "Task %d (%s -> %s) status: %d\n", task->id, task->src,
+	       task->dst, task->status);
 
-  if (*optind == argc)
+  if (task->status == TASK_STATUS_QUEUED)
     {
-      error_print ("Local path missing\n");
-      return EXIT_FAILURE;
+      report->tasks++;
+      return;
     }
-  else
+
+  if (task->status != TASK_STATUS_RUNNING && report->progress)
     {
-      src_path = argv[*optind];
-      (*optind)++;
+      report->progress = FALSE;
+      fprintf (stderr, "\n");
     }
 
-  if (*optind == argc)
+  if (task->status != TASK_STATUS_RUNNING)
     {
-      error_print ("Remote path missing\n");
-      return EXIT_FAILURE;
+      cli_add_task_stats (task);
     }
-  else
+
+  switch (task->status)
     {
-      device_dst_path = argv[*optind];
-      (*optind)++;
+    case TASK_STATUS_COMPLETED_OK:
+      report->completed++;
+      report->bytes += cli_get_task_bytes (task);
+      break;
+    case TASK_STATUS_COMPLETED_DEDUPLICATED:
+      report->deduplicated++;
+      break;
+    case TASK_STATUS_COMPLETED_ERROR:
+      report->failed++;
+      if (!report->err)
+	{
+	  report->err = task->err ? task->err : -EIO;
+	}
+      break;
+    case TASK_STATUS_CANCELED:
+      report->canceled++;
+      if (!report->err)
+	{
+	  report->err = -ECANCELED;
+	}
+      break;
+    default:
+      break;
     }
+}
 
-  err = cli_connect (device_dst_path);
-  if (err)
+static void
+cli_task_stats_free (gpointer data)
+{
+  struct cli_task_stats *stats = data;
+
+  g_free (stats->src);
+  g_free (stats->dst);
+  g_free (stats);
+}
+
+static void
+cli_add_task_stats (const struct task *task)
+{
+  struct cli_task_stats *stats;
+
+  if (!task_stats)
     {
-      return err;
+      return;
     }
 
-  dst_path = cli_get_path (device_dst_path);
+  stats = g_malloc (sizeof (struct cli_task_stats));
+  stats->src = strdup (task->src);
+  stats->dst = strdup (task->path ? task->path : task->dst);
+  stats->status = task->status;
+  stats->stats = task->stats;
+  g_ptr_array_add (task_stats, stats);
+}
 
-  upload_path = fs_ops->get_upload_path (&backend, fs_ops, dst_path,
-					 src_path);
+static void
+cli_task_changed (struct scheduler *scheduler, const struct task *task)
+{
+  cli_report_task (scheduler->data, task);
+}
 
-  array = g_byte_array_new ();
-  control.active = TRUE;
-  err = fs_ops->load (src_path, array, &control);
-  if (err)
+static void
+cli_report_init (struct cli_report *report)
+{
+  memset (report, 0, sizeof (struct cli_report));
+  report->start = g_get_monotonic_time ();
+}
+
+static void
+cli_report_print_summary (struct cli_report *report)
+{
+  gdouble elapsed = (g_get_monotonic_time () - report->start) / 1e6;
+
+  debug_print (1,
+	       "Tasks completed: %d; deduplicated: %d; failed: %d; canceled: %d\n",
+	       report->completed, report->deduplicated, report->failed,
+	       report->canceled);
+
+  if (!report->tasks)
+    {
+      return;
+    }
+
+  fprintf (stderr, "%u of %u items transferred", report->completed,
+	   report->tasks);
+  if (report->deduplicated)
+    {
+      fprintf (stderr, ", %u already there", report->deduplicated);
+    }
+  if (report->failed)
+    {
+      fprintf (stderr, ", %u failed", report->failed);
+    }
+  if (report->canceled)
+    {
+      fprintf (stderr, ", %u canceled", report->canceled);
+    }
+  fprintf (stderr, "; %.1f KiB in %.1f s", report->bytes / 1024.0, elapsed);
+  if (elapsed > 0)
     {
-      goto cleanup;
+      fprintf (stderr, " (%.1f KiB/s)", report->bytes / 1024.0 / elapsed);
     }
+  fprintf (stderr, "\n");
+}
 
-  CHECK_FS_OPS_FUNC (fs_ops->upload);
-  err = fs_ops->upload (&backend, upload_path, array, &control);
-  g_free (control.data);
+//The CLI does not ask and always replaces existing files.
+//The progress and the ETA are only shown if stderr is a terminal.
 
-cleanup:
-  g_free (upload_path);
-  g_byte_array_free (array, TRUE);
-  return err;
+static void
+cli_scheduler_init (struct cli_report *report)
+{
+  cli_report_init (report);
+
+  scheduler_init (&scheduler, &backend, NULL, NULL, cli_task_changed,
+		  isatty (fileno (stderr)) ? cli_task_progress : NULL,
+		  report);
+  scheduler_set_policy (&scheduler, policy);
 }
 
-static int
-cli_send (int argc, gchar *argv[], int *optind)
+static gint
+cli_scheduler_run (struct cli_report *report)
 {
-  gint err;
-  const gchar *device_dst_path, *src_file;
+  scheduler_run (&scheduler);
+  scheduler_wait (&scheduler);
+  scheduler_destroy (&scheduler);
 
-  if (*optind == argc)
+  cli_report_print_summary (report);
+
+  return report->err;
+}
+
+//Every line of the manifest is a path. Empty lines and lines starting with '#' are ignored.
+
+static gint
+cli_read_manifest (GPtrArray *paths)
+{
+  gchar *content, **lines, *line;
+  GError *error = NULL;
+
+  if (!g_file_get_contents (from_file, &content, NULL, &error))
     {
-      error_print ("Source file missing\n");
+      error_print ("Error while reading '%s': %s\n", from_file,
+		   error->message);
+      g_error_free (error);
       return -EINVAL;
     }
-  else
+
+  lines = g_strsplit (content, "\n", -1);
+  for (gchar **l = lines; *l; l++)
     {
-      src_file = argv[*optind];
+      line = g_strstrip (*l);
+      if (*line && *line != '#')
+	{
+	  g_ptr_array_add (paths, g_strdup (line));
+	}
+    }
+
+  g_strfreev (lines);
+  g_free (content);
+
+  return 0;
+}
+
+//Returns the paths given in the command line, excluding the last reserved ones, and the ones in the manifest.
+
+static GPtrArray *
+cli_get_paths (int argc, gchar *argv[], int *optind, gint reserved)
+{
+  GPtrArray *paths = g_ptr_array_new_with_free_func (g_free);
+
+  while (*optind < argc - reserved)
+    {
+      g_ptr_array_add (paths, g_strdup (argv[*optind]));
       (*optind)++;
     }
 
-  if (*optind == argc)
+  if (from_file && cli_read_manifest (paths))
     {
-      error_print ("Remote device missing\n");
-      return -EINVAL;
+      g_ptr_array_free (paths, TRUE);
+      return NULL;
     }
-  else
+
+  return paths;
+}
+
+static gint
+cli_add_download (const gchar *src, const gchar *dst, guint batch_id,
+		  gint64 size)
+{
+  gint err = 0;
+  gchar *name, *child_dst, *child_src, *filename;
+  struct item_iterator iter;
+  enum path_type type = backend_get_path_type (&backend);
+
+  //As in the GUI, an item is a directory if it can be read as one. Without recursion, the directory is passed as is as some filesystems download whole directories.
+  if (!recursive || fs_ops->readdir (&backend, &iter, src, NULL))
     {
-      device_dst_path = argv[*optind];
-      (*optind)++;
+      scheduler_add (&scheduler, TASK_TYPE_DOWNLOAD, src, dst, fs_ops,
+		     batch_id, TASK_MODE_REPLACE, TASK_PRIORITY_NORMAL, size);
+      return 0;
     }
 
-  connector = "default";
-  err = cli_connect (device_dst_path);
-  if (err)
+  name = g_path_get_basename (src);
+  if (!strcmp (name, "/") || !strcmp (name, "."))
     {
-      return err;
+      child_dst = strdup (dst);
     }
-  if (backend.type == BE_TYPE_SYSTEM)
+  else
     {
-      error_print (COMMAND_NOT_IN_SYSTEM_FS);
-      return EXIT_FAILURE;
+      child_dst = path_chain (PATH_SYSTEM, dst, name);
     }
+  g_free (name);
 
-  sysex_transfer.active = TRUE;
-  sysex_transfer.timeout = BE_DUMP_TIMEOUT;
-  sysex_transfer.raw = g_byte_array_new ();
-
-  err = load_file (src_file, sysex_transfer.raw, NULL);
-
-  if (!err)
+  while (!err && !next_item_iterator (&iter))
     {
-      err = backend_tx_sysex (&backend, &sysex_transfer);
+      filename = get_filename (fs_ops->options, &iter.item);
+      child_src = path_chain (type, src, filename);
+      err = cli_add_download (child_src, child_dst, batch_id,
+			      iter.item.size);
+      g_free (child_src);
+      g_free (filename);
     }
 
-  free_msg (sysex_transfer.raw);
+  free_item_iterator (&iter);
+  g_free (child_dst);
+
   return err;
 }
 
+//The tasks are queued in the same batch so the pipeline overlaps the transfer of an item with the saving of the previous one.
+
 static int
-cli_receive (int argc, gchar *argv[], int *optind)
+cli_download (int argc, gchar *argv[], int *optind)
 {
-  gint err;
-  const gchar *device_src_path, *dst_file;
+  gint err = 0;
+  guint batch_id;
+  const gchar *src, *device_path;
+  GPtrArray *paths;
+  struct cli_report report;
 
-  if (*optind == argc)
-    {
-      error_print ("Remote device missing\n");
-      return -EINVAL;
-    }
-  else
+  paths = cli_get_paths (argc, argv, optind, 0);
+  if (!paths)
     {
-      device_src_path = argv[*optind];
-      (*optind)++;
+      return EXIT_FAILURE;
     }
 
-  if (*optind == argc)
+  if (!paths->len)
     {
-      error_print ("Destination file missing\n");
-      return -EINVAL;
+      error_print ("Remote path missing\n");
+      g_ptr_array_free (paths, TRUE);
+      return EXIT_FAILURE;
     }
-  else
+
+  device_path = g_ptr_array_index (paths, 0);
+  src = cli_get_path (device_path);
+  for (guint i = 1; i < paths->len; i++)
     {
-      dst_file = argv[*optind];
-      (*optind)++;
+      const gchar *path = g_ptr_array_index (paths, i);
+      if (strncmp (path, device_path, src - device_path)
+	  || cli_get_path (path) - path != src - device_path)
+	{
+	  error_print ("All the paths must belong to the same device\n");
+	  g_ptr_array_free (paths, TRUE);
+	  return EXIT_FAILURE;
+	}
     }
 
-  connector = "default";
-  err = cli_connect (device_src_path);
+  err = cli_connect (device_path);
   if (err)
     {
+      g_ptr_array_free (paths, TRUE);
       return err;
     }
-  if (backend.type == BE_TYPE_SYSTEM)
+
+  if (!fs_ops->download)
     {
-      error_print (COMMAND_NOT_IN_SYSTEM_FS);
-      return EXIT_FAILURE;
+      g_ptr_array_free (paths, TRUE);
+      return -ENOSYS;
     }
 
-  sysex_transfer.timeout = BE_DUMP_TIMEOUT;
-  sysex_transfer.batch = TRUE;
+  cli_scheduler_init (&report);
+  batch_id = scheduler_new_batch (&scheduler);
+  for (guint i = 0; i < paths->len && !err; i++)
+    {
+      src = cli_get_path (g_ptr_array_index (paths, i));
+      err = cli_add_download (src, ".", batch_id, -1);
+    }
+  g_ptr_array_free (paths, TRUE);
 
-  backend_rx_drain (&backend);
-  //This doesn't need to be synchronized because the CLI is not multithreaded.
-  err = backend_rx_sysex (&backend, &sysex_transfer);
-  if (!err)
+  if (err)
     {
-      err = save_file (dst_file, sysex_transfer.raw, NULL);
+      scheduler_destroy (&scheduler);
+      return err;
     }
 
-  free_msg (sysex_transfer.raw);
-  return err;
+  return cli_scheduler_run (&report);
 }
 
+static gint cli_add_upload (const gchar *, const gchar *, guint, gchar **);
+
 static gint
-set_conn_fs_op_from_command (const gchar *cmd)
+cli_add_upload_dir (const gchar *src, const gchar *dst, guint batch_id,
+		    gchar **exts)
 {
-  gchar *aux;
+  gint err = 0;
+  gchar *name, *child_src, *child_dst;
+  struct item_iterator iter;
 
-  connector = strdup (cmd);
-  aux = strchr (connector, '-');
-  if (!aux)
+  err = FS_LOCAL_GENERIC_OPERATIONS.readdir (NULL, &iter, src, exts);
+  if (err)
     {
-      g_free (connector);
-      return -EINVAL;
+      error_print ("Error while reading local %s dir\n", src);
+      return err;
     }
-  *aux = 0;
-  aux++;
 
-  fs = strdup (aux);
-  aux = strchr (fs, '-');
-  if (!aux)
+  name = g_path_get_basename (src);
+  child_dst = path_chain (backend_get_path_type (&backend), dst, name);
+  g_free (name);
+
+  while (!err && !next_item_iterator (&iter))
     {
-      g_free (connector);
-      g_free (fs);
-      return -EINVAL;
+      child_src = path_chain (PATH_SYSTEM, src, iter.item.name);
+      err = cli_add_upload (child_src, child_dst, batch_id, exts);
+      g_free (child_src);
     }
 
-  *aux = 0;
-  aux++;
-
-  op = strdup (aux);
+  free_item_iterator (&iter);
+  g_free (child_dst);
 
-  return 0;
+  return err;
 }
 
-#if defined(__linux__)
-static void
-cli_end (int sig)
+static gint
+cli_add_upload (const gchar *src, const gchar *dst, guint batch_id,
+		gchar **exts)
 {
-  g_mutex_lock (&control.mutex);
-  control.active = FALSE;
-  g_mutex_unlock (&control.mutex);
-
-  g_mutex_lock (&sysex_transfer.mutex);
-  sysex_transfer.active = FALSE;
-  g_mutex_unlock (&sysex_transfer.mutex);
-}
-#endif
+  gchar *upload_path;
 
-int
-main (int argc, gchar *argv[])
+  if (g_file_test (src, G_FILE_TEST_IS_DIR))
+    {
+      if (!recursive)
+	{
+	  error_print ("'%s' is a directory\n", src);
+	  return -EISDIR;
+	}
+
+      if (fs_ops->options & FS_OPTION_SLOT_STORAGE)
+	{
+	  error_print ("Directories can not be uploaded to slots\n");
+	  return -EINVAL;
+	}
+
+      return cli_add_upload_dir (src, dst, batch_id, exts);
+    }
+
+  //As in the GUI, the upload path of the slot storages is known beforehand.
+  if (fs_ops->options & FS_OPTION_SLOT_STORAGE)
+    {
+      upload_path = fs_ops->get_upload_path (&backend, fs_ops, dst, src);
+    }
+  else
+    {
+      upload_path = strdup (dst);
+    }
+
+  scheduler_add (&scheduler, TASK_TYPE_UPLOAD, src, upload_path, fs_ops,
+		 batch_id, TASK_MODE_REPLACE, TASK_PRIORITY_NORMAL, -1);
+  g_free (upload_path);
+
+  return 0;
+}
+
+//Uploads to several devices share the same report so the session callbacks, which are called from every device thread, are serialized.
+
+struct cli_fan_out
+{
+  struct cli_report report;
+  GMutex mutex;
+  gdouble *progress;
+};
+
+static void
+cli_session_task_progress (struct session_device *device,
+			   const struct task *task)
+{
+  struct cli_fan_out *fan_out = device->session->data;
+
+  g_mutex_lock (&fan_out->mutex);
+  fan_out->report.progress = TRUE;
+  fan_out->progress[device->index] = task->progress;
+  fprintf (stderr, "\r%s:", task->src);
+  for (guint i = 0; i < session_get_devices (device->session); i++)
+    {
+      fprintf (stderr, " %s %3.0f%%",
+	       session_get_device (device->session, i)->device.id,
+	       100.0 * fan_out->progress[i]);
+    }
+  fflush (stderr);
+  g_mutex_unlock (&fan_out->mutex);
+}
+
+static void
+cli_session_task_changed (struct session_device *device,
+			  const struct task *task)
+{
+  struct cli_fan_out *fan_out = device->session->data;
+
+  g_mutex_lock (&fan_out->mutex);
+  cli_report_task (&fan_out->report, task);
+  g_mutex_unlock (&fan_out->mutex);
+}
+
+//The device part of the destination is a comma separated list of devices (e.g., 1,2,3:/incoming).
+
+static gint
+cli_upload_fan_out (const gchar *src_path, const gchar *device_dst_path)
+{
+  gint err = 0, id;
+  gchar **ids, *device_ids;
+  struct session fan_out_session;
+  struct cli_fan_out fan_out;
+  struct backend_device device;
+  const gchar *dst_path = cli_get_path (device_dst_path);
+  GArray *devices = backend_get_devices ();
+
+  //A connection kept by the server would make the port busy.
+  if (backend_check (&backend))
+    {
+      backend_destroy (&backend);
+    }
+
+  device_ids = g_strndup (device_dst_path, dst_path - device_dst_path - 1);
+  ids = g_strsplit (device_ids, ",", -1);
+  g_free (device_ids);
+
+  memset (&fan_out, 0, sizeof (struct cli_fan_out));
+  cli_report_init (&fan_out.report);
+  g_mutex_init (&fan_out.mutex);
+  fan_out.progress = g_malloc0 (sizeof (gdouble) * g_strv_length (ids));
+
+  session_init (&fan_out_session, cli_session_task_changed,
+		isatty (fileno (stderr)) ? cli_session_task_progress : NULL,
+		&fan_out);
+
+  for (gchar **i = ids; *i; i++)
+    {
+      id = (gint) atoi (*i);
+      if (id >= devices->len)
+	{
+	  error_print ("Invalid device %d\n", id);
+	  err = -ENODEV;
+	  goto end;
+	}
+
+      device = g_array_index (devices, struct backend_device, id);
+      err = session_add_device (&fan_out_session, &device, connector);
+      if (err < 0)
+	{
+	  error_print ("Error while connecting to device %d\n", id);
+	  goto end;
+	}
+    }
+
+  g_mutex_lock (&session_mutex);
+  session = &fan_out_session;
+  g_mutex_unlock (&session_mutex);
+
+  err = session_fan_out_upload (&fan_out_session, src_path, dst_path, fs,
+				TASK_MODE_REPLACE);
+  if (!err)
+    {
+      session_wait (&fan_out_session);
+      err = fan_out.report.err;
+    }
+
+  cli_report_print_summary (&fan_out.report);
+
+end:
+  g_mutex_lock (&session_mutex);
+  session = NULL;
+  session_destroy (&fan_out_session);
+  g_mutex_unlock (&session_mutex);
+  g_free (fan_out.progress);
+  g_mutex_clear (&fan_out.mutex);
+  g_strfreev (ids);
+  g_array_free (devices, TRUE);
+  return err;
+}
+
+static int
+cli_upload (int argc, gchar *argv[], int *optind)
+{
+  const gchar *dst_path, *device_dst_path;
+  gchar **exts;
+  guint batch_id;
+  GPtrArray *paths;
+  struct cli_report report;
+  gint err = 0;
+
+  if (*optind == argc)
+    {
+      error_print ("Remote path missing\n");
+      return EXIT_FAILURE;
+    }
+
+  //The remote path is the last argument.
+  device_dst_path = argv[argc - 1];
+  paths = cli_get_paths (argc, argv, optind, 1);
+  (*optind)++;
+  if (!paths)
+    {
+      return EXIT_FAILURE;
+    }
+
+  if (!paths->len)
+    {
+      error_print ("Local path missing\n");
+      g_ptr_array_free (paths, TRUE);
+      return EXIT_FAILURE;
+    }
+
+  dst_path = cli_get_path (device_dst_path);
+  if (memchr (device_dst_path, ',', dst_path - device_dst_path))
+    {
+      if (paths->len > 1 || recursive)
+	{
+	  error_print ("Only a single file can be uploaded to several devices\n");
+	  err = EXIT_FAILURE;
+	}
+      else
+	{
+	  err = cli_upload_fan_out (g_ptr_array_index (paths, 0),
+				    device_dst_path);
+	}
+      g_ptr_array_free (paths, TRUE);
+      return err;
+    }
+
+  err = cli_connect (device_dst_path);
+  if (err)
+    {
+      g_ptr_array_free (paths, TRUE);
+      return err;
+    }
+
+  if (!fs_ops->load || !fs_ops->upload)
+    {
+      g_ptr_array_free (paths, TRUE);
+      return -ENOSYS;
+    }
+
+  if (fs_ops->options & FS_OPTION_SLOT_STORAGE && paths->len > 1)
+    {
+      error_print ("Only a single file can be uploaded to a slot\n");
+      g_ptr_array_free (paths, TRUE);
+      return EXIT_FAILURE;
+    }
+
+  if (fs_ops->get_exts)
+    {
+      exts = fs_ops->get_exts (&backend, fs_ops);
+    }
+  else
+    {
+      exts = new_ext_array (fs_ops->ext);
+    }
+
+  cli_scheduler_init (&report);
+  batch_id = scheduler_new_batch (&scheduler);
+  for (guint i = 0; i < paths->len && !err; i++)
+    {
+      err = cli_add_upload (g_ptr_array_index (paths, i), dst_path, batch_id,
+			    exts);
+    }
+  free_ext_array (exts);
+  g_ptr_array_free (paths, TRUE);
+
+  if (err)
+    {
+      scheduler_destroy (&scheduler);
+      return err;
+    }
+
+  return cli_scheduler_run (&report);
+}
+
+static int
+cli_sync (int argc, gchar *argv[], int *optind)
+{
+  const gchar *dst_path;
+  gchar *src_path, *device_dst_path;
+  struct sync_plan plan;
+  struct sync_action *action;
+  struct cli_report report;
+  gint err;
+
+  if (*optind == argc)
+    {
+      error_print ("Local path missing\n");
+      return EXIT_FAILURE;
+    }
+  else
+    {
+      src_path = argv[*optind];
+      (*optind)++;
+    }
+
+  if (*optind == argc)
+    {
+      error_print ("Remote path missing\n");
+      return EXIT_FAILURE;
+    }
+  else
+    {
+      device_dst_path = argv[*optind];
+      (*optind)++;
+    }
+
+  err = cli_connect (device_dst_path);
+  if (err)
+    {
+      return err;
+    }
+
+  dst_path = cli_get_path (device_dst_path);
+
+  err = sync_plan_init (&plan, &backend, fs_ops, src_path, dst_path,
+			sync_delete, sync_by_size);
+  if (err)
+    {
+      return err;
+    }
+
+  if (dry_run)
+    {
+      for (GList * l = plan.actions; l; l = l->next)
+	{
+	  action = l->data;
+	  if (action->src)
+	    {
+	      printf ("%s %s %s\n", sync_get_action_name (action->type),
+		      action->src, action->dst);
+	    }
+	  else
+	    {
+	      printf ("%s %s\n", sync_get_action_name (action->type),
+		      action->dst);
+	    }
+	}
+      sync_plan_free (&plan);
+      return EXIT_SUCCESS;
+    }
+
+  cli_scheduler_init (&report);
+  err = sync_plan_run (&plan, &scheduler);
+  if (err)
+    {
+      scheduler_destroy (&scheduler);
+    }
+  else
+    {
+      err = cli_scheduler_run (&report);
+    }
+  sync_plan_free (&plan);
+
+  return err;
+}
+
+static int
+cli_send (int argc, gchar *argv[], int *optind)
+{
+  gint err;
+  const gchar *device_dst_path, *src_file;
+
+  if (*optind == argc)
+    {
+      error_print ("Source file missing\n");
+      return -EINVAL;
+    }
+  else
+    {
+      src_file = argv[*optind];
+      (*optind)++;
+    }
+
+  if (*optind == argc)
+    {
+      error_print ("Remote device missing\n");
+      return -EINVAL;
+    }
+  else
+    {
+      device_dst_path = argv[*optind];
+      (*optind)++;
+    }
+
+  connector = "default";
+  err = cli_connect (device_dst_path);
+  if (err)
+    {
+      return err;
+    }
+  if (backend.type == BE_TYPE_SYSTEM)
+    {
+      error_print (COMMAND_NOT_IN_SYSTEM_FS);
+      return EXIT_FAILURE;
+    }
+
+  sysex_transfer.active = TRUE;
+  sysex_transfer.timeout = BE_DUMP_TIMEOUT;
+
+  err = sysex_file_send (&backend, &sysex_transfer, src_file, sysex_gap);
+  if (err)
+    {
+      error_print ("Error while sending '%s': %s\n", src_file,
+		   g_strerror (-err));
+    }
+
+  return err;
+}
+
+static int
+cli_receive (int argc, gchar *argv[], int *optind)
+{
+  gint err;
+  const gchar *device_src_path, *dst_file;
+
+  if (*optind == argc)
+    {
+      error_print ("Remote device missing\n");
+      return -EINVAL;
+    }
+  else
+    {
+      device_src_path = argv[*optind];
+      (*optind)++;
+    }
+
+  if (*optind == argc)
+    {
+      error_print ("Destination file missing\n");
+      return -EINVAL;
+    }
+  else
+    {
+      dst_file = argv[*optind];
+      (*optind)++;
+    }
+
+  connector = "default";
+  err = cli_connect (device_src_path);
+  if (err)
+    {
+      return err;
+    }
+  if (backend.type == BE_TYPE_SYSTEM)
+    {
+      error_print (COMMAND_NOT_IN_SYSTEM_FS);
+      return EXIT_FAILURE;
+    }
+
+  sysex_transfer.timeout = BE_DUMP_TIMEOUT;
+  sysex_transfer.batch = TRUE;
+
+  g_mutex_lock (&backend.mutex);
+  backend_rx_drain (&backend);
+  g_mutex_unlock (&backend.mutex);
+
+  return sysex_file_receive (&backend, &sysex_transfer, dst_file,
+			     timestamps ? stdout : NULL);
+}
+
+static gint
+set_conn_fs_op_from_command (const gchar *cmd)
+{
+  gchar *aux;
+
+  connector = strdup (cmd);
+  aux = strchr (connector, '-');
+  if (!aux)
+    {
+      g_free (connector);
+      return -EINVAL;
+    }
+  *aux = 0;
+  aux++;
+
+  fs = strdup (aux);
+  aux = strchr (fs, '-');
+  if (!aux)
+    {
+      g_free (connector);
+      g_free (fs);
+      return -EINVAL;
+    }
+
+  *aux = 0;
+  aux++;
+
+  op = strdup (aux);
+
+  return 0;
+}
+
+#if defined(__linux__)
+static sigset_t cli_signals;
+static gboolean cancelled;
+
+//Cancelling takes locks and prints so it can not be done in a signal handler.
+
+static void
+cli_cancel ()
+{
+  g_atomic_int_set (&cancelled, TRUE);
+
+  //The scheduler is only initialized while running tasks.
+  if (scheduler.tasks)
+    {
+      scheduler_cancel_all (&scheduler);
+    }
+
+  g_mutex_lock (&session_mutex);
+  if (session)
+    {
+      session_cancel_all (session);
+    }
+  g_mutex_unlock (&session_mutex);
+
+  g_mutex_lock (&sysex_transfer.mutex);
+  sysex_transfer.active = FALSE;
+  g_mutex_unlock (&sysex_transfer.mutex);
+}
+
+static void
+cli_end ()
+{
+  cli_cancel ();
+  g_atomic_int_set (&serving, FALSE);
+}
+
+//The signals are blocked in every thread and received here.
+
+static gpointer
+cli_signal_runner (gpointer data)
+{
+  gint sig;
+
+  while (1)
+    {
+      if (sigwait (&cli_signals, &sig))
+	{
+	  continue;
+	}
+      debug_print (1, "Signal %d received\n", sig);
+      cli_end ();
+    }
+
+  return NULL;
+}
+#endif
+
+static gint cli_run (int argc, gchar *argv[]);
+
+#if defined(__linux__)
+//The socket is in a dir only accessible by the user as the runtime dir might not be private.
+//Only the server creates the dir.
+
+static gint
+cli_get_socket_addr (struct sockaddr_un *addr, gboolean create)
+{
+  gint len;
+  gchar *dir;
+  struct stat st;
+
+  dir = g_build_filename (g_get_user_runtime_dir (), CLI_SERVE_DIR, NULL);
+  if (create && g_mkdir (dir, S_IRWXU) && errno != EEXIST)
+    {
+      error_print ("Error while creating dir '%s'\n", dir);
+      g_free (dir);
+      return -errno;
+    }
+
+  if (lstat (dir, &st))
+    {
+      g_free (dir);
+      return -errno;
+    }
+
+  if (!S_ISDIR (st.st_mode) || st.st_uid != getuid ()
+      || (st.st_mode & (S_IRWXG | S_IRWXO)))
+    {
+      error_print ("'%s' must be a dir owned by the user with mode 0700\n",
+		   dir);
+      g_free (dir);
+      return -EPERM;
+    }
+
+  memset (addr, 0, sizeof (struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  len = snprintf (addr->sun_path, sizeof (addr->sun_path), "%s/%s", dir,
+		  CLI_SERVE_SOCKET);
+  g_free (dir);
+  return len < sizeof (addr->sun_path) ? 0 : -ENAMETOOLONG;
+}
+
+static gint
+cli_read_all (gint fd, void *buf, size_t len)
+{
+  ssize_t rx_len;
+  guint8 *data = buf;
+
+  while (len)
+    {
+      rx_len = read (fd, data, len);
+      if (rx_len <= 0)
+	{
+	  return rx_len ? -errno : -EIO;
+	}
+      data += rx_len;
+      len -= rx_len;
+    }
+
+  return 0;
+}
+
+static gint
+cli_write_all (gint fd, const void *buf, size_t len)
+{
+  ssize_t tx_len;
+  const guint8 *data = buf;
+
+  while (len)
+    {
+      tx_len = write (fd, data, len);
+      if (tx_len < 0)
+	{
+	  return -errno;
+	}
+      data += tx_len;
+      len -= tx_len;
+    }
+
+  return 0;
+}
+
+//A request is made of its length, which carries the stdout and stderr of the client, and the working directory followed by the arguments, all of them NUL terminated.
+//The server answers with CLI_SERVE_STARTED before running the command and then with the exit code. The command output goes directly to the client descriptors.
+//While the command runs, the client sends CLI_SERVE_CANCEL or closes the connection to cancel it.
+
+//Returns the socket connected to the server or -ENOTCONN if there is no server running.
+
+static gint
+cli_connect_server ()
+{
+  gint fd;
+  struct sockaddr_un addr;
+
+  if (cli_get_socket_addr (&addr, FALSE))
+    {
+      return -ENOTCONN;
+    }
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      return -errno;
+    }
+
+  if (connect (fd, (struct sockaddr *) &addr, sizeof (struct sockaddr_un)))
+    {
+      close (fd);
+      return -ENOTCONN;
+    }
+
+  return fd;
+}
+
+static gint
+cli_forward_wait (gint fd, gint32 *ret)
+{
+  gint err;
+  guint8 started, cancel = CLI_SERVE_CANCEL;
+  gboolean cancel_sent = FALSE;
+  struct pollfd pfd;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+
+  err = poll (&pfd, 1, CLI_SERVE_TIMEOUT_MS);
+  if (err <= 0)
+    {
+      error_print ("Server busy or not responding\n");
+      return err ? -errno : -ETIMEDOUT;
+    }
+
+  err = cli_read_all (fd, &started, sizeof (started));
+  if (err)
+    {
+      return err;
+    }
+
+  while (1)
+    {
+      err = poll (&pfd, 1, CLI_SERVE_POLL_MS);
+      if (err < 0 && errno != EINTR)
+	{
+	  return -errno;
+	}
+
+      if (err > 0)
+	{
+	  return cli_read_all (fd, ret, sizeof (gint32));
+	}
+
+      if (!cancel_sent && g_atomic_int_get (&cancelled))
+	{
+	  debug_print (1, "Forwarding cancellation to server...\n");
+	  cli_write_all (fd, &cancel, sizeof (cancel));
+	  cancel_sent = TRUE;
+	}
+    }
+}
+
+static gint
+cli_forward (int argc, gchar *argv[], gint32 *ret)
+{
+  gint fd, err, fds[2] = { STDOUT_FILENO, STDERR_FILENO };
+  guint32 len;
+  gchar *cwd;
+  GByteArray *request;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union
+  {
+    struct cmsghdr hdr;
+    gchar buf[CMSG_SPACE (sizeof (fds))];
+  } control;
+
+  fd = cli_connect_server ();
+  if (fd < 0)
+    {
+      return fd;
+    }
+
+  debug_print (1, "Forwarding command to server...\n");
+
+  request = g_byte_array_new ();
+  cwd = g_get_current_dir ();
+  g_byte_array_append (request, (guint8 *) cwd, strlen (cwd) + 1);
+  g_free (cwd);
+  for (gint i = 1; i < argc; i++)
+    {
+      g_byte_array_append (request, (guint8 *) argv[i], strlen (argv[i]) + 1);
+    }
+  len = request->len;
+
+  iov.iov_base = &len;
+  iov.iov_len = sizeof (len);
+  memset (&msg, 0, sizeof (struct msghdr));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+  cmsg = CMSG_FIRSTHDR (&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+  memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+
+  if (sendmsg (fd, &msg, 0) != sizeof (len))
+    {
+      err = -errno;
+    }
+  else
+    {
+      err = cli_write_all (fd, request->data, request->len);
+    }
+
+  if (!err)
+    {
+      err = cli_forward_wait (fd, ret);
+    }
+
+  g_byte_array_free (request, TRUE);
+  close (fd);
+
+  return err;
+}
+
+struct cli_client_watcher
+{
+  gint fd;
+  gboolean running;
+};
+
+//Anything received from the client or the client closing the connection cancels the command.
+
+static gpointer
+cli_client_watcher_runner (gpointer data)
 {
-  gint c;
   gint err;
-  gchar *command;
-  gint vflg = 0, errflg = 0;
-#if defined(__linux__)
-  struct sigaction action;
-
-  action.sa_handler = cli_end;
-  sigemptyset (&action.sa_mask);
-  action.sa_flags = 0;
-  sigaction (SIGTERM, &action, NULL);
-  sigaction (SIGQUIT, &action, NULL);
-  sigaction (SIGINT, &action, NULL);
-  sigaction (SIGHUP, &action, NULL);
+  struct pollfd pfd;
+  struct cli_client_watcher *watcher = data;
+
+  pfd.fd = watcher->fd;
+  pfd.events = POLLIN;
+  while (g_atomic_int_get (&watcher->running))
+    {
+      err = poll (&pfd, 1, CLI_SERVE_POLL_MS);
+      if (err > 0 || (err < 0 && errno != EINTR))
+	{
+	  debug_print (1, "Cancelling command from client...\n");
+	  cli_cancel ();
+	  break;
+	}
+    }
+
+  return NULL;
+}
+
+//Only processes of the same user are served.
+
+static gboolean
+cli_is_client_allowed (gint fd)
+{
+  struct ucred cred;
+  socklen_t len = sizeof (struct ucred);
+
+  if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len))
+    {
+      error_print ("Error while getting client credentials\n");
+      return FALSE;
+    }
+
+  if (cred.uid != getuid ())
+    {
+      error_print ("Rejecting client with uid %d\n", cred.uid);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static void
+cli_serve_client (gint fd)
+{
+  gint err, fds[2], saved_fds[2], saved_debug_level;
+  gint32 ret = EXIT_FAILURE;
+  guint32 len;
+  guint8 started = CLI_SERVE_STARTED;
+  gchar *request, *cwd, *saved_cwd;
+  GPtrArray *args;
+  GThread *thread;
+  struct cli_client_watcher watcher;
+  struct msghdr msg;
+  struct iovec iov;
+  struct cmsghdr *cmsg;
+  union
+  {
+    struct cmsghdr hdr;
+    gchar buf[CMSG_SPACE (sizeof (fds))];
+  } control;
+
+  iov.iov_base = &len;
+  iov.iov_len = sizeof (len);
+  memset (&msg, 0, sizeof (struct msghdr));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof (control.buf);
+
+  if (!cli_is_client_allowed (fd))
+    {
+      return;
+    }
+
+  if (recvmsg (fd, &msg, 0) != sizeof (len))
+    {
+      error_print ("Error while receiving request\n");
+      return;
+    }
+
+  cmsg = CMSG_FIRSTHDR (&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN (sizeof (fds)))
+    {
+      error_print ("Request without descriptors\n");
+      return;
+    }
+  memcpy (fds, CMSG_DATA (cmsg), sizeof (fds));
+
+  if (!len || len > CLI_SERVE_MAX_REQUEST_LEN)
+    {
+      error_print ("Invalid request length %u\n", len);
+      goto close_fds;
+    }
+
+  request = g_malloc (len + 1);
+  err = cli_read_all (fd, request, len);
+  if (err)
+    {
+      error_print ("Error while receiving request: %s\n",
+		   g_strerror (-err));
+      goto free_request;
+    }
+  request[len] = 0;
+
+  cwd = request;
+  args = g_ptr_array_new ();
+  g_ptr_array_add (args, PACKAGE "-cli");
+  for (gchar *arg = cwd + strlen (cwd) + 1; arg < request + len;
+       arg += strlen (arg) + 1)
+    {
+      g_ptr_array_add (args, arg);
+    }
+  g_ptr_array_add (args, NULL);
+
+  fflush (stdout);
+  fflush (stderr);
+  saved_fds[0] = dup (STDOUT_FILENO);
+  saved_fds[1] = dup (STDERR_FILENO);
+  dup2 (fds[0], STDOUT_FILENO);
+  dup2 (fds[1], STDERR_FILENO);
+  saved_cwd = g_get_current_dir ();
+  saved_debug_level = debug_level;
+
+  g_atomic_int_set (&cancelled, FALSE);
+  watcher.fd = fd;
+  watcher.running = TRUE;
+  thread = NULL;
+
+  if (chdir (cwd))
+    {
+      error_print ("Error while changing to '%s'\n", cwd);
+    }
+  else if (!cli_write_all (fd, &started, sizeof (started)))
+    {
+      thread = g_thread_new ("cli_client_watcher_runner",
+			     cli_client_watcher_runner, &watcher);
+      ret = cli_run (args->len - 1, (gchar **) args->pdata);
+    }
+
+  if (thread)
+    {
+      g_atomic_int_set (&watcher.running, FALSE);
+      g_thread_join (thread);
+    }
+
+  fflush (stdout);
+  fflush (stderr);
+  dup2 (saved_fds[0], STDOUT_FILENO);
+  dup2 (saved_fds[1], STDERR_FILENO);
+  close (saved_fds[0]);
+  close (saved_fds[1]);
+  if (chdir (saved_cwd))
+    {
+      error_print ("Error while changing to '%s'\n", saved_cwd);
+    }
+  g_free (saved_cwd);
+  debug_level = saved_debug_level;
+
+  cli_write_all (fd, &ret, sizeof (ret));
+
+  g_ptr_array_free (args, TRUE);
+free_request:
+  g_free (request);
+close_fds:
+  close (fds[0]);
+  close (fds[1]);
+}
+
+//Commands are run one at a time in the server process so the connection to the device is kept between them.
+
+static gint
+cli_serve ()
+{
+  gint fd, client, err = 0;
+  struct sockaddr_un addr;
+  struct pollfd pfd;
+
+  if (serving)
+    {
+      error_print ("Already serving\n");
+      return -EINVAL;
+    }
+
+  err = cli_get_socket_addr (&addr, TRUE);
+  if (err)
+    {
+      return err;
+    }
+
+  fd = cli_connect_server ();
+  if (fd >= 0)
+    {
+      close (fd);
+      error_print ("Server already running\n");
+      return -EADDRINUSE;
+    }
+
+  //The socket file might be there if a previous server was killed.
+  unlink (addr.sun_path);
+
+  fd = socket (AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    {
+      return -errno;
+    }
+
+  if (bind (fd, (struct sockaddr *) &addr, sizeof (struct sockaddr_un))
+      || listen (fd, 1))
+    {
+      err = -errno;
+      close (fd);
+      return err;
+    }
+
+  debug_print (1, "Serving at '%s'...\n", addr.sun_path);
+
+  //As signals are not delivered to this thread, accept is only called when there is a client.
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  g_atomic_int_set (&serving, TRUE);
+  while (g_atomic_int_get (&serving))
+    {
+      err = poll (&pfd, 1, CLI_SERVE_POLL_MS);
+      if (err <= 0)
+	{
+	  if (err < 0 && errno != EINTR)
+	    {
+	      err = -errno;
+	      break;
+	    }
+	  err = 0;
+	  continue;
+	}
+
+      client = accept (fd, NULL, NULL);
+      if (client < 0)
+	{
+	  if (errno != EINTR)
+	    {
+	      err = -errno;
+	      break;
+	    }
+	  continue;
+	}
+
+      cli_serve_client (client);
+      close (client);
+    }
+  serving = FALSE;
+
+  close (fd);
+  unlink (addr.sun_path);
+
+  if (backend_check (&backend))
+    {
+      backend_destroy (&backend);
+    }
+
+  return err;
+}
+#else
+static gint
+cli_forward (int argc, gchar *argv[], gint32 *ret)
+{
+  return -ENOTCONN;
+}
+
+static gint
+cli_serve ()
+{
+  return -ENOSYS;
+}
 #endif
 
-  while ((c = getopt (argc, argv, "v")) != -1)
+//Returns the first argument not being an option nor an option argument.
+
+static const gchar *
+cli_get_command (int argc, gchar *argv[])
+{
+  for (gint i = 1; i < argc; i++)
+    {
+      if (argv[i][0] != '-')
+	{
+	  return argv[i];
+	}
+      if (!strcmp (argv[i], "-s") || !strcmp (argv[i], "-f")
+	  || !strcmp (argv[i], "--from-file") || !strcmp (argv[i], "-g")
+	  || !strcmp (argv[i], "--gap") || !strcmp (argv[i], "--trace")
+	  || !strcmp (argv[i], "--replay")
+	  || !strcmp (argv[i], "--replay-scale"))
+	{
+	  i++;
+	}
+    }
+  return NULL;
+}
+
+//Tracing and replaying need the MIDI port of the process so these commands are never forwarded.
+
+static gboolean
+cli_is_forwardable (int argc, gchar *argv[])
+{
+  for (gint i = 1; i < argc; i++)
+    {
+      if (g_str_has_prefix (argv[i], "--trace")
+	  || g_str_has_prefix (argv[i], "--replay"))
+	{
+	  return FALSE;
+	}
+    }
+  return TRUE;
+}
+
+static void
+cli_print_stats_json (const struct backend_stats *stats)
+{
+  gchar *json;
+  JsonNode *root;
+  JsonGenerator *gen;
+  JsonBuilder *builder = json_builder_new ();
+
+  json_builder_begin_object (builder);
+
+  json_builder_set_member_name (builder, "device");
+  json_builder_add_string_value (builder, backend.name);
+
+  json_builder_set_member_name (builder, "backend");
+  json_builder_begin_object (builder);
+  backend_stats_build_json (builder, stats);
+  json_builder_end_object (builder);
+
+  json_builder_set_member_name (builder, "tasks");
+  json_builder_begin_array (builder);
+  for (guint i = 0; i < task_stats->len; i++)
+    {
+      struct cli_task_stats *task = g_ptr_array_index (task_stats, i);
+
+      json_builder_begin_object (builder);
+      json_builder_set_member_name (builder, "src");
+      json_builder_add_string_value (builder, task->src);
+      json_builder_set_member_name (builder, "dst");
+      json_builder_add_string_value (builder, task->dst);
+      json_builder_set_member_name (builder, "status");
+      json_builder_add_int_value (builder, task->status);
+      backend_stats_build_json (builder, &task->stats);
+      json_builder_end_object (builder);
+    }
+  json_builder_end_array (builder);
+
+  json_builder_end_object (builder);
+
+  gen = json_generator_new ();
+  json_generator_set_pretty (gen, TRUE);
+  root = json_builder_get_root (builder);
+  json_generator_set_root (gen, root);
+  json = json_generator_to_data (gen, NULL);
+
+  fprintf (stderr, "%s\n", json);
+
+  g_free (json);
+  json_node_free (root);
+  g_object_unref (gen);
+  g_object_unref (builder);
+}
+
+//The stats are printed to stderr so that they do not mix with the output of the commands.
+
+static void
+cli_print_stats ()
+{
+  gchar *text;
+  struct backend_stats stats;
+
+  if (backend.type == BE_TYPE_MIDI)
+    {
+      backend_stats_get (&backend, &stats);
+    }
+  else
+    {
+      memset (&stats, 0, sizeof (struct backend_stats));
+    }
+
+  if (stats_format == CLI_STATS_JSON)
+    {
+      cli_print_stats_json (&stats);
+      return;
+    }
+
+  text = backend_stats_to_string (&stats);
+  fprintf (stderr, "%s\n", text);
+  g_free (text);
+
+  for (guint i = 0; i < task_stats->len; i++)
+    {
+      struct cli_task_stats *task = g_ptr_array_index (task_stats, i);
+
+      text = backend_stats_to_string (&task->stats);
+      fprintf (stderr, "%s -> %s:\n%s\n", task->src, task->dst, text);
+      g_free (text);
+    }
+}
+
+static const struct option CLI_OPTIONS[] = {
+  {"recursive", no_argument, NULL, 'r'},
+  {"from-file", required_argument, NULL, 'f'},
+  {"gap", required_argument, NULL, 'g'},
+  {"timestamps", no_argument, NULL, 't'},
+  {"size", no_argument, NULL, 'z'},
+  {"stats", optional_argument, NULL, 'S'},
+  {"trace", required_argument, NULL, 'T'},
+  {"replay", required_argument, NULL, 'R'},
+  {"replay-scale", required_argument, NULL, 'P'},
+  {NULL, 0, NULL, 0}
+};
+
+static gint
+cli_run (int argc, gchar *argv[])
+{
+  gint c;
+  gint err;
+  gchar *command, *endptr;
+  gint vflg = 0, errflg = 0, p;
+  struct trace *trace = NULL;
+  struct trace_replay *replay = NULL;
+
+  //When serving, this is called once per command.
+  optind = 1;
+  dry_run = FALSE;
+  sync_delete = FALSE;
+  sync_by_size = FALSE;
+  recursive = FALSE;
+  from_file = NULL;
+  timestamps = FALSE;
+  sysex_gap = SYSEX_FILE_GAP_LEARN;
+  stats_format = CLI_STATS_NONE;
+  trace_path = NULL;
+  replay_path = NULL;
+  replay_scale = 1.0;
+  policy = SCHEDULER_POLICY_FIFO;
+  fs_ops = NULL;
+  //send and receive force the default connector without owning the string.
+  connector = NULL;
+
+  while ((c = getopt_long (argc, argv, "vs:ndzrf:g:t", CLI_OPTIONS,
+			   NULL)) != -1)
     {
       switch (c)
 	{
+	case 'g':
+	  sysex_gap = atoi (optarg);
+	  if (sysex_gap < 0)
+	    {
+	      error_print ("Invalid gap '%s'\n", optarg);
+	      errflg++;
+	    }
+	  break;
+	case 't':
+	  timestamps = TRUE;
+	  break;
+	case 'S':
+	  if (!optarg || !strcmp (optarg, "text"))
+	    {
+	      stats_format = CLI_STATS_TEXT;
+	    }
+	  else if (!strcmp (optarg, "json"))
+	    {
+	      stats_format = CLI_STATS_JSON;
+	    }
+	  else
+	    {
+	      error_print ("Invalid stats format '%s'\n", optarg);
+	      errflg++;
+	    }
+	  break;
+	case 'T':
+	  trace_path = optarg;
+	  break;
+	case 'R':
+	  replay_path = optarg;
+	  break;
+	case 'P':
+	  replay_scale = g_ascii_strtod (optarg, &endptr);
+	  if (*endptr || replay_scale < 0)
+	    {
+	      error_print ("Invalid replay scale '%s'\n", optarg);
+	      errflg++;
+	    }
+	  break;
+	case 'r':
+	  recursive = TRUE;
+	  break;
+	case 'f':
+	  from_file = optarg;
+	  break;
 	case 'v':
 	  vflg++;
 	  break;
+	case 'n':
+	  dry_run = TRUE;
+	  break;
+	case 'd':
+	  sync_delete = TRUE;
+	  break;
+	case 'z':
+	  sync_by_size = TRUE;
+	  break;
+	case 's':
+	  p = scheduler_get_policy_by_name (optarg);
+	  if (p < 0)
+	    {
+	      error_print ("Invalid scheduling policy '%s'\n", optarg);
+	      errflg++;
+	    }
+	  else
+	    {
+	      policy = p;
+	    }
+	  break;
 	case '?':
 	  errflg++;
 	}
@@ -795,7 +2302,36 @@ main (int argc, gchar *argv[])
       fprintf (stderr, "%s\n", PACKAGE_STRING);
       gchar *exec_name = g_path_get_basename (argv[0]);
       fprintf (stderr, "Usage: %s [options] command\n", exec_name);
-      exit (EXIT_FAILURE);
+      g_free (exec_name);
+      return EXIT_FAILURE;
+    }
+
+  if ((trace_path || replay_path)
+      && (serving || !strcmp (command, "serve")))
+    {
+      error_print ("Tracing and replaying are not available when serving\n");
+      return EXIT_FAILURE;
+    }
+
+  if (replay_path)
+    {
+      replay = trace_replay_new (replay_path, replay_scale);
+      if (!replay)
+	{
+	  return EXIT_FAILURE;
+	}
+      backend.replay = replay;
+    }
+
+  if (trace_path)
+    {
+      trace = trace_new (TRACE_DEFAULT_LEN);
+      backend.trace = trace;
+    }
+
+  if (stats_format != CLI_STATS_NONE)
+    {
+      task_stats = g_ptr_array_new_with_free_func (cli_task_stats_free);
     }
 
   if (!strcmp (command, "ld") || !strcmp (command, "list-devices"))
@@ -822,6 +2358,10 @@ main (int argc, gchar *argv[])
     {
       err = cli_upgrade_os (argc, argv, &optind);
     }
+  else if (!strcmp (command, "serve"))
+    {
+      err = cli_serve ();
+    }
   else
     {
       err = set_conn_fs_op_from_command (command);
@@ -856,11 +2396,20 @@ main (int argc, gchar *argv[])
 	{
 	  err = cli_upload (argc, argv, &optind);
 	}
+      else if (!strcmp (op, "sync"))
+	{
+	  err = cli_sync (argc, argv, &optind);
+	}
       else if (!strcmp (op, "cl"))
 	{
 	  err = cli_command_path (argc, argv, &optind,
 				  GET_FS_OPS_OFFSET (clear));
 	}
+      else if (!strcmp (op, "rescan"))
+	{
+	  err = cli_command_path (argc, argv, &optind,
+				  GET_FS_OPS_OFFSET (rescan));
+	}
       else if (!strcmp (op, "cp"))
 	{
 	  err = cli_command_src_dst (argc, argv, &optind,
@@ -881,22 +2430,114 @@ main (int argc, gchar *argv[])
 	  err = EXIT_FAILURE;
 	}
 
-      if (backend_check (&backend))
-	{
-	  backend_destroy (&backend);
-	}
-
       g_free (connector);
       g_free (fs);
       g_free (op);
+      connector = NULL;
+      fs = NULL;
+      op = NULL;
+    }
+
+  if (task_stats)
+    {
+      cli_print_stats ();
+    }
+
+  if (!serving && backend_check (&backend))
+    {
+      backend_destroy (&backend);
     }
 
 end:
+  if (task_stats)
+    {
+      g_ptr_array_free (task_stats, TRUE);
+      task_stats = NULL;
+    }
+
+  if (trace)
+    {
+      backend.trace = NULL;
+      if (trace_save (trace, trace_path))
+	{
+	  error_print ("Error while saving trace to '%s'\n", trace_path);
+	}
+      trace_free (trace);
+    }
+
+  if (replay)
+    {
+      backend.replay = NULL;
+      if (!trace_replay_is_done (replay))
+	{
+	  debug_print (1, "Replay finished before the trace end\n");
+	}
+      if (replay->mismatches)
+	{
+	  error_print ("Replay diverged from the trace (%u mismatches)\n",
+		       replay->mismatches);
+	  if (!err)
+	    {
+	      err = EXIT_FAILURE;
+	    }
+	}
+      trace_replay_free (replay);
+    }
+
   if (err && err != EXIT_FAILURE)
     {
       error_print ("Error: %s\n", g_strerror (-err));
     }
 
-  usleep (BE_REST_TIME_US * 2);
   return err ? EXIT_FAILURE : EXIT_SUCCESS;
 }
+
+int
+main (int argc, gchar *argv[])
+{
+  gint err;
+  gint32 ret;
+  const gchar *command;
+#if defined(__linux__)
+  //This must be done before creating any thread so that all of them inherit the mask.
+  sigemptyset (&cli_signals);
+  sigaddset (&cli_signals, SIGTERM);
+  sigaddset (&cli_signals, SIGQUIT);
+  sigaddset (&cli_signals, SIGINT);
+  sigaddset (&cli_signals, SIGHUP);
+  pthread_sigmask (SIG_BLOCK, &cli_signals, NULL);
+  g_thread_unref (g_thread_new ("cli_signal_runner", cli_signal_runner,
+				NULL));
+#endif
+
+  //If there is a server running, it runs the command without connecting to the device again.
+  command = cli_get_command (argc, argv);
+  if (command && strcmp (command, "serve")
+      && cli_is_forwardable (argc, argv))
+    {
+      err = cli_forward (argc, argv, &ret);
+      if (!err)
+	{
+	  return ret;
+	}
+      if (err != -ENOTCONN)
+	{
+	  error_print ("Error while forwarding command to server: %s\n",
+		       g_strerror (-err));
+	  return EXIT_FAILURE;
+	}
+    }
+
+  //The server redirects stderr for every command so the messages must be written in order.
+  if (g_getenv (LOG_THREAD_ENV) && (!command || strcmp (command, "serve")))
+    {
+      log_start_thread ();
+    }
+
+  ret = cli_run (argc, argv);
+
+  log_stop_thread ();
+
+  usleep (BE_REST_TIME_US * 2);
+  return ret;
+}
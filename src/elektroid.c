@@ -29,6 +29,7 @@
 #include <getopt.h>
 #include "backend.h"
 #include "connector.h"
+#include "discovery.h"
 #include "browser.h"
 #include "editor.h"
 #include "tasks.h"
@@ -38,6 +39,7 @@
 #include "preferences.h"
 #include "menu_action.h"
 #include "progress.h"
+#include "sysex_file.h"
 
 #define EDITOR_VISIBLE (remote_browser.fs_ops->options & FS_OPTION_SAMPLE_EDITOR ? TRUE : FALSE)
 
@@ -57,7 +59,8 @@ enum device_list_store_columns
 {
   DEVICES_LIST_STORE_TYPE_FIELD,
   DEVICES_LIST_STORE_ID_FIELD,
-  DEVICES_LIST_STORE_NAME_FIELD
+  DEVICES_LIST_STORE_NAME_FIELD,
+  DEVICES_LIST_STORE_LABEL_FIELD
 };
 
 enum fs_list_store_columns
@@ -79,13 +82,11 @@ struct elektroid_dnd_data
   gchar *type_name;
 };
 
-static gpointer elektroid_upload_task_runner (gpointer);
-static gpointer elektroid_download_task_runner (gpointer);
-static void elektroid_update_progress (struct job_control *);
 
 static const struct option ELEKTROID_OPTIONS[] = {
   {"local-directory", 1, NULL, 'l'},
   {"verbose", 0, NULL, 'v'},
+  {"trace", 1, NULL, 't'},
   {"help", 0, NULL, 'h'},
   {NULL, 0, NULL, 0}
 };
@@ -159,6 +160,7 @@ static GtkLabel *host_audio_status_label;
 static GtkLabel *host_midi_status_label;
 static GtkListStore *devices_list_store;
 static GtkWidget *devices_combo;
+static GThread *discovery_thread;
 static GtkListStore *fs_list_store;
 static GtkWidget *fs_combo;
 
@@ -219,11 +221,96 @@ elektroid_load_remote_if_midi (gpointer data)
   return FALSE;
 }
 
+struct elektroid_discovery_data
+{
+  GThread *thread;
+  GArray *results;
+};
+
+static gboolean
+elektroid_set_discovery_results (gpointer data)
+{
+  GtkTreeIter iter;
+  gboolean valid;
+  gchar *id, *label;
+  struct elektroid_discovery_data *discovery_data = data;
+  GArray *results = discovery_data->results;
+  struct discovery_result *result;
+
+  //The thread might have been joined before connecting to a device.
+  if (discovery_thread == discovery_data->thread)
+    {
+      g_thread_join (discovery_thread);
+      discovery_thread = NULL;
+    }
+
+  //The rows are matched by id as the devices might have been reloaded in the meantime.
+  valid = gtk_tree_model_get_iter_first (GTK_TREE_MODEL (devices_list_store),
+					 &iter);
+  while (valid)
+    {
+      gtk_tree_model_get (GTK_TREE_MODEL (devices_list_store), &iter,
+			  DEVICES_LIST_STORE_ID_FIELD, &id, -1);
+
+      for (gint i = 0; i < results->len; i++)
+	{
+	  result = &g_array_index (results, struct discovery_result, i);
+	  if (result->device.type == BE_TYPE_MIDI
+	      && !strcmp (result->device.id, id))
+	    {
+	      label = discovery_get_result_label (result);
+	      gtk_list_store_set (devices_list_store, &iter,
+				  DEVICES_LIST_STORE_LABEL_FIELD, label, -1);
+	      g_free (label);
+	      break;
+	    }
+	}
+
+      g_free (id);
+      valid = gtk_tree_model_iter_next (GTK_TREE_MODEL (devices_list_store),
+					&iter);
+    }
+
+  g_array_free (results, TRUE);
+  g_free (discovery_data);
+
+  return FALSE;
+}
+
+static gpointer
+elektroid_discovery_runner (gpointer data)
+{
+  GArray *devices = data;
+  struct elektroid_discovery_data *discovery_data =
+    g_malloc (sizeof (struct elektroid_discovery_data));
+
+  discovery_data->thread = g_thread_self ();
+  discovery_data->results = discovery_probe (devices, DISCOVERY_TIMEOUT_MS);
+  g_array_free (devices, TRUE);
+  g_idle_add (elektroid_set_discovery_results, discovery_data);
+
+  return NULL;
+}
+
+//Connecting to a port while it is being probed would fail.
+
+static void
+elektroid_wait_discovery ()
+{
+  if (discovery_thread)
+    {
+      debug_print (1, "Waiting for device discovery...\n");
+      g_thread_join (discovery_thread);
+      discovery_thread = NULL;
+    }
+}
+
 static void
 elektroid_load_devices (gboolean auto_select)
 {
   gint i;
   gint device_index;
+  gboolean midi = FALSE;
   GArray *devices = backend_get_devices ();
   struct backend_device device;
 
@@ -241,10 +328,21 @@ elektroid_load_devices (gboolean auto_select)
 					 DEVICES_LIST_STORE_ID_FIELD,
 					 device.id,
 					 DEVICES_LIST_STORE_NAME_FIELD,
+					 device.name,
+					 DEVICES_LIST_STORE_LABEL_FIELD,
 					 device.name, -1);
+      midi = midi || device.type == BE_TYPE_MIDI;
     }
 
-  g_array_free (devices, TRUE);
+  if (midi && !discovery_thread)
+    {
+      discovery_thread = g_thread_new ("elektroid_discovery_runner",
+				       elektroid_discovery_runner, devices);
+    }
+  else
+    {
+      g_array_free (devices, TRUE);
+    }
 
   device_index = auto_select && i == 1 ? 0 : -1;
   debug_print (1, "Selecting device %d...\n", device_index);
@@ -357,11 +455,9 @@ elektroid_update_backend_status ()
 gboolean
 elektroid_check_backend ()
 {
-  GtkTreeIter iter;
   gboolean remote_sensitive;
   gboolean connected = backend_check (&backend);
-  gboolean queued = tasks_get_next_queued (&tasks, &iter, NULL, NULL, NULL,
-					   NULL, NULL, NULL);
+  gboolean queued = !scheduler_is_idle (&tasks.scheduler);
 
   if (!remote_browser.fs_ops
       || remote_browser.fs_ops->options & FS_OPTION_SINGLE_OP)
@@ -397,11 +493,7 @@ static void
 elektroid_cancel_all_tasks_and_wait ()
 {
   tasks_cancel_all (NULL, &tasks);
-  //In this case, the active waiting can not be avoided as the user has cancelled the operation.
-  while (tasks.transfer.status == TASK_STATUS_RUNNING)
-    {
-      usleep (50000);
-    }
+  scheduler_wait (&tasks.scheduler);
 }
 
 static void
@@ -436,11 +528,13 @@ elektroid_refresh_devices (GtkWidget *widget, gpointer data)
   elektroid_check_backend ();	//This triggers the actual devices refresh if there is no backend
 }
 
+//Messages are saved as soon as they are received so the capture is stopped by closing the dialog.
+
 static gpointer
 elektroid_rx_sysex_runner (gpointer data)
 {
+  const gchar *filename = data;
   gint *res = g_malloc (sizeof (gint));
-  gchar *text;
 
   sysex_transfer.status = WAITING;
   sysex_transfer.active = TRUE;
@@ -454,14 +548,7 @@ elektroid_rx_sysex_runner (gpointer data)
 
   if (sysex_transfer.active)
     {
-      *res = backend_rx_sysex (&backend, &sysex_transfer);
-      if (!*res)
-	{
-	  text = debug_get_hex_msg (sysex_transfer.raw);
-	  debug_print (1, "SysEx message received (%d): %s\n",
-		       sysex_transfer.raw->len, text);
-	  g_free (text);
-	}
+      *res = sysex_file_receive (&backend, &sysex_transfer, filename, NULL);
     }
   else
     {
@@ -479,37 +566,12 @@ elektroid_rx_sysex ()
   GtkFileChooser *chooser;
   GtkFileFilter *filter;
   gint dres;
-  gchar *filename;
+  gchar *filename = NULL;
   gchar *filename_w_ext;
   const gchar *ext;
   gint *res;
   GtkFileChooserAction action = GTK_FILE_CHOOSER_ACTION_SAVE;
 
-  res = progress_run (elektroid_rx_sysex_runner, NULL, _("Receive SysEx"),
-		      "", &dres);
-  if (!res)			//Signal captured while running the dialog.
-    {
-      g_byte_array_free (sysex_transfer.raw, TRUE);
-      return;
-    }
-
-  if (dres != GTK_RESPONSE_ACCEPT)
-    {
-      if (!*res)
-	{
-	  g_byte_array_free (sysex_transfer.raw, TRUE);
-	}
-      g_free (res);
-      return;
-    }
-
-  if (*res)
-    {
-      elektroid_check_backend ();
-      g_free (res);
-      return;
-    }
-
   dialog = gtk_file_chooser_dialog_new (_("Save SysEx"),
 					GTK_WINDOW (main_window),
 					action,
@@ -553,21 +615,32 @@ elektroid_rx_sysex ()
       break;
     }
 
-  if (filename != NULL)
+  gtk_widget_destroy (dialog);
+  dialog = NULL;
+
+  if (filename == NULL)
+    {
+      return;
+    }
+
+  res = progress_run (elektroid_rx_sysex_runner, filename,
+		      _("Receive SysEx"), "", &dres);
+  if (!res)			//Signal captured while running the dialog.
     {
-      *res = save_file (filename, sysex_transfer.raw, NULL);
-      if (*res)
-	{
-	  show_error_msg (_("Error while saving “%s”: %s."),
-			  filename, g_strerror (-*res));
-	}
-      g_byte_array_free (sysex_transfer.raw, TRUE);
-      g_free (res);
       g_free (filename);
+      return;
     }
 
-  gtk_widget_destroy (dialog);
-  dialog = NULL;
+  //If the dialog was closed, the messages received so far are kept.
+  if (dres == GTK_RESPONSE_ACCEPT && *res)
+    {
+      show_error_msg (_("Error while saving “%s”: %s."),
+		      filename, g_strerror (-*res));
+      elektroid_check_backend ();
+    }
+
+  g_free (res);
+  g_free (filename);
 }
 
 static gint
@@ -591,7 +664,6 @@ elektroid_tx_sysex_files_runner (gpointer data)
 {
   GSList *filenames = data;
   gint *err = g_malloc (sizeof (gint));
-  sysex_transfer.raw = g_byte_array_new ();
   sysex_transfer.active = TRUE;
   sysex_transfer.status = SENDING;
 
@@ -600,9 +672,13 @@ elektroid_tx_sysex_files_runner (gpointer data)
   *err = 0;
   while (*err != -ECANCELED && filenames)
     {
-      g_byte_array_set_size (sysex_transfer.raw, 0);
-      *err = elektroid_send_sysex_file (filenames->data,
-					backend_tx_sysex_no_status);
+      *err = sysex_file_send (&backend, &sysex_transfer, filenames->data,
+			      SYSEX_FILE_GAP_LEARN);
+      if (*err && *err != -ECANCELED)
+	{
+	  show_error_msg (_("Error while loading “%s”: %s."),
+			  (gchar *) filenames->data, g_strerror (-*err));
+	}
       filenames = filenames->next;
       //The device may have sent some messages in response so we skip all these.
       backend_rx_drain (&backend);
@@ -610,7 +686,6 @@ elektroid_tx_sysex_files_runner (gpointer data)
     }
   progress_response (GTK_RESPONSE_CANCEL);	//Any response is OK.
 
-  free_msg (sysex_transfer.raw);
   return err;
 }
 
@@ -1295,103 +1370,45 @@ elektroid_name_dialog_entry_changed (GtkWidget *object, gpointer data)
   gtk_widget_set_sensitive (name_dialog_accept_button, len > 0);
 }
 
-static gboolean
-elektroid_run_next (gpointer data)
-{
-  GtkTreeIter iter;
-  enum task_type type;
-  gchar *src;
-  gchar *dst;
-  gint fs;
-  guint batch_id, mode;
-  GtkTreePath *path;
-  gboolean transfer_active;
-  gboolean found = tasks_get_next_queued (&tasks, &iter, &type, &src, &dst,
-					  &fs, &batch_id, &mode);
-  const gchar *status_human = tasks_get_human_status (TASK_STATUS_RUNNING);
-
-  g_mutex_lock (&tasks.transfer.control.mutex);
-  transfer_active = tasks.transfer.control.active;
-  g_mutex_unlock (&tasks.transfer.control.mutex);
-
-  if (!transfer_active && found)
-    {
-      if (remote_browser.fs_ops->options & FS_OPTION_SINGLE_OP)
-	{
-	  gtk_widget_set_sensitive (remote_box, FALSE);
-	}
-      gtk_widget_set_sensitive (ma_data.box, FALSE);
-
-      gtk_list_store_set (tasks.list_store, &iter,
-			  TASK_LIST_STORE_STATUS_FIELD, TASK_STATUS_RUNNING,
-			  TASK_LIST_STORE_STATUS_HUMAN_FIELD, status_human,
-			  -1);
-      path = gtk_tree_model_get_path (GTK_TREE_MODEL (tasks.list_store),
-				      &iter);
-      gtk_tree_view_set_cursor (GTK_TREE_VIEW (tasks.tree_view), path, NULL,
-				FALSE);
-      gtk_tree_path_free (path);
-      tasks.transfer.status = TASK_STATUS_RUNNING;
-      tasks.transfer.control.active = TRUE;
-      tasks.transfer.control.callback = elektroid_update_progress;
-      tasks.transfer.control.parts = 1000;	//Any reasonable high number is enough to make the progress monotonic.
-      tasks.transfer.control.part = 0;
-      set_job_control_progress (&tasks.transfer.control, 0.0);
-      tasks.transfer.src = src;
-      tasks.transfer.dst = dst;
-      tasks.transfer.fs_ops = backend_get_fs_operations_by_id (&backend, fs);
-      tasks.transfer.batch_id = batch_id;
-      tasks.transfer.mode = mode;
-      debug_print (1,
-		   "Running task type %d from %s to %s (filesystem %s)...\n",
-		   type, tasks.transfer.src, tasks.transfer.dst,
-		   tasks.transfer.fs_ops->name);
-
-      if (type == TASK_TYPE_UPLOAD)
-	{
-	  tasks.thread = g_thread_new ("upload_task",
-				       elektroid_upload_task_runner, NULL);
-	  remote_browser.dirty = TRUE;
-	}
-      else if (type == TASK_TYPE_DOWNLOAD)
-	{
-	  tasks.thread = g_thread_new ("download_task",
-				       elektroid_download_task_runner, NULL);
-	}
-
-      gtk_widget_set_sensitive (tasks.cancel_task_button, TRUE);
-    }
-  else
-    {
-      gtk_widget_set_sensitive (remote_box, TRUE);
-
-      if ((remote_browser.fs_ops->options & FS_OPTION_SINGLE_OP)
-	  && remote_browser.dirty)
-	{
-	  remote_browser.dirty = FALSE;
-	  g_idle_add (elektroid_load_remote_if_midi, &remote_browser);
-	}
-    }
+//The scheduler asks once at a time so a single ask can be pending.
+//Every ask has its own id so that a dialog shown for an ask already answered does not answer the next one.
 
-  tasks_check_buttons (&tasks);
+struct elektroid_overwrite_data
+{
+  GMutex mutex;
+  GCond cond;
+  guint id;
+  gchar *path;
+  enum task_answer answer;
+  gboolean apply_to_all;
+  gboolean done;
+};
 
-  return FALSE;
-}
+static struct elektroid_overwrite_data overwrite_data;
 
 static gboolean
 elektroid_show_task_overwrite_dialog (gpointer data)
 {
   gint res;
-  gboolean apply_to_all;
+  gchar *path;
   GtkWidget *container, *checkbutton;
+  guint id = GPOINTER_TO_UINT (data);
+
+  g_mutex_lock (&overwrite_data.mutex);
+  if (overwrite_data.done || overwrite_data.id != id)
+    {
+      g_mutex_unlock (&overwrite_data.mutex);
+      return FALSE;
+    }
+  path = strdup (overwrite_data.path);
+  g_mutex_unlock (&overwrite_data.mutex);
 
   dialog = gtk_message_dialog_new (GTK_WINDOW (main_window),
 				   GTK_DIALOG_MODAL |
 				   GTK_DIALOG_USE_HEADER_BAR,
 				   GTK_MESSAGE_WARNING,
 				   GTK_BUTTONS_NONE,
-				   _("Replace file “%s”?"),
-				   (gchar *) data);
+				   _("Replace file “%s”?"), path);
   gtk_dialog_add_buttons (GTK_DIALOG (dialog),
 			  _("_Cancel"), GTK_RESPONSE_CANCEL,
 			  _("_Skip"), GTK_RESPONSE_REJECT,
@@ -1406,40 +1423,32 @@ elektroid_show_task_overwrite_dialog (gpointer data)
   gtk_container_add (GTK_CONTAINER (container), checkbutton);
 
   res = gtk_dialog_run (GTK_DIALOG (dialog));
-  apply_to_all =
-    gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (checkbutton));
-  switch (res)
-    {
-    case GTK_RESPONSE_CANCEL:
-      //Cancel current task.
-      tasks.transfer.status = TASK_STATUS_CANCELED;
-      //Cancel all tasks belonging to the same batch.
-      tasks_visit_pending (&tasks, tasks_visitor_set_batch_canceled);
-      break;
-    case GTK_RESPONSE_REJECT:
-      //Cancel current task.
-      tasks.transfer.status = TASK_STATUS_CANCELED;
-      if (apply_to_all)
-	{
-	  //Mark pending tasks as SKIP.
-	  tasks_visit_pending (&tasks, tasks_batch_visitor_set_skip);
-	}
-      break;
-    case GTK_RESPONSE_ACCEPT:
-      //Mark pending tasks as REPLACE.
-      if (apply_to_all)
+
+  //The ask might have been canceled meanwhile.
+  g_mutex_lock (&overwrite_data.mutex);
+  if (!overwrite_data.done && overwrite_data.id == id)
+    {
+      switch (res)
 	{
-	  tasks_visit_pending (&tasks, tasks_batch_visitor_set_replace);
+	case GTK_RESPONSE_ACCEPT:
+	  overwrite_data.answer = TASK_ANSWER_REPLACE;
+	  break;
+	case GTK_RESPONSE_REJECT:
+	  overwrite_data.answer = TASK_ANSWER_SKIP;
+	  break;
+	default:
+	  overwrite_data.answer = TASK_ANSWER_CANCEL;
 	}
-      break;
+      overwrite_data.apply_to_all =
+	gtk_toggle_button_get_active (GTK_TOGGLE_BUTTON (checkbutton));
+      overwrite_data.done = TRUE;
+      g_cond_signal (&overwrite_data.cond);
     }
+  g_mutex_unlock (&overwrite_data.mutex);
 
   gtk_widget_destroy (dialog);
   dialog = NULL;
-
-  g_mutex_lock (&tasks.transfer.control.mutex);
-  g_cond_signal (&tasks.transfer.control.cond);
-  g_mutex_unlock (&tasks.transfer.control.mutex);
+  g_free (path);
 
   return FALSE;
 }
@@ -1452,121 +1461,126 @@ elektroid_close_progress_dialog (gpointer data)
   return FALSE;
 }
 
-static void
-elektroid_check_file_and_wait (gchar *path, struct browser *browser)
-{
-  struct backend *backend = browser->backend;
-  const struct fs_operations *fs_ops = browser->fs_ops;
-  if (fs_ops->file_exists && fs_ops->file_exists (backend, path))
-    {
-      switch (tasks.transfer.mode)
-	{
-	case TASK_MODE_ASK:
-	  g_idle_add (elektroid_close_progress_dialog, NULL);
-	  g_idle_add (elektroid_show_task_overwrite_dialog, path);
-	  g_cond_wait (&tasks.transfer.control.cond,
-		       &tasks.transfer.control.mutex);
-	  break;
-	case TASK_MODE_SKIP:
-	  tasks.transfer.status = TASK_STATUS_CANCELED;
-	  break;
-	}
-    }
-}
+//Called from a pipeline thread. The scheduler applies the answer to the whole batch if needed.
+//The ask might have been canceled even before starting it. The state is reset for the next ask once answered.
 
-static gpointer
-elektroid_upload_task_runner (gpointer data)
+static enum task_answer
+elektroid_ask_overwrite (struct scheduler *scheduler,
+			 const struct task *task, const gchar *path,
+			 gboolean *apply_to_all)
 {
-  gint res;
-  GByteArray *array;
-  gchar *dst_dir, *upload_path;
+  enum task_answer answer;
 
-  debug_print (1, "Local path: %s\n", tasks.transfer.src);
-  debug_print (1, "Remote path: %s\n", tasks.transfer.dst);
+  g_mutex_lock (&overwrite_data.mutex);
 
-  if (remote_browser.fs_ops->mkdir
-      && remote_browser.fs_ops->mkdir (remote_browser.backend,
-				       tasks.transfer.dst))
+  overwrite_data.id++;
+  if (!overwrite_data.done)
     {
-      error_print ("Error while creating remote %s dir\n",
-		   tasks.transfer.dst);
-      tasks.transfer.status = TASK_STATUS_COMPLETED_ERROR;
-      return NULL;
+      overwrite_data.path = strdup (path);
+      g_idle_add (elektroid_close_progress_dialog, NULL);
+      g_idle_add (elektroid_show_task_overwrite_dialog,
+		  GUINT_TO_POINTER (overwrite_data.id));
     }
 
-  array = g_byte_array_new ();
-  res =
-    tasks.transfer.fs_ops->load (tasks.transfer.src, array,
-				 &tasks.transfer.control);
-  if (res)
+  while (!overwrite_data.done)
     {
-      error_print ("Error while loading file\n");
-      tasks.transfer.status = TASK_STATUS_COMPLETED_ERROR;
-      goto end_cleanup;
+      g_cond_wait (&overwrite_data.cond, &overwrite_data.mutex);
     }
 
-  debug_print (1, "Writing from file %s (filesystem %s)...\n",
-	       tasks.transfer.src, tasks.transfer.fs_ops->name);
+  answer = overwrite_data.answer;
+  *apply_to_all = overwrite_data.apply_to_all;
 
-  if (remote_browser.fs_ops->options & FS_OPTION_SLOT_STORAGE)
+  overwrite_data.id++;
+  overwrite_data.done = FALSE;
+  g_free (overwrite_data.path);
+  overwrite_data.path = NULL;
+
+  g_mutex_unlock (&overwrite_data.mutex);
+
+  return answer;
+}
+
+//Called when canceling all the tasks or when stopping the tasks while an ask is pending. This might happen while the main loop is blocked so the dialog, if any, is not touched.
+
+static void
+elektroid_cancel_ask_overwrite (struct scheduler *scheduler)
+{
+  g_mutex_lock (&overwrite_data.mutex);
+  if (!overwrite_data.done)
     {
-      upload_path = strdup (tasks.transfer.dst);
+      overwrite_data.answer = TASK_ANSWER_SKIP;
+      overwrite_data.apply_to_all = FALSE;
+      overwrite_data.done = TRUE;
+      g_cond_signal (&overwrite_data.cond);
     }
-  else
+  g_mutex_unlock (&overwrite_data.mutex);
+}
+
+static void
+elektroid_complete_task (const struct task *task)
+{
+  gchar *dst_dir;
+
+  elektroid_check_backend ();
+
+  if (task->status != TASK_STATUS_COMPLETED_OK)
     {
-      upload_path = remote_browser.fs_ops->get_upload_path (&backend,
-							    remote_browser.fs_ops,
-							    tasks.
-							    transfer.dst,
-							    tasks.
-							    transfer.src);
-      g_mutex_lock (&tasks.transfer.control.mutex);
-      elektroid_check_file_and_wait (upload_path, &remote_browser);
-      g_mutex_unlock (&tasks.transfer.control.mutex);
-      if (tasks.transfer.status == TASK_STATUS_CANCELED)
-	{
-	  goto end_cleanup;
-	}
+      return;
     }
 
-  res =
-    tasks.transfer.fs_ops->upload (remote_browser.backend,
-				   upload_path, array,
-				   &tasks.transfer.control);
-  g_free (tasks.transfer.control.data);
-  tasks.transfer.control.data = NULL;
-  g_idle_add (elektroid_check_backend_bg, NULL);
-
-  if (res && tasks.transfer.control.active)
+  if (task->type == TASK_TYPE_UPLOAD)
     {
-      error_print ("Error while uploading\n");
-      tasks.transfer.status = TASK_STATUS_COMPLETED_ERROR;
+      dst_dir = g_path_get_dirname (task->path);
+      if (task->fs_ops == remote_browser.fs_ops &&
+	  !strncmp (dst_dir, remote_browser.dir,
+		    strlen (remote_browser.dir))
+	  && !(task->fs_ops->options & FS_OPTION_SINGLE_OP))
+	{
+	  g_idle_add (elektroid_load_remote_if_midi, &remote_browser);
+	}
+      g_free (dst_dir);
     }
   else
     {
-      g_mutex_lock (&tasks.transfer.control.mutex);
-      tasks.transfer.status = tasks.transfer.control.active ?
-	TASK_STATUS_COMPLETED_OK : TASK_STATUS_CANCELED;
-      g_mutex_unlock (&tasks.transfer.control.mutex);
+      g_idle_add (elektroid_load_local_if_no_notifier, &local_browser);
     }
+}
+
+//Called from the main loop every time a task changes.
 
-  dst_dir = g_path_get_dirname (upload_path);
-  if (!res && tasks.transfer.fs_ops == remote_browser.fs_ops &&
-      !strncmp (dst_dir, remote_browser.dir,
-		strlen (remote_browser.dir))
-      && !(tasks.transfer.fs_ops->options & FS_OPTION_SINGLE_OP))
+static void
+elektroid_task_changed (struct tasks *tasks, const struct task *task)
+{
+  switch (task->status)
     {
-      g_idle_add (elektroid_load_remote_if_midi, &remote_browser);
+    case TASK_STATUS_QUEUED:
+      break;
+    case TASK_STATUS_RUNNING:
+      if (remote_browser.fs_ops->options & FS_OPTION_SINGLE_OP)
+	{
+	  gtk_widget_set_sensitive (remote_box, FALSE);
+	}
+      gtk_widget_set_sensitive (ma_data.box, FALSE);
+      if (task->type == TASK_TYPE_UPLOAD)
+	{
+	  remote_browser.dirty = TRUE;
+	}
+      break;
+    default:
+      elektroid_complete_task (task);
     }
 
-  g_free (upload_path);
-  g_free (dst_dir);
+  if (scheduler_is_idle (&tasks->scheduler))
+    {
+      gtk_widget_set_sensitive (remote_box, TRUE);
 
-end_cleanup:
-  g_byte_array_free (array, TRUE);
-  g_idle_add (tasks_complete_current, &tasks);
-  g_idle_add (elektroid_run_next, NULL);
-  return NULL;
+      if ((remote_browser.fs_ops->options & FS_OPTION_SINGLE_OP)
+	  && remote_browser.dirty)
+	{
+	  remote_browser.dirty = FALSE;
+	  g_idle_add (elektroid_load_remote_if_midi, &remote_browser);
+	}
+    }
 }
 
 static void
@@ -1613,7 +1627,7 @@ elektroid_add_upload_task_path (const gchar *rel_path, const gchar *src_dir,
 	  upload_path = strdup (dst_abs_dir);
 	}
       tasks_add (&tasks, TASK_TYPE_UPLOAD, src_abs_path, upload_path,
-		 remote_browser.fs_ops->id, &backend);
+		 remote_browser.fs_ops->id, &backend, -1);
       g_free (upload_path);
       g_free (dst_abs_dir);
       g_free (dst_abs_path);
@@ -1641,9 +1655,8 @@ cleanup:
 static gpointer
 elektroid_add_upload_tasks_runner (gpointer userdata)
 {
-  GtkTreeIter iter;
   GList *selected_rows;
-  gboolean queued_before, queued_after, active;
+  gboolean active;
   GtkTreeModel *model;
   GtkTreeSelection *selection;
   guint64 start = g_get_monotonic_time ();
@@ -1655,8 +1668,7 @@ elektroid_add_upload_tasks_runner (gpointer userdata)
   selection =
     gtk_tree_view_get_selection (GTK_TREE_VIEW (local_browser.view));
 
-  queued_before = tasks_get_next_queued (&tasks, &iter, NULL, NULL, NULL,
-					 NULL, NULL, NULL);
+  tasks_new_batch (&tasks);
 
   selected_rows = gtk_tree_selection_get_selected_rows (selection, NULL);
   while (selected_rows)
@@ -1683,12 +1695,7 @@ elektroid_add_upload_tasks_runner (gpointer userdata)
     }
   g_list_free_full (selected_rows, (GDestroyNotify) gtk_tree_path_free);
 
-  queued_after = tasks_get_next_queued (&tasks, &iter, NULL, NULL, NULL,
-					NULL, NULL, NULL);
-  if (!queued_before && queued_after)
-    {
-      g_idle_add (elektroid_run_next, NULL);
-    }
+  tasks_run (&tasks);
 
   elektroid_usleep_since (MIN_TIME_UNTIL_DIALOG_RESPONSE, start);
   progress_response (GTK_RESPONSE_ACCEPT);
@@ -1710,101 +1717,10 @@ elektroid_add_upload_tasks (GtkWidget *object, gpointer data)
 		_("Waiting..."), NULL);
 }
 
-static gpointer
-elektroid_download_task_runner (gpointer userdata)
-{
-  gint res;
-  GByteArray *array;
-  gchar *dst_path;
-
-  debug_print (1, "Remote path: %s\n", tasks.transfer.src);
-  debug_print (1, "Local dir: %s\n", tasks.transfer.dst);
-
-  if (local_browser.fs_ops->mkdir (local_browser.backend, tasks.transfer.dst))
-    {
-      error_print ("Error while creating local %s dir\n", tasks.transfer.dst);
-      tasks.transfer.status = TASK_STATUS_COMPLETED_ERROR;
-      goto end_no_dir;
-    }
-
-  dst_path = remote_browser.fs_ops->get_download_path (&backend,
-						       remote_browser.fs_ops,
-						       tasks.transfer.dst,
-						       tasks.transfer.src,
-						       NULL);
-  g_mutex_lock (&tasks.transfer.control.mutex);
-  elektroid_check_file_and_wait (dst_path, &local_browser);
-  g_mutex_unlock (&tasks.transfer.control.mutex);
-
-  if (tasks.transfer.status == TASK_STATUS_CANCELED)
-    {
-      goto end_with_no_download;
-    }
-
-  array = g_byte_array_new ();
-  res = tasks.transfer.fs_ops->download (remote_browser.backend,
-					 tasks.transfer.src, array,
-					 &tasks.transfer.control);
-  g_idle_add (elektroid_check_backend_bg, NULL);
-
-  g_mutex_lock (&tasks.transfer.control.mutex);
-  if (res && tasks.transfer.control.active)
-    {
-      error_print ("Error while downloading\n");
-      tasks.transfer.status = TASK_STATUS_COMPLETED_ERROR;
-      goto end_with_download_error;
-    }
-
-  if (!tasks.transfer.control.active)
-    {
-      tasks.transfer.status = TASK_STATUS_CANCELED;
-      goto end_canceled_transfer;
-    }
-
-  if (!dst_path)
-    {
-      dst_path = remote_browser.fs_ops->get_download_path (&backend,
-							   remote_browser.fs_ops,
-							   tasks.transfer.dst,
-							   tasks.transfer.src,
-							   array);
-      elektroid_check_file_and_wait (dst_path, &local_browser);
-    }
-
-  if (tasks.transfer.status != TASK_STATUS_CANCELED)
-    {
-      debug_print (1, "Writing %d bytes to file %s (filesystem %s)...\n",
-		   array->len, dst_path, tasks.transfer.fs_ops->name);
-      res =
-	tasks.transfer.fs_ops->save (dst_path, array,
-				     &tasks.transfer.control);
-      if (!res)
-	{
-	  tasks.transfer.status = TASK_STATUS_COMPLETED_OK;
-	  g_idle_add (elektroid_load_local_if_no_notifier, &local_browser);
-	}
-    }
-  g_free (dst_path);
-
-end_canceled_transfer:
-  g_byte_array_free (array, TRUE);
-  g_free (tasks.transfer.control.data);
-  tasks.transfer.control.data = NULL;
-
-end_with_download_error:
-  g_mutex_unlock (&tasks.transfer.control.mutex);
-
-end_with_no_download:
-  g_idle_add (tasks_complete_current, &tasks);
-  g_idle_add (elektroid_run_next, NULL);
-
-end_no_dir:
-  return NULL;
-}
-
 static void
 elektroid_add_download_task_path (const gchar *rel_path,
-				  const gchar *src_dir, const gchar *dst_dir)
+				  const gchar *src_dir, const gchar *dst_dir,
+				  gint64 size)
 {
   gboolean active;
   struct item_iterator iter;
@@ -1834,7 +1750,7 @@ elektroid_add_download_task_path (const gchar *rel_path,
 
       gchar *dst_abs_dir = g_path_get_dirname (dst_abs_path);
       tasks_add (&tasks, TASK_TYPE_DOWNLOAD, src_abs_path, dst_abs_dir,
-		 remote_browser.fs_ops->id, &backend);
+		 remote_browser.fs_ops->id, &backend, size);
       g_free (dst_abs_dir);
       g_free (dst_abs_path);
       goto cleanup;
@@ -1844,7 +1760,8 @@ elektroid_add_download_task_path (const gchar *rel_path,
     {
       filename = get_filename (remote_browser.fs_ops->options, &iter.item);
       path = path_chain (PATH_INTERNAL, rel_path, filename);
-      elektroid_add_download_task_path (path, src_dir, dst_dir);
+      elektroid_add_download_task_path (path, src_dir, dst_dir,
+					iter.item.size);
       debug_print (1, "name: %s\n", filename);
       g_free (path);
       g_free (filename);
@@ -1859,9 +1776,8 @@ cleanup:
 static gpointer
 elektroid_add_download_tasks_runner (gpointer data)
 {
-  GtkTreeIter iter;
   GList *selected_rows;
-  gboolean queued_before, queued_after, active;
+  gboolean active;
   GtkTreeModel *model;
   GtkTreeSelection *selection;
   gint64 start = g_get_monotonic_time ();
@@ -1873,8 +1789,7 @@ elektroid_add_download_tasks_runner (gpointer data)
   selection =
     gtk_tree_view_get_selection (GTK_TREE_VIEW (remote_browser.view));
 
-  queued_before = tasks_get_next_queued (&tasks, &iter, NULL, NULL, NULL,
-					 NULL, NULL, NULL);
+  tasks_new_batch (&tasks);
 
   selected_rows = gtk_tree_selection_get_selected_rows (selection, NULL);
   while (selected_rows)
@@ -1888,7 +1803,7 @@ elektroid_add_download_tasks_runner (gpointer data)
       browser_set_item (model, &path_iter, &item);
       filename = get_filename (remote_browser.fs_ops->options, &item);
       elektroid_add_download_task_path (filename, remote_browser.dir,
-					local_browser.dir);
+					local_browser.dir, item.size);
       g_free (filename);
 
       g_mutex_lock (&sysex_transfer.mutex);
@@ -1904,12 +1819,7 @@ elektroid_add_download_tasks_runner (gpointer data)
     }
   g_list_free_full (selected_rows, (GDestroyNotify) gtk_tree_path_free);
 
-  queued_after = tasks_get_next_queued (&tasks, &iter, NULL, NULL, NULL,
-					NULL, NULL, NULL);
-  if (!queued_before && queued_after)
-    {
-      g_idle_add (elektroid_run_next, NULL);
-    }
+  tasks_run (&tasks);
 
   elektroid_usleep_since (MIN_TIME_UNTIL_DIALOG_RESPONSE, start);
   progress_response (GTK_RESPONSE_ACCEPT);
@@ -1931,12 +1841,6 @@ elektroid_add_download_tasks (GtkWidget *object, gpointer data)
 		_("Preparing Tasks"), _("Waiting..."), NULL);
 }
 
-static void
-elektroid_update_progress (struct job_control *control)
-{
-  g_idle_add (tasks_update_current_progress, &tasks);
-}
-
 static gboolean
 elektroid_common_key_press (GtkWidget *widget, GdkEventKey *event,
 			    gpointer data)
@@ -2260,6 +2164,8 @@ elektroid_set_device (GtkWidget *object, gpointer data)
       return;
     }
 
+  elektroid_wait_discovery ();
+
   elektroid_set_preferences_remote_dir ();
 
   if (backend_check (&backend))
@@ -2409,7 +2315,7 @@ elektroid_add_upload_task_slot (const gchar *name,
       dst_file_path = g_string_free (str, FALSE);
 
       tasks_add (&tasks, TASK_TYPE_UPLOAD, src_file_path, dst_file_path,
-		 remote_browser.fs_ops->id, &backend);
+		 remote_browser.fs_ops->id, &backend, -1);
     }
 }
 
@@ -2417,8 +2323,7 @@ static gpointer
 elektroid_dnd_received_runner_dialog (gpointer data, gboolean dialog)
 {
   gint64 start;
-  GtkTreeIter iter;
-  gboolean queued_before, queued_after, active;
+  gboolean active;
   struct elektroid_dnd_data *dnd_data = data;
   GtkWidget *widget = dnd_data->widget;
 
@@ -2430,8 +2335,7 @@ elektroid_dnd_received_runner_dialog (gpointer data, gboolean dialog)
       g_timeout_add (100, progress_pulse, NULL);
     }
 
-  queued_before = tasks_get_next_queued (&tasks, &iter, NULL, NULL, NULL,
-					 NULL, NULL, NULL);
+  tasks_new_batch (&tasks);
 
   for (gint i = 0; dnd_data->uris[i] != NULL; i++)
     {
@@ -2458,7 +2362,8 @@ elektroid_dnd_received_runner_dialog (gpointer data, gboolean dialog)
 	    }
 	  else if (!strcmp (dnd_data->type_name, TEXT_URI_LIST_ELEKTROID))
 	    {
-	      elektroid_add_download_task_path (name, dir, local_browser.dir);
+	      elektroid_add_download_task_path (name, dir, local_browser.dir,
+						-1);
 	    }
 	}
       else if (widget == GTK_WIDGET (remote_browser.view))
@@ -2487,12 +2392,7 @@ elektroid_dnd_received_runner_dialog (gpointer data, gboolean dialog)
     }
 
 end:
-  queued_after = tasks_get_next_queued (&tasks, &iter, NULL, NULL, NULL,
-					NULL, NULL, NULL);
-  if (!queued_before && queued_after)
-    {
-      g_idle_add (elektroid_run_next, NULL);
-    }
+  tasks_run (&tasks);
 
   if (dialog)
     {
@@ -2949,7 +2849,7 @@ elektroid_run (int argc, char *argv[])
   g_signal_connect (remote_browser.add_dir_button, "clicked",
 		    G_CALLBACK (elektroid_add_dir), &remote_browser);
   g_signal_connect (remote_browser.refresh_button, "clicked",
-		    G_CALLBACK (browser_refresh), &remote_browser);
+		    G_CALLBACK (browser_rescan), &remote_browser);
   g_signal_connect (remote_browser.search_button, "clicked",
 		    G_CALLBACK (browser_open_search), &remote_browser);
   g_signal_connect (remote_browser.search_entry, "stop-search",
@@ -3058,7 +2958,9 @@ elektroid_run (int argc, char *argv[])
   g_signal_connect (fs_combo, "changed", G_CALLBACK (elektroid_set_fs), NULL);
 
   editor_init (&editor, builder);
-  tasks_init (&tasks, builder);
+  tasks_init (&tasks, builder, &backend, elektroid_ask_overwrite,
+	      elektroid_cancel_ask_overwrite, elektroid_task_changed);
+  scheduler_set_policy (&tasks.scheduler, preferences.task_policy);
   progress_init (builder);
 
   g_object_set (G_OBJECT (show_remote_button), "active",
@@ -3083,11 +2985,23 @@ elektroid_run (int argc, char *argv[])
 
   gtk_main ();
 
+  elektroid_wait_discovery ();
+
   preferences.local_dir = local_browser.dir;
   elektroid_set_preferences_remote_dir ();
 
   if (backend_check (&backend))
     {
+      if (debug_level >= 1 && backend.type == BE_TYPE_MIDI)
+	{
+	  struct backend_stats stats;
+	  gchar *text;
+
+	  backend_stats_get (&backend, &stats);
+	  text = backend_stats_to_string (&stats);
+	  debug_print (1, "MIDI stats for %s:\n%s\n", backend.name, text);
+	  g_free (text);
+	}
       backend_destroy (&backend);
     }
 
@@ -3133,7 +3047,8 @@ int
 main (int argc, char *argv[])
 {
   gint opt, ret;
-  gchar *local_dir = NULL;
+  gchar *local_dir = NULL, *trace_path = NULL;
+  struct trace *trace = NULL;
   gint vflg = 0, dflg = 0, errflg = 0;
   int long_index = 0;
 
@@ -3148,7 +3063,7 @@ main (int argc, char *argv[])
   textdomain (PACKAGE);
 
   while ((opt =
-	  getopt_long (argc, argv, "l:vh", ELEKTROID_OPTIONS,
+	  getopt_long (argc, argv, "l:vt:h", ELEKTROID_OPTIONS,
 		       &long_index)) != -1)
     {
       switch (opt)
@@ -3160,6 +3075,9 @@ main (int argc, char *argv[])
 	case 'v':
 	  vflg++;
 	  break;
+	case 't':
+	  trace_path = optarg;
+	  break;
 	case 'h':
 	  elektroid_print_help (argv[0]);
 	  exit (EXIT_SUCCESS);
@@ -3194,10 +3112,34 @@ main (int argc, char *argv[])
     }
   editor.preferences = &preferences;
 
+  if (g_getenv (LOG_THREAD_ENV))
+    {
+      log_start_thread ();
+    }
+
+  //The trace is kept for every device connected during the session.
+  if (trace_path)
+    {
+      trace = trace_new (TRACE_DEFAULT_LEN);
+      backend.trace = trace;
+    }
+
   ret = elektroid_run (argc, argv);
 
+  if (trace)
+    {
+      backend.trace = NULL;
+      if (trace_save (trace, trace_path))
+	{
+	  error_print ("Error while saving trace to '%s'\n", trace_path);
+	}
+      trace_free (trace);
+    }
+
   preferences_save (&preferences);
   preferences_free (&preferences);
 
+  log_stop_thread ();
+
   return ret;
 }
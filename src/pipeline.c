@@ -0,0 +1,606 @@
+/*
+ *   pipeline.c
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include "pipeline.h"
+#include "local.h"
+#include "sample.h"
+
+struct task_transfer *
+task_transfer_new (enum task_type type, const gchar *src, const gchar *dst,
+		   const struct fs_operations *fs_ops, guint batch_id,
+		   guint mode)
+{
+  struct task_transfer *transfer = g_malloc0 (sizeof (struct task_transfer));
+
+  g_mutex_init (&transfer->control.mutex);
+  g_cond_init (&transfer->control.cond);
+  transfer->control.active = TRUE;
+  transfer->control.parts = 1000;	//Any reasonable high number is enough to make the progress monotonic.
+  transfer->control.part = 0;
+  transfer->type = type;
+  transfer->src = strdup (src);
+  transfer->dst = strdup (dst);
+  transfer->status = TASK_STATUS_RUNNING;
+  transfer->fs_ops = fs_ops;
+  transfer->batch_id = batch_id;
+  transfer->mode = mode;
+  transfer->stage = PIPELINE_STAGE_LOCAL_PRE;
+
+  return transfer;
+}
+
+void
+task_transfer_free (struct task_transfer *transfer)
+{
+  g_free (transfer->src);
+  g_free (transfer->dst);
+  g_free (transfer->path);
+  if (transfer->data)
+    {
+      g_byte_array_unref (transfer->data);
+    }
+  if (transfer->source)
+    {
+      sample_source_close (transfer->source);
+    }
+  g_free (transfer->control.data);
+  g_mutex_clear (&transfer->control.mutex);
+  g_cond_clear (&transfer->control.cond);
+  g_free (transfer);
+}
+
+static gboolean
+pipeline_is_active (struct task_transfer *transfer)
+{
+  gboolean active;
+  g_mutex_lock (&transfer->control.mutex);
+  active = transfer->control.active;
+  g_mutex_unlock (&transfer->control.mutex);
+  return active;
+}
+
+static void
+pipeline_set_status (struct task_transfer *transfer, gint err)
+{
+  g_mutex_lock (&transfer->control.mutex);
+  if (!transfer->control.active)
+    {
+      transfer->status = TASK_STATUS_CANCELED;
+    }
+  else
+    {
+      if (err)
+	{
+	  transfer->status = TASK_STATUS_COMPLETED_ERROR;
+	}
+      else if (transfer->control.deduplicated)
+	{
+	  transfer->status = TASK_STATUS_COMPLETED_DEDUPLICATED;
+	}
+      else
+	{
+	  transfer->status = TASK_STATUS_COMPLETED_OK;
+	}
+      transfer->err = err;
+    }
+  g_mutex_unlock (&transfer->control.mutex);
+}
+
+static void
+pipeline_finish (struct pipeline *pipeline, struct task_transfer *transfer)
+{
+  g_mutex_lock (&pipeline->mutex);
+  g_queue_remove (pipeline->transfers, transfer);
+  transfer->stage = PIPELINE_STAGE_DONE;
+  g_cond_broadcast (&pipeline->cond);
+  g_mutex_unlock (&pipeline->mutex);
+
+  debug_print (1, "Transfer %d finished with status %d\n", transfer->id,
+	       transfer->status);
+
+  //The data is not needed anymore and the callee might keep the transfer for a while.
+  if (transfer->data)
+    {
+      g_byte_array_unref (transfer->data);
+      transfer->data = NULL;
+    }
+
+  pipeline->done (pipeline, transfer);
+}
+
+static void
+pipeline_check_file (struct pipeline *pipeline,
+		     struct task_transfer *transfer, struct backend *backend,
+		     const struct fs_operations *fs_ops)
+{
+  if (!fs_ops->file_exists || !fs_ops->file_exists (backend, transfer->path))
+    {
+      return;
+    }
+
+  g_mutex_lock (&transfer->control.mutex);
+  switch (transfer->mode)
+    {
+    case TASK_MODE_ASK:
+      pipeline->ask (pipeline, transfer);
+      break;
+    case TASK_MODE_SKIP:
+      transfer->status = TASK_STATUS_CANCELED;
+      break;
+    }
+  g_mutex_unlock (&transfer->control.mutex);
+}
+
+static void
+pipeline_load (struct pipeline *pipeline, struct task_transfer *transfer)
+{
+  gint err = -ENOTSUP;
+  const struct fs_operations *fs_ops = transfer->fs_ops;
+
+  if (fs_ops->open_source && fs_ops->upload_source)
+    {
+      debug_print (1, "Opening file %s (filesystem %s)...\n",
+		   transfer->src, fs_ops->name);
+      err = fs_ops->open_source (transfer->src, &transfer->source,
+				 &transfer->control);
+    }
+
+  if (err == -ENOTSUP)
+    {
+      debug_print (1, "Loading file %s (filesystem %s)...\n",
+		   transfer->src, fs_ops->name);
+      transfer->data = g_byte_array_new ();
+      err = fs_ops->load (transfer->src, transfer->data, &transfer->control);
+    }
+
+  if (err)
+    {
+      if (pipeline_is_active (transfer))
+	{
+	  error_print ("Error while loading file\n");
+	}
+      pipeline_set_status (transfer, err);
+      pipeline_finish (pipeline, transfer);
+      return;
+    }
+
+  g_mutex_lock (&pipeline->mutex);
+  transfer->stage = PIPELINE_STAGE_READY;
+  g_cond_broadcast (&pipeline->cond);
+  g_mutex_unlock (&pipeline->mutex);
+}
+
+static void
+pipeline_save (struct pipeline *pipeline, struct task_transfer *transfer)
+{
+  gint err;
+
+  if (!transfer->path)
+    {
+      transfer->path =
+	transfer->fs_ops->get_download_path (pipeline->backend,
+					     transfer->fs_ops, transfer->dst,
+					     transfer->src, transfer->data);
+      if (!transfer->path)
+	{
+	  transfer->status = TASK_STATUS_COMPLETED_ERROR;
+	  transfer->err = -EINVAL;
+	  goto end;
+	}
+      pipeline_check_file (pipeline, transfer, NULL,
+			   &FS_LOCAL_GENERIC_OPERATIONS);
+    }
+
+  if (transfer->status != TASK_STATUS_CANCELED)
+    {
+      debug_print (1, "Writing %d bytes to file %s (filesystem %s)...\n",
+		   transfer->data->len, transfer->path,
+		   transfer->fs_ops->name);
+      err = transfer->fs_ops->save (transfer->path, transfer->data,
+				    &transfer->control);
+      if (err)
+	{
+	  error_print ("Error while saving file\n");
+	}
+      pipeline_set_status (transfer, err);
+    }
+
+end:
+  pipeline_finish (pipeline, transfer);
+}
+
+static void
+pipeline_local_runner (gpointer data, gpointer user_data)
+{
+  struct task_transfer *transfer = data;
+  struct pipeline *pipeline = user_data;
+
+  if (transfer->stage == PIPELINE_STAGE_LOCAL_PRE)
+    {
+      pipeline_load (pipeline, transfer);
+    }
+  else
+    {
+      pipeline_save (pipeline, transfer);
+    }
+}
+
+static void
+pipeline_upload (struct pipeline *pipeline, struct task_transfer *transfer)
+{
+  gint err;
+  const struct fs_operations *fs_ops = transfer->fs_ops;
+
+  debug_print (1, "Local path: %s\n", transfer->src);
+  debug_print (1, "Remote path: %s\n", transfer->dst);
+
+  err = fs_ops->mkdir ? fs_ops->mkdir (pipeline->backend, transfer->dst) : 0;
+  if (err)
+    {
+      error_print ("Error while creating remote %s dir\n", transfer->dst);
+      transfer->status = TASK_STATUS_COMPLETED_ERROR;
+      transfer->err = err;
+      return;
+    }
+
+  if (fs_ops->options & FS_OPTION_SLOT_STORAGE)
+    {
+      transfer->path = strdup (transfer->dst);
+    }
+  else
+    {
+      transfer->path = fs_ops->get_upload_path (pipeline->backend, fs_ops,
+						transfer->dst, transfer->src);
+      pipeline_check_file (pipeline, transfer, pipeline->backend, fs_ops);
+      if (transfer->status == TASK_STATUS_CANCELED)
+	{
+	  return;
+	}
+    }
+
+  debug_print (1, "Writing from file %s (filesystem %s)...\n",
+	       transfer->src, fs_ops->name);
+
+  backend_lock_op (pipeline->backend);
+  if (transfer->source)
+    {
+      err = fs_ops->upload_source (pipeline->backend, transfer->path,
+				   transfer->source, &transfer->control);
+    }
+  else
+    {
+      err = fs_ops->upload (pipeline->backend, transfer->path,
+			    transfer->data, &transfer->control);
+    }
+  backend_unlock_op (pipeline->backend);
+  if (err && pipeline_is_active (transfer))
+    {
+      error_print ("Error while uploading\n");
+    }
+  pipeline_set_status (transfer, err);
+}
+
+//Returns TRUE if the local stage needs to save the downloaded data.
+
+static gboolean
+pipeline_download (struct pipeline *pipeline, struct task_transfer *transfer)
+{
+  gint err;
+  const struct fs_operations *fs_ops = transfer->fs_ops;
+
+  debug_print (1, "Remote path: %s\n", transfer->src);
+  debug_print (1, "Local dir: %s\n", transfer->dst);
+
+  err = FS_LOCAL_GENERIC_OPERATIONS.mkdir (NULL, transfer->dst);
+  if (err)
+    {
+      error_print ("Error while creating local %s dir\n", transfer->dst);
+      transfer->status = TASK_STATUS_COMPLETED_ERROR;
+      transfer->err = err;
+      return FALSE;
+    }
+
+  transfer->path = fs_ops->get_download_path (pipeline->backend, fs_ops,
+					      transfer->dst, transfer->src,
+					      NULL);
+  if (transfer->path)
+    {
+      pipeline_check_file (pipeline, transfer, NULL,
+			   &FS_LOCAL_GENERIC_OPERATIONS);
+      if (transfer->status == TASK_STATUS_CANCELED)
+	{
+	  return FALSE;
+	}
+    }
+
+  //The device thread writes the file so there is nothing left for the local stage.
+  if (fs_ops->download_sink && transfer->path)
+    {
+      backend_lock_op (pipeline->backend);
+      err = fs_ops->download_sink (pipeline->backend, transfer->src,
+				   transfer->path, &transfer->control);
+      backend_unlock_op (pipeline->backend);
+      if (err && pipeline_is_active (transfer))
+	{
+	  error_print ("Error while downloading\n");
+	}
+      pipeline_set_status (transfer, err);
+      return FALSE;
+    }
+
+  transfer->data = g_byte_array_new ();
+  backend_lock_op (pipeline->backend);
+  err = fs_ops->download (pipeline->backend, transfer->src, transfer->data,
+			  &transfer->control);
+  backend_unlock_op (pipeline->backend);
+  if (err && pipeline_is_active (transfer))
+    {
+      error_print ("Error while downloading\n");
+    }
+
+  if (err || !pipeline_is_active (transfer))
+    {
+      pipeline_set_status (transfer, err);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+//Transfers are given to the device in order so a transfer waiting to be converted blocks the following ones.
+
+static struct task_transfer *
+pipeline_get_next_ready (struct pipeline *pipeline)
+{
+  for (GList *e = pipeline->transfers->head; e; e = e->next)
+    {
+      struct task_transfer *transfer = e->data;
+      if (transfer->stage == PIPELINE_STAGE_LOCAL_PRE)
+	{
+	  return NULL;
+	}
+      if (transfer->stage == PIPELINE_STAGE_READY)
+	{
+	  return transfer;
+	}
+    }
+  return NULL;
+}
+
+static gpointer
+pipeline_device_runner (gpointer data)
+{
+  gboolean save;
+  struct backend_stats stats;
+  struct task_transfer *transfer;
+  struct pipeline *pipeline = data;
+
+  g_mutex_lock (&pipeline->mutex);
+  while (1)
+    {
+      while (pipeline->running &&
+	     !(transfer = pipeline_get_next_ready (pipeline)))
+	{
+	  g_cond_wait (&pipeline->cond, &pipeline->mutex);
+	}
+
+      if (!pipeline->running)
+	{
+	  break;
+	}
+
+      transfer->stage = PIPELINE_STAGE_DEVICE;
+      g_mutex_unlock (&pipeline->mutex);
+
+      debug_print (1,
+		   "Running task type %d from %s to %s (filesystem %s)...\n",
+		   transfer->type, transfer->src, transfer->dst,
+		   transfer->fs_ops->name);
+
+      save = FALSE;
+      backend_stats_mark (pipeline->backend, &stats);
+      if (!pipeline_is_active (transfer))
+	{
+	  transfer->status = TASK_STATUS_CANCELED;
+	}
+      else if (transfer->type == TASK_TYPE_UPLOAD)
+	{
+	  pipeline_upload (pipeline, transfer);
+	}
+      else
+	{
+	  save = pipeline_download (pipeline, transfer);
+	}
+      backend_stats_get_since (pipeline->backend, &transfer->stats, &stats);
+
+      if (save)
+	{
+	  g_mutex_lock (&pipeline->mutex);
+	  transfer->stage = PIPELINE_STAGE_LOCAL_POST;
+	  g_mutex_unlock (&pipeline->mutex);
+	  g_thread_pool_push (pipeline->local_pool, transfer, NULL);
+	}
+      else
+	{
+	  pipeline_finish (pipeline, transfer);
+	}
+
+      g_mutex_lock (&pipeline->mutex);
+    }
+  g_mutex_unlock (&pipeline->mutex);
+
+  return NULL;
+}
+
+void
+pipeline_init (struct pipeline *pipeline, struct backend *backend,
+	       pipeline_ask_cb ask, pipeline_done_cb done, gpointer data)
+{
+  pipeline->backend = backend;
+  pipeline->ask = ask;
+  pipeline->done = done;
+  pipeline->data = data;
+  pipeline->transfers = g_queue_new ();
+  pipeline->running = TRUE;
+  g_mutex_init (&pipeline->mutex);
+  g_cond_init (&pipeline->cond);
+  pipeline->local_pool = g_thread_pool_new (pipeline_local_runner, pipeline,
+					    PIPELINE_LOCAL_WORKERS, FALSE,
+					    NULL);
+  pipeline->device_thread = g_thread_new ("pipeline_device",
+					  pipeline_device_runner, pipeline);
+}
+
+void
+pipeline_destroy (struct pipeline *pipeline)
+{
+  debug_print (1, "Stopping pipeline...\n");
+
+  pipeline_cancel_all (pipeline);
+
+  g_mutex_lock (&pipeline->mutex);
+  pipeline->running = FALSE;
+  g_cond_broadcast (&pipeline->cond);
+  g_mutex_unlock (&pipeline->mutex);
+
+  g_thread_join (pipeline->device_thread);
+  pipeline->device_thread = NULL;
+
+  //Waits for the local workers to finish.
+  g_thread_pool_free (pipeline->local_pool, FALSE, TRUE);
+  pipeline->local_pool = NULL;
+
+  //Only transfers waiting for the device might remain.
+  g_queue_free_full (pipeline->transfers,
+		     (GDestroyNotify) task_transfer_free);
+  pipeline->transfers = NULL;
+
+  g_mutex_clear (&pipeline->mutex);
+  g_cond_clear (&pipeline->cond);
+}
+
+//Returns -EAGAIN if the pipeline is full.
+
+gint
+pipeline_submit (struct pipeline *pipeline, struct task_transfer *transfer)
+{
+  g_mutex_lock (&pipeline->mutex);
+
+  if (g_queue_get_length (pipeline->transfers) >= PIPELINE_MAX_TRANSFERS)
+    {
+      g_mutex_unlock (&pipeline->mutex);
+      return -EAGAIN;
+    }
+
+  transfer->pipeline = pipeline;
+  g_queue_push_tail (pipeline->transfers, transfer);
+
+  //Uploads might be loaded beforehand (e.g., when the same data is uploaded to several devices).
+  if (transfer->type == TASK_TYPE_UPLOAD && transfer->fs_ops->load
+      && !transfer->data)
+    {
+      transfer->stage = PIPELINE_STAGE_LOCAL_PRE;
+      g_thread_pool_push (pipeline->local_pool, transfer, NULL);
+    }
+  else
+    {
+      transfer->stage = PIPELINE_STAGE_READY;
+      g_cond_broadcast (&pipeline->cond);
+    }
+
+  g_mutex_unlock (&pipeline->mutex);
+
+  return 0;
+}
+
+gboolean
+pipeline_is_full (struct pipeline *pipeline)
+{
+  gboolean full;
+  g_mutex_lock (&pipeline->mutex);
+  full = g_queue_get_length (pipeline->transfers) >= PIPELINE_MAX_TRANSFERS;
+  g_mutex_unlock (&pipeline->mutex);
+  return full;
+}
+
+gboolean
+pipeline_is_empty (struct pipeline *pipeline)
+{
+  gboolean empty;
+  g_mutex_lock (&pipeline->mutex);
+  empty = g_queue_is_empty (pipeline->transfers);
+  g_mutex_unlock (&pipeline->mutex);
+  return empty;
+}
+
+static void
+pipeline_cancel_transfer (struct task_transfer *transfer)
+{
+  g_mutex_lock (&transfer->control.mutex);
+  transfer->control.active = FALSE;
+  g_mutex_unlock (&transfer->control.mutex);
+}
+
+void
+pipeline_cancel_all (struct pipeline *pipeline)
+{
+  g_mutex_lock (&pipeline->mutex);
+  for (GList *e = pipeline->transfers->head; e; e = e->next)
+    {
+      pipeline_cancel_transfer (e->data);
+    }
+  g_mutex_unlock (&pipeline->mutex);
+}
+
+void
+pipeline_cancel_batch (struct pipeline *pipeline, guint batch_id)
+{
+  g_mutex_lock (&pipeline->mutex);
+  for (GList *e = pipeline->transfers->head; e; e = e->next)
+    {
+      struct task_transfer *transfer = e->data;
+      if (transfer->batch_id == batch_id)
+	{
+	  pipeline_cancel_transfer (transfer);
+	}
+    }
+  g_mutex_unlock (&pipeline->mutex);
+}
+
+//Transfers already admitted must follow the choices the user makes for the remaining ones in the batch.
+
+void
+pipeline_set_batch_mode (struct pipeline *pipeline, guint batch_id,
+			 enum task_mode mode)
+{
+  g_mutex_lock (&pipeline->mutex);
+  for (GList *e = pipeline->transfers->head; e; e = e->next)
+    {
+      struct task_transfer *transfer = e->data;
+      if (transfer->batch_id == batch_id)
+	{
+	  g_mutex_lock (&transfer->control.mutex);
+	  transfer->mode = mode;
+	  g_mutex_unlock (&transfer->control.mutex);
+	}
+    }
+  g_mutex_unlock (&pipeline->mutex);
+}
@@ -0,0 +1,137 @@
+/*
+ *   pipeline.h
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "backend.h"
+
+//Threads running the local stage (loading, converting and saving).
+#define PIPELINE_LOCAL_WORKERS 2
+//Max amount of transfers admitted and not finished. This bounds the memory used by the uploads already converted and waiting for the device.
+#define PIPELINE_MAX_TRANSFERS 3
+
+enum task_status
+{
+  TASK_STATUS_QUEUED,
+  TASK_STATUS_RUNNING,
+  TASK_STATUS_COMPLETED_OK,
+  TASK_STATUS_COMPLETED_ERROR,
+  TASK_STATUS_CANCELED,
+  TASK_STATUS_COMPLETED_DEDUPLICATED	//The content was already in the destination.
+};
+
+enum task_mode
+{
+  TASK_MODE_ASK,
+  TASK_MODE_REPLACE,
+  TASK_MODE_SKIP
+};
+
+enum task_type
+{
+  TASK_TYPE_UPLOAD,
+  TASK_TYPE_DOWNLOAD
+};
+
+enum pipeline_stage
+{
+  PIPELINE_STAGE_LOCAL_PRE,	//Loading and converting before an upload.
+  PIPELINE_STAGE_READY,		//Waiting for the device.
+  PIPELINE_STAGE_DEVICE,
+  PIPELINE_STAGE_LOCAL_POST,	//Saving after a download.
+  PIPELINE_STAGE_DONE
+};
+
+struct pipeline;
+
+//As the control is the first member, a pointer to it is also a pointer to the transfer.
+
+struct task_transfer
+{
+  struct job_control control;
+  guint id;
+  enum task_type type;
+  gchar *src;			//Contains a path to a file
+  gchar *dst;			//Contains a path to a file
+  enum task_status status;	//Contains the final status
+  gint err;			//Contains the error if the status is TASK_STATUS_COMPLETED_ERROR
+  const struct fs_operations *fs_ops;	//Contains the fs_operations to use in this transfer
+  guint mode;
+  guint batch_id;
+  enum pipeline_stage stage;
+  GByteArray *data;		//Contains the loaded or downloaded resource. It might be shared with other transfers.
+  struct sample_source *source;	//Contains the source to upload from if the filesystem reads it while uploading.
+  gchar *path;			//Contains the actual upload or download path once known
+  struct backend_stats stats;	//Contains the MIDI traffic of the transfer once run by the device
+  struct pipeline *pipeline;	//Contains the pipeline running the transfer once submitted
+  gpointer user_data;		//Contains the caller data
+};
+
+//Called from a pipeline thread with the transfer control mutex held when the destination exists and the mode is TASK_MODE_ASK.
+//It must not return until the mode or the status of the transfer have been decided.
+typedef void (*pipeline_ask_cb) (struct pipeline *, struct task_transfer *);
+
+//Called from a pipeline thread once the transfer has finished. The ownership of the transfer is passed to the callee.
+typedef void (*pipeline_done_cb) (struct pipeline *, struct task_transfer *);
+
+//Uploads are loaded and converted (or just opened if the filesystem implements open_source) in a pool of local workers while the device thread, which is the only one accessing the backend, runs the previous transfer.
+//Downloads are saved by the local workers while the next transfer is already using the device unless the filesystem writes them while receiving them.
+//The device runs the transfers in the same order they were submitted.
+
+struct pipeline
+{
+  struct backend *backend;
+  GThreadPool *local_pool;
+  GThread *device_thread;
+  GMutex mutex;
+  GCond cond;
+  GQueue *transfers;		//Admitted and not finished transfers in submission order.
+  gboolean running;
+  pipeline_ask_cb ask;
+  pipeline_done_cb done;
+  gpointer data;
+};
+
+struct task_transfer *task_transfer_new (enum task_type, const gchar *,
+					 const gchar *,
+					 const struct fs_operations *, guint,
+					 guint);
+
+void task_transfer_free (struct task_transfer *);
+
+void pipeline_init (struct pipeline *, struct backend *, pipeline_ask_cb,
+		    pipeline_done_cb, gpointer);
+
+void pipeline_destroy (struct pipeline *);
+
+gint pipeline_submit (struct pipeline *, struct task_transfer *);
+
+gboolean pipeline_is_full (struct pipeline *);
+
+gboolean pipeline_is_empty (struct pipeline *);
+
+void pipeline_cancel_all (struct pipeline *);
+
+void pipeline_cancel_batch (struct pipeline *, guint);
+
+void pipeline_set_batch_mode (struct pipeline *, guint, enum task_mode);
+
+#endif
@@ -23,6 +23,7 @@
 #include <json-glib/json-glib.h>
 #include "preferences.h"
 #include "utils.h"
+#include "scheduler.h"
 
 #define PREFERENCES_FILE "/preferences.json"
 
@@ -33,6 +34,7 @@
 #define MEMBER_SHOW_REMOTE "showRemote"
 #define MEMBER_SHOW_GRID "showGrid"
 #define MEMBER_GRID_LENGTH "gridLength"
+#define MEMBER_TASK_POLICY "taskPolicy"
 
 #define DEFAULT_GRID_LENGHT 16
 
@@ -84,6 +86,9 @@ preferences_save (struct preferences *preferences)
   json_builder_set_member_name (builder, MEMBER_GRID_LENGTH);
   json_builder_add_int_value (builder, preferences->grid_length);
 
+  json_builder_set_member_name (builder, MEMBER_TASK_POLICY);
+  json_builder_add_int_value (builder, preferences->task_policy);
+
   json_builder_end_object (builder);
 
   gen = json_generator_new ();
@@ -126,6 +131,7 @@ preferences_load (struct preferences *preferences)
       preferences->remote_dir = get_user_dir (NULL);
       preferences->show_grid = FALSE;
       preferences->grid_length = DEFAULT_GRID_LENGHT;
+      preferences->task_policy = SCHEDULER_POLICY_FIFO;
       return 0;
     }
 
@@ -213,6 +219,21 @@ preferences_load (struct preferences *preferences)
     }
   json_reader_end_member (reader);
 
+  if (json_reader_read_member (reader, MEMBER_TASK_POLICY))
+    {
+      preferences->task_policy = json_reader_get_int_value (reader);
+      if (preferences->task_policy < SCHEDULER_POLICY_FIFO ||
+	  preferences->task_policy > SCHEDULER_POLICY_GROUP_BY_DIR)
+	{
+	  preferences->task_policy = SCHEDULER_POLICY_FIFO;
+	}
+    }
+  else
+    {
+      preferences->task_policy = SCHEDULER_POLICY_FIFO;
+    }
+  json_reader_end_member (reader);
+
   g_object_unref (reader);
   g_object_unref (parser);
 
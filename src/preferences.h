@@ -32,6 +32,7 @@ struct preferences
   gchar *remote_dir;
   gboolean show_grid;
   gint grid_length;
+  gint task_policy;
 };
 
 gint preferences_save (struct preferences *);
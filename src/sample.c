@@ -151,6 +151,79 @@ static SF_VIRTUAL_IO G_BYTE_ARRAY_IO = {
   .tell = tell_byte_array_io
 };
 
+//Read only access to a mapped file.
+
+struct mapped_file_io_data
+{
+  const guint8 *data;
+  sf_count_t len;
+  sf_count_t pos;
+};
+
+static sf_count_t
+get_filelen_mapped_file_io (void *user_data)
+{
+  struct mapped_file_io_data *data = user_data;
+  return data->len;
+}
+
+static sf_count_t
+seek_mapped_file_io (sf_count_t offset, int whence, void *user_data)
+{
+  struct mapped_file_io_data *data = user_data;
+  switch (whence)
+    {
+    case SEEK_SET:
+      data->pos = offset;
+      break;
+    case SEEK_CUR:
+      data->pos = data->pos + offset;
+      break;
+    case SEEK_END:
+      data->pos = data->len + offset;
+      break;
+    default:
+      break;
+    };
+
+  data->pos = CLAMP (data->pos, 0, data->len);
+  return data->pos;
+}
+
+static sf_count_t
+read_mapped_file_io (void *ptr, sf_count_t count, void *user_data)
+{
+  struct mapped_file_io_data *data = user_data;
+  if (data->pos + count > data->len)
+    {
+      count = data->len - data->pos;
+    }
+  memcpy (ptr, data->data + data->pos, count);
+  data->pos += count;
+  return count;
+}
+
+static sf_count_t
+write_mapped_file_io (const void *ptr, sf_count_t count, void *user_data)
+{
+  return 0;
+}
+
+static sf_count_t
+tell_mapped_file_io (void *user_data)
+{
+  struct mapped_file_io_data *data = user_data;
+  return data->pos;
+}
+
+static SF_VIRTUAL_IO MAPPED_FILE_IO = {
+  .get_filelen = get_filelen_mapped_file_io,
+  .seek = seek_mapped_file_io,
+  .read = read_mapped_file_io,
+  .write = write_mapped_file_io,
+  .tell = tell_mapped_file_io
+};
+
 static sf_count_t
 get_filelen_file_io (void *user_data)
 {
@@ -200,38 +273,30 @@ static SF_VIRTUAL_IO FILE_IO = {
   .tell = tell_file_io
 };
 
-static gint
-sample_get_audio_file_data (GByteArray *sample, struct job_control *control,
-			    struct g_byte_array_io_data *wave, guint32 format)
+static void
+sample_init_sf_info (SF_INFO *sf_info, GByteArray *sample,
+		     struct sample_info *sample_info, guint32 format)
 {
-  SF_INFO sf_info;
-  SNDFILE *sndfile;
-  sf_count_t frames, total;
-  struct SF_CHUNK_INFO junk_chunk_info;
-  struct SF_CHUNK_INFO smpl_chunk_info;
-  struct smpl_chunk_data smpl_chunk_data;
-  struct sample_info *sample_info = control->data;
-
-  g_byte_array_set_size (wave->array, sample->len + 4096);	//We need space for the headers.
-  wave->array->len = 0;
-
-  frames = sample->len / SAMPLE_INFO_FRAME_SIZE (sample_info);
   debug_print (1, "Frames: %" PRIu64 "; sample rate: %d; channels: %d\n",
-	       frames, sample_info->rate, sample_info->channels);
+	       (guint64) (sample->len / SAMPLE_INFO_FRAME_SIZE (sample_info)),
+	       sample_info->rate, sample_info->channels);
   debug_print (1, "Loop start at %d; loop end at %d\n",
 	       sample_info->loop_start, sample_info->loop_end);
 
-  memset (&sf_info, 0, sizeof (sf_info));
-  sf_info.samplerate = sample_info->rate;
-  sf_info.channels = sample_info->channels;
-  sf_info.format = format;
+  memset (sf_info, 0, sizeof (SF_INFO));
+  sf_info->samplerate = sample_info->rate;
+  sf_info->channels = sample_info->channels;
+  sf_info->format = format;
+}
 
-  sndfile = sf_open_virtual (&G_BYTE_ARRAY_IO, SFM_WRITE, &sf_info, wave);
-  if (!sndfile)
-    {
-      error_print ("%s\n", sf_strerror (sndfile));
-      return -1;
-    }
+//Chunks must be set before writing any frame.
+
+static void
+sample_set_chunks (SNDFILE *sndfile, struct sample_info *sample_info)
+{
+  struct SF_CHUNK_INFO junk_chunk_info;
+  struct SF_CHUNK_INFO smpl_chunk_info;
+  struct smpl_chunk_data smpl_chunk_data;
 
   strcpy (junk_chunk_info.id, JUNK_CHUNK_ID);
   junk_chunk_info.id_size = strlen (JUNK_CHUNK_ID);
@@ -266,24 +331,45 @@ sample_get_audio_file_data (GByteArray *sample, struct job_control *control,
     {
       error_print ("%s\n", sf_strerror (sndfile));
     }
+}
 
-  if ((sample_info->format & SF_FORMAT_SUBMASK) == SF_FORMAT_PCM_16)
+static sf_count_t
+sample_writef (SNDFILE *sndfile, guint32 format, void *data,
+	       sf_count_t frames)
+{
+  if ((format & SF_FORMAT_SUBMASK) == SF_FORMAT_PCM_16)
     {
-      total = sf_writef_short (sndfile, (gint16 *) sample->data, frames);
+      return sf_writef_short (sndfile, (gint16 *) data, frames);
     }
-  else if ((sample_info->format & SF_FORMAT_SUBMASK) == SF_FORMAT_FLOAT)
+  else if ((format & SF_FORMAT_SUBMASK) == SF_FORMAT_FLOAT)
     {
-      total = sf_writef_float (sndfile, (gfloat *) sample->data, frames);
+      return sf_writef_float (sndfile, (gfloat *) data, frames);
     }
-  else if ((sample_info->format & SF_FORMAT_SUBMASK) == SF_FORMAT_PCM_32)
+  else if ((format & SF_FORMAT_SUBMASK) == SF_FORMAT_PCM_32)
     {
-      total = sf_writef_int (sndfile, (gint32 *) sample->data, frames);
+      return sf_writef_int (sndfile, (gint32 *) data, frames);
     }
   else
     {
       error_print ("Invalid sample format. Using short...\n");
-      total = sf_writef_short (sndfile, (gint16 *) sample->data, frames);
+      return sf_writef_short (sndfile, (gint16 *) data, frames);
     }
+}
+
+//Writes the chunks and the frames and closes the file.
+
+static gint
+sample_write_audio_file_data (GByteArray *sample,
+			      struct job_control *control, SNDFILE *sndfile)
+{
+  sf_count_t frames, total;
+  struct sample_info *sample_info = control->data;
+
+  frames = sample->len / SAMPLE_INFO_FRAME_SIZE (sample_info);
+
+  sample_set_chunks (sndfile, sample_info);
+
+  total = sample_writef (sndfile, sample_info->format, sample->data, frames);
 
   sf_close (sndfile);
 
@@ -297,6 +383,28 @@ sample_get_audio_file_data (GByteArray *sample, struct job_control *control,
   return 0;
 }
 
+static gint
+sample_get_audio_file_data (GByteArray *sample, struct job_control *control,
+			    struct g_byte_array_io_data *wave, guint32 format)
+{
+  SF_INFO sf_info;
+  SNDFILE *sndfile;
+
+  g_byte_array_set_size (wave->array, sample->len + 4096);	//We need space for the headers.
+  wave->array->len = 0;
+
+  sample_init_sf_info (&sf_info, sample, control->data, format);
+
+  sndfile = sf_open_virtual (&G_BYTE_ARRAY_IO, SFM_WRITE, &sf_info, wave);
+  if (!sndfile)
+    {
+      error_print ("%s\n", sf_strerror (sndfile));
+      return -1;
+    }
+
+  return sample_write_audio_file_data (sample, control, sndfile);
+}
+
 gint
 sample_get_audio_file_data_from_array (GByteArray *sample, GByteArray *wave,
 				       struct job_control *control,
@@ -308,19 +416,43 @@ sample_get_audio_file_data_from_array (GByteArray *sample, GByteArray *wave,
   return sample_get_audio_file_data (sample, control, &data, format);
 }
 
+//The file is written directly without an intermediate copy in memory and only replaces the destination once completely written.
+
 gint
 sample_save_to_file (const gchar *path, GByteArray *sample,
 		     struct job_control *control, guint32 format)
 {
-  GByteArray *wave = g_byte_array_new ();
-  gint ret = sample_get_audio_file_data_from_array (sample, wave, control,
-						    format);
-  if (!ret)
+  gint err;
+  SF_INFO sf_info;
+  SNDFILE *sndfile;
+  struct atomic_file file;
+
+  sample_init_sf_info (&sf_info, sample, control->data, format);
+
+  debug_print (1, "Saving file %s...\n", path);
+
+  //The headers and the chunks take less than 4 KiB.
+  err = atomic_file_open (&file, path, sample->len + 4096);
+  if (err)
+    {
+      return err;
+    }
+
+  sndfile = sf_open_fd (file.fd, SFM_WRITE, &sf_info, FALSE);
+  if (!sndfile)
+    {
+      error_print ("%s\n", sf_strerror (sndfile));
+      atomic_file_abort (&file);
+      return -EIO;
+    }
+
+  if (sample_write_audio_file_data (sample, control, sndfile))
     {
-      ret = save_file (path, wave, control);
+      atomic_file_abort (&file);
+      return -EIO;
     }
-  g_byte_array_free (wave, TRUE);
-  return ret;
+
+  return atomic_file_commit (&file);
 }
 
 static void
@@ -427,6 +559,77 @@ audio_mono_to_stereo_int (gint32 *input, gint32 *output, gint size)
     }
 }
 
+static sf_count_t
+sample_readf (SNDFILE *sndfile, guint32 format, void *buffer,
+	      sf_count_t frames)
+{
+  if (format == SF_FORMAT_FLOAT)
+    {
+      return sf_readf_float (sndfile, (gfloat *) buffer, frames);
+    }
+  else if (format == SF_FORMAT_PCM_32)
+    {
+      return sf_readf_int (sndfile, (gint32 *) buffer, frames);
+    }
+  else
+    {
+      return sf_readf_short (sndfile, (gint16 *) buffer, frames);
+    }
+}
+
+//Returns the buffer containing the frames with the destination channels.
+
+static void *
+sample_convert_channels (void *buffer_input_multi, void *buffer_input_mono,
+			 void *buffer_input_stereo, gint frames,
+			 gint channels_src, struct sample_info *sample_info_dst)
+{
+  if (sample_info_dst->channels == channels_src)
+    {
+      return buffer_input_multi;
+    }
+
+  if (sample_info_dst->format == SF_FORMAT_FLOAT)
+    {
+      audio_multichannel_to_mono_float (buffer_input_multi,
+					buffer_input_mono, frames,
+					channels_src);
+    }
+  else if (sample_info_dst->format == SF_FORMAT_PCM_32)
+    {
+      audio_multichannel_to_mono_int (buffer_input_multi, buffer_input_mono,
+				      frames, channels_src);
+    }
+  else
+    {
+      audio_multichannel_to_mono_short (buffer_input_multi,
+					buffer_input_mono, frames,
+					channels_src);
+    }
+
+  if (sample_info_dst->channels == 1)
+    {
+      return buffer_input_mono;
+    }
+
+  if (sample_info_dst->format == SF_FORMAT_FLOAT)
+    {
+      audio_mono_to_stereo_float (buffer_input_mono, buffer_input_stereo,
+				  frames);
+    }
+  else if (sample_info_dst->format == SF_FORMAT_PCM_32)
+    {
+      audio_mono_to_stereo_int (buffer_input_mono, buffer_input_stereo,
+				frames);
+    }
+  else
+    {
+      audio_mono_to_stereo_short (buffer_input_mono, buffer_input_stereo,
+				  frames);
+    }
+  return buffer_input_stereo;
+}
+
 static void
 sample_set_sample_info (struct sample_info *sample_info, SNDFILE *sndfile,
 			SF_INFO *sf_info)
@@ -535,6 +738,20 @@ sample_check_and_fix_loop_points (struct sample_info *sample_info)
     }
 }
 
+static inline void
+sample_load_set_progress (struct job_control *control, gdouble p,
+			  sample_load_cb cb, gpointer cb_data)
+{
+  if (cb)
+    {
+      cb (control, p, cb_data);
+    }
+  else
+    {
+      set_job_control_progress (control, p);
+    }
+}
+
 // If control->data is NULL, then a new struct sample_info * is created and control->data points to it.
 // In case of failure, if control->data is NULL is freed.
 
@@ -693,79 +910,16 @@ sample_load_raw (void *data, SF_VIRTUAL_IO *sf_virtual_io,
       debug_print (2, "Loading %d channels buffer...\n",
 		   sample_info_dst->channels);
 
-      if (sample_info_dst->format == SF_FORMAT_FLOAT)
-	{
-	  frames_read = sf_readf_float (sndfile,
-					(gfloat *) buffer_input_multi,
-					LOAD_BUFFER_LEN);
-	}
-      else if (sample_info_dst->format == SF_FORMAT_PCM_32)
-	{
-	  frames_read = sf_readf_int (sndfile,
-				      (gint32 *) buffer_input_multi,
-				      LOAD_BUFFER_LEN);
-	}
-      else
-	{
-	  frames_read = sf_readf_short (sndfile,
-					(gint16 *) buffer_input_multi,
-					LOAD_BUFFER_LEN);
-	}
+      frames_read = sample_readf (sndfile, sample_info_dst->format,
+				  buffer_input_multi, LOAD_BUFFER_LEN);
       f += frames_read;
 
-      if (sample_info_dst->channels == sample_info_src->channels)
-	{
-	  buffer_input = buffer_input_multi;
-	}
-      else
-	{
-	  if (sample_info_dst->format == SF_FORMAT_FLOAT)
-	    {
-	      audio_multichannel_to_mono_float (buffer_input_multi,
-						buffer_input_mono,
-						frames_read,
-						sample_info_src->channels);
-	    }
-	  else if (sample_info_dst->format == SF_FORMAT_PCM_32)
-	    {
-	      audio_multichannel_to_mono_int (buffer_input_multi,
+      buffer_input = sample_convert_channels (buffer_input_multi,
 					      buffer_input_mono,
-					      frames_read,
-					      sample_info_src->channels);
-	    }
-	  else
-	    {
-	      audio_multichannel_to_mono_short (buffer_input_multi,
-						buffer_input_mono,
-						frames_read,
-						sample_info_src->channels);
-	    }
-	  if (sample_info_dst->channels == 1)
-	    {
-	      buffer_input = buffer_input_mono;
-	    }
-	  else
-	    {
-	      if (sample_info_dst->format == SF_FORMAT_FLOAT)
-		{
-		  audio_mono_to_stereo_float (buffer_input_mono,
 					      buffer_input_stereo,
-					      frames_read);
-		}
-	      else if (sample_info_dst->format == SF_FORMAT_PCM_32)
-		{
-		  audio_mono_to_stereo_int (buffer_input_mono,
-					    buffer_input_stereo, frames_read);
-		}
-	      else
-		{
-		  audio_mono_to_stereo_short (buffer_input_mono,
-					      buffer_input_stereo,
-					      frames_read);
-		}
-	      buffer_input = buffer_input_stereo;
-	    }
-	}
+					      frames_read,
+					      sample_info_src->channels,
+					      sample_info_dst);
 
       if (sample_info_dst->rate == sample_info_src->rate)
 	{
@@ -841,7 +995,8 @@ sample_load_raw (void *data, SF_VIRTUAL_IO *sf_virtual_io,
       if (control)
 	{
 	  g_mutex_lock (&control->mutex);
-	  cb (control, f * 1.0 / sample_info_src->frames, cb_data);
+	  sample_load_set_progress (control, f * 1.0 / sample_info_src->frames,
+				    cb, cb_data);
 	  active = control->active;
 	  g_mutex_unlock (&control->mutex);
 	}
@@ -892,7 +1047,7 @@ cleanup:
 	{
 	  if (!control->active)
 	    {
-	      cb (control, 1.0, cb_data);
+	      sample_load_set_progress (control, 1.0, cb, cb_data);
 	    }
 	  g_mutex_unlock (&control->mutex);
 	}
@@ -917,8 +1072,7 @@ sample_load_from_array (GByteArray *wave, GByteArray *sample,
   data.pos = 0;
   data.array = wave;
   return sample_load_raw (&data, &G_BYTE_ARRAY_IO, control, sample,
-			  sample_info_dst, set_job_control_progress_no_sync,
-			  NULL);
+			  sample_info_dst, NULL, NULL);
 }
 
 gint
@@ -927,14 +1081,21 @@ sample_load_from_file_with_cb (const gchar *path, GByteArray *sample,
 			       struct sample_info *sample_info_dst,
 			       sample_load_cb cb, gpointer cb_data)
 {
-  FILE *file = fopen (path, "rb");
+  gint err;
+  struct mapped_file_io_data data;
+  GMappedFile *file = g_mapped_file_new (path, FALSE, NULL);
+
   if (!file)
     {
-      return -errno;
+      return g_file_test (path, G_FILE_TEST_EXISTS) ? -EIO : -ENOENT;
     }
-  gint err = sample_load_raw (file, &FILE_IO, control, sample,
-			      sample_info_dst, cb, cb_data);
-  fclose (file);
+
+  data.data = (guint8 *) g_mapped_file_get_contents (file);
+  data.len = g_mapped_file_get_length (file);
+  data.pos = 0;
+  err = sample_load_raw (&data, &MAPPED_FILE_IO, control, sample,
+			 sample_info_dst, cb, cb_data);
+  g_mapped_file_unref (file);
   return err;
 }
 
@@ -944,9 +1105,181 @@ sample_load_from_file (const gchar *path, GByteArray *sample,
 		       struct sample_info *sample_info_dst)
 {
   return sample_load_from_file_with_cb (path, sample, control,
-					sample_info_dst,
-					set_job_control_progress_no_sync,
-					NULL);
+					sample_info_dst, NULL, NULL);
+}
+
+struct sample_source
+{
+  GMappedFile *file;
+  struct mapped_file_io_data io;
+  SNDFILE *sndfile;
+  gint channels;		//Channels in the file.
+  struct sample_info sample_info;	//Converted sample.
+  guint32 frame;		//Next frame to read.
+  void *buffer_input_multi;
+  void *buffer_input_mono;
+  void *buffer_input_stereo;
+};
+
+void
+sample_source_close (struct sample_source *source)
+{
+  if (source->sndfile)
+    {
+      sf_close (source->sndfile);
+    }
+  g_mapped_file_unref (source->file);
+  g_free (source->buffer_input_multi);
+  g_free (source->buffer_input_mono);
+  g_free (source->buffer_input_stereo);
+  g_free (source);
+}
+
+//The amount of frames needs to be known before reading them so it returns -ENOTSUP if the file needs to be resampled.
+
+gint
+sample_source_open (const gchar *path, struct sample_info *sample_info_dst,
+		    struct sample_source **source)
+{
+  SF_INFO sf_info;
+  guint bytes_per_sample;
+  struct sample_info sample_info_src;
+  struct sample_source *s;
+  GMappedFile *file = g_mapped_file_new (path, FALSE, NULL);
+
+  if (!file)
+    {
+      return g_file_test (path, G_FILE_TEST_EXISTS) ? -EIO : -ENOENT;
+    }
+
+  s = g_malloc0 (sizeof (struct sample_source));
+  s->file = file;
+  s->io.data = (guint8 *) g_mapped_file_get_contents (file);
+  s->io.len = g_mapped_file_get_length (file);
+  s->io.pos = 0;
+
+  sf_info.format = 0;
+  s->sndfile = sf_open_virtual (&MAPPED_FILE_IO, SFM_READ, &sf_info, &s->io);
+  if (!s->sndfile)
+    {
+      error_print ("%s\n", sf_strerror (s->sndfile));
+      sample_source_close (s);
+      return -EIO;
+    }
+
+  sample_set_sample_info (&sample_info_src, s->sndfile, &sf_info);
+
+  sample_info_dst->channels = sample_info_dst->channels ?
+    sample_info_dst->channels : sample_info_src.channels;
+  sample_info_dst->rate = sample_info_dst->rate ? sample_info_dst->rate :
+    sample_info_src.rate;
+  sample_info_dst->format =
+    sample_info_dst->format ? sample_info_dst->format : SF_FORMAT_PCM_16;
+
+  if (sample_info_dst->format != SF_FORMAT_PCM_16 &&
+      sample_info_dst->format != SF_FORMAT_PCM_32 &&
+      sample_info_dst->format != SF_FORMAT_FLOAT)
+    {
+      error_print ("Invalid sample format. Using short...\n");
+      sample_info_dst->format = SF_FORMAT_PCM_16;
+    }
+
+  if (sample_info_dst->rate != sample_info_src.rate)
+    {
+      debug_print (1, "Sample %s needs to be resampled (%d Hz to %d Hz)\n",
+		   path, sample_info_src.rate, sample_info_dst->rate);
+      sample_source_close (s);
+      return -ENOTSUP;
+    }
+
+  if (!sample_info_src.frames)
+    {
+      sample_source_close (s);
+      return -EINVAL;
+    }
+
+  sample_info_dst->frames = sample_info_src.frames;
+  sample_info_dst->loop_start = sample_info_src.loop_start;
+  sample_info_dst->loop_end = sample_info_src.loop_end;
+  sample_info_dst->loop_type = sample_info_src.loop_type;
+  sample_info_dst->midi_note = sample_info_src.midi_note;
+  sample_check_and_fix_loop_points (sample_info_dst);
+
+  //Set scale factor. See http://www.mega-nerd.com/libsndfile/api.html#note2
+  if ((sf_info.format & SF_FORMAT_FLOAT) == SF_FORMAT_FLOAT ||
+      (sf_info.format & SF_FORMAT_DOUBLE) == SF_FORMAT_DOUBLE)
+    {
+      sf_command (s->sndfile, SFC_SET_SCALE_FLOAT_INT_READ, NULL, SF_TRUE);
+    }
+
+  bytes_per_sample = SAMPLE_SIZE (sample_info_dst->format);
+  s->buffer_input_multi = g_malloc (LOAD_BUFFER_LEN *
+				    FRAME_SIZE (sample_info_src.channels,
+						sample_info_dst->format));
+  s->buffer_input_mono = g_malloc (LOAD_BUFFER_LEN * bytes_per_sample);
+  s->buffer_input_stereo = g_malloc (LOAD_BUFFER_LEN * 2 * bytes_per_sample);
+  s->channels = sample_info_src.channels;
+  s->sample_info = *sample_info_dst;
+  s->frame = 0;
+
+  debug_print (1, "Streaming sample %s (%d frames)...\n", path,
+	       sample_info_dst->frames);
+
+  *source = s;
+  return 0;
+}
+
+//Replaces the content of the block with the next frames, which are never more than the requested ones.
+//If the file ends before the expected amount of frames, silence is used.
+
+gint
+sample_source_read (struct sample_source *source, GByteArray *block,
+		    guint frames)
+{
+  void *buffer;
+  sf_count_t frames_read, len;
+  guint bytes_per_frame = SAMPLE_INFO_FRAME_SIZE (&source->sample_info);
+
+  g_byte_array_set_size (block, 0);
+
+  frames = MIN (frames, source->sample_info.frames - source->frame);
+  while (frames)
+    {
+      len = MIN (frames, LOAD_BUFFER_LEN);
+      frames_read = sample_readf (source->sndfile,
+				  source->sample_info.format,
+				  source->buffer_input_multi, len);
+      if (frames_read <= 0)
+	{
+	  error_print ("Unexpected end of file\n");
+	  return -EIO;
+	}
+
+      buffer = sample_convert_channels (source->buffer_input_multi,
+					source->buffer_input_mono,
+					source->buffer_input_stereo,
+					frames_read, source->channels,
+					&source->sample_info);
+      g_byte_array_append (block, buffer, frames_read * bytes_per_frame);
+
+      source->frame += frames_read;
+      frames -= frames_read;
+    }
+
+  return 0;
+}
+
+const struct sample_info *
+sample_source_get_sample_info (struct sample_source *source)
+{
+  return &source->sample_info;
+}
+
+gchar *
+sample_source_get_checksum (struct sample_source *source)
+{
+  return g_compute_checksum_for_data (G_CHECKSUM_SHA256, source->io.data,
+				      source->io.len);
 }
 
 gchar **
@@ -1045,3 +1378,97 @@ sample_resample (GByteArray *input, GByteArray *output, gint channels,
 
   return err;
 }
+
+struct sample_sink
+{
+  struct atomic_file file;
+  SNDFILE *sndfile;
+  guint32 format;
+  guint32 channels;
+};
+
+//The frames are written to the file as they arrive. As libsndfile updates the header on closing, the file is valid whenever it is closed.
+//The size is only used to reserve the space.
+
+gint
+sample_sink_open (const gchar *path, struct sample_info *sample_info,
+		  guint32 format, gint64 size, struct sample_sink **sink)
+{
+  gint err;
+  SF_INFO sf_info;
+  struct sample_sink *s;
+
+  debug_print (1, "Streaming sample to %s...\n", path);
+
+  s = g_malloc (sizeof (struct sample_sink));
+
+  //The headers and the chunks take less than 4 KiB.
+  err = atomic_file_open (&s->file, path, size + 4096);
+  if (err)
+    {
+      g_free (s);
+      return err;
+    }
+
+  memset (&sf_info, 0, sizeof (SF_INFO));
+  sf_info.samplerate = sample_info->rate;
+  sf_info.channels = sample_info->channels;
+  sf_info.format = format;
+
+  s->sndfile = sf_open_fd (s->file.fd, SFM_WRITE, &sf_info, FALSE);
+  if (!s->sndfile)
+    {
+      error_print ("%s\n", sf_strerror (s->sndfile));
+      atomic_file_abort (&s->file);
+      g_free (s);
+      return -EIO;
+    }
+
+  sample_set_chunks (s->sndfile, sample_info);
+
+  s->format = format;
+  s->channels = sample_info->channels;
+
+  *sink = s;
+  return 0;
+}
+
+//The block must contain whole frames in the format of the file.
+
+gint
+sample_sink_write (struct sample_sink *sink, GByteArray *block)
+{
+  sf_count_t frames = block->len / FRAME_SIZE (sink->channels, sink->format);
+
+  if (sample_writef (sink->sndfile, sink->format, block->data, frames) !=
+      frames)
+    {
+      error_print ("%s\n", sf_strerror (sink->sndfile));
+      return -EIO;
+    }
+
+  return 0;
+}
+
+//If commit is not set, the destination is left untouched.
+
+gint
+sample_sink_close (struct sample_sink *sink, gboolean commit)
+{
+  gint err;
+
+  sf_close (sink->sndfile);
+
+  if (commit)
+    {
+      err = atomic_file_commit (&sink->file);
+    }
+  else
+    {
+      atomic_file_abort (&sink->file);
+      err = 0;
+    }
+
+  g_free (sink);
+  return err;
+}
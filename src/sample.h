@@ -63,4 +63,30 @@ const gchar *sample_get_subtype (struct sample_info *);
 
 gint sample_resample (GByteArray *, GByteArray *, gint, gdouble);
 
+//A sample source decodes and converts a file in blocks as they are requested so that the whole sample is never in memory.
+
+gint sample_source_open (const gchar *, struct sample_info *,
+			 struct sample_source **);
+
+gint sample_source_read (struct sample_source *, GByteArray *, guint);
+
+const struct sample_info *sample_source_get_sample_info (struct
+							 sample_source *);
+
+//Returns the SHA-256 of the file contents.
+gchar *sample_source_get_checksum (struct sample_source *);
+
+void sample_source_close (struct sample_source *);
+
+//A sample sink writes the frames to a file as they are produced.
+
+struct sample_sink;
+
+gint sample_sink_open (const gchar *, struct sample_info *, guint32, gint64,
+		       struct sample_sink **);
+
+gint sample_sink_write (struct sample_sink *, GByteArray *);
+
+gint sample_sink_close (struct sample_sink *, gboolean);
+
 #endif
@@ -0,0 +1,720 @@
+/*
+ *   scheduler.c
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <glib/gstdio.h>
+#include "scheduler.h"
+
+//Weight of the last measurement in the throughput average.
+#define SCHEDULER_THROUGHPUT_WEIGHT 0.3
+
+static const gchar *SCHEDULER_POLICY_NAMES[] = {
+  "fifo", "smallest", "dir"
+};
+
+struct task *
+task_copy (const struct task *task)
+{
+  struct task *copy = g_malloc (sizeof (struct task));
+  *copy = *task;
+  copy->src = g_strdup (task->src);
+  copy->dst = g_strdup (task->dst);
+  copy->path = g_strdup (task->path);
+  copy->data = NULL;
+  return copy;
+}
+
+void
+task_free (struct task *task)
+{
+  g_free (task->src);
+  g_free (task->dst);
+  g_free (task->path);
+  if (task->data)
+    {
+      g_byte_array_unref (task->data);
+    }
+  g_free (task);
+}
+
+static void
+scheduler_notify (struct scheduler *scheduler, struct task *task)
+{
+  if (scheduler->changed)
+    {
+      scheduler->changed (scheduler, task);
+    }
+}
+
+//Tasks not started are estimated with the current throughput while running tasks use the throughput known when started.
+//If there is no throughput yet, the elapsed time is used.
+
+static gint64
+scheduler_estimate (const struct task *task, gdouble throughput)
+{
+  gint64 elapsed;
+
+  if (task->size > 0 && throughput > 0)
+    {
+      return task->size * (1.0 - task->progress) / throughput;
+    }
+
+  if (task->status == TASK_STATUS_RUNNING && task->progress > 0)
+    {
+      elapsed = g_get_monotonic_time () - task->start;
+      return elapsed * (1.0 - task->progress) / task->progress / 1e6;
+    }
+
+  return -1;
+}
+
+static gint64
+scheduler_get_task_eta (const struct task *task)
+{
+  return scheduler_estimate (task, task->throughput);
+}
+
+static gdouble
+scheduler_get_throughput (struct scheduler *scheduler,
+			  const struct fs_operations *fs_ops)
+{
+  gdouble *throughput = g_hash_table_lookup (scheduler->throughputs, fs_ops);
+  return throughput ? *throughput : 0;
+}
+
+//As the pipeline overlaps the transfers, the time is measured since the previous transfer finished if it is later than the start.
+//This gives the throughput of the whole pipeline, which is the one needed to estimate the queue.
+
+static void
+scheduler_update_throughput (struct scheduler *scheduler, struct task *task)
+{
+  gint64 now = g_get_monotonic_time ();
+  gint64 start = MAX (task->start, scheduler->last_done);
+  gdouble *throughput, measured;
+
+  scheduler->last_done = now;
+
+  if (task->status != TASK_STATUS_COMPLETED_OK || task->size <= 0
+      || now <= start)
+    {
+      return;
+    }
+
+  measured = task->size * 1e6 / (now - start);
+
+  throughput = g_hash_table_lookup (scheduler->throughputs, task->fs_ops);
+  if (throughput)
+    {
+      *throughput = SCHEDULER_THROUGHPUT_WEIGHT * measured +
+	(1.0 - SCHEDULER_THROUGHPUT_WEIGHT) * *throughput;
+    }
+  else
+    {
+      throughput = g_malloc (sizeof (gdouble));
+      *throughput = measured;
+      g_hash_table_insert (scheduler->throughputs, (gpointer) task->fs_ops,
+			   throughput);
+    }
+
+  debug_print (1, "Throughput for filesystem %s: %.0f B/s\n",
+	       task->fs_ops->name, *throughput);
+}
+
+static gint64
+scheduler_get_size_key (const struct task *task)
+{
+  return task->size > 0 ? task->size : G_MAXINT64;
+}
+
+//Slot storages have a different destination for every task so only the filesystem is compared.
+
+static gboolean
+scheduler_is_last_group (struct scheduler *scheduler, const struct task *task)
+{
+  if (task->fs_ops != scheduler->last_fs_ops)
+    {
+      return FALSE;
+    }
+
+  if (task->fs_ops->options & FS_OPTION_SLOT_STORAGE)
+    {
+      return TRUE;
+    }
+
+  return scheduler->last_dst && !strcmp (task->dst, scheduler->last_dst);
+}
+
+//Only strict comparisons are used so that the insertion order is kept among equivalent tasks.
+
+static gboolean
+scheduler_is_before (struct scheduler *scheduler, const struct task *task,
+		     const struct task *next)
+{
+  if (task->priority != next->priority)
+    {
+      return task->priority > next->priority;
+    }
+
+  switch (scheduler->policy)
+    {
+    case SCHEDULER_POLICY_SMALLEST_FIRST:
+      return scheduler_get_size_key (task) < scheduler_get_size_key (next);
+    case SCHEDULER_POLICY_GROUP_BY_DIR:
+      return scheduler_is_last_group (scheduler, task) &&
+	!scheduler_is_last_group (scheduler, next);
+    default:
+      return FALSE;
+    }
+}
+
+static struct task *
+scheduler_get_next (struct scheduler *scheduler)
+{
+  struct task *next = NULL;
+
+  for (GList *e = scheduler->queued->head; e; e = e->next)
+    {
+      struct task *task = e->data;
+      if (!next || scheduler_is_before (scheduler, task, next))
+	{
+	  next = task;
+	}
+    }
+
+  return next;
+}
+
+static void
+scheduler_run_locked (struct scheduler *scheduler)
+{
+  struct task *task;
+  struct task_transfer *transfer;
+
+  while (scheduler->running && !pipeline_is_full (&scheduler->pipeline))
+    {
+      task = scheduler_get_next (scheduler);
+      if (!task)
+	{
+	  break;
+	}
+
+      g_queue_remove (scheduler->queued, task);
+
+      transfer = task_transfer_new (task->type, task->src, task->dst,
+				    task->fs_ops, task->batch_id, task->mode);
+      transfer->id = task->id;
+      transfer->user_data = task;
+      transfer->data = task->data;
+      task->data = NULL;
+
+      scheduler->last_fs_ops = task->fs_ops;
+      g_free (scheduler->last_dst);
+      scheduler->last_dst = strdup (task->dst);
+
+      task->status = TASK_STATUS_RUNNING;
+      task->start = g_get_monotonic_time ();
+      task->throughput = scheduler_get_throughput (scheduler, task->fs_ops);
+      task->eta = scheduler_get_task_eta (task);
+      scheduler->running_tasks++;
+      scheduler_notify (scheduler, task);
+
+      //The pipeline can not be full as it is only fed from here.
+      pipeline_submit (&scheduler->pipeline, transfer);
+    }
+}
+
+//Called from a pipeline thread with the control mutex held.
+//The mutex is released while asking so that the batch changes can reach this transfer too.
+//Asks are serialized as several pipeline threads might ask at the same time. Once the scheduler is being destroyed, nothing is asked and the transfer is skipped.
+
+static void
+scheduler_ask (struct pipeline *pipeline, struct task_transfer *transfer)
+{
+  gboolean running;
+  enum task_answer answer = TASK_ANSWER_SKIP;
+  gboolean apply_to_all = FALSE;
+  struct scheduler *scheduler = pipeline->data;
+
+  if (!scheduler->ask)
+    {
+      return;
+    }
+
+  g_mutex_unlock (&transfer->control.mutex);
+
+  g_mutex_lock (&scheduler->ask_mutex);
+
+  g_mutex_lock (&scheduler->mutex);
+  running = scheduler->running;
+  scheduler->asking = running;
+  g_mutex_unlock (&scheduler->mutex);
+
+  if (running)
+    {
+      answer = scheduler->ask (scheduler, transfer->user_data,
+			       transfer->path, &apply_to_all);
+
+      g_mutex_lock (&scheduler->mutex);
+      scheduler->asking = FALSE;
+      g_mutex_unlock (&scheduler->mutex);
+    }
+
+  g_mutex_unlock (&scheduler->ask_mutex);
+
+  switch (answer)
+    {
+    case TASK_ANSWER_CANCEL:
+      scheduler_cancel_batch (scheduler, transfer->batch_id);
+      break;
+    case TASK_ANSWER_SKIP:
+      if (apply_to_all)
+	{
+	  scheduler_set_batch_mode (scheduler, transfer->batch_id,
+				    TASK_MODE_SKIP);
+	}
+      break;
+    case TASK_ANSWER_REPLACE:
+      if (apply_to_all)
+	{
+	  scheduler_set_batch_mode (scheduler, transfer->batch_id,
+				    TASK_MODE_REPLACE);
+	}
+      break;
+    }
+
+  g_mutex_lock (&transfer->control.mutex);
+
+  if (answer != TASK_ANSWER_REPLACE)
+    {
+      transfer->status = TASK_STATUS_CANCELED;
+    }
+}
+
+static void
+scheduler_done (struct pipeline *pipeline, struct task_transfer *transfer)
+{
+  struct scheduler *scheduler = pipeline->data;
+  struct task *task = transfer->user_data;
+
+  g_mutex_lock (&scheduler->mutex);
+
+  task->status = transfer->status;
+  task->err = transfer->err;
+  task->path = transfer->path;
+  transfer->path = NULL;
+  task->stats = transfer->stats;
+  if (task->status == TASK_STATUS_COMPLETED_OK
+      || task->status == TASK_STATUS_COMPLETED_DEDUPLICATED)
+    {
+      task->progress = 1.0;
+    }
+  task->eta = 0;
+  scheduler_update_throughput (scheduler, task);
+  scheduler->running_tasks--;
+  scheduler_notify (scheduler, task);
+
+  scheduler_run_locked (scheduler);
+
+  g_cond_broadcast (&scheduler->cond);
+  g_mutex_unlock (&scheduler->mutex);
+
+  task_transfer_free (transfer);
+}
+
+void
+scheduler_init (struct scheduler *scheduler, struct backend *backend,
+		scheduler_ask_cb ask, scheduler_cancel_ask_cb cancel_ask,
+		scheduler_task_cb changed, scheduler_task_cb progress,
+		gpointer data)
+{
+  scheduler->tasks = g_hash_table_new_full (g_direct_hash, g_direct_equal,
+					    NULL, (GDestroyNotify) task_free);
+  scheduler->queued = g_queue_new ();
+  scheduler->running_tasks = 0;
+  scheduler->task_id = 0;
+  scheduler->batch_id = 0;
+  scheduler->running = TRUE;
+  scheduler->policy = SCHEDULER_POLICY_FIFO;
+  scheduler->last_fs_ops = NULL;
+  scheduler->last_dst = NULL;
+  scheduler->throughputs = g_hash_table_new_full (g_direct_hash,
+						  g_direct_equal, NULL,
+						  g_free);
+  scheduler->last_done = 0;
+  scheduler->asking = FALSE;
+  scheduler->ask = ask;
+  scheduler->cancel_ask = cancel_ask;
+  scheduler->changed = changed;
+  scheduler->progress = progress;
+  scheduler->data = data;
+  g_mutex_init (&scheduler->mutex);
+  g_mutex_init (&scheduler->ask_mutex);
+  g_cond_init (&scheduler->cond);
+  pipeline_init (&scheduler->pipeline, backend, scheduler_ask,
+		 scheduler_done, scheduler);
+}
+
+//Called with the scheduler mutex held so the pending ask can not finish meanwhile.
+
+static void
+scheduler_cancel_ask (struct scheduler *scheduler)
+{
+  if (scheduler->asking && scheduler->cancel_ask)
+    {
+      scheduler->cancel_ask (scheduler);
+    }
+}
+
+void
+scheduler_destroy (struct scheduler *scheduler)
+{
+  debug_print (1, "Stopping scheduler...\n");
+
+  g_mutex_lock (&scheduler->mutex);
+  scheduler->running = FALSE;
+  g_queue_clear (scheduler->queued);
+  scheduler_cancel_ask (scheduler);
+  g_mutex_unlock (&scheduler->mutex);
+
+  //The transfers finishing now will not start new ones.
+  pipeline_destroy (&scheduler->pipeline);
+
+  g_hash_table_destroy (scheduler->tasks);
+  scheduler->tasks = NULL;
+  g_queue_free (scheduler->queued);
+  scheduler->queued = NULL;
+  g_hash_table_destroy (scheduler->throughputs);
+  scheduler->throughputs = NULL;
+  g_free (scheduler->last_dst);
+  scheduler->last_dst = NULL;
+
+  g_mutex_clear (&scheduler->mutex);
+  g_mutex_clear (&scheduler->ask_mutex);
+  g_cond_clear (&scheduler->cond);
+}
+
+guint
+scheduler_new_batch (struct scheduler *scheduler)
+{
+  guint batch_id;
+  g_mutex_lock (&scheduler->mutex);
+  scheduler->batch_id++;
+  batch_id = scheduler->batch_id;
+  g_mutex_unlock (&scheduler->mutex);
+  return batch_id;
+}
+
+void
+scheduler_set_policy (struct scheduler *scheduler,
+		      enum scheduler_policy policy)
+{
+  g_mutex_lock (&scheduler->mutex);
+  scheduler->policy = policy;
+  g_mutex_unlock (&scheduler->mutex);
+}
+
+gint
+scheduler_get_policy_by_name (const gchar *name)
+{
+  for (gint i = 0; i < G_N_ELEMENTS (SCHEDULER_POLICY_NAMES); i++)
+    {
+      if (!strcmp (name, SCHEDULER_POLICY_NAMES[i]))
+	{
+	  return i;
+	}
+    }
+  return -EINVAL;
+}
+
+static guint
+scheduler_add_task (struct scheduler *scheduler, enum task_type type,
+		    const gchar *src, const gchar *dst,
+		    const struct fs_operations *fs_ops, guint batch_id,
+		    enum task_mode mode, enum task_priority priority,
+		    gint64 size, GByteArray *data)
+{
+  guint id;
+  struct task *task = g_malloc0 (sizeof (struct task));
+
+  task->type = type;
+  task->src = strdup (src);
+  task->dst = strdup (dst);
+  task->fs_ops = fs_ops;
+  task->status = TASK_STATUS_QUEUED;
+  task->mode = mode;
+  task->priority = priority;
+  task->batch_id = batch_id;
+  task->size = size > 0 ? size : -1;
+  task->data = data ? g_byte_array_ref (data) : NULL;
+
+  g_mutex_lock (&scheduler->mutex);
+  task->eta = scheduler_estimate (task,
+				  scheduler_get_throughput (scheduler,
+							    fs_ops));
+  scheduler->task_id++;
+  task->id = scheduler->task_id;
+  id = task->id;
+  g_hash_table_insert (scheduler->tasks, GUINT_TO_POINTER (id), task);
+  g_queue_push_tail (scheduler->queued, task);
+  scheduler_notify (scheduler, task);
+  g_mutex_unlock (&scheduler->mutex);
+
+  debug_print (2, "Task %d added (batch %d)\n", id, batch_id);
+
+  return id;
+}
+
+//Tasks are not started until scheduler_run is called. This allows clients to add a whole batch first.
+//If the size of an upload is unknown, the size of the local file is used.
+
+guint
+scheduler_add (struct scheduler *scheduler, enum task_type type,
+	       const gchar *src, const gchar *dst,
+	       const struct fs_operations *fs_ops, guint batch_id,
+	       enum task_mode mode, enum task_priority priority, gint64 size)
+{
+  GStatBuf info;
+
+  if (size <= 0 && type == TASK_TYPE_UPLOAD && !g_stat (src, &info))
+    {
+      size = info.st_size;
+    }
+
+  return scheduler_add_task (scheduler, type, src, dst, fs_ops, batch_id,
+			     mode, priority, size, NULL);
+}
+
+guint
+scheduler_add_loaded (struct scheduler *scheduler, const gchar *src,
+		      const gchar *dst, const struct fs_operations *fs_ops,
+		      guint batch_id, enum task_mode mode,
+		      enum task_priority priority, GByteArray *data)
+{
+  return scheduler_add_task (scheduler, TASK_TYPE_UPLOAD, src, dst, fs_ops,
+			     batch_id, mode, priority, data->len, data);
+}
+
+void
+scheduler_run (struct scheduler *scheduler)
+{
+  g_mutex_lock (&scheduler->mutex);
+  scheduler_run_locked (scheduler);
+  g_mutex_unlock (&scheduler->mutex);
+}
+
+//Running tasks can not be removed.
+
+gboolean
+scheduler_remove (struct scheduler *scheduler, guint id)
+{
+  gboolean removed = FALSE;
+  struct task *task;
+
+  g_mutex_lock (&scheduler->mutex);
+  task = g_hash_table_lookup (scheduler->tasks, GUINT_TO_POINTER (id));
+  if (task && task->status != TASK_STATUS_RUNNING)
+    {
+      if (task->status == TASK_STATUS_QUEUED)
+	{
+	  g_queue_remove (scheduler->queued, task);
+	  g_cond_broadcast (&scheduler->cond);
+	}
+      g_hash_table_remove (scheduler->tasks, GUINT_TO_POINTER (id));
+      removed = TRUE;
+    }
+  g_mutex_unlock (&scheduler->mutex);
+
+  return removed;
+}
+
+static void
+scheduler_cancel_queued (struct scheduler *scheduler, gboolean all,
+			 guint batch_id)
+{
+  GList *e = scheduler->queued->head;
+
+  while (e)
+    {
+      GList *next = e->next;
+      struct task *task = e->data;
+      if (all || task->batch_id == batch_id)
+	{
+	  task->status = TASK_STATUS_CANCELED;
+	  scheduler_notify (scheduler, task);
+	  g_queue_delete_link (scheduler->queued, e);
+	}
+      e = next;
+    }
+
+  g_cond_broadcast (&scheduler->cond);
+}
+
+void
+scheduler_cancel_all (struct scheduler *scheduler)
+{
+  g_mutex_lock (&scheduler->mutex);
+  scheduler_cancel_queued (scheduler, TRUE, 0);
+  pipeline_cancel_all (&scheduler->pipeline);
+  scheduler_cancel_ask (scheduler);
+  g_mutex_unlock (&scheduler->mutex);
+}
+
+void
+scheduler_cancel_batch (struct scheduler *scheduler, guint batch_id)
+{
+  g_mutex_lock (&scheduler->mutex);
+  scheduler_cancel_queued (scheduler, FALSE, batch_id);
+  pipeline_cancel_batch (&scheduler->pipeline, batch_id);
+  g_mutex_unlock (&scheduler->mutex);
+}
+
+void
+scheduler_set_batch_mode (struct scheduler *scheduler, guint batch_id,
+			  enum task_mode mode)
+{
+  g_mutex_lock (&scheduler->mutex);
+  for (GList *e = scheduler->queued->head; e; e = e->next)
+    {
+      struct task *task = e->data;
+      if (task->batch_id == batch_id)
+	{
+	  task->mode = mode;
+	}
+    }
+  pipeline_set_batch_mode (&scheduler->pipeline, batch_id, mode);
+  g_mutex_unlock (&scheduler->mutex);
+}
+
+gboolean
+scheduler_has_queued (struct scheduler *scheduler)
+{
+  gboolean queued;
+  g_mutex_lock (&scheduler->mutex);
+  queued = !g_queue_is_empty (scheduler->queued);
+  g_mutex_unlock (&scheduler->mutex);
+  return queued;
+}
+
+gboolean
+scheduler_is_idle (struct scheduler *scheduler)
+{
+  gboolean idle;
+  g_mutex_lock (&scheduler->mutex);
+  idle = g_queue_is_empty (scheduler->queued) && !scheduler->running_tasks;
+  g_mutex_unlock (&scheduler->mutex);
+  return idle;
+}
+
+//Transfers are only removed from the pipeline queue before the done callback, which needs the scheduler mutex, so the tasks are valid here.
+
+static void
+scheduler_sample_progress_locked (struct scheduler *scheduler)
+{
+  gdouble progress;
+  struct task *task;
+  struct task_transfer *transfer;
+
+  if (!scheduler->progress)
+    {
+      return;
+    }
+
+  g_mutex_lock (&scheduler->pipeline.mutex);
+  for (GList *e = scheduler->pipeline.transfers->head; e; e = e->next)
+    {
+      transfer = e->data;
+      task = transfer->user_data;
+      progress = job_control_get_progress (&transfer->control);
+      if (progress != task->progress)
+	{
+	  task->progress = progress;
+	  task->eta = scheduler_get_task_eta (task);
+	  scheduler->progress (scheduler, task);
+	}
+    }
+  g_mutex_unlock (&scheduler->pipeline.mutex);
+}
+
+void
+scheduler_sample_progress (struct scheduler *scheduler)
+{
+  g_mutex_lock (&scheduler->mutex);
+  scheduler_sample_progress_locked (scheduler);
+  g_mutex_unlock (&scheduler->mutex);
+}
+
+//Waits until there are no queued nor running tasks sampling the progress meanwhile.
+
+void
+scheduler_wait (struct scheduler *scheduler)
+{
+  gint64 end;
+
+  g_mutex_lock (&scheduler->mutex);
+  while (!g_queue_is_empty (scheduler->queued) || scheduler->running_tasks)
+    {
+      end = g_get_monotonic_time () + SCHEDULER_PROGRESS_PERIOD_US;
+      if (!g_cond_wait_until (&scheduler->cond, &scheduler->mutex, end))
+	{
+	  scheduler_sample_progress_locked (scheduler);
+	}
+    }
+  g_mutex_unlock (&scheduler->mutex);
+}
+
+//Returns the remaining seconds of the queued and running tasks or -1 if some of them can not be estimated.
+
+gint64
+scheduler_get_eta (struct scheduler *scheduler)
+{
+  GHashTableIter iter;
+  struct task *task;
+  gint64 eta = 0, task_eta;
+
+  g_mutex_lock (&scheduler->mutex);
+  g_hash_table_iter_init (&iter, scheduler->tasks);
+  while (g_hash_table_iter_next (&iter, NULL, (gpointer *) & task))
+    {
+      if (task->status == TASK_STATUS_RUNNING)
+	{
+	  task_eta = scheduler_get_task_eta (task);
+	}
+      else if (task->status == TASK_STATUS_QUEUED)
+	{
+	  task_eta = scheduler_estimate (task,
+					 scheduler_get_throughput (scheduler,
+								   task->fs_ops));
+	}
+      else
+	{
+	  continue;
+	}
+
+      if (task_eta < 0)
+	{
+	  eta = -1;
+	  break;
+	}
+      eta += task_eta;
+    }
+  g_mutex_unlock (&scheduler->mutex);
+
+  return eta;
+}
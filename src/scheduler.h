@@ -0,0 +1,165 @@
+/*
+ *   scheduler.h
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "pipeline.h"
+
+#define SCHEDULER_PROGRESS_PERIOD_US (G_USEC_PER_SEC / 25)
+
+enum task_priority
+{
+  TASK_PRIORITY_LOW,
+  TASK_PRIORITY_NORMAL,
+  TASK_PRIORITY_HIGH
+};
+
+//Order used within the same priority.
+
+enum scheduler_policy
+{
+  SCHEDULER_POLICY_FIFO,
+  SCHEDULER_POLICY_SMALLEST_FIRST,	//Minimizes the mean completion time.
+  SCHEDULER_POLICY_GROUP_BY_DIR	//Avoids switching between filesystems and directories.
+};
+
+enum task_answer
+{
+  TASK_ANSWER_CANCEL,		//Cancels the task and the remaining ones in the batch.
+  TASK_ANSWER_SKIP,
+  TASK_ANSWER_REPLACE
+};
+
+struct task
+{
+  guint id;
+  enum task_type type;
+  gchar *src;
+  gchar *dst;
+  const struct fs_operations *fs_ops;
+  enum task_status status;
+  enum task_mode mode;
+  enum task_priority priority;
+  guint batch_id;
+  gdouble progress;
+  gchar *path;			//Contains the actual upload or download path once finished
+  gint err;
+  gint64 size;			//Size in bytes or -1 if unknown
+  gint64 eta;			//Remaining seconds or -1 if unknown
+  gint64 start;
+  gdouble throughput;		//Bytes per second expected when started or 0 if unknown
+  GByteArray *data;		//Upload data already loaded or NULL. Only the scheduler owns it.
+  struct backend_stats stats;	//MIDI traffic of the transfer once finished
+};
+
+struct scheduler;
+
+//Called with the scheduler mutex held every time a task is added or its status changes. It must not call any scheduler function.
+typedef void (*scheduler_task_cb) (struct scheduler *, const struct task *);
+
+//Called from a pipeline thread when the destination exists and the mode of the task is TASK_MODE_ASK. It may block.
+typedef enum task_answer (*scheduler_ask_cb) (struct scheduler *,
+					      const struct task *,
+					      const gchar *, gboolean *);
+
+//Called with the scheduler mutex held when the tasks are canceled or the scheduler destroyed while asking. The pending ask must return TASK_ANSWER_SKIP as soon as possible. It must not call any scheduler function.
+typedef void (*scheduler_cancel_ask_cb) (struct scheduler *);
+
+//The scheduler owns the tasks and feeds the pipeline with them, highest priority first and following the policy within the same priority.
+//Clients never access the tasks directly but observe them through the callbacks.
+
+struct scheduler
+{
+  struct pipeline pipeline;
+  GMutex mutex;
+  GCond cond;
+  GHashTable *tasks;		//All the tasks indexed by id.
+  GQueue *queued;		//Queued tasks in insertion order.
+  guint running_tasks;
+  guint task_id;
+  guint batch_id;
+  gboolean running;
+  enum scheduler_policy policy;
+  const struct fs_operations *last_fs_ops;
+  gchar *last_dst;
+  GHashTable *throughputs;	//Measured throughput of every filesystem.
+  gint64 last_done;
+  GMutex ask_mutex;		//Only one ask at a time.
+  gboolean asking;
+  scheduler_ask_cb ask;
+  scheduler_cancel_ask_cb cancel_ask;
+  scheduler_task_cb changed;
+  scheduler_task_cb progress;	//Called with the scheduler mutex held from scheduler_sample_progress and scheduler_wait. It must not call any scheduler function.
+  gpointer data;
+};
+
+void scheduler_init (struct scheduler *, struct backend *, scheduler_ask_cb,
+		     scheduler_cancel_ask_cb, scheduler_task_cb,
+		     scheduler_task_cb, gpointer);
+
+void scheduler_destroy (struct scheduler *);
+
+guint scheduler_new_batch (struct scheduler *);
+
+void scheduler_set_policy (struct scheduler *, enum scheduler_policy);
+
+gint scheduler_get_policy_by_name (const gchar *);
+
+guint scheduler_add (struct scheduler *, enum task_type, const gchar *,
+		     const gchar *, const struct fs_operations *, guint,
+		     enum task_mode, enum task_priority, gint64);
+
+//Adds an upload whose data is already loaded and converted. A reference to data is taken.
+
+guint scheduler_add_loaded (struct scheduler *, const gchar *, const gchar *,
+			    const struct fs_operations *, guint,
+			    enum task_mode, enum task_priority, GByteArray *);
+
+void scheduler_run (struct scheduler *);
+
+gboolean scheduler_remove (struct scheduler *, guint);
+
+void scheduler_cancel_all (struct scheduler *);
+
+void scheduler_cancel_batch (struct scheduler *, guint);
+
+void scheduler_set_batch_mode (struct scheduler *, guint, enum task_mode);
+
+gboolean scheduler_has_queued (struct scheduler *);
+
+gboolean scheduler_is_idle (struct scheduler *);
+
+//The progress of the running tasks is never notified by the transfer threads.
+//Instead, this samples it and calls the progress callback for the tasks whose progress changed. Clients call it periodically from their own thread.
+
+void scheduler_sample_progress (struct scheduler *);
+
+//This samples the progress every SCHEDULER_PROGRESS_PERIOD_US while waiting.
+
+void scheduler_wait (struct scheduler *);
+
+gint64 scheduler_get_eta (struct scheduler *);
+
+struct task *task_copy (const struct task *);
+
+void task_free (struct task *);
+
+#endif
@@ -0,0 +1,271 @@
+/*
+ *   session.c
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include "session.h"
+#include "connector.h"
+
+static void
+session_task_changed (struct scheduler *scheduler, const struct task *task)
+{
+  struct session_device *device = scheduler->data;
+  struct session *session = device->session;
+
+  if (session->changed)
+    {
+      session->changed (device, task);
+    }
+}
+
+static void
+session_task_progress (struct scheduler *scheduler, const struct task *task)
+{
+  struct session_device *device = scheduler->data;
+  struct session *session = device->session;
+
+  session->progress (device, task);
+}
+
+void
+session_init (struct session *session, session_task_cb changed,
+	      session_task_cb progress, gpointer data)
+{
+  session->devices = g_ptr_array_new ();
+  session->changed = changed;
+  session->progress = progress;
+  session->data = data;
+}
+
+static void
+session_free_device (struct session_device *device)
+{
+  scheduler_destroy (&device->scheduler);
+  if (backend_check (&device->backend))
+    {
+      backend_destroy (&device->backend);
+    }
+  g_mutex_clear (&device->backend.mutex);
+  g_free (device);
+}
+
+void
+session_destroy (struct session *session)
+{
+  debug_print (1, "Destroying session...\n");
+
+  g_ptr_array_foreach (session->devices, (GFunc) session_free_device, NULL);
+  g_ptr_array_free (session->devices, TRUE);
+}
+
+gint
+session_add_device (struct session *session,
+		    struct backend_device *backend_device,
+		    const gchar *conn_name)
+{
+  gint err;
+  struct session_device *device = g_malloc0 (sizeof (struct session_device));
+
+  debug_print (1, "Adding device '%s' to session...\n", backend_device->id);
+
+  device->session = session;
+  device->device = *backend_device;
+  g_mutex_init (&device->backend.mutex);
+
+  err = connector_init_backend (&device->backend, backend_device, conn_name,
+				NULL);
+  if (err)
+    {
+      g_mutex_clear (&device->backend.mutex);
+      g_free (device);
+      return err;
+    }
+
+  scheduler_init (&device->scheduler, &device->backend, NULL, NULL,
+		  session_task_changed,
+		  session->progress ? session_task_progress : NULL, device);
+
+  device->index = session->devices->len;
+  g_ptr_array_add (session->devices, device);
+
+  return device->index;
+}
+
+guint
+session_get_devices (struct session *session)
+{
+  return session->devices->len;
+}
+
+struct session_device *
+session_get_device (struct session *session, guint index)
+{
+  return g_ptr_array_index (session->devices, index);
+}
+
+static gint
+session_load (const gchar *src, GByteArray *data,
+	      const struct fs_operations *fs_ops)
+{
+  gint err;
+  struct job_control control;
+
+  debug_print (1, "Loading file %s once (filesystem %s)...\n", src,
+	       fs_ops->name);
+
+  memset (&control, 0, sizeof (struct job_control));
+  g_mutex_init (&control.mutex);
+  control.active = TRUE;
+  control.parts = 1;
+
+  err = fs_ops->load (src, data, &control);
+
+  g_free (control.data);
+  g_mutex_clear (&control.mutex);
+
+  return err;
+}
+
+gint
+session_fan_out_upload (struct session *session, const gchar *src,
+			const gchar *dst, const gchar *fs_name,
+			enum task_mode mode)
+{
+  gint err = 0;
+  gchar *upload_path;
+  GByteArray *data, *device_data;
+  GHashTable *loaded;
+  struct session_device *device;
+  const struct fs_operations *fs_ops;
+
+  if (mode == TASK_MODE_ASK)
+    {
+      error_print ("Asking is not supported in sessions\n");
+      return -EINVAL;
+    }
+
+  for (guint i = 0; i < session->devices->len; i++)
+    {
+      device = session_get_device (session, i);
+      fs_ops = backend_get_fs_operations_by_name (&device->backend, fs_name);
+      if (!fs_ops || !fs_ops->load || !fs_ops->upload)
+	{
+	  error_print ("Filesystem '%s' not available in device '%s'\n",
+		       fs_name, device->device.name);
+	  return -EINVAL;
+	}
+    }
+
+  //Devices sharing the same filesystem implementation share the converted data too.
+  loaded = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL,
+				  (GDestroyNotify) g_byte_array_unref);
+
+  for (guint i = 0; i < session->devices->len; i++)
+    {
+      device = session_get_device (session, i);
+      fs_ops = backend_get_fs_operations_by_name (&device->backend, fs_name);
+      if (g_hash_table_contains (loaded, fs_ops))
+	{
+	  continue;
+	}
+
+      data = g_byte_array_new ();
+      err = session_load (src, data, fs_ops);
+      if (err)
+	{
+	  error_print ("Error while loading file\n");
+	  g_byte_array_unref (data);
+	  goto end;
+	}
+      g_hash_table_insert (loaded, (gpointer) fs_ops, data);
+    }
+
+  for (guint i = 0; i < session->devices->len; i++)
+    {
+      device = session_get_device (session, i);
+      fs_ops = backend_get_fs_operations_by_name (&device->backend, fs_name);
+      data = g_hash_table_lookup (loaded, fs_ops);
+
+      //Slot storages write the slot into the data while uploading so every device needs its own copy.
+      if (fs_ops->options & FS_OPTION_SLOT_STORAGE)
+	{
+	  device_data = g_byte_array_sized_new (data->len);
+	  g_byte_array_append (device_data, data->data, data->len);
+	  upload_path = fs_ops->get_upload_path (&device->backend, fs_ops,
+						 dst, src);
+	}
+      else
+	{
+	  device_data = g_byte_array_ref (data);
+	  upload_path = strdup (dst);
+	}
+
+      scheduler_add_loaded (&device->scheduler, src, upload_path, fs_ops,
+			    scheduler_new_batch (&device->scheduler), mode,
+			    TASK_PRIORITY_NORMAL, device_data);
+
+      g_byte_array_unref (device_data);
+      g_free (upload_path);
+    }
+
+  for (guint i = 0; i < session->devices->len; i++)
+    {
+      device = session_get_device (session, i);
+      scheduler_run (&device->scheduler);
+    }
+
+end:
+  g_hash_table_destroy (loaded);
+  return err;
+}
+
+void
+session_cancel_all (struct session *session)
+{
+  for (guint i = 0; i < session->devices->len; i++)
+    {
+      scheduler_cancel_all (&session_get_device (session, i)->scheduler);
+    }
+}
+
+void
+session_wait (struct session *session)
+{
+  gboolean idle;
+  struct scheduler *scheduler;
+
+  //Every device is sampled while waiting so that the progress of all of them is reported.
+  while (1)
+    {
+      idle = TRUE;
+      for (guint i = 0; i < session->devices->len; i++)
+	{
+	  scheduler = &session_get_device (session, i)->scheduler;
+	  scheduler_sample_progress (scheduler);
+	  idle &= scheduler_is_idle (scheduler);
+	}
+
+      if (idle)
+	{
+	  break;
+	}
+
+      g_usleep (SCHEDULER_PROGRESS_PERIOD_US);
+    }
+}
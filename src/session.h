@@ -0,0 +1,77 @@
+/*
+ *   session.h
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include "scheduler.h"
+
+//A session holds several connected devices. Every device has its own backend and scheduler, and thus its own device thread and queue.
+//Transfers to different devices run in parallel.
+
+struct session;
+
+struct session_device
+{
+  struct session *session;
+  guint index;
+  struct backend_device device;
+  struct backend backend;
+  struct scheduler scheduler;
+};
+
+//Same as the scheduler callbacks but called for every device in the session.
+typedef void (*session_task_cb) (struct session_device *,
+				 const struct task *);
+
+struct session
+{
+  GPtrArray *devices;
+  session_task_cb changed;
+  session_task_cb progress;
+  gpointer data;
+};
+
+void session_init (struct session *, session_task_cb, session_task_cb,
+		   gpointer);
+
+void session_destroy (struct session *);
+
+//Returns the index of the device in the session or a negative error.
+
+gint session_add_device (struct session *, struct backend_device *,
+			 const gchar *);
+
+guint session_get_devices (struct session *);
+
+struct session_device *session_get_device (struct session *, guint);
+
+//Loads and converts src once for every filesystem implementation and uploads it to dst in every device.
+//The tasks are added to the devices schedulers and started. Use session_wait to wait for them.
+//TASK_MODE_ASK is rejected with -EINVAL as the devices schedulers have no one to ask.
+
+gint session_fan_out_upload (struct session *, const gchar *, const gchar *,
+			     const gchar *, enum task_mode);
+
+void session_cancel_all (struct session *);
+
+void session_wait (struct session *);
+
+#endif
@@ -0,0 +1,561 @@
+/*
+ *   sync.c
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include "sync.h"
+#include "local.h"
+
+enum sync_local_state
+{
+  SYNC_LOCAL_MISSING,		//Not in the remote dir.
+  SYNC_LOCAL_PRESENT,		//In the remote dir. Uploaded only if it differs.
+  SYNC_LOCAL_CONFLICT,		//A remote item of another type has the same name.
+  SYNC_LOCAL_RENAMED
+};
+
+struct sync_local_item
+{
+  gchar *key;
+  struct item item;
+  enum sync_local_state state;
+};
+
+struct sync_dir
+{
+  gchar *local;
+  gchar *remote;
+  gboolean remote_exists;
+};
+
+static const gchar *SYNC_ACTION_NAMES[] = {
+  "rename", "delete", "mkdir", "upload"
+};
+
+const gchar *
+sync_get_action_name (enum sync_action_type type)
+{
+  return SYNC_ACTION_NAMES[type];
+}
+
+static void
+sync_add_action (struct sync_plan *plan, enum sync_action_type type,
+		 const gchar *src, const gchar *dst)
+{
+  struct sync_action *action = g_malloc (sizeof (struct sync_action));
+
+  debug_print (1, "Sync %s: %s -> %s\n", sync_get_action_name (type),
+	       src ? src : "", dst);
+
+  action->type = type;
+  action->src = src ? strdup (src) : NULL;
+  action->dst = strdup (dst);
+  plan->actions = g_list_prepend (plan->actions, action);
+}
+
+static void
+sync_free_action (gpointer data)
+{
+  struct sync_action *action = data;
+  g_free (action->src);
+  g_free (action->dst);
+  g_free (action);
+}
+
+static gint
+sync_compare_actions (gconstpointer a, gconstpointer b)
+{
+  const struct sync_action *action_a = a;
+  const struct sync_action *action_b = b;
+  return action_a->type - action_b->type;
+}
+
+static gint
+sync_compare_local_items (gconstpointer a, gconstpointer b)
+{
+  const struct sync_local_item *item_a = a;
+  const struct sync_local_item *item_b = b;
+  return strcmp (item_a->item.name, item_b->item.name);
+}
+
+static void
+sync_free_local_item (gpointer data)
+{
+  struct sync_local_item *local_item = data;
+  g_free (local_item->key);
+  g_free (local_item);
+}
+
+static struct sync_dir *
+sync_new_dir (const gchar *local, const gchar *remote, gboolean remote_exists)
+{
+  struct sync_dir *dir = g_malloc (sizeof (struct sync_dir));
+  dir->local = strdup (local);
+  dir->remote = strdup (remote);
+  dir->remote_exists = remote_exists;
+  return dir;
+}
+
+static void
+sync_free_dir (gpointer data)
+{
+  struct sync_dir *dir = data;
+  g_free (dir->local);
+  g_free (dir->remote);
+  g_free (dir);
+}
+
+//Upload paths do not keep the local extension so neither do the keys.
+
+static gchar *
+sync_get_key (struct item *item)
+{
+  gchar *key = strdup (item->name);
+  if (item->type == ELEKTROID_FILE)
+    {
+      remove_ext (key);
+    }
+  return key;
+}
+
+static struct sync_local_item *
+sync_lookup (GHashTable *local_items, struct item *item)
+{
+  gchar *key;
+  struct sync_local_item *local_item;
+
+  local_item = g_hash_table_lookup (local_items, item->name);
+  if (local_item || item->type != ELEKTROID_FILE)
+    {
+      return local_item;
+    }
+
+  key = sync_get_key (item);
+  local_item = g_hash_table_lookup (local_items, key);
+  g_free (key);
+
+  return local_item;
+}
+
+//Errors are considered as different content so the file is uploaded.
+//Sizes are only compared on request as the local and the remote sizes might not be comparable (e.g., converted samples) and files with the same size might differ.
+
+static gboolean
+sync_item_matches (struct sync_plan *plan, const gchar *local_path,
+		   struct item *local_item, struct item_iterator *iter)
+{
+  if (plan->fs_ops->matches)
+    {
+      return plan->fs_ops->matches (plan->backend, local_path, iter) == 1;
+    }
+  return plan->by_size && local_item->size == iter->item.size;
+}
+
+static GList *
+sync_read_local_dir (struct sync_plan *plan, const gchar *local_dir,
+		     GHashTable *local_items, gint *err)
+{
+  gchar **exts;
+  GList *list = NULL;
+  struct item_iterator iter;
+  struct sync_local_item *local_item;
+
+  if (plan->fs_ops->get_exts)
+    {
+      exts = plan->fs_ops->get_exts (plan->backend, plan->fs_ops);
+    }
+  else
+    {
+      exts = new_ext_array (plan->fs_ops->ext);
+    }
+
+  *err = FS_LOCAL_GENERIC_OPERATIONS.readdir (NULL, &iter, local_dir, exts);
+  if (*err)
+    {
+      error_print ("Error while reading local %s dir\n", local_dir);
+      free_ext_array (exts);
+      return NULL;
+    }
+
+  while (!next_item_iterator (&iter))
+    {
+      if (iter.item.type == ELEKTROID_DIR && !plan->fs_ops->mkdir)
+	{
+	  continue;
+	}
+
+      local_item = g_malloc (sizeof (struct sync_local_item));
+      local_item->key = sync_get_key (&iter.item);
+      local_item->item = iter.item;
+      local_item->state = SYNC_LOCAL_MISSING;
+
+      if (g_hash_table_contains (local_items, local_item->key))
+	{
+	  debug_print (1, "Ignoring %s as it has the same upload path...\n",
+		       local_item->item.name);
+	  sync_free_local_item (local_item);
+	  continue;
+	}
+
+      g_hash_table_insert (local_items, local_item->key, local_item);
+      list = g_list_prepend (list, local_item);
+    }
+
+  free_item_iterator (&iter);
+  free_ext_array (exts);
+
+  return g_list_sort (list, sync_compare_local_items);
+}
+
+//Renames are only considered when the content can be compared so every extra remote file needs the listing again to be compared against the missing local files.
+
+static gint
+sync_diff_extras (struct sync_plan *plan, const gchar *local_dir,
+		  const gchar *remote_dir, GList *local_list,
+		  GHashTable *extras)
+{
+  gint err;
+  gboolean renamed;
+  gchar *local_path, *remote_path, *upload_path;
+  struct item_iterator iter;
+  struct sync_local_item *local_item;
+  enum path_type type = backend_get_path_type (plan->backend);
+
+  if (!g_hash_table_size (extras))
+    {
+      return 0;
+    }
+
+  err = plan->fs_ops->readdir (plan->backend, &iter, remote_dir, NULL);
+  if (err)
+    {
+      return err;
+    }
+
+  while (!next_item_iterator (&iter))
+    {
+      if (!g_hash_table_contains (extras, iter.item.name))
+	{
+	  continue;
+	}
+
+      remote_path = path_chain (type, remote_dir, iter.item.name);
+      renamed = FALSE;
+
+      if (iter.item.type == ELEKTROID_FILE && plan->fs_ops->matches
+	  && plan->fs_ops->rename)
+	{
+	  for (GList * l = local_list; l; l = l->next)
+	    {
+	      local_item = l->data;
+	      if (local_item->state != SYNC_LOCAL_MISSING
+		  || local_item->item.type != ELEKTROID_FILE)
+		{
+		  continue;
+		}
+
+	      local_path = path_chain (PATH_SYSTEM, local_dir,
+				       local_item->item.name);
+	      if (sync_item_matches (plan, local_path, &local_item->item,
+				     &iter))
+		{
+		  upload_path = plan->fs_ops->get_upload_path (plan->backend,
+							       plan->fs_ops,
+							       remote_dir,
+							       local_path);
+		  sync_add_action (plan, SYNC_ACTION_RENAME, remote_path,
+				   upload_path);
+		  g_free (upload_path);
+		  local_item->state = SYNC_LOCAL_RENAMED;
+		  renamed = TRUE;
+		}
+	      g_free (local_path);
+
+	      if (renamed)
+		{
+		  break;
+		}
+	    }
+	}
+
+      if (!renamed)
+	{
+	  sync_add_action (plan, SYNC_ACTION_DELETE, NULL, remote_path);
+	}
+
+      g_free (remote_path);
+    }
+
+  free_item_iterator (&iter);
+
+  return 0;
+}
+
+static gint
+sync_diff_remote_dir (struct sync_plan *plan, const gchar *local_dir,
+		      const gchar *remote_dir, GList *local_list,
+		      GHashTable *local_items, GList **subdirs)
+{
+  gint err;
+  GHashTable *extras;
+  gchar *local_path, *remote_path;
+  struct item_iterator iter;
+  struct sync_local_item *local_item;
+  enum path_type type = backend_get_path_type (plan->backend);
+
+  err = plan->fs_ops->readdir (plan->backend, &iter, remote_dir, NULL);
+  if (err)
+    {
+      return err;
+    }
+
+  extras = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+
+  while (!next_item_iterator (&iter))
+    {
+      local_item = sync_lookup (local_items, &iter.item);
+      if (!local_item || local_item->state != SYNC_LOCAL_MISSING)
+	{
+	  if (plan->delete)
+	    {
+	      g_hash_table_add (extras, strdup (iter.item.name));
+	    }
+	  continue;
+	}
+
+      remote_path = path_chain (type, remote_dir, iter.item.name);
+      local_path = path_chain (PATH_SYSTEM, local_dir, local_item->item.name);
+
+      if (local_item->item.type != iter.item.type)
+	{
+	  if (plan->delete)
+	    {
+	      sync_add_action (plan, SYNC_ACTION_DELETE, NULL, remote_path);
+	      local_item->state = SYNC_LOCAL_CONFLICT;
+	    }
+	  else
+	    {
+	      debug_print (1, "Ignoring %s as %s has another type...\n",
+			   local_path, remote_path);
+	      local_item->state = SYNC_LOCAL_PRESENT;
+	    }
+	}
+      else
+	{
+	  local_item->state = SYNC_LOCAL_PRESENT;
+	  if (iter.item.type == ELEKTROID_DIR)
+	    {
+	      *subdirs = g_list_prepend (*subdirs,
+					 sync_new_dir (local_path,
+						       remote_path, TRUE));
+	    }
+	  else if (!sync_item_matches (plan, local_path, &local_item->item,
+				       &iter))
+	    {
+	      sync_add_action (plan, SYNC_ACTION_UPLOAD, local_path,
+			       remote_dir);
+	    }
+	}
+
+      g_free (local_path);
+      g_free (remote_path);
+    }
+
+  free_item_iterator (&iter);
+
+  err = sync_diff_extras (plan, local_dir, remote_dir, local_list, extras);
+  g_hash_table_destroy (extras);
+
+  return err;
+}
+
+static gint
+sync_diff_dir (struct sync_plan *plan, const gchar *local_dir,
+	       const gchar *remote_dir, gboolean remote_exists)
+{
+  gint err;
+  GList *local_list, *subdirs = NULL;
+  GHashTable *local_items;
+  gchar *local_path, *remote_path;
+  struct sync_local_item *local_item;
+  struct sync_dir *dir;
+  enum path_type type = backend_get_path_type (plan->backend);
+
+  local_items = g_hash_table_new (g_str_hash, g_str_equal);
+  local_list = sync_read_local_dir (plan, local_dir, local_items, &err);
+  if (err)
+    {
+      goto end;
+    }
+
+  if (remote_exists)
+    {
+      err = sync_diff_remote_dir (plan, local_dir, remote_dir, local_list,
+				  local_items, &subdirs);
+      if (err)
+	{
+	  error_print ("Error while reading remote %s dir\n", remote_dir);
+	  goto end;
+	}
+    }
+
+  for (GList * l = local_list; l; l = l->next)
+    {
+      local_item = l->data;
+      if (local_item->state != SYNC_LOCAL_MISSING
+	  && local_item->state != SYNC_LOCAL_CONFLICT)
+	{
+	  continue;
+	}
+
+      local_path = path_chain (PATH_SYSTEM, local_dir, local_item->item.name);
+      if (local_item->item.type == ELEKTROID_FILE)
+	{
+	  sync_add_action (plan, SYNC_ACTION_UPLOAD, local_path, remote_dir);
+	}
+      else
+	{
+	  remote_path = path_chain (type, remote_dir, local_item->item.name);
+	  sync_add_action (plan, SYNC_ACTION_MKDIR, NULL, remote_path);
+	  subdirs = g_list_prepend (subdirs,
+				    sync_new_dir (local_path, remote_path,
+						  FALSE));
+	  g_free (remote_path);
+	}
+      g_free (local_path);
+    }
+
+  subdirs = g_list_reverse (subdirs);
+  for (GList * l = subdirs; l && !err; l = l->next)
+    {
+      dir = l->data;
+      err = sync_diff_dir (plan, dir->local, dir->remote, dir->remote_exists);
+    }
+
+end:
+  g_list_free_full (subdirs, sync_free_dir);
+  g_list_free_full (local_list, sync_free_local_item);
+  g_hash_table_destroy (local_items);
+  return err;
+}
+
+gint
+sync_plan_init (struct sync_plan *plan, struct backend *backend,
+		const struct fs_operations *fs_ops, const gchar *local_dir,
+		const gchar *remote_dir, gboolean delete, gboolean by_size)
+{
+  gint err;
+  struct item_iterator iter;
+  gboolean remote_exists = TRUE;
+
+  plan->backend = backend;
+  plan->fs_ops = fs_ops;
+  plan->delete = delete;
+  plan->by_size = by_size;
+  plan->actions = NULL;
+
+  if (!fs_ops->readdir || !fs_ops->upload || !fs_ops->load
+      || !fs_ops->get_upload_path || (delete && !fs_ops->delete))
+    {
+      return -ENOSYS;
+    }
+
+  //Slots are not identified by name so there is nothing to compare.
+  if (fs_ops->options & (FS_OPTION_SLOT_STORAGE | FS_OPTION_ID_AS_FILENAME))
+    {
+      return -ENOTSUP;
+    }
+
+  err = fs_ops->readdir (backend, &iter, remote_dir, NULL);
+  if (err)
+    {
+      if ((err != -ENOENT && err != -ENOTDIR) || !fs_ops->mkdir
+	  || (fs_ops->file_exists && fs_ops->file_exists (backend,
+							  remote_dir)))
+	{
+	  error_print ("Error while reading remote %s dir\n", remote_dir);
+	  return err;
+	}
+      sync_add_action (plan, SYNC_ACTION_MKDIR, NULL, remote_dir);
+      remote_exists = FALSE;
+    }
+  else
+    {
+      free_item_iterator (&iter);
+    }
+
+  err = sync_diff_dir (plan, local_dir, remote_dir, remote_exists);
+  if (err)
+    {
+      sync_plan_free (plan);
+      return err;
+    }
+
+  //The stable sort keeps the parent dirs before their children.
+  plan->actions = g_list_reverse (plan->actions);
+  plan->actions = g_list_sort (plan->actions, sync_compare_actions);
+
+  return 0;
+}
+
+void
+sync_plan_free (struct sync_plan *plan)
+{
+  g_list_free_full (plan->actions, sync_free_action);
+  plan->actions = NULL;
+}
+
+gint
+sync_plan_run (struct sync_plan *plan, struct scheduler *scheduler)
+{
+  gint err = 0;
+  struct sync_action *action;
+  const struct fs_operations *fs_ops = plan->fs_ops;
+  guint batch_id = scheduler_new_batch (scheduler);
+
+  for (GList * l = plan->actions; l && !err; l = l->next)
+    {
+      action = l->data;
+      switch (action->type)
+	{
+	case SYNC_ACTION_RENAME:
+	  err = fs_ops->rename (plan->backend, action->src, action->dst);
+	  break;
+	case SYNC_ACTION_DELETE:
+	  err = fs_ops->delete (plan->backend, action->dst);
+	  break;
+	case SYNC_ACTION_MKDIR:
+	  err = fs_ops->mkdir (plan->backend, action->dst);
+	  break;
+	case SYNC_ACTION_UPLOAD:
+	  scheduler_add (scheduler, TASK_TYPE_UPLOAD, action->src,
+			 action->dst, fs_ops, batch_id, TASK_MODE_REPLACE,
+			 TASK_PRIORITY_NORMAL, -1);
+	  break;
+	}
+
+      if (err)
+	{
+	  error_print ("Error while running %s on %s\n",
+		       sync_get_action_name (action->type), action->dst);
+	}
+    }
+
+  return err;
+}
@@ -0,0 +1,68 @@
+/*
+ *   sync.h
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYNC_H
+#define SYNC_H
+
+#include "scheduler.h"
+
+//Actions are run in this order.
+
+enum sync_action_type
+{
+  SYNC_ACTION_RENAME,
+  SYNC_ACTION_DELETE,
+  SYNC_ACTION_MKDIR,
+  SYNC_ACTION_UPLOAD
+};
+
+struct sync_action
+{
+  enum sync_action_type type;
+  gchar *src;			//Local path for uploads and remote path for renames. NULL otherwise.
+  gchar *dst;			//Remote path. For uploads, this is the remote dir.
+};
+
+//A plan contains the actions needed to make a remote dir mirror a local one.
+//Files are compared by name and by content if the filesystem implements matches; if not, they are uploaded again unless by_size is set.
+//Remote items not present locally are only deleted or renamed if delete is set.
+
+struct sync_plan
+{
+  struct backend *backend;
+  const struct fs_operations *fs_ops;
+  gboolean delete;
+  gboolean by_size;		//Files the filesystem can not compare are considered equal if they have the same size.
+  GList *actions;
+};
+
+gint sync_plan_init (struct sync_plan *, struct backend *,
+		     const struct fs_operations *, const gchar *,
+		     const gchar *, gboolean, gboolean);
+
+void sync_plan_free (struct sync_plan *);
+
+//Runs every action but the uploads, which are added to the scheduler in a new batch and run by the caller.
+
+gint sync_plan_run (struct sync_plan *, struct scheduler *);
+
+const gchar *sync_get_action_name (enum sync_action_type);
+
+#endif
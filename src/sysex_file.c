@@ -0,0 +1,254 @@
+/*
+ *   sysex_file.c
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include "sysex_file.h"
+
+#define SYSEX_FILE_READ_LEN (4 * BE_KB)
+
+struct sysex_file_pacer
+{
+  gint gap;
+  gboolean learning;
+  guint replies;
+};
+
+struct sysex_file_writer
+{
+  struct atomic_file file;
+  FILE *timestamps;
+  guint msgs;
+};
+
+static void
+sysex_file_learn_gap (struct backend *backend,
+		      struct sysex_file_pacer *pacer)
+{
+  gint elapsed;
+  gint64 start;
+  struct sysex_transfer reply;
+
+  reply.timeout = pacer->gap;
+  reply.batch = FALSE;
+
+  start = g_get_monotonic_time ();
+  if (backend_rx_sysex (backend, &reply))
+    {
+      if (pacer->replies)
+	{
+	  //The device is slower than expected so the maximum gap is used until the next reply.
+	  pacer->gap = SYSEX_FILE_MAX_GAP_MS;
+	}
+      else
+	{
+	  debug_print (1, "No reply received. Using %d ms gap...\n",
+		       SYSEX_FILE_DEFAULT_GAP_MS);
+	  pacer->learning = FALSE;
+	  pacer->gap = SYSEX_FILE_DEFAULT_GAP_MS;
+	}
+      return;
+    }
+
+  free_msg (reply.raw);
+  pacer->replies++;
+  elapsed = (g_get_monotonic_time () - start) / 1000;
+  pacer->gap = CLAMP (elapsed * 2, SYSEX_FILE_MIN_GAP_MS,
+		      SYSEX_FILE_MAX_GAP_MS);
+  debug_print (2, "Reply received after %d ms. Waiting up to %d ms...\n",
+	       elapsed, pacer->gap);
+}
+
+static gint
+sysex_file_send_msg (struct backend *backend,
+		     struct sysex_transfer *transfer, GByteArray *msg,
+		     struct sysex_file_pacer *pacer)
+{
+  gboolean active;
+
+  g_mutex_lock (&transfer->mutex);
+  active = transfer->active;
+  g_mutex_unlock (&transfer->mutex);
+
+  if (!active)
+    {
+      return -ECANCELED;
+    }
+
+  transfer->raw = msg;
+  if (backend_tx_sysex_no_status (backend, transfer))
+    {
+      return transfer->err;
+    }
+
+  if (pacer->learning)
+    {
+      sysex_file_learn_gap (backend, pacer);
+    }
+  else if (pacer->gap)
+    {
+      usleep (pacer->gap * 1000);
+    }
+
+  return 0;
+}
+
+gint
+sysex_file_send (struct backend *backend, struct sysex_transfer *transfer,
+		 const gchar *path, gint gap)
+{
+  gint err = 0;
+  size_t len;
+  guint8 buf[SYSEX_FILE_READ_LEN], *b;
+  GByteArray *msg;
+  struct sysex_file_pacer pacer;
+  FILE *file = fopen (path, "rb");
+
+  if (!file)
+    {
+      return -errno;
+    }
+
+  pacer.learning = gap == SYSEX_FILE_GAP_LEARN;
+  pacer.gap = pacer.learning ? SYSEX_FILE_MAX_GAP_MS : gap;
+  pacer.replies = 0;
+
+  debug_print (1, "Sending %s...\n", path);
+
+  transfer->err = 0;
+  transfer->status = SENDING;
+  msg = g_byte_array_sized_new (BE_INT_BUF_LEN);
+
+  while (!err && (len = fread (buf, 1, SYSEX_FILE_READ_LEN, file)))
+    {
+      b = buf;
+      for (gint i = 0; i < len && !err; i++, b++)
+	{
+	  if (*b == 0xf0 && msg->len)
+	    {
+	      debug_print (1, "Unterminated message found. Skipping...\n");
+	      g_byte_array_set_size (msg, 0);
+	    }
+
+	  if (*b != 0xf0 && !msg->len)
+	    {
+	      continue;
+	    }
+
+	  g_byte_array_append (msg, b, 1);
+
+	  if (*b == 0xf7)
+	    {
+	      err = sysex_file_send_msg (backend, transfer, msg, &pacer);
+	      g_byte_array_set_size (msg, 0);
+	    }
+	}
+    }
+
+  if (!err && ferror (file))
+    {
+      error_print ("Error while reading %s\n", path);
+      err = -EIO;
+    }
+
+  //Some files do not end the last message properly so it is sent as is.
+  if (!err && msg->len)
+    {
+      err = sysex_file_send_msg (backend, transfer, msg, &pacer);
+    }
+
+  free_msg (msg);
+  transfer->raw = NULL;
+  fclose (file);
+
+  return err;
+}
+
+static gint
+sysex_file_write_msg (GByteArray *msg, gint64 time, gpointer data)
+{
+  ssize_t bytes;
+  guint len = msg->len;
+  guint8 *b = msg->data;
+  struct sysex_file_writer *writer = data;
+
+  while (len)
+    {
+      bytes = write (writer->file.fd, b, len);
+      if (bytes < 0)
+	{
+	  if (errno == EINTR)
+	    {
+	      continue;
+	    }
+	  error_print ("Error while writing SysEx message: %s\n",
+		       g_strerror (errno));
+	  return -errno;
+	}
+      b += bytes;
+      len -= bytes;
+    }
+
+  if (writer->timestamps)
+    {
+      fprintf (writer->timestamps, "%.3f\t%u\n", time / 1e6, msg->len);
+      fflush (writer->timestamps);
+    }
+
+  writer->msgs++;
+
+  return 0;
+}
+
+gint
+sysex_file_receive (struct backend *backend,
+		    struct sysex_transfer *transfer, const gchar *path,
+		    FILE *timestamps)
+{
+  gint err, commit_err;
+  struct sysex_file_writer writer;
+
+  err = atomic_file_open (&writer.file, path, 0);
+  if (err)
+    {
+      return err;
+    }
+  writer.timestamps = timestamps;
+  writer.msgs = 0;
+
+  debug_print (1, "Receiving into %s...\n", path);
+
+  err = backend_rx_sysex_stream (backend, transfer, sysex_file_write_msg,
+				 &writer);
+
+  debug_print (1, "%u messages received\n", writer.msgs);
+
+  //An existing file is only replaced if something was received.
+  if (writer.msgs)
+    {
+      commit_err = atomic_file_commit (&writer.file);
+      err = err ? err : commit_err;
+    }
+  else
+    {
+      atomic_file_abort (&writer.file);
+    }
+
+  return err;
+}
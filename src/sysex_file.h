@@ -0,0 +1,47 @@
+/*
+ *   sysex_file.h
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SYSEX_FILE_H
+#define SYSEX_FILE_H
+
+#include "backend.h"
+
+#define SYSEX_FILE_GAP_LEARN -1
+#define SYSEX_FILE_DEFAULT_GAP_MS (BE_REST_TIME_US / 1000)
+#define SYSEX_FILE_MIN_GAP_MS 5
+#define SYSEX_FILE_MAX_GAP_MS 500
+
+//Sends the messages of a SysEx file one by one, reading the file incrementally, and waits the given gap in ms after every one.
+//When learning the gap, the sender waits for the reply of the device to every message, if any, and adapts the wait to the time the device takes to reply. If the device does not reply to the first message, the default gap is used.
+//Data outside the messages is skipped.
+//Access to this function must be synchronized and the transfer must be active.
+
+gint sysex_file_send (struct backend *, struct sysex_transfer *,
+		      const gchar *, gint);
+
+//Appends every message received to the file as soon as it is complete so that there is no limit in the length of the captures.
+//If a timestamps file is given, a line with the time in seconds since the reception started and the length of the message is written to it for every message.
+//The file is removed if no message is received.
+//Access to this function must be synchronized.
+
+gint sysex_file_receive (struct backend *, struct sysex_transfer *,
+			 const gchar *, FILE *);
+
+#endif
@@ -18,6 +18,7 @@
  *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <inttypes.h>
 #include <glib/gi18n.h>
 #include "tasks.h"
 #include "backend.h"
@@ -38,6 +39,8 @@ tasks_get_human_status (enum task_status status)
       return _("Terminated with errors");
     case TASK_STATUS_CANCELED:
       return _("Canceled");
+    case TASK_STATUS_COMPLETED_DEDUPLICATED:
+      return _("Deduplicated");
     default:
       return _("Undefined");
     }
@@ -57,129 +60,106 @@ tasks_get_human_type (enum task_type type)
     }
 }
 
-static void
-tasks_stop_current (GtkWidget *object, gpointer data)
-{
-  struct tasks *tasks = data;
-  g_mutex_lock (&tasks->transfer.control.mutex);
-  tasks->transfer.control.active = FALSE;
-  g_mutex_unlock (&tasks->transfer.control.mutex);
-}
+//Finished tasks and tasks that can not be estimated yet show nothing.
 
-void
-tasks_visit_pending (struct tasks *tasks,
-		     void (*visitor) (struct tasks *tasks, GtkTreeIter *iter))
+static gchar *
+tasks_get_human_eta (enum task_status status, gint64 eta)
 {
-  enum task_status status;
-  GtkTreeIter iter;
-  gboolean valid =
-    gtk_tree_model_get_iter_first (GTK_TREE_MODEL (tasks->list_store), &iter);
-
-  while (valid)
+  if (eta < 0 || (status != TASK_STATUS_QUEUED
+		  && status != TASK_STATUS_RUNNING))
     {
-      gtk_tree_model_get (GTK_TREE_MODEL (tasks->list_store), &iter,
-			  TASK_LIST_STORE_STATUS_FIELD, &status, -1);
-      if (status == TASK_STATUS_QUEUED)
-	{
-	  visitor (tasks, &iter);
-	}
-      valid = gtk_tree_model_iter_next (GTK_TREE_MODEL (tasks->list_store),
-					&iter);
+      return strdup ("");
     }
+  return g_strdup_printf ("%" PRId64 ":%02" PRId64, eta / 60, eta % 60);
 }
 
 static gboolean
-tasks_get_current (struct tasks *tasks, GtkTreeIter *iter)
+tasks_get_by_id (struct tasks *tasks, guint id, GtkTreeIter *iter)
 {
-  enum task_status status;
-  gboolean found = FALSE;
+  guint task_id;
   gboolean valid =
     gtk_tree_model_get_iter_first (GTK_TREE_MODEL (tasks->list_store), iter);
 
   while (valid)
     {
       gtk_tree_model_get (GTK_TREE_MODEL (tasks->list_store), iter,
-			  TASK_LIST_STORE_STATUS_FIELD, &status, -1);
+			  TASK_LIST_STORE_ID_FIELD, &task_id, -1);
 
-      if (status == TASK_STATUS_RUNNING)
+      if (task_id == id)
 	{
-	  found = TRUE;
-	  break;
+	  return TRUE;
 	}
 
       valid =
 	gtk_tree_model_iter_next (GTK_TREE_MODEL (tasks->list_store), iter);
     }
 
-  return found;
+  return FALSE;
 }
 
-gboolean
-tasks_complete_current (gpointer data)
+static void
+tasks_insert (struct tasks *tasks, const struct task *task)
 {
-  struct tasks *tasks = data;
-  GtkTreeIter iter;
-  const gchar *status = tasks_get_human_status (tasks->transfer.status);
-
-  if (tasks_get_current (tasks, &iter))
-    {
-      gtk_list_store_set (tasks->list_store, &iter,
-			  TASK_LIST_STORE_STATUS_FIELD,
-			  tasks->transfer.status,
-			  TASK_LIST_STORE_STATUS_HUMAN_FIELD, status, -1);
-      tasks_stop_current (NULL, tasks);
-      g_free (tasks->transfer.src);
-      g_free (tasks->transfer.dst);
-
-      gtk_widget_set_sensitive (tasks->cancel_task_button, FALSE);
-    }
-  else
-    {
-      debug_print (1, "No task running. Skipping...\n");
-    }
+  const gchar *status_human = tasks_get_human_status (task->status);
+  const gchar *type_human = tasks_get_human_type (task->type);
+  gchar *eta = tasks_get_human_eta (task->status, task->eta);
 
-  return FALSE;
+  gtk_list_store_insert_with_values (tasks->list_store, NULL, -1,
+				     TASK_LIST_STORE_STATUS_FIELD,
+				     task->status,
+				     TASK_LIST_STORE_TYPE_FIELD, task->type,
+				     TASK_LIST_STORE_SRC_FIELD, task->src,
+				     TASK_LIST_STORE_DST_FIELD, task->dst,
+				     TASK_LIST_STORE_PROGRESS_FIELD,
+				     100.0 * task->progress,
+				     TASK_LIST_STORE_STATUS_HUMAN_FIELD,
+				     status_human,
+				     TASK_LIST_STORE_TYPE_HUMAN_FIELD,
+				     type_human,
+				     TASK_LIST_STORE_REMOTE_FS_ID_FIELD,
+				     task->fs_ops->id,
+				     TASK_LIST_STORE_REMOTE_FS_ICON_FIELD,
+				     task->fs_ops->gui_icon,
+				     TASK_LIST_STORE_ID_FIELD, task->id,
+				     TASK_LIST_STORE_ETA_FIELD, eta, -1);
+  g_free (eta);
 }
 
-gboolean
-tasks_get_next_queued (struct tasks *tasks, GtkTreeIter *iter,
-		       enum task_type *type, gchar **src,
-		       gchar **dst, gint *fs, guint *batch_id, guint *mode)
+static void
+tasks_update (struct tasks *tasks, GtkTreeIter *iter,
+	      const struct task *task)
 {
-  enum task_status status;
-  gboolean found = FALSE;
-  gboolean valid =
-    gtk_tree_model_get_iter_first (GTK_TREE_MODEL (tasks->list_store), iter);
+  GtkTreePath *path;
+  const gchar *status_human = tasks_get_human_status (task->status);
+  gchar *eta = tasks_get_human_eta (task->status, task->eta);
 
-  while (valid)
+  gtk_list_store_set (tasks->list_store, iter,
+		      TASK_LIST_STORE_STATUS_FIELD, task->status,
+		      TASK_LIST_STORE_STATUS_HUMAN_FIELD, status_human,
+		      TASK_LIST_STORE_PROGRESS_FIELD, 100.0 * task->progress,
+		      TASK_LIST_STORE_ETA_FIELD, eta, -1);
+  g_free (eta);
+
+  //The MIDI traffic is shown as a tooltip, which uses markup, once the task has finished.
+  if (task->status != TASK_STATUS_QUEUED
+      && task->status != TASK_STATUS_RUNNING)
     {
-      if (type)
-	{
-	  gtk_tree_model_get (GTK_TREE_MODEL (tasks->list_store), iter,
-			      TASK_LIST_STORE_STATUS_FIELD, &status,
-			      TASK_LIST_STORE_TYPE_FIELD, type,
-			      TASK_LIST_STORE_SRC_FIELD, src,
-			      TASK_LIST_STORE_DST_FIELD, dst,
-			      TASK_LIST_STORE_REMOTE_FS_ID_FIELD, fs,
-			      TASK_LIST_STORE_BATCH_ID_FIELD, batch_id,
-			      TASK_LIST_STORE_MODE_FIELD, mode, -1);
-	}
-      else
-	{
-	  gtk_tree_model_get (GTK_TREE_MODEL (tasks->list_store), iter,
-			      TASK_LIST_STORE_STATUS_FIELD, &status, -1);
-	}
-
-      if (status == TASK_STATUS_QUEUED)
-	{
-	  found = TRUE;
-	  break;
-	}
-      valid = gtk_tree_model_iter_next (GTK_TREE_MODEL (tasks->list_store),
-					iter);
+      gchar *stats = backend_stats_to_string (&task->stats);
+      gchar *markup = g_markup_escape_text (stats, -1);
+      gtk_list_store_set (tasks->list_store, iter,
+			  TASK_LIST_STORE_STATS_FIELD, markup, -1);
+      g_free (markup);
+      g_free (stats);
     }
 
-  return found;
+  if (task->status == TASK_STATUS_RUNNING)
+    {
+      path = gtk_tree_model_get_path (GTK_TREE_MODEL (tasks->list_store),
+				      iter);
+      gtk_tree_view_set_cursor (GTK_TREE_VIEW (tasks->tree_view), path,
+				NULL, FALSE);
+      gtk_tree_path_free (path);
+    }
 }
 
 static gboolean
@@ -193,7 +173,8 @@ tasks_is_finished (enum task_status status)
 {
   return (status == TASK_STATUS_COMPLETED_OK ||
 	  status == TASK_STATUS_COMPLETED_ERROR ||
-	  status == TASK_STATUS_CANCELED);
+	  status == TASK_STATUS_CANCELED ||
+	  status == TASK_STATUS_COMPLETED_DEDUPLICATED);
 }
 
 gboolean
@@ -237,6 +218,7 @@ static void
 tasks_remove_on_cond (struct tasks *tasks,
 		      gboolean (*selector) (enum task_status))
 {
+  guint id;
   enum task_status status;
   GtkTreeIter iter;
   gboolean valid =
@@ -246,9 +228,11 @@ tasks_remove_on_cond (struct tasks *tasks,
   while (valid)
     {
       gtk_tree_model_get (GTK_TREE_MODEL (tasks->list_store), &iter,
-			  TASK_LIST_STORE_STATUS_FIELD, &status, -1);
+			  TASK_LIST_STORE_STATUS_FIELD, &status,
+			  TASK_LIST_STORE_ID_FIELD, &id, -1);
 
-      if (selector (status))
+      //The row might not be up to date so the scheduler has the last word.
+      if (selector (status) && scheduler_remove (&tasks->scheduler, id))
 	{
 	  gtk_list_store_remove (tasks->list_store, &iter);
 	  valid = gtk_list_store_iter_is_valid (tasks->list_store, &iter);
@@ -276,148 +260,170 @@ tasks_clear_finished (GtkWidget *object, gpointer data)
   tasks_remove_on_cond (data, tasks_is_finished);
 }
 
-static void
-tasks_visitor_set_canceled (struct tasks *tasks, GtkTreeIter *iter)
-{
-  const gchar *canceled = tasks_get_human_status (TASK_STATUS_CANCELED);
-  gtk_list_store_set (tasks->list_store, iter,
-		      TASK_LIST_STORE_STATUS_FIELD,
-		      TASK_STATUS_CANCELED,
-		      TASK_LIST_STORE_STATUS_HUMAN_FIELD, canceled, -1);
-}
-
 void
 tasks_cancel_all (GtkWidget *object, gpointer data)
 {
-  tasks_visit_pending (data, tasks_visitor_set_canceled);
-
-  tasks_stop_current (NULL, data);
-  tasks_check_buttons (data);
+  struct tasks *tasks = data;
+  scheduler_cancel_all (&tasks->scheduler);
 }
 
 void
-tasks_visitor_set_batch_status (struct tasks *tasks, GtkTreeIter *iter,
-				enum task_mode mode)
+tasks_new_batch (struct tasks *tasks)
 {
-  gint batch_id;
-  gtk_tree_model_get (GTK_TREE_MODEL (tasks->list_store), iter,
-		      TASK_LIST_STORE_BATCH_ID_FIELD, &batch_id, -1);
-  if (batch_id == tasks->transfer.batch_id)
-    {
-      gtk_list_store_set (tasks->list_store, iter, TASK_LIST_STORE_MODE_FIELD,
-			  mode, -1);
-    }
+  tasks->batch_id = scheduler_new_batch (&tasks->scheduler);
 }
 
+//The row is added once the scheduler notifies the new task.
+
 void
-tasks_visitor_set_batch_canceled (struct tasks *tasks, GtkTreeIter *iter)
+tasks_add (struct tasks *tasks, enum task_type type,
+	   const char *src, const char *dst, gint remote_fs_id,
+	   struct backend *backend, gint64 size)
 {
-  gint batch_id;
-  gtk_tree_model_get (GTK_TREE_MODEL (tasks->list_store), iter,
-		      TASK_LIST_STORE_BATCH_ID_FIELD, &batch_id, -1);
-  if (batch_id == tasks->transfer.batch_id)
-    {
-      tasks_visitor_set_canceled (tasks, iter);
-    }
+  const struct fs_operations *ops = backend_get_fs_operations_by_id (backend,
+								     remote_fs_id);
+
+  scheduler_add (&tasks->scheduler, type, src, dst, ops, tasks->batch_id,
+		 TASK_MODE_ASK, TASK_PRIORITY_NORMAL, size);
 }
 
 void
-tasks_batch_visitor_set_skip (struct tasks *tasks, GtkTreeIter *iter)
+tasks_run (struct tasks *tasks)
 {
-  tasks_visitor_set_batch_status (tasks, iter, TASK_MODE_SKIP);
+  scheduler_run (&tasks->scheduler);
 }
 
+//The changes not yet applied are discarded as the scheduler they refer to does not exist anymore.
+
 void
-tasks_batch_visitor_set_replace (struct tasks *tasks, GtkTreeIter *iter)
+tasks_stop_thread (struct tasks *tasks)
 {
-  tasks_visitor_set_batch_status (tasks, iter, TASK_MODE_REPLACE);
+  debug_print (1, "Stopping task threads...\n");
+  g_source_remove (tasks->progress_source);
+  scheduler_destroy (&tasks->scheduler);
+
+  g_mutex_lock (&tasks->changed_mutex);
+  if (tasks->changed_source)
+    {
+      g_source_remove (tasks->changed_source);
+      tasks->changed_source = 0;
+    }
+  g_queue_free_full (tasks->changed_tasks, (GDestroyNotify) task_free);
+  tasks->changed_tasks = NULL;
+  g_mutex_unlock (&tasks->changed_mutex);
 }
 
-void
-tasks_add (struct tasks *tasks, enum task_type type,
-	   const char *src, const char *dst, gint remote_fs_id,
-	   struct backend *backend)
+//This is called from the main loop while sampling the progress so the list store can be updated directly.
+
+static void
+tasks_update_progress (struct scheduler *scheduler, const struct task *task)
 {
-  const gchar *status_human = tasks_get_human_status (TASK_STATUS_QUEUED);
-  const gchar *type_human = tasks_get_human_type (type);
-  const struct fs_operations *ops = backend_get_fs_operations_by_id (backend,
-								     remote_fs_id);
+  gchar *eta;
+  GtkTreeIter iter;
+  struct tasks *tasks = scheduler->data;
 
-  gtk_list_store_insert_with_values (tasks->list_store, NULL, -1,
-				     TASK_LIST_STORE_STATUS_FIELD,
-				     TASK_STATUS_QUEUED,
-				     TASK_LIST_STORE_TYPE_FIELD, type,
-				     TASK_LIST_STORE_SRC_FIELD, src,
-				     TASK_LIST_STORE_DST_FIELD, dst,
-				     TASK_LIST_STORE_PROGRESS_FIELD, 0.0,
-				     TASK_LIST_STORE_STATUS_HUMAN_FIELD,
-				     status_human,
-				     TASK_LIST_STORE_TYPE_HUMAN_FIELD,
-				     type_human,
-				     TASK_LIST_STORE_REMOTE_FS_ID_FIELD,
-				     remote_fs_id,
-				     TASK_LIST_STORE_REMOTE_FS_ICON_FIELD,
-				     ops->gui_icon,
-				     TASK_LIST_STORE_BATCH_ID_FIELD,
-				     tasks->batch_id,
-				     TASK_LIST_STORE_MODE_FIELD,
-				     TASK_MODE_ASK, -1);
+  if (tasks_get_by_id (tasks, task->id, &iter))
+    {
+      eta = tasks_get_human_eta (TASK_STATUS_RUNNING, task->eta);
+      gtk_list_store_set (tasks->list_store, &iter,
+			  TASK_LIST_STORE_PROGRESS_FIELD,
+			  100.0 * task->progress,
+			  TASK_LIST_STORE_ETA_FIELD, eta, -1);
+      g_free (eta);
+    }
+}
 
-  gtk_widget_set_sensitive (tasks->remove_tasks_button, TRUE);
+static gboolean
+tasks_sample_progress (gpointer data)
+{
+  struct tasks *tasks = data;
+  scheduler_sample_progress (&tasks->scheduler);
+  return G_SOURCE_CONTINUE;
 }
 
 static void
-tasks_join_thread (struct tasks *tasks)
+tasks_apply_change (struct tasks *tasks, struct task *task)
 {
-  debug_print (2, "Joining task thread...\n");
+  GtkTreeIter iter;
+
+  if (tasks_get_by_id (tasks, task->id, &iter))
+    {
+      tasks_update (tasks, &iter, task);
+    }
+  else if (task->status == TASK_STATUS_QUEUED)
+    {
+      tasks_insert (tasks, task);
+    }
 
-  g_mutex_lock (&tasks->transfer.control.mutex);
-  g_cond_signal (&tasks->transfer.control.cond);
-  g_mutex_unlock (&tasks->transfer.control.mutex);
+  gtk_widget_set_sensitive (tasks->cancel_task_button,
+			    !scheduler_is_idle (&tasks->scheduler));
+  tasks_check_buttons (tasks);
 
-  if (tasks->thread)
+  if (tasks->changed)
     {
-      g_thread_join (tasks->thread);
-      tasks->thread = NULL;
+      tasks->changed (tasks, task);
     }
 }
 
-void
-tasks_stop_thread (struct tasks *tasks)
+static gboolean
+tasks_changed_runner (gpointer data)
 {
-  debug_print (1, "Stopping task thread...\n");
+  GQueue *changed_tasks;
+  struct task *task;
+  struct tasks *tasks = data;
+
+  g_mutex_lock (&tasks->changed_mutex);
+  changed_tasks = tasks->changed_tasks;
+  tasks->changed_tasks = g_queue_new ();
+  tasks->changed_source = 0;
+  g_mutex_unlock (&tasks->changed_mutex);
 
-  g_mutex_lock (&tasks->transfer.control.mutex);
-  tasks->transfer.control.active = FALSE;
-  g_mutex_unlock (&tasks->transfer.control.mutex);
+  while ((task = g_queue_pop_head (changed_tasks)))
+    {
+      tasks_apply_change (tasks, task);
+      task_free (task);
+    }
+  g_queue_free (changed_tasks);
 
-  tasks_join_thread (tasks);
+  return FALSE;
 }
 
-gboolean
-tasks_update_current_progress (gpointer data)
+//This is called from any thread with the scheduler mutex held so the task is copied to be used from the main loop.
+//A single source applies all the pending changes so that it can be removed when stopping.
+
+static void
+tasks_changed (struct scheduler *scheduler, const struct task *task)
 {
-  struct tasks *tasks = data;
-  GtkTreeIter iter;
-  gdouble progress;
+  struct tasks *tasks = scheduler->data;
 
-  if (tasks_get_current (tasks, &iter))
+  g_mutex_lock (&tasks->changed_mutex);
+  if (tasks->changed_tasks)
     {
-      g_mutex_lock (&tasks->transfer.control.mutex);
-      progress = tasks->transfer.control.progress;
-      g_mutex_unlock (&tasks->transfer.control.mutex);
-
-      gtk_list_store_set (tasks->list_store, &iter,
-			  TASK_LIST_STORE_PROGRESS_FIELD,
-			  100.0 * progress, -1);
+      g_queue_push_tail (tasks->changed_tasks, task_copy (task));
+      if (!tasks->changed_source)
+	{
+	  tasks->changed_source = g_idle_add (tasks_changed_runner, tasks);
+	}
     }
-
-  return FALSE;
+  g_mutex_unlock (&tasks->changed_mutex);
 }
 
 void
-tasks_init (struct tasks *tasks, GtkBuilder *builder)
+tasks_init (struct tasks *tasks, GtkBuilder *builder,
+	    struct backend *backend, scheduler_ask_cb ask,
+	    scheduler_cancel_ask_cb cancel_ask, tasks_task_cb changed)
 {
+  tasks->batch_id = 0;
+  tasks->changed = changed;
+  g_mutex_init (&tasks->changed_mutex);
+  tasks->changed_tasks = g_queue_new ();
+  tasks->changed_source = 0;
+  scheduler_init (&tasks->scheduler, backend, ask, cancel_ask,
+		  tasks_changed, tasks_update_progress, tasks);
+  tasks->progress_source =
+    g_timeout_add (SCHEDULER_PROGRESS_PERIOD_US / 1000,
+		   tasks_sample_progress, tasks);
+
   tasks->list_store =
     GTK_LIST_STORE (gtk_builder_get_object (builder, "task_list_store"));
   tasks->tree_view =
@@ -23,6 +23,7 @@
 
 #include <gtk/gtk.h>
 #include "utils.h"
+#include "scheduler.h"
 
 enum task_list_store_columns
 {
@@ -35,48 +36,27 @@ enum task_list_store_columns
   TASK_LIST_STORE_TYPE_HUMAN_FIELD,
   TASK_LIST_STORE_REMOTE_FS_ID_FIELD,
   TASK_LIST_STORE_REMOTE_FS_ICON_FIELD,
-  TASK_LIST_STORE_BATCH_ID_FIELD,
-  TASK_LIST_STORE_MODE_FIELD
+  TASK_LIST_STORE_ID_FIELD,
+  TASK_LIST_STORE_ETA_FIELD,
+  TASK_LIST_STORE_STATS_FIELD
 };
 
-enum task_status
-{
-  TASK_STATUS_QUEUED,
-  TASK_STATUS_RUNNING,
-  TASK_STATUS_COMPLETED_OK,
-  TASK_STATUS_COMPLETED_ERROR,
-  TASK_STATUS_CANCELED
-};
+struct tasks;
 
-enum task_mode
-{
-  TASK_MODE_ASK,
-  TASK_MODE_REPLACE,
-  TASK_MODE_SKIP
-};
+//Called from the main loop after the list has been updated.
+typedef void (*tasks_task_cb) (struct tasks *, const struct task *);
 
-enum task_type
-{
-  TASK_TYPE_UPLOAD,
-  TASK_TYPE_DOWNLOAD
-};
-
-struct task_transfer
-{
-  struct job_control control;
-  gchar *src;			//Contains a path to a file
-  gchar *dst;			//Contains a path to a file
-  enum task_status status;	//Contains the final status
-  const struct fs_operations *fs_ops;	//Contains the fs_operations to use in this transfer
-  guint mode;
-  guint batch_id;
-};
+//The list store only mirrors the scheduler, which is the one owning the tasks.
 
 struct tasks
 {
-  struct task_transfer transfer;
-  GThread *thread;
-  gint batch_id;
+  struct scheduler scheduler;
+  guint batch_id;
+  tasks_task_cb changed;
+  guint progress_source;	//Samples the progress at a fixed rate.
+  GMutex changed_mutex;
+  GQueue *changed_tasks;	//Copies of the changed tasks not yet applied to the list.
+  guint changed_source;
   GtkListStore *list_store;
   GtkWidget *tree_view;
   GtkWidget *cancel_task_button;
@@ -84,24 +64,19 @@ struct tasks
   GtkWidget *clear_tasks_button;
 };
 
-void tasks_init (struct tasks *tasks, GtkBuilder * builder);
+void tasks_init (struct tasks *tasks, GtkBuilder * builder,
+		 struct backend *backend, scheduler_ask_cb ask,
+		 scheduler_cancel_ask_cb cancel_ask, tasks_task_cb changed);
 
-gboolean tasks_get_next_queued (struct tasks *tasks, GtkTreeIter * iter,
-				enum task_type *type, gchar ** src,
-				gchar ** dst, gint * fs, guint * batch_id,
-				guint * mode);
+void tasks_new_batch (struct tasks *tasks);
 
-gboolean tasks_complete_current (gpointer data);
-
-void tasks_cancel_all (GtkWidget * object, gpointer data);
-
-void tasks_visitor_set_batch_canceled (struct tasks *tasks,
-				       GtkTreeIter * iter);
+void tasks_add (struct tasks *tasks, enum task_type type,
+		const char *src, const char *dst, gint remote_fs_id,
+		struct backend *backend, gint64 size);
 
-void tasks_batch_visitor_set_skip (struct tasks *tasks, GtkTreeIter * iter);
+void tasks_run (struct tasks *tasks);
 
-void tasks_batch_visitor_set_replace (struct tasks *tasks,
-				      GtkTreeIter * iter);
+void tasks_cancel_all (GtkWidget * object, gpointer data);
 
 void tasks_stop_thread (struct tasks *tasks);
 
@@ -109,14 +84,4 @@ const gchar *tasks_get_human_status (enum task_status status);
 
 gboolean tasks_check_buttons (gpointer data);
 
-void tasks_visit_pending (struct tasks *tasks,
-			  void (*visitor) (struct tasks * tasks,
-					   GtkTreeIter * iter));
-
-void tasks_add (struct tasks *tasks, enum task_type type,
-		const char *src, const char *dst, gint remote_fs_id,
-		struct backend *backend);
-
-gboolean tasks_update_current_progress (gpointer data);
-
 #endif
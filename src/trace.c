@@ -0,0 +1,400 @@
+/*
+ *   trace.c
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include "trace.h"
+#include "backend.h"
+
+//A trace file is the magic followed by the frames. Every frame is the time as a 64 bits integer, the direction as a byte, the length as a 32 bits integer and the data. Integers are little endian.
+
+#define TRACE_MAGIC "ETRACE01"
+#define TRACE_MAGIC_LEN 8
+#define TRACE_HEADER_LEN 13
+
+static void
+trace_set_header (guint8 *header, gint64 time, enum trace_dir dir,
+		  guint32 len)
+{
+  guint64 t = GUINT64_TO_LE (time);
+  guint32 l = GUINT32_TO_LE (len);
+
+  memcpy (header, &t, sizeof (guint64));
+  header[8] = dir;
+  memcpy (header + 9, &l, sizeof (guint32));
+}
+
+static void
+trace_get_header (const guint8 *header, gint64 *time, enum trace_dir *dir,
+		  guint32 *len)
+{
+  guint64 t;
+  guint32 l;
+
+  memcpy (&t, header, sizeof (guint64));
+  *dir = header[8];
+  memcpy (&l, header + 9, sizeof (guint32));
+  *time = GUINT64_FROM_LE (t);
+  *len = GUINT32_FROM_LE (l);
+}
+
+static void
+trace_ring_write (struct trace *trace, const guint8 *data, guint len)
+{
+  guint n = MIN (len, trace->len - trace->head);
+
+  memcpy (trace->buffer + trace->head, data, n);
+  memcpy (trace->buffer, data + n, len - n);
+  trace->head = (trace->head + len) % trace->len;
+  trace->used += len;
+}
+
+static void
+trace_ring_read (struct trace *trace, guint pos, guint8 *data, guint len)
+{
+  guint n = MIN (len, trace->len - pos);
+
+  memcpy (data, trace->buffer + pos, n);
+  memcpy (data + n, trace->buffer, len - n);
+}
+
+static guint
+trace_get_tail (struct trace *trace)
+{
+  return (trace->head + trace->len - trace->used) % trace->len;
+}
+
+static void
+trace_drop_oldest (struct trace *trace)
+{
+  gint64 time;
+  guint32 len;
+  enum trace_dir dir;
+  guint8 header[TRACE_HEADER_LEN];
+
+  trace_ring_read (trace, trace_get_tail (trace), header, TRACE_HEADER_LEN);
+  trace_get_header (header, &time, &dir, &len);
+  trace->used -= TRACE_HEADER_LEN + len;
+  trace->dropped++;
+}
+
+struct trace *
+trace_new (guint len)
+{
+  struct trace *trace = g_malloc (sizeof (struct trace));
+
+  g_mutex_init (&trace->mutex);
+  trace->buffer = g_malloc (len);
+  trace->len = len;
+  trace->head = 0;
+  trace->used = 0;
+  trace->start = g_get_monotonic_time ();
+  trace->dropped = 0;
+
+  return trace;
+}
+
+void
+trace_free (struct trace *trace)
+{
+  g_mutex_clear (&trace->mutex);
+  g_free (trace->buffer);
+  g_free (trace);
+}
+
+void
+trace_record (struct trace *trace, enum trace_dir dir, const guint8 *data,
+	      guint len)
+{
+  guint8 header[TRACE_HEADER_LEN];
+  gint64 time = g_get_monotonic_time ();
+
+  g_mutex_lock (&trace->mutex);
+
+  if (TRACE_HEADER_LEN + len > trace->len)
+    {
+      trace->dropped++;
+      g_mutex_unlock (&trace->mutex);
+      return;
+    }
+
+  while (trace->len - trace->used < TRACE_HEADER_LEN + len)
+    {
+      trace_drop_oldest (trace);
+    }
+
+  trace_set_header (header, time - trace->start, dir, len);
+  trace_ring_write (trace, header, TRACE_HEADER_LEN);
+  trace_ring_write (trace, data, len);
+
+  g_mutex_unlock (&trace->mutex);
+}
+
+gint
+trace_save (struct trace *trace, const gchar *path)
+{
+  gint err = 0;
+  guint8 *data;
+  FILE *file = fopen (path, "wb");
+
+  if (!file)
+    {
+      return -errno;
+    }
+
+  g_mutex_lock (&trace->mutex);
+
+  if (trace->dropped)
+    {
+      debug_print (1, "%" PRIu64 " frames dropped from the trace\n",
+		   trace->dropped);
+    }
+
+  data = g_malloc (trace->used);
+  trace_ring_read (trace, trace_get_tail (trace), data, trace->used);
+
+  if (fwrite (TRACE_MAGIC, 1, TRACE_MAGIC_LEN, file) != TRACE_MAGIC_LEN
+      || fwrite (data, 1, trace->used, file) != trace->used)
+    {
+      error_print ("Error while writing trace to '%s'\n", path);
+      err = -EIO;
+    }
+  else
+    {
+      debug_print (1, "Trace saved to '%s' (%u B)\n", path, trace->used);
+    }
+
+  g_mutex_unlock (&trace->mutex);
+
+  g_free (data);
+  fclose (file);
+
+  return err;
+}
+
+static void
+trace_frame_free (gpointer data)
+{
+  struct trace_frame *frame = data;
+
+  free_msg (frame->data);
+  g_free (frame);
+}
+
+GPtrArray *
+trace_load (const gchar *path)
+{
+  gint64 time;
+  guint32 len;
+  enum trace_dir dir;
+  GByteArray *content;
+  GPtrArray *frames;
+  struct trace_frame *frame;
+  guint8 *b;
+  guint remaining;
+
+  content = g_byte_array_new ();
+  if (load_file (path, content, NULL))
+    {
+      error_print ("Error while loading trace from '%s'\n", path);
+      free_msg (content);
+      return NULL;
+    }
+
+  if (content->len < TRACE_MAGIC_LEN
+      || memcmp (content->data, TRACE_MAGIC, TRACE_MAGIC_LEN))
+    {
+      error_print ("Invalid trace file '%s'\n", path);
+      free_msg (content);
+      return NULL;
+    }
+
+  frames = g_ptr_array_new_with_free_func (trace_frame_free);
+  b = content->data + TRACE_MAGIC_LEN;
+  remaining = content->len - TRACE_MAGIC_LEN;
+  while (remaining >= TRACE_HEADER_LEN)
+    {
+      trace_get_header (b, &time, &dir, &len);
+      b += TRACE_HEADER_LEN;
+      remaining -= TRACE_HEADER_LEN;
+      if (len > remaining)
+	{
+	  error_print ("Truncated frame in trace file '%s'\n", path);
+	  break;
+	}
+
+      frame = g_malloc (sizeof (struct trace_frame));
+      frame->time = time;
+      frame->dir = dir;
+      frame->data = g_byte_array_sized_new (len);
+      g_byte_array_append (frame->data, b, len);
+      g_ptr_array_add (frames, frame);
+
+      b += len;
+      remaining -= len;
+    }
+
+  free_msg (content);
+
+  debug_print (1, "%u frames loaded from trace '%s'\n", frames->len, path);
+
+  return frames;
+}
+
+struct trace_replay *
+trace_replay_new (const gchar *path, gdouble scale)
+{
+  struct trace_replay *replay;
+  GPtrArray *frames = trace_load (path);
+
+  if (!frames)
+    {
+      return NULL;
+    }
+
+  replay = g_malloc (sizeof (struct trace_replay));
+  replay->frames = frames;
+  replay->next = 0;
+  replay->offset = 0;
+  replay->scale = scale;
+  replay->anchor = g_get_monotonic_time ();
+  replay->anchor_time = 0;
+  replay->mismatches = 0;
+
+  return replay;
+}
+
+void
+trace_replay_free (struct trace_replay *replay)
+{
+  g_ptr_array_free (replay->frames, TRUE);
+  g_free (replay);
+}
+
+static struct trace_frame *
+trace_replay_get_next (struct trace_replay *replay)
+{
+  if (replay->next == replay->frames->len)
+    {
+      return NULL;
+    }
+  return g_ptr_array_index (replay->frames, replay->next);
+}
+
+static void
+trace_replay_advance (struct trace_replay *replay, struct trace_frame *frame)
+{
+  replay->next++;
+  replay->offset = 0;
+  replay->anchor = g_get_monotonic_time ();
+  replay->anchor_time = frame->time;
+}
+
+gboolean
+trace_replay_is_done (struct trace_replay *replay)
+{
+  return replay->next == replay->frames->len;
+}
+
+//The data might be sent in chunks different from the recorded ones so it is compared as a stream.
+
+ssize_t
+trace_replay_tx (struct trace_replay *replay, const guint8 *data, guint len)
+{
+  guint n, sent = 0;
+  gboolean mismatch = FALSE;
+  struct trace_frame *frame;
+
+  while (sent < len)
+    {
+      frame = trace_replay_get_next (replay);
+      while (frame && frame->dir == TRACE_DIR_RX)
+	{
+	  debug_print (1, "Skipping frame %u not received...\n",
+		       replay->next);
+	  trace_replay_advance (replay, frame);
+	  frame = trace_replay_get_next (replay);
+	}
+
+      if (!frame)
+	{
+	  debug_print (1, "Unexpected data sent after the trace end\n");
+	  mismatch = TRUE;
+	  break;
+	}
+
+      n = MIN (len - sent, frame->data->len - replay->offset);
+      if (memcmp (frame->data->data + replay->offset, data + sent, n))
+	{
+	  debug_print (1, "Data sent does not match frame %u\n",
+		       replay->next);
+	  mismatch = TRUE;
+	}
+
+      sent += n;
+      replay->offset += n;
+      if (replay->offset == frame->data->len)
+	{
+	  trace_replay_advance (replay, frame);
+	}
+    }
+
+  if (mismatch)
+    {
+      replay->mismatches++;
+    }
+
+  return len;
+}
+
+ssize_t
+trace_replay_rx (struct trace_replay *replay, guint8 *buffer, guint len)
+{
+  guint n;
+  gint64 now, due;
+  struct trace_frame *frame = trace_replay_get_next (replay);
+
+  if (!frame || frame->dir == TRACE_DIR_TX)
+    {
+      usleep (BE_POLL_TIMEOUT_MS * 1000 * replay->scale);
+      return 0;
+    }
+
+  due = replay->anchor + (frame->time - replay->anchor_time) * replay->scale;
+  now = g_get_monotonic_time ();
+  if (now < due)
+    {
+      usleep (MIN (due - now, BE_POLL_TIMEOUT_MS * 1000));
+      if (g_get_monotonic_time () < due)
+	{
+	  return 0;
+	}
+    }
+
+  n = MIN (len, frame->data->len - replay->offset);
+  memcpy (buffer, frame->data->data + replay->offset, n);
+  replay->offset += n;
+  if (replay->offset == frame->data->len)
+    {
+      trace_replay_advance (replay, frame);
+    }
+
+  return n;
+}
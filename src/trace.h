@@ -0,0 +1,93 @@
+/*
+ *   trace.h
+ *   Copyright (C) 2023 David García Goñi <dagargo@gmail.com>
+ *
+ *   This file is part of Elektroid.
+ *
+ *   Elektroid is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   Elektroid is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "utils.h"
+
+#define TRACE_DEFAULT_LEN (4 * 1024 * 1024)
+
+enum trace_dir
+{
+  TRACE_DIR_TX,
+  TRACE_DIR_RX
+};
+
+//A trace keeps the last MIDI data sent to and received from a device as it was passed to the MIDI API.
+//Frames are stored with a timestamp in a ring buffer so the oldest ones are dropped when it is full.
+
+struct trace
+{
+  GMutex mutex;
+  guint8 *buffer;
+  guint len;
+  guint head;			//Next byte to write
+  guint used;
+  gint64 start;
+  guint64 dropped;		//Frames
+};
+
+struct trace_frame
+{
+  gint64 time;			//µs since the trace started
+  enum trace_dir dir;
+  GByteArray *data;
+};
+
+//A replay feeds the received frames of a trace to a backend and checks that the frames sent match the recorded ones.
+//The received frames are delivered with the time elapsed since the previous frame in the trace multiplied by the scale, so 0 means as fast as possible.
+
+struct trace_replay
+{
+  GPtrArray *frames;
+  guint next;
+  guint offset;			//Bytes of the next frame already delivered
+  gdouble scale;
+  gint64 anchor;		//Real time of the last frame
+  gint64 anchor_time;		//Trace time of the last frame
+  guint mismatches;
+};
+
+struct trace *trace_new (guint);
+
+void trace_free (struct trace *);
+
+void trace_record (struct trace *, enum trace_dir, const guint8 *, guint);
+
+gint trace_save (struct trace *, const gchar *);
+
+//Returns an array of frames.
+
+GPtrArray *trace_load (const gchar *);
+
+struct trace_replay *trace_replay_new (const gchar *, gdouble);
+
+void trace_replay_free (struct trace_replay *);
+
+//These behave as the raw backend functions.
+
+ssize_t trace_replay_tx (struct trace_replay *, const guint8 *, guint);
+
+ssize_t trace_replay_rx (struct trace_replay *, guint8 *, guint);
+
+gboolean trace_replay_is_done (struct trace_replay *);
+
+#endif
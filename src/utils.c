@@ -18,11 +18,19 @@
  *   along with Elektroid. If not, see <http://www.gnu.org/licenses/>.
  */
 
+//Needed by fallocate.
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #if !defined(__linux__)
 #include <dirent.h>
 #endif
 #include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
 #include "utils.h"
 
 #define DEBUG_SHORT_HEX_LEN 64
@@ -30,8 +38,16 @@
 
 #define KIB 1024
 
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
 gint debug_level;
 
+static gint log_threaded;
+static GThread *log_thread;
+static gchar log_end;		//Its address marks the end of the queue.
+
 static guint
 get_max_message_length (guint msg_len)
 {
@@ -116,6 +132,90 @@ debug_get_hex_msg (const GByteArray *msg)
   return debug_get_hex_data (debug_level, msg->data, msg->len);
 }
 
+//The queue is never freed so that a message logged while the thread stops is never pushed to a freed queue.
+
+static GAsyncQueue *
+log_get_queue ()
+{
+  static gsize queue = 0;
+
+  if (g_once_init_enter (&queue))
+    {
+      g_once_init_leave (&queue, (gsize) g_async_queue_new ());
+    }
+
+  return (GAsyncQueue *) queue;
+}
+
+void
+log_print (const gchar *format, ...)
+{
+  va_list args;
+
+  va_start (args, format);
+  if (g_atomic_int_get (&log_threaded))
+    {
+      g_async_queue_push (log_get_queue (), g_strdup_vprintf (format, args));
+    }
+  else
+    {
+      vfprintf (stderr, format, args);
+    }
+  va_end (args);
+}
+
+static gpointer
+log_runner (gpointer data)
+{
+  gchar *msg;
+  GAsyncQueue *queue = data;
+
+  while ((msg = g_async_queue_pop (queue)) != &log_end)
+    {
+      fputs (msg, stderr);
+      g_free (msg);
+    }
+
+  return NULL;
+}
+
+void
+log_start_thread ()
+{
+  if (log_thread)
+    {
+      return;
+    }
+
+  log_thread = g_thread_new ("log_runner", log_runner, log_get_queue ());
+  g_atomic_int_set (&log_threaded, TRUE);
+}
+
+//The messages pushed by the threads that were logging while the thread stopped are printed here.
+
+void
+log_stop_thread ()
+{
+  gchar *msg;
+  GAsyncQueue *queue = log_get_queue ();
+
+  if (!log_thread)
+    {
+      return;
+    }
+
+  g_atomic_int_set (&log_threaded, FALSE);
+  g_async_queue_push (queue, &log_end);
+  g_thread_join (log_thread);
+  log_thread = NULL;
+
+  while ((msg = g_async_queue_try_pop (queue)))
+    {
+      fputs (msg, stderr);
+      g_free (msg);
+    }
+}
+
 void
 remove_ext (char *name)
 {
@@ -287,36 +387,172 @@ end:
 }
 
 gint
-save_file_char (const gchar *path, const guint8 *data, ssize_t len)
+atomic_file_open (struct atomic_file *file, const gchar *path, gint64 size)
 {
-  gint res;
-  size_t bytes;
-  FILE *file;
+  gchar *dir = g_path_get_dirname (path);
+  gchar *name = g_path_get_basename (path);
+  gchar *tmp_name = g_strdup_printf (".%s.XXXXXX", name);
+
+  //The temporary file is hidden and has the same permissions a new file would have.
+  file->path = strdup (path);
+  file->tmp_path = g_build_filename (dir, tmp_name, NULL);
+  file->fd = g_mkstemp_full (file->tmp_path, O_RDWR | O_BINARY, 0666);
+  g_free (dir);
+  g_free (name);
+  g_free (tmp_name);
+  if (file->fd < 0)
+    {
+      gint err = -errno;
+      error_print ("Error while creating temporary file for %s: %s\n", path,
+		   g_strerror (errno));
+      g_free (file->path);
+      g_free (file->tmp_path);
+      return err;
+    }
+
+#if defined(__linux__)
+  //This only reserves the space so the file size is not changed. Not every filesystem supports it but running out of space is detected here.
+  if (size > 0 && fallocate (file->fd, FALLOC_FL_KEEP_SIZE, 0, size))
+    {
+      if (errno != EOPNOTSUPP && errno != ENOSYS)
+	{
+	  gint err = -errno;
+	  error_print ("Error while preallocating %s: %s\n", file->tmp_path,
+		       g_strerror (errno));
+	  atomic_file_abort (file);
+	  return err;
+	}
+      debug_print (2, "Preallocation not supported for %s\n",
+		   file->tmp_path);
+    }
+#endif
 
-  file = fopen (path, "wb");
+  return 0;
+}
 
-  if (!file)
+//A replaced file keeps its permissions. New files already have the ones given by the umask as the temporary file is created with 0666.
+
+static gint
+atomic_file_sync (struct atomic_file *file)
+{
+#if defined(__MINGW32__) | defined(__MINGW64__)
+  return 0;
+#else
+  struct stat info;
+
+  if (!g_stat (file->path, &info)
+      && fchmod (file->fd, info.st_mode & (S_IRWXU | S_IRWXG | S_IRWXO)))
     {
       return -errno;
     }
 
-  debug_print (1, "Saving file %s...\n", path);
+  return fsync (file->fd) ? -errno : 0;
+#endif
+}
 
-  res = 0;
-  bytes = fwrite (data, 1, len, file);
-  if (bytes == len)
+//The directory is synced so that the rename survives a crash. Not every filesystem allows it so errors are ignored.
+
+static void
+atomic_file_sync_dir (struct atomic_file *file)
+{
+#if !(defined(__MINGW32__) | defined(__MINGW64__))
+  gint fd;
+  gchar *dir = g_path_get_dirname (file->path);
+
+  fd = open (dir, O_RDONLY);
+  if (fd >= 0)
+    {
+      if (fsync (fd))
+	{
+	  debug_print (2, "Error while syncing dir %s: %s\n", dir,
+		       g_strerror (errno));
+	}
+      close (fd);
+    }
+  g_free (dir);
+#endif
+}
+
+gint
+atomic_file_commit (struct atomic_file *file)
+{
+  gint err = atomic_file_sync (file);
+
+  if (close (file->fd) && !err)
+    {
+      err = -errno;
+    }
+
+  if (!err && g_rename (file->tmp_path, file->path))
+    {
+      err = -errno;
+    }
+
+  if (err)
     {
-      debug_print (1, "%zu B written\n", bytes);
+      error_print ("Error while writing to file %s: %s\n", file->path,
+		   g_strerror (-err));
+      g_unlink (file->tmp_path);
     }
   else
     {
-      error_print ("Error while writing to file %s\n", path);
-      res = -EIO;
+      atomic_file_sync_dir (file);
     }
 
-  fclose (file);
+  g_free (file->path);
+  g_free (file->tmp_path);
 
-  return res;
+  return err;
+}
+
+void
+atomic_file_abort (struct atomic_file *file)
+{
+  close (file->fd);
+  g_unlink (file->tmp_path);
+  g_free (file->path);
+  g_free (file->tmp_path);
+}
+
+gint
+save_file_char (const gchar *path, const guint8 *data, ssize_t len)
+{
+  gint err;
+  ssize_t bytes;
+  struct atomic_file file;
+
+  debug_print (1, "Saving file %s...\n", path);
+
+  err = atomic_file_open (&file, path, len);
+  if (err)
+    {
+      return err;
+    }
+
+  while (len)
+    {
+      bytes = write (file.fd, data, len);
+      if (bytes < 0)
+	{
+	  if (errno == EINTR)
+	    {
+	      continue;
+	    }
+	  error_print ("Error while writing to file %s\n", path);
+	  atomic_file_abort (&file);
+	  return -EIO;
+	}
+      data += bytes;
+      len -= bytes;
+    }
+
+  err = atomic_file_commit (&file);
+  if (!err)
+    {
+      debug_print (1, "File %s saved\n", path);
+    }
+
+  return err;
 }
 
 gint
@@ -357,43 +593,20 @@ get_human_size (gint64 size, gboolean with_space)
   return label;
 }
 
-static inline void
-set_job_control_progress_value (struct job_control *control, gdouble p)
-{
-  control->progress =
-    (control->part / (double) control->parts) + (p / (double) control->parts);
-}
-
-void
-set_job_control_progress_with_cb (struct job_control *control, gdouble p,
-				  gpointer data)
-{
-  g_mutex_lock (&control->mutex);
-  set_job_control_progress_value (control, p);
-  g_mutex_unlock (&control->mutex);
-
-  if (control->callback)
-    {
-      control->callback (control);
-    }
-}
-
 void
 set_job_control_progress (struct job_control *control, gdouble p)
 {
-  set_job_control_progress_with_cb (control, p, NULL);
+  gdouble progress = (control->part / (double) control->parts) +
+    (p / (double) control->parts);
+  g_atomic_int_set (&control->progress,
+		    (gint) (progress * JOB_CONTROL_PROGRESS_MAX));
 }
 
-void
-set_job_control_progress_no_sync (struct job_control *control, gdouble p,
-				  gpointer data)
+gdouble
+job_control_get_progress (struct job_control *control)
 {
-  set_job_control_progress_value (control, p);
-
-  if (control->callback)
-    {
-      control->callback (control);
-    }
+  return g_atomic_int_get (&control->progress) /
+    (gdouble) JOB_CONTROL_PROGRESS_MAX;
 }
 
 gboolean
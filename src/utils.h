@@ -34,8 +34,17 @@
 
 #define MAX_BACKEND_STORAGE (sizeof (gint32) * 8)
 
-#define debug_print(level, format, ...) if (level <= debug_level) fprintf(stderr, "DEBUG:" __FILE__ ":%d:(%s): " format, __LINE__, __FUNCTION__, ## __VA_ARGS__)
-#define error_print(format, ...) fprintf(stderr, "%sERROR:" __FILE__ ":%d:(%s): " format "%s", isatty(fileno(stderr)) ? "\x1b[31m" : "", __LINE__, __FUNCTION__, ## __VA_ARGS__, isatty(fileno(stderr)) ? "\x1b[m" : "")
+//Debug messages above this level are removed at compile time.
+#ifndef DEBUG_LEVEL_MAX
+#define DEBUG_LEVEL_MAX G_MAXINT
+#endif
+
+//Arguments are only evaluated if the message is going to be printed.
+#define debug_enabled(level) ((level) <= DEBUG_LEVEL_MAX && (level) <= debug_level)
+#define debug_print(level, format, ...) if (debug_enabled(level)) log_print("DEBUG:" __FILE__ ":%d:(%s): " format, __LINE__, __FUNCTION__, ## __VA_ARGS__)
+//The hex dump of the data is passed as the last argument of the format.
+#define debug_print_hex(level, data, len, format, ...) do { if (debug_enabled(level)) {gchar *hex__ = debug_get_hex_data (debug_level, data, len); log_print("DEBUG:" __FILE__ ":%d:(%s): " format, __LINE__, __FUNCTION__, ## __VA_ARGS__, hex__); g_free (hex__);} } while (0)
+#define error_print(format, ...) log_print("%sERROR:" __FILE__ ":%d:(%s): " format "%s", isatty(fileno(stderr)) ? "\x1b[31m" : "", __LINE__, __FUNCTION__, ## __VA_ARGS__, isatty(fileno(stderr)) ? "\x1b[m" : "")
 
 enum item_type
 {
@@ -60,6 +69,8 @@ struct backend;
 
 struct item_iterator;
 
+struct sample_source;
+
 typedef gint (*iterator_next) (struct item_iterator *);
 
 typedef void (*iterator_free) (void *);
@@ -96,19 +107,19 @@ struct fs_operations;
 typedef void (*fs_print_item) (struct item_iterator *, struct backend *,
 			       const struct fs_operations *);
 
-struct job_control;
+#define JOB_CONTROL_PROGRESS_MAX 1000000
 
-typedef void (*job_control_callback) (struct job_control *);
+//The progress is written with atomic operations and never notified so that clients sample it at their own pace with job_control_get_progress.
 
 struct job_control
 {
   gboolean active;
   GMutex mutex;
   GCond cond;			//This can be used by the calling threads. It requires to call g_cond_init and g_cond_clear.
-  job_control_callback callback;
   gint parts;
   gint part;
-  gdouble progress;
+  gint progress;		//From 0 to JOB_CONTROL_PROGRESS_MAX
+  gboolean deduplicated;	//Set by uploads when the content was already in the destination.
   void *data;
 };
 
@@ -156,6 +167,16 @@ typedef gchar *(*fs_get_item_slot) (struct item *, struct backend *);
 typedef gint (*fs_local_file_op) (const gchar *, GByteArray *,
 				  struct job_control *);
 
+typedef gint (*fs_open_source) (const gchar *, struct sample_source **,
+				struct job_control *);
+
+typedef gint (*fs_remote_source_op) (struct backend *, const gchar *,
+				     struct sample_source *,
+				     struct job_control *);
+
+typedef gint (*fs_remote_sink_op) (struct backend *, const gchar *,
+				   const gchar *, struct job_control *);
+
 typedef gchar **(*fs_get_exts) (struct backend *,
 				const struct fs_operations *);
 
@@ -178,6 +199,11 @@ typedef gint (*t_sysex_transfer) (struct backend *, struct sysex_transfer *);
 
 typedef gboolean (*fs_file_exists) (struct backend *, const gchar *);
 
+//Returns 1 if the local file has the same content as the current item of the remote iterator, 0 if not or a negative error if it is not known.
+
+typedef gint (*fs_item_matches) (struct backend *, const gchar *,
+				 struct item_iterator *);
+
 // All the function members that return gint should return 0 if no error and a negative number in case of error.
 // errno values are recommended as will provide the user with a meaningful message. In particular,
 // ENOSYS could be used when a particular device does not support a feature that other devices implementing the same filesystem do.
@@ -206,13 +232,18 @@ struct fs_operations
   fs_src_dst_func swap;
   fs_remote_file_op download;	//Donload a resource from the filesystem to memory.
   fs_remote_file_op upload;	//Upload a resource from memory to the filesystem.
+  fs_remote_sink_op download_sink;	//Download a resource into a local file while receiving it. Used instead of download and save if the local path is known beforehand.
   fs_local_file_op save;	//Write a file from memory to the OS storage. Typically used after download.
   fs_local_file_op load;	//Load a file from the OS storage into memory. Typically used before upload.
+  fs_open_source open_source;	//Open a file from the OS storage to be read in blocks while uploading. If it returns -ENOTSUP, load is used.
+  fs_remote_source_op upload_source;	//Upload a resource while reading it from a source. Used instead of upload if open_source succeeds.
   fs_get_item_slot get_slot;
   fs_get_exts get_exts;		//If present, this is used; if not, type_ext is used.
   fs_get_upload_path get_upload_path;
   fs_get_download_path get_download_path;
   fs_select_item select_item;
+  fs_item_matches matches;	//If missing, sync uploads the files again unless sizes are compared.
+  fs_path_func rescan;		//Forget what is known about a dir so that the next listing reads it from the device.
 };
 
 enum fs_options
@@ -251,6 +282,19 @@ gchar *debug_get_hex_data (gint, guint8 *, guint);
 
 gchar *debug_get_hex_msg (const GByteArray *);
 
+//Writes to stderr or queues the message for the log thread if it is running.
+
+void log_print (const gchar *, ...) G_GNUC_PRINTF (1, 2);
+
+//While running, messages are written by a thread so that logging does not block the callers. Stopping it writes the pending messages.
+//Other threads can keep logging while it starts and stops but both must be called from the same thread.
+
+#define LOG_THREAD_ENV "ELEKTROID_LOG_THREAD"
+
+void log_start_thread ();
+
+void log_stop_thread ();
+
 void remove_ext (gchar *);
 
 const gchar *get_file_ext (const gchar *);
@@ -285,15 +329,29 @@ gint save_file (const char *, GByteArray *, struct job_control *);
 
 gint save_file_char (const gchar *, const guint8 *, ssize_t);
 
-gchar *get_human_size (gint64, gboolean);
+//Atomic files are written to a temporary file in the same directory that replaces the destination when committed.
+//Readers never see a partially written file and nothing is left behind on errors.
+
+struct atomic_file
+{
+  gchar *path;
+  gchar *tmp_path;
+  gint fd;
+};
 
-void set_job_control_progress_with_cb (struct job_control *, gdouble,
-				       gpointer);
+//The size, if known, is used to reserve the space in advance.
+
+gint atomic_file_open (struct atomic_file *, const gchar *, gint64);
+
+gint atomic_file_commit (struct atomic_file *);
+
+void atomic_file_abort (struct atomic_file *);
+
+gchar *get_human_size (gint64, gboolean);
 
 void set_job_control_progress (struct job_control *, gdouble);
 
-void set_job_control_progress_no_sync (struct job_control *, gdouble,
-				       gpointer);
+gdouble job_control_get_progress (struct job_control *);
 
 gboolean file_matches_extensions (const gchar *, gchar **);
 
@@ -0,0 +1,104 @@
+#!/usr/bin/env bash
+
+err=0
+
+fs=wav48k16b2c
+expf=$srcdir/res/connectors/square-$fs.wav
+
+tmpdir=$(mktemp -d)
+
+function check_file() {
+  if [ ! -f $1 ]; then
+    echo "$1 not found"
+    err=1
+    return
+  fi
+  act=$(cksum $1 | awk '{print $1 " " $2}')
+  exp=$(cksum $expf | awk '{print $1 " " $2}')
+  [ "$act" != "$exp" ] && echo "Unexpected cksum for $1" && err=1
+}
+
+function check_order() {
+  act=$(ls -tr $1 | xargs)
+  [ "$act" != "$2" ] && echo "Unexpected order in $1: $act" && err=1
+}
+
+mkdir -p $tmpdir/src/a/b
+for f in s0 s1 s2; do
+  cp $srcdir/res/connectors/square.wav $tmpdir/src/$f.wav
+done
+cp $srcdir/res/connectors/square.wav $tmpdir/src/a/a0.wav
+cp $srcdir/res/connectors/square.wav $tmpdir/src/a/b/b0.wav
+cp $srcdir/res/connectors/silence.wav $tmpdir/src/silence.wav
+
+echo "Running multiple source upload test on $tmpdir..."
+
+$ecli system-$fs-ul $tmpdir/src/s0.wav $tmpdir/src/s1.wav 0:$tmpdir/multi
+[ $? -ne 0 ] && err=1
+check_file $tmpdir/multi/s0.wav
+check_file $tmpdir/multi/s1.wav
+
+echo "Running directory upload without recursion test on $tmpdir..."
+
+$ecli system-$fs-ul $tmpdir/src/a 0:$tmpdir/norec
+[ $? -eq 0 ] && echo "Directory uploaded without recursion" && err=1
+
+echo "Running recursive upload test on $tmpdir..."
+
+$ecli -r system-$fs-ul $tmpdir/src/a $tmpdir/src/s2.wav 0:$tmpdir/rec
+[ $? -ne 0 ] && err=1
+check_file $tmpdir/rec/a/a0.wav
+check_file $tmpdir/rec/a/b/b0.wav
+check_file $tmpdir/rec/s2.wav
+
+echo "Running upload from file test on $tmpdir..."
+
+manifest=$tmpdir/manifest.txt
+echo "# Comment" > $manifest
+echo "$tmpdir/src/s1.wav" >> $manifest
+echo "" >> $manifest
+echo "  $tmpdir/src/s2.wav  " >> $manifest
+$ecli -f $manifest system-$fs-ul $tmpdir/src/s0.wav 0:$tmpdir/manifest
+[ $? -ne 0 ] && err=1
+check_file $tmpdir/manifest/s0.wav
+check_file $tmpdir/manifest/s1.wav
+check_file $tmpdir/manifest/s2.wav
+[ $(ls $tmpdir/manifest | wc -l) -ne 3 ] && echo "Unexpected files uploaded" && err=1
+
+$ecli -f $tmpdir/missing.txt system-$fs-ul 0:$tmpdir/manifest
+[ $? -eq 0 ] && echo "Missing manifest accepted" && err=1
+
+echo "Running recursive download test on $tmpdir..."
+
+mkdir $tmpdir/dl
+pushd $tmpdir/dl > /dev/null
+$ecli -r system-$fs-dl 0:$tmpdir/rec/a 0:$tmpdir/multi/s0.wav
+[ $? -ne 0 ] && err=1
+popd > /dev/null
+for f in a/a0.wav a/b/b0.wav s0.wav; do
+  [ ! -s $tmpdir/dl/$f ] && echo "$f not downloaded" && err=1
+done
+
+echo "Running scheduling policy tests on $tmpdir..."
+
+#The files are saved in the order they are scheduled.
+
+$ecli system-$fs-ul $tmpdir/src/s0.wav $tmpdir/src/silence.wav 0:$tmpdir/fifo
+[ $? -ne 0 ] && err=1
+check_order $tmpdir/fifo "s0.wav silence.wav"
+
+$ecli -s smallest system-$fs-ul $tmpdir/src/s0.wav $tmpdir/src/silence.wav 0:$tmpdir/smallest
+[ $? -ne 0 ] && err=1
+check_order $tmpdir/smallest "silence.wav s0.wav"
+
+#In insertion order, a/a0.wav would be saved between s0.wav and s1.wav.
+$ecli -r -s dir system-$fs-ul $tmpdir/src/s0.wav $tmpdir/src/a $tmpdir/src/s1.wav 0:$tmpdir/dir
+[ $? -ne 0 ] && err=1
+check_order $tmpdir/dir "s0.wav s1.wav a"
+
+$ecli -s unknown system-$fs-ul $tmpdir/src/s0.wav 0:$tmpdir/unknown
+[ $? -eq 0 ] && echo "Unknown policy accepted" && err=1
+
+rm -rf $tmpdir
+
+exit $err
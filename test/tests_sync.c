@@ -0,0 +1,359 @@
+#include <errno.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <glib/gstdio.h>
+#include "../src/sync.h"
+#include "../src/connectors/system.h"
+
+static gchar *tmp_dir;
+static gchar *local_dir;
+static gchar *remote_dir;
+
+static gchar *
+test_get_upload_path (struct backend *backend,
+		      const struct fs_operations *ops,
+		      const gchar *dst_dir, const gchar *src_path)
+{
+  gchar *name = g_path_get_basename (src_path);
+  gchar *path = path_chain (PATH_SYSTEM, dst_dir, name);
+  g_free (name);
+  return path;
+}
+
+//Files with the same size are considered as having the same content.
+
+static gint
+test_matches (struct backend *backend, const gchar *path,
+	      struct item_iterator *iter)
+{
+  struct stat st;
+
+  if (stat (path, &st))
+    {
+      return -errno;
+    }
+
+  return st.st_size == iter->item.size;
+}
+
+static const struct fs_operations FS_TEST_OPERATIONS = {
+  .name = "test",
+  .readdir = system_read_dir,
+  .mkdir = system_mkdir,
+  .delete = system_delete,
+  .rename = system_rename,
+  .upload = system_upload,
+  .load = load_file,
+  .get_upload_path = test_get_upload_path,
+  .matches = test_matches
+};
+
+static const struct fs_operations FS_TEST_NO_MATCHES_OPERATIONS = {
+  .name = "test",
+  .readdir = system_read_dir,
+  .mkdir = system_mkdir,
+  .delete = system_delete,
+  .rename = system_rename,
+  .upload = system_upload,
+  .load = load_file,
+  .get_upload_path = test_get_upload_path
+};
+
+static void
+create_file (const gchar *dir, const gchar *name, gint size)
+{
+  gchar *path = path_chain (PATH_SYSTEM, dir, name);
+  gchar *content = g_malloc0 (size);
+  g_file_set_contents (path, content, size, NULL);
+  g_free (content);
+  g_free (path);
+}
+
+static void
+create_dir (const gchar *dir, const gchar *name)
+{
+  gchar *path = path_chain (PATH_SYSTEM, dir, name);
+  g_mkdir_with_parents (path, 0755);
+  g_free (path);
+}
+
+//Paths are relative to the local and remote dirs.
+
+static gboolean
+plan_has_action (struct sync_plan *plan, enum sync_action_type type,
+		 const gchar *src, const gchar *dst)
+{
+  gboolean found = FALSE;
+  gchar *src_path = src ? path_chain (PATH_SYSTEM, local_dir, src) : NULL;
+  gchar *dst_path = path_chain (PATH_SYSTEM, remote_dir, dst);
+
+  if (type == SYNC_ACTION_RENAME)
+    {
+      g_free (src_path);
+      src_path = path_chain (PATH_SYSTEM, remote_dir, src);
+    }
+
+  for (GList * l = plan->actions; l && !found; l = l->next)
+    {
+      struct sync_action *action = l->data;
+      found = action->type == type && !strcmp (action->dst, dst_path) &&
+	(src ? action->src && !strcmp (action->src, src_path) :
+	 !action->src);
+    }
+
+  g_free (src_path);
+  g_free (dst_path);
+  return found;
+}
+
+static gboolean
+plan_is_sorted (struct sync_plan *plan)
+{
+  enum sync_action_type type = SYNC_ACTION_RENAME;
+
+  for (GList * l = plan->actions; l; l = l->next)
+    {
+      struct sync_action *action = l->data;
+      if (action->type < type)
+	{
+	  return FALSE;
+	}
+      type = action->type;
+    }
+
+  return TRUE;
+}
+
+static void
+create_local_dir ()
+{
+  create_file (local_dir, "a.wav", 10);
+  create_file (local_dir, "b.wav", 20);
+  create_file (local_dir, "e.wav", 30);
+  create_file (local_dir, "f.wav", 40);
+  create_file (local_dir, "n.wav", 50);
+  create_dir (local_dir, "d");
+  create_file (local_dir, "d/c.wav", 60);
+}
+
+static void
+create_remote_dir ()
+{
+  create_file (remote_dir, "a.wav", 10);
+  create_file (remote_dir, "b.wav", 21);
+  create_dir (remote_dir, "e");
+  create_file (remote_dir, "f", 40);
+  create_file (remote_dir, "x.wav", 50);
+  create_file (remote_dir, "y.wav", 70);
+}
+
+static gint
+suite_init ()
+{
+  tmp_dir = g_dir_make_tmp ("elektroid-tests-sync-XXXXXX", NULL);
+  if (!tmp_dir)
+    {
+      return 1;
+    }
+  local_dir = path_chain (PATH_SYSTEM, tmp_dir, "local");
+  remote_dir = path_chain (PATH_SYSTEM, tmp_dir, "remote");
+  return 0;
+}
+
+static gint
+suite_cleanup ()
+{
+  system_delete (NULL, tmp_dir);
+  g_free (local_dir);
+  g_free (remote_dir);
+  g_free (tmp_dir);
+  return 0;
+}
+
+static void
+test_setup ()
+{
+  system_delete (NULL, local_dir);
+  system_delete (NULL, remote_dir);
+  create_dir (local_dir, "");
+}
+
+void
+test_new_remote_dir ()
+{
+  gint err;
+  struct sync_plan plan;
+
+  printf ("\n");
+
+  test_setup ();
+  create_local_dir ();
+
+  err = sync_plan_init (&plan, NULL, &FS_TEST_OPERATIONS, local_dir,
+			remote_dir, FALSE, FALSE);
+  CU_ASSERT_EQUAL_FATAL (err, 0);
+
+  CU_ASSERT_EQUAL (g_list_length (plan.actions), 8);
+  CU_ASSERT_TRUE (plan_is_sorted (&plan));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_MKDIR, NULL, ""));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_MKDIR, NULL, "d"));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "a.wav", ""));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "d/c.wav",
+				   "d"));
+
+  //The remote dir must be created before its children.
+  struct sync_action *action = plan.actions->data;
+  CU_ASSERT_EQUAL (action->type, SYNC_ACTION_MKDIR);
+  CU_ASSERT_EQUAL (strcmp (action->dst, remote_dir), 0);
+
+  sync_plan_free (&plan);
+}
+
+void
+test_diff_without_delete ()
+{
+  gint err;
+  struct sync_plan plan;
+
+  printf ("\n");
+
+  test_setup ();
+  create_local_dir ();
+  create_remote_dir ();
+
+  err = sync_plan_init (&plan, NULL, &FS_TEST_OPERATIONS, local_dir,
+			remote_dir, FALSE, FALSE);
+  CU_ASSERT_EQUAL_FATAL (err, 0);
+
+  //Same content: a.wav and f (matched without the extension). Type conflict ignored: e.wav.
+  CU_ASSERT_EQUAL (g_list_length (plan.actions), 4);
+  CU_ASSERT_TRUE (plan_is_sorted (&plan));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "b.wav", ""));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "n.wav", ""));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_MKDIR, NULL, "d"));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "d/c.wav",
+				   "d"));
+
+  sync_plan_free (&plan);
+}
+
+void
+test_diff_with_delete ()
+{
+  gint err;
+  struct sync_plan plan;
+
+  printf ("\n");
+
+  test_setup ();
+  create_local_dir ();
+  create_remote_dir ();
+
+  err = sync_plan_init (&plan, NULL, &FS_TEST_OPERATIONS, local_dir,
+			remote_dir, TRUE, FALSE);
+  CU_ASSERT_EQUAL_FATAL (err, 0);
+
+  //x.wav has the content of n.wav, e is replaced by a file and y.wav is not present locally.
+  CU_ASSERT_EQUAL (g_list_length (plan.actions), 7);
+  CU_ASSERT_TRUE (plan_is_sorted (&plan));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_RENAME, "x.wav",
+				   "n.wav"));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_DELETE, NULL, "e"));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_DELETE, NULL,
+				   "y.wav"));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_MKDIR, NULL, "d"));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "b.wav", ""));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "e.wav", ""));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "d/c.wav",
+				   "d"));
+
+  sync_plan_free (&plan);
+}
+
+void
+test_diff_by_size ()
+{
+  gint err;
+  struct sync_plan plan;
+
+  printf ("\n");
+
+  test_setup ();
+  create_local_dir ();
+  create_remote_dir ();
+
+  //Without matches, files are uploaded again and renames are not detected.
+  err = sync_plan_init (&plan, NULL, &FS_TEST_NO_MATCHES_OPERATIONS,
+			local_dir, remote_dir, TRUE, FALSE);
+  CU_ASSERT_EQUAL_FATAL (err, 0);
+
+  CU_ASSERT_EQUAL (g_list_length (plan.actions), 10);
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_DELETE, NULL,
+				   "x.wav"));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "a.wav", ""));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "f.wav", ""));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "n.wav", ""));
+
+  sync_plan_free (&plan);
+
+  //Sizes are only compared on request.
+  err = sync_plan_init (&plan, NULL, &FS_TEST_NO_MATCHES_OPERATIONS,
+			local_dir, remote_dir, TRUE, TRUE);
+  CU_ASSERT_EQUAL_FATAL (err, 0);
+
+  CU_ASSERT_EQUAL (g_list_length (plan.actions), 8);
+  CU_ASSERT_FALSE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "a.wav", ""));
+  CU_ASSERT_FALSE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "f.wav", ""));
+  CU_ASSERT_TRUE (plan_has_action (&plan, SYNC_ACTION_UPLOAD, "b.wav", ""));
+
+  sync_plan_free (&plan);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int err = 0;
+
+  debug_level = 5;
+
+  if (CU_initialize_registry () != CUE_SUCCESS)
+    {
+      goto cleanup;
+    }
+  CU_pSuite suite = CU_add_suite ("Elektroid sync tests", suite_init,
+				  suite_cleanup);
+  if (!suite)
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_new_remote_dir", test_new_remote_dir))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_diff_without_delete",
+		    test_diff_without_delete))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_diff_with_delete", test_diff_with_delete))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_diff_by_size", test_diff_by_size))
+    {
+      goto cleanup;
+    }
+
+  CU_basic_set_mode (CU_BRM_VERBOSE);
+
+  CU_basic_run_tests ();
+  err = CU_get_number_of_tests_failed ();
+
+cleanup:
+  CU_cleanup_registry ();
+  return err || CU_get_error ();
+}
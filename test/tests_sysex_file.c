@@ -0,0 +1,201 @@
+#include <errno.h>
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <glib/gstdio.h>
+#include "../src/backend.h"
+#include "../src/trace.h"
+#include "../src/sysex_file.h"
+
+#define MSG_0 "\xf0\x00\x20\x3c\x01\xf7"
+#define MSG_1 "\xf0\x00\x20\x3c\x02\x03\xf7"
+#define MSG_2 "\xf0\x00\x20\x3c\x04"
+#define NOISE "\x01\x02\x03"
+
+static gchar *
+get_test_path (const gchar *name)
+{
+  return g_build_filename (g_get_tmp_dir (), name, NULL);
+}
+
+static void
+init_backend (struct backend *backend, const gchar *path)
+{
+  memset (backend, 0, sizeof (struct backend));
+  backend->type = BE_TYPE_MIDI;
+  backend->replay = trace_replay_new (path, 0);
+  backend->buffer = g_malloc (BE_INT_BUF_LEN);
+}
+
+static void
+free_backend (struct backend *backend)
+{
+  trace_replay_free (backend->replay);
+  g_free (backend->buffer);
+}
+
+void
+test_send ()
+{
+  gint err;
+  GByteArray *content;
+  struct backend backend;
+  struct sysex_transfer transfer;
+  gchar *trace_path = get_test_path ("elektroid-tests-sysex-file.bin");
+  gchar *path = get_test_path ("elektroid-tests-sysex-file.syx");
+  struct trace *trace = trace_new (TRACE_DEFAULT_LEN);
+
+  printf ("\n");
+
+  //Every message must be sent on its own and without the data around it.
+  trace_record (trace, TRACE_DIR_TX, (guint8 *) MSG_0, sizeof (MSG_0) - 1);
+  trace_record (trace, TRACE_DIR_TX, (guint8 *) MSG_1, sizeof (MSG_1) - 1);
+  trace_record (trace, TRACE_DIR_TX, (guint8 *) MSG_2, sizeof (MSG_2) - 1);
+  err = trace_save (trace, trace_path);
+  CU_ASSERT_EQUAL (err, 0);
+  trace_free (trace);
+
+  //The unterminated message in the middle is skipped and the unterminated last one is sent as is.
+  content = g_byte_array_new ();
+  g_byte_array_append (content, (guint8 *) NOISE, sizeof (NOISE) - 1);
+  g_byte_array_append (content, (guint8 *) MSG_0, sizeof (MSG_0) - 1);
+  g_byte_array_append (content, (guint8 *) NOISE, sizeof (NOISE) - 1);
+  g_byte_array_append (content, (guint8 *) MSG_2, sizeof (MSG_2) - 1);
+  g_byte_array_append (content, (guint8 *) MSG_1, sizeof (MSG_1) - 1);
+  g_byte_array_append (content, (guint8 *) MSG_2, sizeof (MSG_2) - 1);
+  g_file_set_contents (path, (gchar *) content->data, content->len, NULL);
+  g_byte_array_free (content, TRUE);
+
+  init_backend (&backend, trace_path);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (backend.replay);
+
+  g_mutex_init (&transfer.mutex);
+  transfer.active = TRUE;
+  err = sysex_file_send (&backend, &transfer, path, 0);
+  CU_ASSERT_EQUAL (err, 0);
+  CU_ASSERT_EQUAL (backend.replay->mismatches, 0);
+  CU_ASSERT_TRUE (trace_replay_is_done (backend.replay));
+  g_mutex_clear (&transfer.mutex);
+
+  free_backend (&backend);
+  g_unlink (trace_path);
+  g_unlink (path);
+  g_free (trace_path);
+  g_free (path);
+}
+
+void
+test_receive ()
+{
+  gint err;
+  gchar *content, **lines;
+  gsize len;
+  FILE *timestamps;
+  struct backend backend;
+  struct sysex_transfer transfer;
+  gchar *trace_path = get_test_path ("elektroid-tests-sysex-file.bin");
+  gchar *path = get_test_path ("elektroid-tests-sysex-file.syx");
+  gchar *ts_path = get_test_path ("elektroid-tests-sysex-file.txt");
+  struct trace *trace = trace_new (TRACE_DEFAULT_LEN);
+
+  printf ("\n");
+
+  //The second message is split as the MIDI API might do.
+  trace_record (trace, TRACE_DIR_RX, (guint8 *) NOISE, sizeof (NOISE) - 1);
+  trace_record (trace, TRACE_DIR_RX, (guint8 *) MSG_0, sizeof (MSG_0) - 1);
+  trace_record (trace, TRACE_DIR_RX, (guint8 *) MSG_1, 3);
+  trace_record (trace, TRACE_DIR_RX, (guint8 *) MSG_1 + 3,
+		sizeof (MSG_1) - 4);
+  err = trace_save (trace, trace_path);
+  CU_ASSERT_EQUAL (err, 0);
+  trace_free (trace);
+
+  init_backend (&backend, trace_path);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (backend.replay);
+
+  timestamps = fopen (ts_path, "w");
+  CU_ASSERT_PTR_NOT_NULL_FATAL (timestamps);
+
+  transfer.timeout = 1000;
+  err = sysex_file_receive (&backend, &transfer, path, timestamps);
+  fclose (timestamps);
+  CU_ASSERT_EQUAL (err, 0);
+  CU_ASSERT_TRUE (trace_replay_is_done (backend.replay));
+
+  CU_ASSERT_TRUE_FATAL (g_file_get_contents (path, &content, &len, NULL));
+  CU_ASSERT_EQUAL (len, sizeof (MSG_0) + sizeof (MSG_1) - 2);
+  CU_ASSERT_EQUAL (memcmp (content, MSG_0, sizeof (MSG_0) - 1), 0);
+  CU_ASSERT_EQUAL (memcmp (content + sizeof (MSG_0) - 1, MSG_1,
+			   sizeof (MSG_1) - 1), 0);
+  g_free (content);
+
+  CU_ASSERT_TRUE_FATAL (g_file_get_contents (ts_path, &content, NULL, NULL));
+  lines = g_strsplit (content, "\n", -1);
+  //The last line is empty.
+  CU_ASSERT_EQUAL (g_strv_length (lines), 3);
+  CU_ASSERT_TRUE (g_str_has_suffix (lines[0], "\t6"));
+  CU_ASSERT_TRUE (g_str_has_suffix (lines[1], "\t7"));
+  g_strfreev (lines);
+  g_free (content);
+
+  free_backend (&backend);
+
+  //No message is received now so the previous file must be kept.
+  trace = trace_new (TRACE_DEFAULT_LEN);
+  trace_record (trace, TRACE_DIR_RX, (guint8 *) NOISE, sizeof (NOISE) - 1);
+  err = trace_save (trace, trace_path);
+  CU_ASSERT_EQUAL (err, 0);
+  trace_free (trace);
+
+  init_backend (&backend, trace_path);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (backend.replay);
+  err = sysex_file_receive (&backend, &transfer, path, NULL);
+  CU_ASSERT_EQUAL (err, -ETIMEDOUT);
+  CU_ASSERT_TRUE_FATAL (g_file_get_contents (path, &content, &len, NULL));
+  CU_ASSERT_EQUAL (len, sizeof (MSG_0) + sizeof (MSG_1) - 2);
+  g_free (content);
+  free_backend (&backend);
+
+  g_unlink (trace_path);
+  g_unlink (path);
+  g_unlink (ts_path);
+  g_free (trace_path);
+  g_free (path);
+  g_free (ts_path);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int err = 0;
+
+  debug_level = 5;
+
+  if (CU_initialize_registry () != CUE_SUCCESS)
+    {
+      goto cleanup;
+    }
+  CU_pSuite suite = CU_add_suite ("Elektroid SysEx file tests", 0, 0);
+  if (!suite)
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_send", test_send))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_receive", test_receive))
+    {
+      goto cleanup;
+    }
+
+  CU_basic_set_mode (CU_BRM_VERBOSE);
+
+  CU_basic_run_tests ();
+  err = CU_get_number_of_tests_failed ();
+
+cleanup:
+  CU_cleanup_registry ();
+  return err || CU_get_error ();
+}
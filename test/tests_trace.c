@@ -0,0 +1,160 @@
+#include <CUnit/CUnit.h>
+#include <CUnit/Basic.h>
+#include <glib/gstdio.h>
+#include "../src/backend.h"
+#include "../src/trace.h"
+
+#define FRAME_LEN 20
+#define FRAMES 5
+
+#define IDENTITY_REQ "\xf0\x7e\x7f\x06\x01\xf7"
+#define IDENTITY_REP "\xf0\x7e\x00\x06\x02\x00\x20\x3c\x01\x00\x02\x00\x01\x02\x03\x04\xf7"
+
+static gchar *
+get_trace_path ()
+{
+  return g_build_filename (g_get_tmp_dir (), "elektroid-tests-trace.bin",
+			   NULL);
+}
+
+void
+test_ring_buffer ()
+{
+  gint err;
+  GPtrArray *frames;
+  struct trace_frame *frame;
+  guint8 data[FRAME_LEN];
+  gchar *path = get_trace_path ();
+  //Every frame takes 13 bytes of header plus the data so only 3 frames fit.
+  struct trace *trace = trace_new (100);
+
+  printf ("\n");
+
+  for (gint i = 0; i < FRAMES; i++)
+    {
+      memset (data, i, FRAME_LEN);
+      trace_record (trace, i % 2 ? TRACE_DIR_RX : TRACE_DIR_TX, data,
+		    FRAME_LEN);
+    }
+
+  CU_ASSERT_EQUAL (trace->dropped, 2);
+
+  err = trace_save (trace, path);
+  CU_ASSERT_EQUAL (err, 0);
+  trace_free (trace);
+
+  frames = trace_load (path);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (frames);
+  CU_ASSERT_EQUAL (frames->len, 3);
+
+  for (gint i = 0; i < frames->len; i++)
+    {
+      frame = g_ptr_array_index (frames, i);
+      memset (data, i + 2, FRAME_LEN);
+      CU_ASSERT_EQUAL (frame->dir, i % 2 ? TRACE_DIR_RX : TRACE_DIR_TX);
+      CU_ASSERT_EQUAL (frame->data->len, FRAME_LEN);
+      CU_ASSERT_EQUAL (memcmp (frame->data->data, data, FRAME_LEN), 0);
+      if (i)
+	{
+	  struct trace_frame *prev = g_ptr_array_index (frames, i - 1);
+	  CU_ASSERT (frame->time >= prev->time);
+	}
+    }
+
+  g_ptr_array_free (frames, TRUE);
+  g_unlink (path);
+  g_free (path);
+}
+
+void
+test_replay ()
+{
+  gint err;
+  gint64 start;
+  GByteArray *tx_msg, *rx_msg;
+  struct backend backend;
+  gchar *path = get_trace_path ();
+  struct trace *trace = trace_new (TRACE_DEFAULT_LEN);
+
+  printf ("\n");
+
+  trace_record (trace, TRACE_DIR_TX, (guint8 *) IDENTITY_REQ,
+		sizeof (IDENTITY_REQ) - 1);
+  //The reply is split as the MIDI API might do.
+  trace_record (trace, TRACE_DIR_RX, (guint8 *) IDENTITY_REP, 5);
+  trace_record (trace, TRACE_DIR_RX, (guint8 *) IDENTITY_REP + 5,
+		sizeof (IDENTITY_REP) - 6);
+  err = trace_save (trace, path);
+  CU_ASSERT_EQUAL (err, 0);
+  trace_free (trace);
+
+  memset (&backend, 0, sizeof (struct backend));
+  backend.type = BE_TYPE_MIDI;
+  backend.replay = trace_replay_new (path, 0);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (backend.replay);
+  backend.buffer = g_malloc (BE_INT_BUF_LEN);
+  CU_ASSERT_TRUE (backend_check (&backend));
+
+  tx_msg = g_byte_array_new ();
+  g_byte_array_append (tx_msg, (guint8 *) IDENTITY_REQ,
+		       sizeof (IDENTITY_REQ) - 1);
+  rx_msg = backend_tx_and_rx_sysex (&backend, tx_msg, -1);
+  CU_ASSERT_PTR_NOT_NULL_FATAL (rx_msg);
+  CU_ASSERT_EQUAL (rx_msg->len, sizeof (IDENTITY_REP) - 1);
+  CU_ASSERT_EQUAL (memcmp (rx_msg->data, IDENTITY_REP, rx_msg->len), 0);
+  CU_ASSERT_EQUAL (backend.replay->mismatches, 0);
+  CU_ASSERT_TRUE (trace_replay_is_done (backend.replay));
+  free_msg (rx_msg);
+
+  //Nothing is sent after the end of the trace so this must time out without waiting as the scale is 0.
+  start = g_get_monotonic_time ();
+  tx_msg = g_byte_array_new ();
+  g_byte_array_append (tx_msg, (guint8 *) IDENTITY_REQ,
+		       sizeof (IDENTITY_REQ) - 1);
+  rx_msg = backend_tx_and_rx_sysex (&backend, tx_msg, 1000);
+  CU_ASSERT_PTR_NULL (rx_msg);
+  CU_ASSERT (g_get_monotonic_time () - start < 500000);
+  CU_ASSERT_EQUAL (backend.replay->mismatches, 1);
+
+  trace_replay_free (backend.replay);
+  g_free (backend.buffer);
+  g_unlink (path);
+  g_free (path);
+}
+
+int
+main (int argc, char *argv[])
+{
+  int err = 0;
+
+  debug_level = 5;
+
+  if (CU_initialize_registry () != CUE_SUCCESS)
+    {
+      goto cleanup;
+    }
+  CU_pSuite suite = CU_add_suite ("Elektroid trace tests", 0, 0);
+  if (!suite)
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_ring_buffer", test_ring_buffer))
+    {
+      goto cleanup;
+    }
+
+  if (!CU_add_test (suite, "test_replay", test_replay))
+    {
+      goto cleanup;
+    }
+
+  CU_basic_set_mode (CU_BRM_VERBOSE);
+
+  CU_basic_run_tests ();
+  err = CU_get_number_of_tests_failed ();
+
+cleanup:
+  CU_cleanup_registry ();
+  return err || CU_get_error ();
+}